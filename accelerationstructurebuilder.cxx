@@ -0,0 +1,343 @@
+#include "accelerationstructurebuilder.hxx"
+
+#include <stdio.h>
+#include <algorithm>
+
+// VkAccelerationStructureCreateInfoKHR::offset has to be a multiple of 256
+static VkDeviceSize const kStorageAlignment = 256;
+static VkDeviceSize const kDefaultScratchBudget = 128ull * 1024 * 1024;
+
+static VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+CAccelerationStructureBuilder::CAccelerationStructureBuilder(VkDevice device, VkPhysicalDevice gpu, CVulkanHelper& helper)
+    : m_device(device)
+    , m_helper(helper)
+    , m_scratchBudget(kDefaultScratchBudget)
+    , m_storageBuffer()
+    , m_scratchBuffer()
+    , m_batchCount(0)
+    , m_compaction(false)
+    , m_compacted(false)
+    , m_compactedSizeQueryPool(VK_NULL_HANDLE)
+    , m_uncompactedStorageBuffer()
+{
+    VkPhysicalDeviceAccelerationStructurePropertiesKHR accelerationStructureProperties = {};
+    accelerationStructureProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR;
+
+    VkPhysicalDeviceProperties2 properties = {};
+    properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    properties.pNext = &accelerationStructureProperties;
+    vkGetPhysicalDeviceProperties2(gpu, &properties);
+
+    m_scratchAlignment = std::max<VkDeviceSize>(accelerationStructureProperties.minAccelerationStructureScratchOffsetAlignment, 1);
+}
+
+uint32_t CAccelerationStructureBuilder::addBottomLevel(std::vector<VkAccelerationStructureGeometryKHR> const& geometries,
+                                                       std::vector<VkAccelerationStructureBuildRangeInfoKHR> const& buildRanges,
+                                                       VkBuildAccelerationStructureFlagsKHR flags) {
+    Build build;
+    build.geometries = geometries;
+    build.buildRanges = buildRanges;
+    build.flags = m_compaction ? flags | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR : flags;
+    build.storageOffset = 0;
+    build.compactedSize = 0;
+    build.result = {};
+
+    std::vector<uint32_t> maxPrimitiveCounts(buildRanges.size());
+    for (size_t index = 0; index < buildRanges.size(); ++index) {
+        maxPrimitiveCounts[index] = buildRanges[index].primitiveCount;
+    }
+
+    VkAccelerationStructureBuildGeometryInfoKHR buildInfo = getBuildGeometryInfo(build, 0);
+
+    build.sizes = {};
+    build.sizes.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
+    vkGetAccelerationStructureBuildSizesKHR(m_device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildInfo, maxPrimitiveCounts.data(), &build.sizes);
+
+    m_builds.push_back(build);
+    return static_cast<uint32_t>(m_builds.size() - 1);
+}
+
+VkAccelerationStructureBuildGeometryInfoKHR CAccelerationStructureBuilder::getBuildGeometryInfo(Build const& build, VkDeviceAddress scratchAddress) const {
+    VkAccelerationStructureBuildGeometryInfoKHR buildInfo = {};
+    buildInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+    buildInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+    buildInfo.flags = build.flags;
+    buildInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+    buildInfo.srcAccelerationStructure = VK_NULL_HANDLE;
+    buildInfo.dstAccelerationStructure = build.result.handle;
+    buildInfo.geometryCount = static_cast<uint32_t>(build.geometries.size());
+    buildInfo.pGeometries = build.geometries.data();
+    buildInfo.scratchData.deviceAddress = scratchAddress;
+    return buildInfo;
+}
+
+void CAccelerationStructureBuilder::createAccelerationStructures() {
+    if (m_storageBuffer.handle != VK_NULL_HANDLE || m_builds.empty()) {
+        return;
+    }
+
+    VkDeviceSize storageSize = 0;
+    for (size_t index = 0; index < m_builds.size(); ++index) {
+        m_builds[index].storageOffset = storageSize;
+        storageSize = alignUp(storageSize + m_builds[index].sizes.accelerationStructureSize, kStorageAlignment);
+    }
+
+    // shared, the TLAS refits on the compute queue read the BLASes
+    m_storageBuffer = m_helper.createBuffer(VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, storageSize, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, true);
+
+    for (size_t index = 0; index < m_builds.size(); ++index) {
+        Build& build = m_builds[index];
+
+        VkAccelerationStructureCreateInfoKHR accelerationStructureInfo = {};
+        accelerationStructureInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+        accelerationStructureInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+        accelerationStructureInfo.buffer = m_storageBuffer.handle;
+        accelerationStructureInfo.offset = build.storageOffset;
+        accelerationStructureInfo.size = build.sizes.accelerationStructureSize;
+
+        VK_CHECK(vkCreateAccelerationStructureKHR(m_device, &accelerationStructureInfo, nullptr, &build.result.handle));
+
+        VkAccelerationStructureDeviceAddressInfoKHR accDeviceAddressInfo = {};
+        accDeviceAddressInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
+        accDeviceAddressInfo.accelerationStructure = build.result.handle;
+
+        build.result.buffer = m_storageBuffer;
+        build.result.gpuAddress = vkGetAccelerationStructureDeviceAddressKHR(m_device, &accDeviceAddressInfo);
+    }
+}
+
+void CAccelerationStructureBuilder::recordBuild(VkCommandBuffer commandBuffer, AccelerationStructureBuildMode::Enum mode) {
+    if (m_builds.empty()) {
+        return;
+    }
+
+    if (m_compacted) {
+        printf("compacted acceleration structures can not be rebuilt\n");
+        return;
+    }
+
+    createAccelerationStructures();
+    releaseScratch();
+
+    // scratch offsets and the first build of every batch
+    std::vector<VkDeviceSize> scratchOffsets(m_builds.size(), 0);
+    std::vector<size_t> batchStarts;
+    VkDeviceSize scratchSize = 0;
+
+    if (mode == AccelerationStructureBuildMode::Serial) {
+        for (size_t index = 0; index < m_builds.size(); ++index) {
+            batchStarts.push_back(index);
+            scratchSize = std::max(scratchSize, m_builds[index].sizes.buildScratchSize);
+        }
+    }
+    else {
+        VkDeviceSize batchOffset = 0;
+        for (size_t index = 0; index < m_builds.size(); ++index) {
+            VkDeviceSize buildScratchSize = m_builds[index].sizes.buildScratchSize;
+            if (batchStarts.empty() || (batchOffset > 0 && batchOffset + buildScratchSize > m_scratchBudget)) {
+                batchStarts.push_back(index);
+                batchOffset = 0;
+            }
+
+            scratchOffsets[index] = batchOffset;
+            batchOffset = alignUp(batchOffset + buildScratchSize, m_scratchAlignment);
+            scratchSize = std::max(scratchSize, batchOffset);
+        }
+    }
+
+    m_batchCount = static_cast<uint32_t>(batchStarts.size());
+    batchStarts.push_back(m_builds.size());
+
+    // the buffer address is only 256 byte aligned, leave room to align the base for larger requirements
+    m_scratchBuffer = m_helper.createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, scratchSize + m_scratchAlignment, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    VkDeviceAddress scratchAddress = alignUp(m_scratchBuffer.address, m_scratchAlignment);
+
+    // the next batch reuses the scratch memory, the builds after the last one read the results
+    VkMemoryBarrier scratchBarrier = {};
+    scratchBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    scratchBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    scratchBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+
+    std::vector<VkAccelerationStructureBuildGeometryInfoKHR> buildInfos;
+    std::vector<VkAccelerationStructureBuildRangeInfoKHR const*> buildRangeInfos;
+
+    for (uint32_t batch = 0; batch < m_batchCount; ++batch) {
+        buildInfos.clear();
+        buildRangeInfos.clear();
+
+        for (size_t index = batchStarts[batch]; index < batchStarts[batch + 1]; ++index) {
+            buildInfos.push_back(getBuildGeometryInfo(m_builds[index], scratchAddress + scratchOffsets[index]));
+            buildRangeInfos.push_back(m_builds[index].buildRanges.data());
+        }
+
+        vkCmdBuildAccelerationStructuresKHR(commandBuffer, static_cast<uint32_t>(buildInfos.size()), buildInfos.data(), buildRangeInfos.data());
+
+        if (batch + 1 < m_batchCount) {
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &scratchBarrier, 0, nullptr, 0, nullptr);
+        }
+    }
+
+    VkMemoryBarrier memoryBarrier = {};
+    memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    memoryBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    memoryBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+
+    if (m_compaction) {
+        if (m_compactedSizeQueryPool == VK_NULL_HANDLE) {
+            VkQueryPoolCreateInfo queryPoolInfo = {};
+            queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+            queryPoolInfo.queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR;
+            queryPoolInfo.queryCount = static_cast<uint32_t>(m_builds.size());
+
+            VK_CHECK(vkCreateQueryPool(m_device, &queryPoolInfo, nullptr, &m_compactedSizeQueryPool));
+        }
+
+        std::vector<VkAccelerationStructureKHR> handles(m_builds.size());
+        for (size_t index = 0; index < m_builds.size(); ++index) {
+            handles[index] = m_builds[index].result.handle;
+        }
+
+        vkCmdResetQueryPool(commandBuffer, m_compactedSizeQueryPool, 0, static_cast<uint32_t>(handles.size()));
+        vkCmdWriteAccelerationStructuresPropertiesKHR(commandBuffer, static_cast<uint32_t>(handles.size()), handles.data(), VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR, m_compactedSizeQueryPool, 0);
+    }
+}
+
+void CAccelerationStructureBuilder::recordCompaction(VkCommandBuffer commandBuffer) {
+    if (!m_compaction || m_compacted || m_compactedSizeQueryPool == VK_NULL_HANDLE) {
+        return;
+    }
+
+    std::vector<VkDeviceSize> compactedSizes(m_builds.size());
+    VK_CHECK(vkGetQueryPoolResults(m_device, m_compactedSizeQueryPool, 0, static_cast<uint32_t>(compactedSizes.size()), compactedSizes.size() * sizeof(VkDeviceSize), compactedSizes.data(), sizeof(VkDeviceSize), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+
+    VkDeviceSize storageSize = 0;
+    std::vector<VkDeviceSize> storageOffsets(m_builds.size());
+    for (size_t index = 0; index < m_builds.size(); ++index) {
+        m_builds[index].compactedSize = compactedSizes[index];
+        storageOffsets[index] = storageSize;
+        storageSize = alignUp(storageSize + compactedSizes[index], kStorageAlignment);
+    }
+
+    m_uncompactedStorageBuffer = m_storageBuffer;
+    m_uncompactedHandles.resize(m_builds.size());
+
+    m_storageBuffer = m_helper.createBuffer(VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, storageSize, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, true);
+
+    for (size_t index = 0; index < m_builds.size(); ++index) {
+        Build& build = m_builds[index];
+        m_uncompactedHandles[index] = build.result.handle;
+
+        VkAccelerationStructureCreateInfoKHR accelerationStructureInfo = {};
+        accelerationStructureInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+        accelerationStructureInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+        accelerationStructureInfo.buffer = m_storageBuffer.handle;
+        accelerationStructureInfo.offset = storageOffsets[index];
+        accelerationStructureInfo.size = build.compactedSize;
+
+        VkAccelerationStructureKHR compactedHandle;
+        VK_CHECK(vkCreateAccelerationStructureKHR(m_device, &accelerationStructureInfo, nullptr, &compactedHandle));
+
+        VkCopyAccelerationStructureInfoKHR copyInfo = {};
+        copyInfo.sType = VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR;
+        copyInfo.src = build.result.handle;
+        copyInfo.dst = compactedHandle;
+        copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR;
+
+        vkCmdCopyAccelerationStructureKHR(commandBuffer, &copyInfo);
+
+        VkAccelerationStructureDeviceAddressInfoKHR accDeviceAddressInfo = {};
+        accDeviceAddressInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
+        accDeviceAddressInfo.accelerationStructure = compactedHandle;
+
+        build.storageOffset = storageOffsets[index];
+        build.result.handle = compactedHandle;
+        build.result.buffer = m_storageBuffer;
+        build.result.gpuAddress = vkGetAccelerationStructureDeviceAddressKHR(m_device, &accDeviceAddressInfo);
+    }
+
+    VkMemoryBarrier memoryBarrier = {};
+    memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    memoryBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    memoryBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+
+    m_compacted = true;
+
+    printCompactionReport(m_uncompactedStorageBuffer.size);
+}
+
+void CAccelerationStructureBuilder::printCompactionReport(VkDeviceSize uncompactedStorageSize) const {
+    // a line per BLAS is only useful for small scenes
+    size_t const kMaxReportedBuilds = 64;
+
+    for (size_t index = 0; index < m_builds.size() && index < kMaxReportedBuilds; ++index) {
+        Build const& build = m_builds[index];
+        printf("blas %6zu: %10llu -> %10llu bytes, saved %10llu\n",
+               index,
+               static_cast<unsigned long long>(build.sizes.accelerationStructureSize),
+               static_cast<unsigned long long>(build.compactedSize),
+               static_cast<unsigned long long>(build.sizes.accelerationStructureSize - std::min(build.compactedSize, build.sizes.accelerationStructureSize)));
+    }
+
+    if (m_builds.size() > kMaxReportedBuilds) {
+        printf("... %zu more BLASes\n", m_builds.size() - kMaxReportedBuilds);
+    }
+
+    VkDeviceSize savedBytes = uncompactedStorageSize - std::min(m_storageBuffer.size, uncompactedStorageSize);
+    printf("blas compaction: %zu BLASes, %.2f MB -> %.2f MB, saved %.2f MB (%.1f%%)\n",
+           m_builds.size(),
+           uncompactedStorageSize / (1024.0 * 1024.0),
+           m_storageBuffer.size / (1024.0 * 1024.0),
+           savedBytes / (1024.0 * 1024.0),
+           uncompactedStorageSize > 0 ? 100.0 * savedBytes / uncompactedStorageSize : 0.0);
+}
+
+void CAccelerationStructureBuilder::releaseUncompacted() {
+    for (size_t index = 0; index < m_uncompactedHandles.size(); ++index) {
+        vkDestroyAccelerationStructureKHR(m_device, m_uncompactedHandles[index], nullptr);
+    }
+    m_uncompactedHandles.clear();
+
+    if (m_uncompactedStorageBuffer.handle != VK_NULL_HANDLE) {
+        m_helper.destroyBuffer(m_uncompactedStorageBuffer);
+        m_uncompactedStorageBuffer = VulkanBuffer();
+    }
+
+    if (m_compactedSizeQueryPool != VK_NULL_HANDLE) {
+        vkDestroyQueryPool(m_device, m_compactedSizeQueryPool, nullptr);
+        m_compactedSizeQueryPool = VK_NULL_HANDLE;
+    }
+}
+
+void CAccelerationStructureBuilder::releaseScratch() {
+    if (m_scratchBuffer.handle != VK_NULL_HANDLE) {
+        m_helper.destroyBuffer(m_scratchBuffer);
+        m_scratchBuffer = VulkanBuffer();
+    }
+}
+
+void CAccelerationStructureBuilder::destroy() {
+    releaseScratch();
+    releaseUncompacted();
+
+    for (size_t index = 0; index < m_builds.size(); ++index) {
+        if (m_builds[index].result.handle != VK_NULL_HANDLE) {
+            vkDestroyAccelerationStructureKHR(m_device, m_builds[index].result.handle, nullptr);
+        }
+    }
+    m_builds.clear();
+
+    if (m_storageBuffer.handle != VK_NULL_HANDLE) {
+        m_helper.destroyBuffer(m_storageBuffer);
+        m_storageBuffer = VulkanBuffer();
+    }
+
+    m_batchCount = 0;
+    m_compacted = false;
+}
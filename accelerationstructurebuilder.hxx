@@ -0,0 +1,106 @@
+#ifndef ACCELERATIONSTRUCTUREBUILDER_HXX
+#define ACCELERATIONSTRUCTUREBUILDER_HXX
+
+#include <stdint.h>
+#include <vector>
+
+#include "vulkanhelper.hxx"
+
+struct BottomLevelAccelerationStructure {
+    VulkanBuffer buffer;
+    VkAccelerationStructureKHR handle;
+    VkDeviceAddress gpuAddress;
+};
+
+namespace AccelerationStructureBuildMode {
+    enum Enum {
+        // one vkCmdBuildAccelerationStructuresKHR per BLAS, all sharing one scratch range with a barrier in between
+        Serial = 0,
+        // every BLAS gets its own scratch range, all builds of a batch go into one call
+        Batched,
+        Count
+    };
+}
+
+/*
+ * Collects bottom level acceleration structure builds and records them together.
+ * All BLASes of the builder live in one storage buffer. In batched mode the scratch
+ * buffer is split into one range per build, so the builds are independent and the
+ * driver may run them in parallel; builds are only split into several batches
+ * (with a barrier in between) if their scratch memory exceeds the scratch budget.
+ * Optionally the BLASes are compacted into a second, right-sized storage buffer.
+ */
+class CAccelerationStructureBuilder
+{
+public:
+    CAccelerationStructureBuilder(VkDevice device, VkPhysicalDevice gpu, CVulkanHelper& helper);
+
+    // Returns the index of the BLAS. The geometry description and ranges are copied,
+    // device addresses in them have to stay valid until the build has executed.
+    uint32_t addBottomLevel(std::vector<VkAccelerationStructureGeometryKHR> const& geometries,
+                            std::vector<VkAccelerationStructureBuildRangeInfoKHR> const& buildRanges,
+                            VkBuildAccelerationStructureFlagsKHR flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR);
+
+    // Creates the acceleration structures of all added builds (once) and the scratch buffer
+    // for the mode, then records the builds followed by a single barrier that makes the
+    // results visible to a following TLAS build. With compaction enabled the compacted
+    // sizes are queried right after the builds.
+    void recordBuild(VkCommandBuffer commandBuffer, AccelerationStructureBuildMode::Enum mode);
+
+    // Reads the compacted sizes, so the recorded build has to be finished on the GPU. Creates
+    // right-sized acceleration structures in a new storage buffer and records the copies into
+    // them plus a barrier for a following TLAS build. getBottomLevel() returns the compacted
+    // BLASes from here on, the TLAS instances have to be written afterwards.
+    void recordCompaction(VkCommandBuffer commandBuffer);
+    // The originals can go once the recorded copies have finished on the GPU.
+    void releaseUncompacted();
+
+    // The scratch buffer can go once the recorded build has finished on the GPU.
+    void releaseScratch();
+    void destroy();
+
+    void setScratchBudget(VkDeviceSize budget) { m_scratchBudget = budget; }
+    // Has to be set before the first addBottomLevel(), the builds then allow compaction.
+    void setCompaction(bool compaction) { m_compaction = compaction; }
+    bool isCompacted() const { return m_compacted; }
+
+    uint32_t getBottomLevelCount() const { return static_cast<uint32_t>(m_builds.size()); }
+    BottomLevelAccelerationStructure const& getBottomLevel(uint32_t index) const { return m_builds[index].result; }
+    uint32_t getBatchCount() const { return m_batchCount; }
+    VkDeviceSize getScratchSize() const { return m_scratchBuffer.size; }
+    VkDeviceSize getStorageSize() const { return m_storageBuffer.size; }
+
+private:
+    struct Build {
+        std::vector<VkAccelerationStructureGeometryKHR> geometries;
+        std::vector<VkAccelerationStructureBuildRangeInfoKHR> buildRanges;
+        VkBuildAccelerationStructureFlagsKHR flags;
+        VkAccelerationStructureBuildSizesInfoKHR sizes;
+        VkDeviceSize storageOffset;
+        VkDeviceSize compactedSize;
+        BottomLevelAccelerationStructure result;
+    };
+
+    void printCompactionReport(VkDeviceSize uncompactedStorageSize) const;
+
+    void createAccelerationStructures();
+    VkAccelerationStructureBuildGeometryInfoKHR getBuildGeometryInfo(Build const& build, VkDeviceAddress scratchAddress) const;
+
+    VkDevice m_device;
+    CVulkanHelper& m_helper;
+    VkDeviceSize m_scratchAlignment;
+    VkDeviceSize m_scratchBudget;
+
+    std::vector<Build> m_builds;
+    VulkanBuffer m_storageBuffer;
+    VulkanBuffer m_scratchBuffer;
+    uint32_t m_batchCount;
+
+    bool m_compaction;
+    bool m_compacted;
+    VkQueryPool m_compactedSizeQueryPool;
+    std::vector<VkAccelerationStructureKHR> m_uncompactedHandles;
+    VulkanBuffer m_uncompactedStorageBuffer;
+};
+
+#endif // ACCELERATIONSTRUCTUREBUILDER_HXX
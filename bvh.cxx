@@ -0,0 +1,677 @@
+#include "bvh.hxx"
+#include "taskscheduler.hxx"
+
+#include <algorithm>
+#include <chrono>
+
+namespace {
+
+    uint32_t const kMinChunkSize = 1024;
+
+    struct BuildReference {
+        BvhBounds bounds;
+        glm::vec3 centroid;
+        uint32_t primitiveIndex;
+    };
+
+    struct BuildTask {
+        uint32_t nodeIndex;
+        uint32_t begin;
+        uint32_t end;
+        uint32_t depth;
+        BvhBounds centroidBounds;
+    };
+
+    struct Bin {
+        BvhBounds bounds;
+        uint32_t count;
+    };
+
+    struct Binning {
+        Bin bins[3][CBvh::kMaxBinCount];
+
+        void clear(uint32_t binCount) {
+            for (uint32_t axis = 0; axis < 3; ++axis) {
+                for (uint32_t bin = 0; bin < binCount; ++bin) {
+                    bins[axis][bin].bounds = BvhBounds::empty();
+                    bins[axis][bin].count = 0;
+                }
+            }
+        }
+
+        void merge(Binning const& other, uint32_t binCount) {
+            for (uint32_t axis = 0; axis < 3; ++axis) {
+                for (uint32_t bin = 0; bin < binCount; ++bin) {
+                    bins[axis][bin].bounds.grow(other.bins[axis][bin].bounds);
+                    bins[axis][bin].count += other.bins[axis][bin].count;
+                }
+            }
+        }
+    };
+
+    struct BinMapping {
+        glm::vec3 origin;
+        glm::vec3 scale;
+        uint32_t binCount;
+
+        BinMapping(BvhBounds const& centroidBounds, uint32_t count)
+            : origin(centroidBounds.min)
+            , binCount(count)
+        {
+            glm::vec3 extent = centroidBounds.max - centroidBounds.min;
+            for (uint32_t axis = 0; axis < 3; ++axis) {
+                // the factor keeps the centroid on the upper bound inside the last bin
+                scale[axis] = extent[axis] > 0.0f ? static_cast<float>(binCount) * 0.99999f / extent[axis] : 0.0f;
+            }
+        }
+
+        uint32_t getBin(glm::vec3 const& centroid, uint32_t axis) const {
+            int32_t bin = static_cast<int32_t>((centroid[axis] - origin[axis]) * scale[axis]);
+            return static_cast<uint32_t>(std::min(std::max(bin, 0), static_cast<int32_t>(binCount) - 1));
+        }
+    };
+
+    struct Split {
+        uint32_t axis;
+        uint32_t leftBinCount;
+        uint32_t leftCount;
+        BvhBounds leftBounds;
+        BvhBounds rightBounds;
+        BvhBounds leftCentroidBounds;
+        BvhBounds rightCentroidBounds;
+    };
+
+    uint32_t getChunkCount(CTaskScheduler* scheduler, uint32_t count) {
+        if (scheduler == nullptr || scheduler->getThreadCount() == 1) {
+            return 1;
+        }
+        return std::max(1u, std::min(scheduler->getThreadCount() * 4, count / kMinChunkSize));
+    }
+
+    // func(chunkIndex, begin, end) for chunkCount even slices of [0, count)
+    template<typename Func>
+    void forEachChunk(CTaskScheduler* scheduler, uint32_t count, uint32_t chunkCount, Func const& func) {
+        auto runChunk = [&](uint32_t chunkIndex, uint32_t) {
+            uint32_t begin = static_cast<uint32_t>(static_cast<uint64_t>(count) * chunkIndex / chunkCount);
+            uint32_t end = static_cast<uint32_t>(static_cast<uint64_t>(count) * (chunkIndex + 1) / chunkCount);
+            func(chunkIndex, begin, end);
+        };
+
+        if (chunkCount == 1) {
+            runChunk(0, 0);
+        }
+        else {
+            scheduler->parallelFor(chunkCount, runChunk);
+        }
+    }
+
+    uint32_t expandBits(uint32_t value) {
+        value = (value * 0x00010001u) & 0xFF0000FFu;
+        value = (value * 0x00000101u) & 0x0F00F00Fu;
+        value = (value * 0x00000011u) & 0xC30C30C3u;
+        value = (value * 0x00000005u) & 0x49249249u;
+        return value;
+    }
+
+    // 30 bit Morton code of a position normalized to [0, 1]
+    uint32_t getMortonCode(glm::vec3 const& position) {
+        glm::vec3 scaled = glm::clamp(position * 1024.0f, 0.0f, 1023.0f);
+        return (expandBits(static_cast<uint32_t>(scaled.x)) << 2) | (expandBits(static_cast<uint32_t>(scaled.y)) << 1) | expandBits(static_cast<uint32_t>(scaled.z));
+    }
+
+    // sorts the chunks in parallel and merges them pairwise
+    void parallelSort(CTaskScheduler* scheduler, std::vector<uint64_t>& keys) {
+        uint32_t count = static_cast<uint32_t>(keys.size());
+        uint32_t chunkCount = getChunkCount(scheduler, count);
+
+        forEachChunk(scheduler, count, chunkCount, [&](uint32_t, uint32_t begin, uint32_t end) {
+            std::sort(keys.begin() + begin, keys.begin() + end);
+        });
+
+        for (uint32_t width = 1; width < chunkCount; width *= 2) {
+            uint32_t mergeCount = (chunkCount + 2 * width - 1) / (2 * width);
+            auto mergeChunks = [&](uint32_t mergeIndex, uint32_t) {
+                uint32_t firstChunk = mergeIndex * 2 * width;
+                uint32_t middleChunk = std::min(firstChunk + width, chunkCount);
+                uint32_t lastChunk = std::min(firstChunk + 2 * width, chunkCount);
+                uint64_t begin = static_cast<uint64_t>(count) * firstChunk / chunkCount;
+                uint64_t middle = static_cast<uint64_t>(count) * middleChunk / chunkCount;
+                uint64_t end = static_cast<uint64_t>(count) * lastChunk / chunkCount;
+                std::inplace_merge(keys.begin() + begin, keys.begin() + middle, keys.begin() + end);
+            };
+
+            if (mergeCount == 1) {
+                mergeChunks(0, 0);
+            }
+            else {
+                scheduler->parallelFor(mergeCount, mergeChunks);
+            }
+        }
+    }
+
+    void binReferences(BuildReference const* references, uint32_t begin, uint32_t end, BinMapping const& mapping, Binning& binning) {
+        for (uint32_t index = begin; index < end; ++index) {
+            BuildReference const& reference = references[index];
+            for (uint32_t axis = 0; axis < 3; ++axis) {
+                Bin& bin = binning.bins[axis][mapping.getBin(reference.centroid, axis)];
+                bin.bounds.grow(reference.bounds);
+                ++bin.count;
+            }
+        }
+    }
+
+    void computeCentroidBounds(CTaskScheduler* scheduler, BuildReference const* references, uint32_t begin, uint32_t end, BvhBounds& centroidBounds) {
+        uint32_t chunkCount = getChunkCount(scheduler, end - begin);
+        if (chunkCount == 1) {
+            centroidBounds = BvhBounds::empty();
+            for (uint32_t index = begin; index < end; ++index) {
+                centroidBounds.grow(references[index].centroid);
+            }
+            return;
+        }
+
+        std::vector<BvhBounds> chunkBounds(chunkCount, BvhBounds::empty());
+
+        forEachChunk(scheduler, end - begin, chunkCount, [&](uint32_t chunkIndex, uint32_t chunkBegin, uint32_t chunkEnd) {
+            for (uint32_t index = begin + chunkBegin; index < begin + chunkEnd; ++index) {
+                chunkBounds[chunkIndex].grow(references[index].centroid);
+            }
+        });
+
+        centroidBounds = BvhBounds::empty();
+        for (uint32_t chunkIndex = 0; chunkIndex < chunkCount; ++chunkIndex) {
+            centroidBounds.grow(chunkBounds[chunkIndex]);
+        }
+    }
+
+    // Returns false if the node should become a leaf.
+    bool findSplit(CTaskScheduler* scheduler, BuildReference* references, BuildTask const& task, BvhBounds const& nodeBounds, BvhBuildSettings const& settings, Split& split) {
+        uint32_t count = task.end - task.begin;
+        if (count <= 1) {
+            return false;
+        }
+        if (task.depth + 1 >= CBvh::kMaxDepth) {
+            return false;
+        }
+
+        // small nodes do not need more bins than primitives
+        uint32_t binCount = std::min(std::min(std::max(settings.binCount, 2u), CBvh::kMaxBinCount), std::max(count, 2u));
+        BinMapping mapping(task.centroidBounds, binCount);
+
+        Binning binning;
+        binning.clear(binCount);
+
+        uint32_t chunkCount = getChunkCount(scheduler, count);
+        if (chunkCount == 1) {
+            binReferences(references, task.begin, task.end, mapping, binning);
+        }
+        else {
+            std::vector<Binning> chunkBinnings(chunkCount);
+            forEachChunk(scheduler, count, chunkCount, [&](uint32_t chunkIndex, uint32_t begin, uint32_t end) {
+                chunkBinnings[chunkIndex].clear(binCount);
+                binReferences(references, task.begin + begin, task.begin + end, mapping, chunkBinnings[chunkIndex]);
+            });
+            for (uint32_t chunkIndex = 0; chunkIndex < chunkCount; ++chunkIndex) {
+                binning.merge(chunkBinnings[chunkIndex], binCount);
+            }
+        }
+
+        float nodeArea = nodeBounds.getSurfaceArea();
+        float leafCost = settings.intersectionCost * count;
+        float bestCost = 1e30f;
+        bool splitFound = false;
+
+        for (uint32_t axis = 0; axis < 3; ++axis) {
+            if (mapping.scale[axis] == 0.0f) {
+                continue;
+            }
+
+            // right side areas and counts, swept from the last bin
+            float rightArea[CBvh::kMaxBinCount];
+            uint32_t rightCount[CBvh::kMaxBinCount];
+            BvhBounds accumulated = BvhBounds::empty();
+            uint32_t accumulatedCount = 0;
+            for (uint32_t bin = binCount - 1; bin > 0; --bin) {
+                accumulated.grow(binning.bins[axis][bin].bounds);
+                accumulatedCount += binning.bins[axis][bin].count;
+                rightArea[bin] = accumulated.getSurfaceArea();
+                rightCount[bin] = accumulatedCount;
+            }
+
+            accumulated = BvhBounds::empty();
+            accumulatedCount = 0;
+            for (uint32_t leftBinCount = 1; leftBinCount < binCount; ++leftBinCount) {
+                accumulated.grow(binning.bins[axis][leftBinCount - 1].bounds);
+                accumulatedCount += binning.bins[axis][leftBinCount - 1].count;
+
+                if (accumulatedCount == 0 || rightCount[leftBinCount] == 0) {
+                    continue;
+                }
+
+                float cost = settings.traversalCost + settings.intersectionCost * (accumulatedCount * accumulated.getSurfaceArea() + rightCount[leftBinCount] * rightArea[leftBinCount]) / nodeArea;
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    split.axis = axis;
+                    split.leftBinCount = leftBinCount;
+                    splitFound = true;
+                }
+            }
+        }
+
+        if (splitFound) {
+            if (bestCost >= leafCost && count <= settings.maxLeafSize) {
+                return false;
+            }
+
+            split.leftCount = 0;
+            split.leftBounds = BvhBounds::empty();
+            split.rightBounds = BvhBounds::empty();
+            for (uint32_t bin = 0; bin < binCount; ++bin) {
+                Bin const& source = binning.bins[split.axis][bin];
+                bool left = bin < split.leftBinCount;
+                split.leftCount += left ? source.count : 0;
+                (left ? split.leftBounds : split.rightBounds).grow(source.bounds);
+            }
+
+            // stable, so both halves stay in Morton order
+            std::stable_partition(references + task.begin, references + task.end, [&](BuildReference const& reference) {
+                return mapping.getBin(reference.centroid, split.axis) < split.leftBinCount;
+            });
+
+            computeCentroidBounds(scheduler, references, task.begin, task.begin + split.leftCount, split.leftCentroidBounds);
+            computeCentroidBounds(scheduler, references, task.begin + split.leftCount, task.end, split.rightCentroidBounds);
+
+            return true;
+        }
+
+        // all centroids in one spot, only an oversized leaf is worth splitting
+        if (count <= settings.maxLeafSize) {
+            return false;
+        }
+
+        split.axis = 0;
+        split.leftBinCount = 0;
+        split.leftCount = count / 2;
+        split.leftBounds = BvhBounds::empty();
+        split.rightBounds = BvhBounds::empty();
+        for (uint32_t index = task.begin; index < task.end; ++index) {
+            (index < task.begin + split.leftCount ? split.leftBounds : split.rightBounds).grow(references[index].bounds);
+        }
+        split.leftCentroidBounds = task.centroidBounds;
+        split.rightCentroidBounds = task.centroidBounds;
+
+        return true;
+    }
+
+    BvhNode makeNode(BvhBounds const& bounds) {
+        BvhNode node;
+        node.boundsMin = bounds.min;
+        node.boundsMax = bounds.max;
+        node.leftFirst = 0;
+        node.primitiveCount = 0;
+        return node;
+    }
+
+    // Splits task into two child tasks, their nodes are added to nodes. Returns false for a leaf.
+    bool splitTask(CTaskScheduler* scheduler, BuildReference* references, BuildTask const& task, BvhBuildSettings const& settings, std::vector<BvhNode>& nodes, BuildTask& left, BuildTask& right) {
+        BvhBounds nodeBounds = { nodes[task.nodeIndex].boundsMin, nodes[task.nodeIndex].boundsMax };
+
+        Split split;
+        if (!findSplit(scheduler, references, task, nodeBounds, settings, split)) {
+            nodes[task.nodeIndex].leftFirst = task.begin;
+            nodes[task.nodeIndex].primitiveCount = task.end - task.begin;
+            return false;
+        }
+
+        uint32_t childIndex = static_cast<uint32_t>(nodes.size());
+        nodes[task.nodeIndex].leftFirst = childIndex;
+        nodes[task.nodeIndex].primitiveCount = 0;
+        nodes.push_back(makeNode(split.leftBounds));
+        nodes.push_back(makeNode(split.rightBounds));
+
+        left.nodeIndex = childIndex;
+        left.begin = task.begin;
+        left.end = task.begin + split.leftCount;
+        left.depth = task.depth + 1;
+        left.centroidBounds = split.leftCentroidBounds;
+
+        right.nodeIndex = childIndex + 1;
+        right.begin = task.begin + split.leftCount;
+        right.end = task.end;
+        right.depth = task.depth + 1;
+        right.centroidBounds = split.rightCentroidBounds;
+
+        return true;
+    }
+
+    // Builds the subtree below task into localNodes, local node 0 is the subtree root.
+    void buildSubtree(BuildReference* references, BuildTask const& rootTask, BvhNode const& rootNode, BvhBuildSettings const& settings, std::vector<BvhNode>& localNodes) {
+        localNodes.clear();
+        localNodes.push_back(rootNode);
+
+        std::vector<BuildTask> stack;
+        BuildTask task = rootTask;
+        task.nodeIndex = 0;
+        stack.push_back(task);
+
+        while (!stack.empty()) {
+            task = stack.back();
+            stack.pop_back();
+
+            BuildTask left, right;
+            if (splitTask(nullptr, references, task, settings, localNodes, left, right)) {
+                stack.push_back(right);
+                stack.push_back(left);
+            }
+        }
+    }
+}
+
+uint32_t const CBvh::kMaxBinCount;
+uint32_t const CBvh::kMaxDepth;
+
+BvhBounds BvhBounds::transformed(glm::mat4 const& transform) const {
+    if (isEmpty()) {
+        return *this;
+    }
+
+    BvhBounds result = BvhBounds::empty();
+    for (uint32_t corner = 0; corner < 8; ++corner) {
+        glm::vec3 position((corner & 1) ? max.x : min.x, (corner & 2) ? max.y : min.y, (corner & 4) ? max.z : min.z);
+        result.grow(glm::vec3(transform * glm::vec4(position, 1.0f)));
+    }
+    return result;
+}
+
+BvhBounds CBvh::getBounds() const {
+    if (m_nodes.empty()) {
+        return BvhBounds::empty();
+    }
+    BvhBounds bounds = { m_nodes[0].boundsMin, m_nodes[0].boundsMax };
+    return bounds;
+}
+
+void CBvh::build(CTaskScheduler* scheduler, std::vector<BvhBounds> const& primitiveBounds, BvhBuildSettings const& settings) {
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    uint32_t primitiveCount = static_cast<uint32_t>(primitiveBounds.size());
+
+    m_nodes.clear();
+    m_primitiveIndices.clear();
+    m_stats = BvhBuildStats();
+
+    if (primitiveCount == 0) {
+        return;
+    }
+
+    uint32_t chunkCount = getChunkCount(scheduler, primitiveCount);
+
+    // scene and centroid bounds
+    BvhBounds rootBounds = BvhBounds::empty();
+    BvhBounds rootCentroidBounds = BvhBounds::empty();
+    {
+        std::vector<BvhBounds> chunkBounds(chunkCount, BvhBounds::empty());
+        std::vector<BvhBounds> chunkCentroidBounds(chunkCount, BvhBounds::empty());
+        forEachChunk(scheduler, primitiveCount, chunkCount, [&](uint32_t chunkIndex, uint32_t begin, uint32_t end) {
+            for (uint32_t index = begin; index < end; ++index) {
+                chunkBounds[chunkIndex].grow(primitiveBounds[index]);
+                chunkCentroidBounds[chunkIndex].grow(primitiveBounds[index].getCenter());
+            }
+        });
+        for (uint32_t chunkIndex = 0; chunkIndex < chunkCount; ++chunkIndex) {
+            rootBounds.grow(chunkBounds[chunkIndex]);
+            rootCentroidBounds.grow(chunkCentroidBounds[chunkIndex]);
+        }
+    }
+
+    // Morton order of the centroids
+    std::vector<BuildReference> references(primitiveCount);
+    {
+        std::vector<uint64_t> keys(primitiveCount);
+        glm::vec3 extent = rootCentroidBounds.max - rootCentroidBounds.min;
+        glm::vec3 inverseExtent = glm::vec3(
+            extent.x > 0.0f ? 1.0f / extent.x : 0.0f,
+            extent.y > 0.0f ? 1.0f / extent.y : 0.0f,
+            extent.z > 0.0f ? 1.0f / extent.z : 0.0f);
+
+        forEachChunk(scheduler, primitiveCount, chunkCount, [&](uint32_t, uint32_t begin, uint32_t end) {
+            for (uint32_t index = begin; index < end; ++index) {
+                uint32_t code = getMortonCode((primitiveBounds[index].getCenter() - rootCentroidBounds.min) * inverseExtent);
+                keys[index] = (static_cast<uint64_t>(code) << 32) | index;
+            }
+        });
+
+        parallelSort(scheduler, keys);
+
+        forEachChunk(scheduler, primitiveCount, chunkCount, [&](uint32_t, uint32_t begin, uint32_t end) {
+            for (uint32_t index = begin; index < end; ++index) {
+                uint32_t primitiveIndex = static_cast<uint32_t>(keys[index]);
+                references[index].bounds = primitiveBounds[primitiveIndex];
+                references[index].centroid = primitiveBounds[primitiveIndex].getCenter();
+                references[index].primitiveIndex = primitiveIndex;
+            }
+        });
+    }
+
+    m_nodes.reserve(2 * primitiveCount);
+    m_nodes.push_back(makeNode(rootBounds));
+
+    BuildTask rootTask;
+    rootTask.nodeIndex = 0;
+    rootTask.begin = 0;
+    rootTask.end = primitiveCount;
+    rootTask.depth = 0;
+    rootTask.centroidBounds = rootCentroidBounds;
+
+    // upper levels: one node at a time, binned in parallel
+    std::vector<BuildTask> subtreeTasks;
+    {
+        bool parallel = scheduler != nullptr && scheduler->getThreadCount() > 1;
+        std::vector<BuildTask> stack(1, rootTask);
+
+        while (!stack.empty()) {
+            BuildTask task = stack.back();
+            stack.pop_back();
+
+            if (!parallel || task.end - task.begin <= settings.parallelThreshold) {
+                subtreeTasks.push_back(task);
+                continue;
+            }
+
+            BuildTask left, right;
+            if (splitTask(scheduler, references.data(), task, settings, m_nodes, left, right)) {
+                stack.push_back(right);
+                stack.push_back(left);
+            }
+        }
+    }
+
+    // lower levels: every subtree is built by one worker into its own node list
+    {
+        std::vector<std::vector<BvhNode>> subtreeNodes(subtreeTasks.size());
+        auto buildTask = [&](uint32_t taskIndex, uint32_t) {
+            BuildTask const& task = subtreeTasks[taskIndex];
+            buildSubtree(references.data(), task, m_nodes[task.nodeIndex], settings, subtreeNodes[taskIndex]);
+        };
+
+        if (scheduler != nullptr && subtreeTasks.size() > 1) {
+            scheduler->parallelFor(static_cast<uint32_t>(subtreeTasks.size()), buildTask);
+        }
+        else {
+            for (uint32_t taskIndex = 0; taskIndex < subtreeTasks.size(); ++taskIndex) {
+                buildTask(taskIndex, 0);
+            }
+        }
+
+        // the subtree roots already have a slot, the rest is appended
+        std::vector<uint32_t> offsets(subtreeTasks.size());
+        uint32_t nodeCount = static_cast<uint32_t>(m_nodes.size());
+        for (size_t taskIndex = 0; taskIndex < subtreeTasks.size(); ++taskIndex) {
+            offsets[taskIndex] = nodeCount;
+            nodeCount += static_cast<uint32_t>(subtreeNodes[taskIndex].size()) - 1;
+        }
+        m_nodes.resize(nodeCount);
+
+        auto copyTask = [&](uint32_t taskIndex, uint32_t) {
+            std::vector<BvhNode> const& localNodes = subtreeNodes[taskIndex];
+            uint32_t offset = offsets[taskIndex];
+
+            for (size_t localIndex = 0; localIndex < localNodes.size(); ++localIndex) {
+                BvhNode node = localNodes[localIndex];
+                if (!node.isLeaf()) {
+                    node.leftFirst = offset + node.leftFirst - 1;
+                }
+                m_nodes[localIndex == 0 ? subtreeTasks[taskIndex].nodeIndex : offset + static_cast<uint32_t>(localIndex) - 1] = node;
+            }
+        };
+
+        if (scheduler != nullptr && subtreeTasks.size() > 1) {
+            scheduler->parallelFor(static_cast<uint32_t>(subtreeTasks.size()), copyTask);
+        }
+        else {
+            for (uint32_t taskIndex = 0; taskIndex < subtreeTasks.size(); ++taskIndex) {
+                copyTask(taskIndex, 0);
+            }
+        }
+    }
+
+    m_primitiveIndices.resize(primitiveCount);
+    for (uint32_t index = 0; index < primitiveCount; ++index) {
+        m_primitiveIndices[index] = references[index].primitiveIndex;
+    }
+
+    std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+
+    computeStats(settings);
+    m_stats.primitiveCount = primitiveCount;
+    m_stats.buildSeconds = std::chrono::duration<double>(end - start).count();
+}
+
+void CBvh::computeStats(BvhBuildSettings const& settings) {
+    m_stats.nodeCount = static_cast<uint32_t>(m_nodes.size());
+    m_stats.leafCount = 0;
+    m_stats.maxDepth = 0;
+    m_stats.sahCost = 0.0f;
+
+    float rootArea = getBounds().getSurfaceArea();
+    if (m_nodes.empty() || rootArea <= 0.0f) {
+        m_stats.leafCount = m_nodes.empty() ? 0 : 1;
+        m_stats.maxDepth = m_nodes.empty() ? 0 : 1;
+        m_stats.sahCost = m_nodes.empty() ? 0.0f : settings.intersectionCost * m_nodes[0].primitiveCount;
+        return;
+    }
+
+    double cost = 0.0;
+    std::vector<std::pair<uint32_t, uint32_t>> stack(1, std::make_pair(0u, 1u));
+    while (!stack.empty()) {
+        uint32_t nodeIndex = stack.back().first;
+        uint32_t depth = stack.back().second;
+        stack.pop_back();
+
+        BvhNode const& node = m_nodes[nodeIndex];
+        BvhBounds bounds = { node.boundsMin, node.boundsMax };
+        float area = bounds.getSurfaceArea() / rootArea;
+
+        m_stats.maxDepth = std::max(m_stats.maxDepth, depth);
+
+        if (node.isLeaf()) {
+            ++m_stats.leafCount;
+            cost += settings.intersectionCost * node.primitiveCount * area;
+        }
+        else {
+            cost += settings.traversalCost * area;
+            stack.push_back(std::make_pair(node.leftFirst, depth + 1));
+            stack.push_back(std::make_pair(node.leftFirst + 1, depth + 1));
+        }
+    }
+
+    m_stats.sahCost = static_cast<float>(cost);
+}
+
+void CTwoLevelBvh::build(CTaskScheduler* scheduler, std::vector<std::vector<BvhBounds>> const& bottomLevelPrimitives, std::vector<BvhInstance> const& instances, BvhBuildSettings const& settings) {
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    uint32_t bottomLevelCount = static_cast<uint32_t>(bottomLevelPrimitives.size());
+    uint32_t instanceCount = static_cast<uint32_t>(instances.size());
+
+    m_instances = instances;
+    m_bottomLevels.resize(bottomLevelCount);
+
+    // large BLASes get the whole scheduler, the small ones are built side by side
+    std::vector<uint32_t> smallBottomLevels;
+    for (uint32_t index = 0; index < bottomLevelCount; ++index) {
+        if (scheduler != nullptr && bottomLevelPrimitives[index].size() > settings.parallelThreshold) {
+            m_bottomLevels[index].build(scheduler, bottomLevelPrimitives[index], settings);
+        }
+        else {
+            smallBottomLevels.push_back(index);
+        }
+    }
+
+    auto buildBottomLevel = [&](uint32_t taskIndex, uint32_t) {
+        uint32_t index = smallBottomLevels[taskIndex];
+        m_bottomLevels[index].build(nullptr, bottomLevelPrimitives[index], settings);
+    };
+
+    if (scheduler != nullptr && smallBottomLevels.size() > 1) {
+        scheduler->parallelFor(static_cast<uint32_t>(smallBottomLevels.size()), buildBottomLevel);
+    }
+    else {
+        for (uint32_t taskIndex = 0; taskIndex < smallBottomLevels.size(); ++taskIndex) {
+            buildBottomLevel(taskIndex, 0);
+        }
+    }
+
+    std::chrono::high_resolution_clock::time_point bottomLevelEnd = std::chrono::high_resolution_clock::now();
+
+    // world space bounds of every instance
+    std::vector<BvhBounds> instanceBounds(instanceCount);
+    forEachChunk(scheduler, instanceCount, getChunkCount(scheduler, instanceCount), [&](uint32_t, uint32_t begin, uint32_t end) {
+        for (uint32_t index = begin; index < end; ++index) {
+            BvhInstance const& instance = instances[index];
+            instanceBounds[index] = m_bottomLevels[instance.bottomLevelIndex].getBounds().transformed(instance.objectToWorld);
+        }
+    });
+
+    m_topLevel.build(scheduler, instanceBounds, settings);
+
+    std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+
+    m_stats = TwoLevelBvhStats();
+    m_stats.topLevel = m_topLevel.getStats();
+    m_stats.bottomLevelCount = bottomLevelCount;
+    m_stats.bottomLevelSeconds = std::chrono::duration<double>(bottomLevelEnd - start).count();
+    m_stats.totalSeconds = std::chrono::duration<double>(end - start).count();
+
+    m_stats.memoryBytes = m_topLevel.getNodes().size() * sizeof(BvhNode) + m_topLevel.getPrimitiveIndices().size() * sizeof(uint32_t) + m_instances.size() * sizeof(BvhInstance);
+    for (uint32_t index = 0; index < bottomLevelCount; ++index) {
+        m_stats.bottomLevelNodeCount += static_cast<uint32_t>(m_bottomLevels[index].getNodes().size());
+        m_stats.memoryBytes += m_bottomLevels[index].getNodes().size() * sizeof(BvhNode) + m_bottomLevels[index].getPrimitiveIndices().size() * sizeof(uint32_t);
+    }
+
+    // TLAS cost where entering an instance costs one intersection plus the SAH cost of its BLAS,
+    // with the BLAS root approximated by the TLAS leaf it sits in
+    std::vector<BvhNode> const& nodes = m_topLevel.getNodes();
+    std::vector<uint32_t> const& instanceIndices = m_topLevel.getPrimitiveIndices();
+    float rootArea = m_topLevel.getBounds().getSurfaceArea();
+    if (rootArea > 0.0f) {
+        double cost = 0.0;
+        for (size_t nodeIndex = 0; nodeIndex < nodes.size(); ++nodeIndex) {
+            BvhNode const& node = nodes[nodeIndex];
+            BvhBounds bounds = { node.boundsMin, node.boundsMax };
+            float area = bounds.getSurfaceArea() / rootArea;
+
+            if (!node.isLeaf()) {
+                cost += settings.traversalCost * area;
+                continue;
+            }
+
+            double leafCost = 0.0;
+            for (uint32_t index = node.leftFirst; index < node.leftFirst + node.primitiveCount; ++index) {
+                leafCost += settings.intersectionCost + m_bottomLevels[m_instances[instanceIndices[index]].bottomLevelIndex].getStats().sahCost;
+            }
+            cost += leafCost * area;
+        }
+        m_stats.sahCost = static_cast<float>(cost);
+    }
+}
@@ -0,0 +1,248 @@
+#ifndef BVH_HXX
+#define BVH_HXX
+
+#include <stdint.h>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+class CTaskScheduler;
+
+struct BvhBounds {
+    glm::vec3 min;
+    glm::vec3 max;
+
+    static BvhBounds empty() {
+        BvhBounds bounds = { glm::vec3(1e30f), glm::vec3(-1e30f) };
+        return bounds;
+    }
+
+    void grow(glm::vec3 const& point) {
+        min = glm::min(min, point);
+        max = glm::max(max, point);
+    }
+
+    void grow(BvhBounds const& bounds) {
+        min = glm::min(min, bounds.min);
+        max = glm::max(max, bounds.max);
+    }
+
+    bool isEmpty() const { return min.x > max.x || min.y > max.y || min.z > max.z; }
+    glm::vec3 getCenter() const { return 0.5f * (min + max); }
+
+    float getSurfaceArea() const {
+        if (isEmpty()) {
+            return 0.0f;
+        }
+        glm::vec3 extent = max - min;
+        return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+    }
+
+    BvhBounds transformed(glm::mat4 const& transform) const;
+};
+
+// Interior nodes store the index of the left child, the right child follows it.
+// Leaves store the first entry in the primitive index list and the primitive count.
+struct BvhNode {
+    glm::vec3 boundsMin;
+    uint32_t leftFirst;
+    glm::vec3 boundsMax;
+    uint32_t primitiveCount;
+
+    bool isLeaf() const { return primitiveCount > 0; }
+};
+
+static_assert(sizeof(BvhNode) == 32, "BvhNode is expected to be 32 bytes");
+
+struct BvhBuildSettings {
+    uint32_t binCount = 16;
+    uint32_t maxLeafSize = 4;
+    float traversalCost = 1.0f;
+    float intersectionCost = 1.0f;
+    // nodes with more primitives are binned in parallel, smaller ones become one subtree task each
+    uint32_t parallelThreshold = 4096;
+};
+
+struct BvhBuildStats {
+    uint32_t primitiveCount;
+    uint32_t nodeCount;
+    uint32_t leafCount;
+    uint32_t maxDepth;
+    float sahCost;
+    double buildSeconds;
+};
+
+/*
+ * Binned SAH bounding volume hierarchy over a list of primitive bounds.
+ * Primitives are first sorted along a Morton curve of their centroids; the
+ * SAH partitions are stable, so every leaf and every subtree covers a range of
+ * the Morton order. The upper levels are binned in parallel, the remaining
+ * subtrees are built in parallel on the CTaskScheduler.
+ */
+class CBvh
+{
+public:
+    static uint32_t const kMaxBinCount = 32;
+    static uint32_t const kMaxDepth = 64;
+
+    // scheduler may be nullptr for a single threaded build
+    void build(CTaskScheduler* scheduler, std::vector<BvhBounds> const& primitiveBounds, BvhBuildSettings const& settings = BvhBuildSettings());
+
+    // Closest hit (or any hit) traversal. intersect(primitiveIndex, tmin, tmax) returns true
+    // and shortens tmax if the primitive is hit closer than tmax.
+    template<typename IntersectPrimitive>
+    bool traverse(glm::vec3 const& origin, glm::vec3 const& direction, float tmin, float& tmax, bool anyHit, IntersectPrimitive const& intersect) const;
+
+    BvhBounds getBounds() const;
+    BvhBuildStats const& getStats() const { return m_stats; }
+    std::vector<BvhNode> const& getNodes() const { return m_nodes; }
+    std::vector<uint32_t> const& getPrimitiveIndices() const { return m_primitiveIndices; }
+
+private:
+    static bool intersectNode(BvhNode const& node, glm::vec3 const& origin, glm::vec3 const& inverseDirection, float tmin, float tmax, float& tenter);
+
+    void computeStats(BvhBuildSettings const& settings);
+
+    std::vector<BvhNode> m_nodes;
+    std::vector<uint32_t> m_primitiveIndices;
+    BvhBuildStats m_stats = {};
+};
+
+struct BvhInstance {
+    glm::mat4 objectToWorld;
+    glm::mat4 worldToObject;
+    uint32_t bottomLevelIndex;
+};
+
+struct TwoLevelBvhStats {
+    BvhBuildStats topLevel;
+    uint32_t bottomLevelCount;
+    uint32_t bottomLevelNodeCount;
+    double bottomLevelSeconds;
+    double totalSeconds;
+    // expected cost of a ray through the TLAS and the BLASes it enters, relative to the scene bounds
+    float sahCost;
+    size_t memoryBytes;
+};
+
+/*
+ * Host mirror of the acceleration structure layout CRayTracing hands to the driver:
+ * one BVH per bottom level geometry and a top level BVH over the transformed
+ * instance bounds.
+ */
+class CTwoLevelBvh
+{
+public:
+    void build(CTaskScheduler* scheduler, std::vector<std::vector<BvhBounds>> const& bottomLevelPrimitives, std::vector<BvhInstance> const& instances, BvhBuildSettings const& settings = BvhBuildSettings());
+
+    // intersect(instanceIndex, primitiveIndex, objectOrigin, objectDirection, tmin, tmax) with the
+    // ray in object space of the instance, t is the same in both spaces.
+    template<typename IntersectPrimitive>
+    bool traverse(glm::vec3 const& origin, glm::vec3 const& direction, float tmin, float& tmax, bool anyHit, IntersectPrimitive const& intersect) const;
+
+    TwoLevelBvhStats const& getStats() const { return m_stats; }
+    CBvh const& getTopLevel() const { return m_topLevel; }
+    std::vector<CBvh> const& getBottomLevels() const { return m_bottomLevels; }
+    std::vector<BvhInstance> const& getInstances() const { return m_instances; }
+
+private:
+    std::vector<CBvh> m_bottomLevels;
+    std::vector<BvhInstance> m_instances;
+    CBvh m_topLevel;
+    TwoLevelBvhStats m_stats = {};
+};
+
+inline bool CBvh::intersectNode(BvhNode const& node, glm::vec3 const& origin, glm::vec3 const& inverseDirection, float tmin, float tmax, float& tenter) {
+    glm::vec3 t0 = (node.boundsMin - origin) * inverseDirection;
+    glm::vec3 t1 = (node.boundsMax - origin) * inverseDirection;
+    glm::vec3 tNear = glm::min(t0, t1);
+    glm::vec3 tFar = glm::max(t0, t1);
+    tenter = glm::max(glm::max(tNear.x, tNear.y), glm::max(tNear.z, tmin));
+    float exit = glm::min(glm::min(tFar.x, tFar.y), glm::min(tFar.z, tmax));
+    return tenter <= exit;
+}
+
+template<typename IntersectPrimitive>
+bool CBvh::traverse(glm::vec3 const& origin, glm::vec3 const& direction, float tmin, float& tmax, bool anyHit, IntersectPrimitive const& intersect) const {
+    if (m_nodes.empty()) {
+        return false;
+    }
+
+    glm::vec3 inverseDirection = 1.0f / direction;
+
+    float tenter;
+    if (!intersectNode(m_nodes[0], origin, inverseDirection, tmin, tmax, tenter)) {
+        return false;
+    }
+
+    struct StackEntry {
+        uint32_t nodeIndex;
+        float tenter;
+    };
+
+    StackEntry stack[kMaxDepth];
+    uint32_t stackSize = 0;
+    uint32_t nodeIndex = 0;
+    bool hit = false;
+
+    for (;;) {
+        BvhNode const& node = m_nodes[nodeIndex];
+
+        if (node.isLeaf()) {
+            for (uint32_t index = node.leftFirst; index < node.leftFirst + node.primitiveCount; ++index) {
+                if (intersect(m_primitiveIndices[index], tmin, tmax)) {
+                    hit = true;
+                    if (anyHit) {
+                        return true;
+                    }
+                }
+            }
+        }
+        else {
+            float tleft, tright;
+            bool hitLeft = intersectNode(m_nodes[node.leftFirst], origin, inverseDirection, tmin, tmax, tleft);
+            bool hitRight = intersectNode(m_nodes[node.leftFirst + 1], origin, inverseDirection, tmin, tmax, tright);
+
+            if (hitLeft && hitRight) {
+                // visit the nearer child first, the other one waits on the stack
+                bool leftFirst = tleft <= tright;
+                stack[stackSize].nodeIndex = leftFirst ? node.leftFirst + 1 : node.leftFirst;
+                stack[stackSize].tenter = leftFirst ? tright : tleft;
+                ++stackSize;
+                nodeIndex = leftFirst ? node.leftFirst : node.leftFirst + 1;
+                continue;
+            }
+            if (hitLeft || hitRight) {
+                nodeIndex = hitLeft ? node.leftFirst : node.leftFirst + 1;
+                continue;
+            }
+        }
+
+        // pop, skipping nodes that start behind the closest hit found so far
+        for (;;) {
+            if (stackSize == 0) {
+                return hit;
+            }
+            --stackSize;
+            if (stack[stackSize].tenter <= tmax) {
+                nodeIndex = stack[stackSize].nodeIndex;
+                break;
+            }
+        }
+    }
+}
+
+template<typename IntersectPrimitive>
+bool CTwoLevelBvh::traverse(glm::vec3 const& origin, glm::vec3 const& direction, float tmin, float& tmax, bool anyHit, IntersectPrimitive const& intersect) const {
+    return m_topLevel.traverse(origin, direction, tmin, tmax, anyHit, [&](uint32_t instanceIndex, float instanceTmin, float& instanceTmax) {
+        BvhInstance const& instance = m_instances[instanceIndex];
+        glm::vec3 objectOrigin = glm::vec3(instance.worldToObject * glm::vec4(origin, 1.0f));
+        glm::vec3 objectDirection = glm::mat3(instance.worldToObject) * direction;
+
+        return m_bottomLevels[instance.bottomLevelIndex].traverse(objectOrigin, objectDirection, instanceTmin, instanceTmax, anyHit, [&](uint32_t primitiveIndex, float primitiveTmin, float& primitiveTmax) {
+            return intersect(instanceIndex, primitiveIndex, objectOrigin, objectDirection, primitiveTmin, primitiveTmax);
+        });
+    });
+}
+
+#endif // BVH_HXX
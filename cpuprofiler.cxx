@@ -0,0 +1,284 @@
+#include "cpuprofiler.hxx"
+
+#include <algorithm>
+
+namespace {
+    std::atomic<uint64_t> g_nextProfilerId(1);
+
+    // ring of the profiler the current thread recorded into last
+    struct ThreadRingCache {
+        uint64_t profilerId;
+        void* ring;
+    };
+    thread_local ThreadRingCache t_ringCache = { 0, nullptr };
+
+    double toMilliseconds(uint64_t nanoseconds) {
+        return nanoseconds / 1000000.0;
+    }
+}
+
+CLatencyHistogram::CLatencyHistogram()
+    : m_count(0)
+    , m_sum(0)
+    , m_max(0)
+{
+    for (uint32_t index = 0; index < kBucketCount; ++index) {
+        m_counts[index].store(0, std::memory_order_relaxed);
+    }
+}
+
+uint32_t CLatencyHistogram::getIndex(uint64_t value) {
+    value = std::min<uint64_t>(value, (1ull << 40) - 1);
+    if (value < kSubBucketCount) {
+        return static_cast<uint32_t>(value);
+    }
+
+    // shift so the value keeps kSubBucketBits significant bits, its top bit selects the upper half of the sub-buckets
+    uint32_t shift = 0;
+    while ((value >> shift) >= kSubBucketCount) {
+        ++shift;
+    }
+    return shift * (kSubBucketCount / 2) + static_cast<uint32_t>(value >> shift);
+}
+
+uint64_t CLatencyHistogram::getHighestValue(uint32_t index) {
+    if (index < kSubBucketCount) {
+        return index;
+    }
+
+    uint32_t shift = index / (kSubBucketCount / 2) - 1;
+    uint64_t subBucket = index % (kSubBucketCount / 2) + kSubBucketCount / 2;
+    return ((subBucket + 1) << shift) - 1;
+}
+
+void CLatencyHistogram::record(uint64_t nanoseconds) {
+    m_counts[getIndex(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(nanoseconds, std::memory_order_relaxed);
+
+    uint64_t max = m_max.load(std::memory_order_relaxed);
+    while (nanoseconds > max && !m_max.compare_exchange_weak(max, nanoseconds, std::memory_order_relaxed)) {
+    }
+}
+
+double CLatencyHistogram::getMean() const {
+    uint64_t count = getCount();
+    return count > 0 ? static_cast<double>(m_sum.load(std::memory_order_relaxed)) / count : 0.0;
+}
+
+uint64_t CLatencyHistogram::getValueAtQuantile(double quantile) const {
+    uint64_t count = getCount();
+    if (count == 0) {
+        return 0;
+    }
+
+    uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(quantile * count + 0.999999));
+    uint64_t cumulative = 0;
+    for (uint32_t index = 0; index < kBucketCount; ++index) {
+        cumulative += m_counts[index].load(std::memory_order_relaxed);
+        if (cumulative >= rank) {
+            return std::min(getHighestValue(index), getMax());
+        }
+    }
+
+    return getMax();
+}
+
+CCpuProfiler::CCpuProfiler()
+    : m_id(g_nextProfilerId.fetch_add(1))
+    , m_start(std::chrono::steady_clock::now())
+    , m_stageCount(0)
+{
+}
+
+uint32_t CCpuProfiler::registerStage(char const* name) {
+    if (m_stageCount >= kMaxStages) {
+        printf("cpu profiler: more than %u stages, %s is not measured\n", kMaxStages, name);
+        return UINT32_MAX;
+    }
+
+    m_stages[m_stageCount].reset(new Stage());
+    m_stages[m_stageCount]->name = name;
+    m_stages[m_stageCount]->intervalSum.store(0);
+    m_stages[m_stageCount]->intervalCount.store(0);
+    return m_stageCount++;
+}
+
+uint64_t CCpuProfiler::now() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count();
+}
+
+CCpuProfiler::ThreadRing* CCpuProfiler::getThreadRing() {
+    if (t_ringCache.profilerId == m_id) {
+        return static_cast<ThreadRing*>(t_ringCache.ring);
+    }
+
+    std::lock_guard<std::mutex> lock(m_ringMutex);
+
+    std::unique_ptr<ThreadRing> ring(new ThreadRing());
+    ring->threadIndex = static_cast<uint32_t>(m_rings.size());
+    // value initialized, every sequence starts at 0
+    ring->events.reset(new Event[kRingSize]());
+    ring->head.store(0);
+    m_rings.push_back(std::move(ring));
+
+    t_ringCache.profilerId = m_id;
+    t_ringCache.ring = m_rings.back().get();
+    return m_rings.back().get();
+}
+
+void CCpuProfiler::record(uint32_t stage, uint64_t startNanoseconds, uint64_t endNanoseconds) {
+    if (stage >= m_stageCount) {
+        return;
+    }
+
+    uint64_t duration = endNanoseconds - startNanoseconds;
+
+    ThreadRing* ring = getThreadRing();
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    Event& event = ring->events[head & (kRingSize - 1)];
+    event.sequence.store(2 * head + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    event.stage.store(stage, std::memory_order_relaxed);
+    event.startNanoseconds.store(startNanoseconds, std::memory_order_relaxed);
+    event.durationNanoseconds.store(duration, std::memory_order_relaxed);
+    event.sequence.store(2 * head + 2, std::memory_order_release);
+    ring->head.store(head + 1, std::memory_order_release);
+
+    Stage& profilerStage = *m_stages[stage];
+    profilerStage.histogram.record(duration);
+    profilerStage.intervalSum.fetch_add(duration, std::memory_order_relaxed);
+    profilerStage.intervalCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+std::string CCpuProfiler::takeIntervalSummary() {
+    std::string summary;
+
+    for (uint32_t stage = 0; stage < m_stageCount; ++stage) {
+        uint64_t sum = m_stages[stage]->intervalSum.exchange(0, std::memory_order_relaxed);
+        uint64_t count = m_stages[stage]->intervalCount.exchange(0, std::memory_order_relaxed);
+        if (count == 0) {
+            continue;
+        }
+
+        char text[64];
+        snprintf(text, sizeof(text), "%s%s %.2f ms", summary.empty() ? "" : ", ", m_stages[stage]->name, toMilliseconds(sum) / count);
+        summary += text;
+    }
+
+    return summary;
+}
+
+std::vector<CpuStageStats> CCpuProfiler::getStats() const {
+    std::vector<CpuStageStats> stats;
+
+    for (uint32_t stage = 0; stage < m_stageCount; ++stage) {
+        CLatencyHistogram const& histogram = m_stages[stage]->histogram;
+        if (histogram.getCount() == 0) {
+            continue;
+        }
+
+        CpuStageStats stageStats;
+        stageStats.name = m_stages[stage]->name;
+        stageStats.sampleCount = histogram.getCount();
+        stageStats.avgMilliseconds = histogram.getMean() / 1000000.0;
+        stageStats.p50Milliseconds = toMilliseconds(histogram.getValueAtQuantile(0.5));
+        stageStats.p90Milliseconds = toMilliseconds(histogram.getValueAtQuantile(0.9));
+        stageStats.p99Milliseconds = toMilliseconds(histogram.getValueAtQuantile(0.99));
+        stageStats.maxMilliseconds = toMilliseconds(histogram.getMax());
+        stats.push_back(stageStats);
+    }
+
+    return stats;
+}
+
+void CCpuProfiler::printReport() const {
+    std::vector<CpuStageStats> stats = getStats();
+    for (size_t index = 0; index < stats.size(); ++index) {
+        printf("cpu %-20s %6llu samples, avg %8.3f ms, p50 %8.3f ms, p90 %8.3f ms, p99 %8.3f ms, max %8.3f ms\n",
+               stats[index].name.c_str(),
+               static_cast<unsigned long long>(stats[index].sampleCount),
+               stats[index].avgMilliseconds,
+               stats[index].p50Milliseconds,
+               stats[index].p90Milliseconds,
+               stats[index].p99Milliseconds,
+               stats[index].maxMilliseconds);
+    }
+}
+
+bool CCpuProfiler::writeReport(std::string const& path) const {
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file) {
+        printf("cpu profiler: can not open %s\n", path.c_str());
+        return false;
+    }
+
+    std::vector<CpuStageStats> stats = getStats();
+
+    // the stage names are string literals of the code, nothing to escape
+    fprintf(file, "{\n  \"stages\": [");
+    for (size_t index = 0; index < stats.size(); ++index) {
+        fprintf(file, "%s\n    { \"name\": \"%s\", \"samples\": %llu, \"avgMs\": %.6f, \"p50Ms\": %.6f, \"p90Ms\": %.6f, \"p99Ms\": %.6f, \"maxMs\": %.6f }",
+                index > 0 ? "," : "",
+                stats[index].name.c_str(),
+                static_cast<unsigned long long>(stats[index].sampleCount),
+                stats[index].avgMilliseconds,
+                stats[index].p50Milliseconds,
+                stats[index].p90Milliseconds,
+                stats[index].p99Milliseconds,
+                stats[index].maxMilliseconds);
+    }
+    fprintf(file, "\n  ]\n}\n");
+
+    fclose(file);
+
+    printf("cpu profiler: written to %s\n", path.c_str());
+    return true;
+}
+
+bool CCpuProfiler::writeChromeTrace(std::string const& path) const {
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file) {
+        printf("cpu profiler: can not open %s\n", path.c_str());
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(m_ringMutex);
+
+    bool first = true;
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (size_t ringIndex = 0; ringIndex < m_rings.size(); ++ringIndex) {
+        ThreadRing const& ring = *m_rings[ringIndex];
+
+        uint64_t head = ring.head.load(std::memory_order_acquire);
+        uint64_t count = std::min<uint64_t>(head, kRingSize);
+        for (uint64_t index = head - count; index < head; ++index) {
+            Event const& event = ring.events[index & (kRingSize - 1)];
+            uint64_t const sequence = 2 * index + 2;
+            if (event.sequence.load(std::memory_order_acquire) != sequence) {
+                continue;
+            }
+            uint32_t stage = event.stage.load(std::memory_order_relaxed);
+            uint64_t startNanoseconds = event.startNanoseconds.load(std::memory_order_relaxed);
+            uint64_t durationNanoseconds = event.durationNanoseconds.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            // the writer wrapped around to the event while it was copied
+            if (event.sequence.load(std::memory_order_relaxed) != sequence) {
+                continue;
+            }
+
+            // the trace format counts in microseconds
+            fprintf(file, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                    first ? "" : ",",
+                    m_stages[stage]->name,
+                    ring.threadIndex,
+                    startNanoseconds / 1000.0,
+                    durationNanoseconds / 1000.0);
+            first = false;
+        }
+    }
+    fprintf(file, "\n]}\n");
+
+    fclose(file);
+    return true;
+}
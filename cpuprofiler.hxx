@@ -0,0 +1,151 @@
+#ifndef CPUPROFILER_HXX
+#define CPUPROFILER_HXX
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <chrono>
+
+struct CpuStageStats {
+    std::string name;
+    uint64_t sampleCount;
+    double avgMilliseconds;
+    double p50Milliseconds;
+    double p90Milliseconds;
+    double p99Milliseconds;
+    double maxMilliseconds;
+};
+
+/*
+ * Log-linear latency histogram in the style of HdrHistogram: every power of two range is split
+ * into kSubBucketCount / 2 linear sub-buckets, so a value is known to within about 3% from 1 ns
+ * up to minutes with a fixed 9 KB of counters. Recording is a relaxed atomic increment.
+ */
+class CLatencyHistogram
+{
+public:
+    CLatencyHistogram();
+
+    void record(uint64_t nanoseconds);
+
+    uint64_t getCount() const { return m_count.load(std::memory_order_relaxed); }
+    uint64_t getMax() const { return m_max.load(std::memory_order_relaxed); }
+    double getMean() const;
+    // highest value of the bucket holding the quantile, quantile in [0, 1]
+    uint64_t getValueAtQuantile(double quantile) const;
+
+    static uint32_t const kSubBucketBits = 6;
+    static uint32_t const kSubBucketCount = 1u << kSubBucketBits;
+    // values from 2^40 ns on (about 18 minutes) land in the last bucket
+    static uint32_t const kBucketCount = (40 - kSubBucketBits + 2) * (kSubBucketCount / 2);
+
+private:
+    static uint32_t getIndex(uint64_t value);
+    static uint64_t getHighestValue(uint32_t index);
+
+    std::atomic<uint64_t> m_counts[kBucketCount];
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_sum;
+    std::atomic<uint64_t> m_max;
+};
+
+/*
+ * Scoped CPU timers for the frame loop. Every thread writes its events into its own ring, which
+ * needs neither a lock nor an allocation after the thread's first event, and into a latency
+ * histogram per stage. The rings keep the last kRingSize events per thread for a Chrome trace
+ * (chrome://tracing or ui.perfetto.dev), the histograms cover the whole run.
+ */
+class CCpuProfiler
+{
+public:
+    CCpuProfiler();
+
+    // Stages are registered before the first event is recorded, the names have to outlive the profiler.
+    uint32_t registerStage(char const* name);
+
+    // nanoseconds since the profiler was created
+    uint64_t now() const;
+    void record(uint32_t stage, uint64_t startNanoseconds, uint64_t endNanoseconds);
+
+    // Average of every stage since the last call, for a one line frame time overlay.
+    std::string takeIntervalSummary();
+
+    std::vector<CpuStageStats> getStats() const;
+    void printReport() const;
+    // summary of the histograms as JSON
+    bool writeReport(std::string const& path) const;
+    // the events still in the rings, in the Chrome trace event format
+    bool writeChromeTrace(std::string const& path) const;
+
+    static uint32_t const kMaxStages = 32;
+    static uint32_t const kRingSize = 1u << 16;
+
+private:
+    // A seqlock per event: the sequence is odd while the writer fills the event and 2 * (n + 1)
+    // once it holds the n-th event of its thread. A reader keeps a copy only if the sequence is
+    // the one of the event it expects before and after copying, so an event the writer wraps
+    // around to in the meantime is dropped instead of exported torn.
+    struct Event {
+        std::atomic<uint64_t> sequence;
+        std::atomic<uint32_t> stage;
+        std::atomic<uint64_t> startNanoseconds;
+        std::atomic<uint64_t> durationNanoseconds;
+    };
+
+    // written by its thread only, read by the exports while it records
+    struct ThreadRing {
+        uint32_t threadIndex;
+        std::unique_ptr<Event[]> events;
+        std::atomic<uint64_t> head;
+    };
+
+    struct Stage {
+        char const* name;
+        CLatencyHistogram histogram;
+        std::atomic<uint64_t> intervalSum;
+        std::atomic<uint64_t> intervalCount;
+    };
+
+    ThreadRing* getThreadRing();
+
+    // tells the thread local ring caches of different profilers apart
+    uint64_t m_id;
+    std::chrono::steady_clock::time_point m_start;
+
+    std::unique_ptr<Stage> m_stages[kMaxStages];
+    uint32_t m_stageCount;
+
+    // only taken by the first event of a thread and by the exports
+    mutable std::mutex m_ringMutex;
+    std::vector<std::unique_ptr<ThreadRing>> m_rings;
+};
+
+// Records the time from its construction to its destruction as one event of the stage.
+class CCpuScope
+{
+public:
+    CCpuScope(CCpuProfiler& profiler, uint32_t stage)
+        : m_profiler(profiler)
+        , m_stage(stage)
+        , m_start(profiler.now())
+    {
+    }
+
+    ~CCpuScope() {
+        m_profiler.record(m_stage, m_start, m_profiler.now());
+    }
+
+private:
+    CCpuScope(CCpuScope const&);
+    CCpuScope& operator=(CCpuScope const&);
+
+    CCpuProfiler& m_profiler;
+    uint32_t m_stage;
+    uint64_t m_start;
+};
+
+#endif // CPUPROFILER_HXX
@@ -0,0 +1,315 @@
+#include "cpuraytracing.hxx"
+
+#include <chrono>
+
+using CpuShaders::Ray;
+using CpuShaders::RayContext;
+using CpuShaders::ProceduralPrimitiveAttributes;
+namespace RayFlags = CpuShaders::RayFlags;
+
+CCpuRayTracing::CCpuRayTracing(CRayTracingScene const& scene)
+    : m_scene(scene)
+{
+}
+
+void CCpuRayTracing::setupInstances(CTaskScheduler& scheduler) {
+    m_triangles.clear();
+    m_aabbInstances.clear();
+
+    std::vector<std::vector<BvhBounds>> bottomLevelPrimitives;
+    std::vector<BvhInstance> instances;
+
+    // plane instance, same vertices and transform as the triangle BLAS
+    {
+        glm::mat4 planeTransform = m_scene.getPlaneTransform();
+        std::vector<Index> const& indices = m_scene.getPlaneIndices();
+        std::vector<Vertex> const& vertices = m_scene.getPlaneVertices();
+        std::vector<glm::vec4> const& normals = m_scene.getPlaneNormals();
+
+        std::vector<BvhBounds> triangleBounds;
+        for (size_t index = 0; index + 2 < indices.size(); index += 3) {
+            Triangle triangle;
+            triangle.v0 = vertices[indices[index + 0]].position;
+            triangle.v1 = vertices[indices[index + 1]].position;
+            triangle.v2 = vertices[indices[index + 2]].position;
+            // closest_hit_triangle reads the object space normal of the first face index
+            triangle.normal = glm::vec3(normals[indices[index + 0]]);
+            m_triangles.push_back(triangle);
+
+            BvhBounds bounds = BvhBounds::empty();
+            bounds.grow(triangle.v0);
+            bounds.grow(triangle.v1);
+            bounds.grow(triangle.v2);
+            triangleBounds.push_back(bounds);
+        }
+
+        BvhInstance instance;
+        instance.objectToWorld = planeTransform;
+        instance.worldToObject = glm::inverse(planeTransform);
+        instance.bottomLevelIndex = static_cast<uint32_t>(bottomLevelPrimitives.size());
+        bottomLevelPrimitives.push_back(triangleBounds);
+        instances.push_back(instance);
+    }
+
+    // one single AABB BLAS and instance per AABB, SBT offset 1 + index selects the intersection shader
+    {
+        glm::mat4 aabbTransform = m_scene.getAABBTransform();
+        std::vector<VkAabbPositionsKHR> const& aabbs = m_scene.getAABBs();
+
+        for (size_t index = 0; index < aabbs.size(); ++index) {
+            AABBInstance aabbInstance;
+            aabbInstance.objectToWorld = aabbTransform;
+            aabbInstance.materialIndex = static_cast<uint32_t>(index);
+
+            aabbInstance.intersectionType = m_scene.getIntersectionShaderType(static_cast<uint32_t>(index));
+
+            m_aabbInstances.push_back(aabbInstance);
+
+            BvhBounds bounds = {
+                glm::vec3(aabbs[index].minX, aabbs[index].minY, aabbs[index].minZ),
+                glm::vec3(aabbs[index].maxX, aabbs[index].maxY, aabbs[index].maxZ)
+            };
+
+            BvhInstance instance;
+            instance.objectToWorld = aabbTransform;
+            instance.worldToObject = glm::inverse(aabbTransform);
+            instance.bottomLevelIndex = static_cast<uint32_t>(bottomLevelPrimitives.size());
+            bottomLevelPrimitives.push_back(std::vector<BvhBounds>(1, bounds));
+            instances.push_back(instance);
+        }
+    }
+
+    m_bvh.build(&scheduler, bottomLevelPrimitives, instances);
+}
+
+CpuRenderStats CCpuRayTracing::render(CTaskScheduler& scheduler, uint32_t width, uint32_t height, std::vector<uint8_t>& rgba) {
+    setupInstances(scheduler);
+
+    rgba.resize(static_cast<size_t>(width) * height * 4);
+
+    uint32_t tilesX = (width + kTileSize - 1) / kTileSize;
+    uint32_t tilesY = (height + kTileSize - 1) / kTileSize;
+
+    std::vector<ThreadContext> contexts(scheduler.getThreadCount());
+    for (size_t index = 0; index < contexts.size(); ++index) {
+        contexts[index].launchSize = glm::uvec2(width, height);
+        contexts[index].rayCount = 0;
+    }
+
+    uint8_t* pixels = rgba.data();
+
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    scheduler.parallelFor(tilesX * tilesY, [&](uint32_t tileIndex, uint32_t threadIndex) {
+        renderTile(tileIndex, tilesX, width, height, pixels, contexts[threadIndex]);
+    });
+
+    std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+
+    CpuRenderStats stats = {};
+    stats.threadCount = scheduler.getThreadCount();
+    stats.seconds = std::chrono::duration<double>(end - start).count();
+    for (size_t index = 0; index < contexts.size(); ++index) {
+        stats.rayCount += contexts[index].rayCount;
+    }
+
+    return stats;
+}
+
+void CCpuRayTracing::renderTile(uint32_t tileIndex, uint32_t tilesX, uint32_t width, uint32_t height, uint8_t* rgba, ThreadContext& context) const {
+    SceneConstantBuffer const& params = m_scene.getSceneConstantBuffer();
+
+    uint32_t beginX = (tileIndex % tilesX) * kTileSize;
+    uint32_t beginY = (tileIndex / tilesX) * kTileSize;
+    uint32_t endX = glm::min(beginX + kTileSize, width);
+    uint32_t endY = glm::min(beginY + kTileSize, height);
+
+    for (uint32_t y = beginY; y < endY; ++y) {
+        for (uint32_t x = beginX; x < endX; ++x) {
+            context.launchId = glm::uvec2(x, y);
+
+            Ray ray = CpuShaders::generateCameraRay(context.launchId, context.launchSize, glm::vec3(params.cameraPosition), params.projectionToWorld);
+            glm::vec4 color = traceRadianceRay(ray, 1, context);
+
+            // imageStore into an UNORM image
+            glm::vec4 clamped = glm::clamp(color, 0.0f, 1.0f);
+            uint8_t* pixel = rgba + (static_cast<size_t>(y) * width + x) * 4;
+            pixel[0] = static_cast<uint8_t>(clamped.x * 255.0f + 0.5f);
+            pixel[1] = static_cast<uint8_t>(clamped.y * 255.0f + 0.5f);
+            pixel[2] = static_cast<uint8_t>(clamped.z * 255.0f + 0.5f);
+            pixel[3] = static_cast<uint8_t>(clamped.w * 255.0f + 0.5f);
+        }
+    }
+}
+
+bool CCpuRayTracing::intersectTriangle(Triangle const& triangle, Ray const& ray, uint32_t rayFlags, float tmin, float tmax, float& thit) const {
+    glm::vec3 edge1 = triangle.v1 - triangle.v0;
+    glm::vec3 edge2 = triangle.v2 - triangle.v0;
+
+    // front faces are the ones the ray sees in clockwise order
+    float facing = glm::dot(ray.direction, glm::cross(edge1, edge2));
+    if (((rayFlags & RayFlags::CullBackFacingTriangles) != 0 && facing > 0.0f) ||
+        ((rayFlags & RayFlags::CullFrontFacingTriangles) != 0 && facing < 0.0f)) {
+        return false;
+    }
+
+    glm::vec3 p = glm::cross(ray.direction, edge2);
+    float determinant = glm::dot(edge1, p);
+    if (determinant == 0.0f) {
+        return false;
+    }
+
+    float inverseDeterminant = 1.0f / determinant;
+    glm::vec3 s = ray.origin - triangle.v0;
+    float u = glm::dot(s, p) * inverseDeterminant;
+    if (u < 0.0f || u > 1.0f) {
+        return false;
+    }
+
+    glm::vec3 q = glm::cross(s, edge1);
+    float v = glm::dot(ray.direction, q) * inverseDeterminant;
+    if (v < 0.0f || u + v > 1.0f) {
+        return false;
+    }
+
+    float t = glm::dot(edge2, q) * inverseDeterminant;
+    if (t < tmin || t > tmax) {
+        return false;
+    }
+
+    thit = t;
+    return true;
+}
+
+bool CCpuRayTracing::intersectAABBInstance(AABBInstance const& instance, Ray const& objectRay, uint32_t rayFlags, float tmin, float tmax, float& thit, glm::vec3& normal) const {
+    // the BLAS traversal only gets here for rays entering the AABB
+    PrimitiveConstantBuffer const& materialCB = m_scene.getAABBMaterialBuffers()[instance.materialIndex];
+    PrimitiveInstanceConstantBuffer const& aabbCB = m_scene.getAABBInstanceBuffers()[instance.materialIndex];
+    PrimitiveInstancePerFrameBuffer const& aabbAttribute = m_scene.getAABBPrimitiveAttributes()[aabbCB.instanceIndex];
+
+    // getRayInAABBPrimitiveLocalSpace()
+    Ray localRay;
+    localRay.origin = glm::vec3(aabbAttribute.bottomLevelASToLocalSpace * glm::vec4(objectRay.origin, 1.0f));
+    localRay.direction = glm::mat3(aabbAttribute.bottomLevelASToLocalSpace) * objectRay.direction;
+
+    RayContext context;
+    context.tmin = tmin;
+    context.tmax = tmax;
+    context.incomingRayFlags = rayFlags;
+
+    ProceduralPrimitiveAttributes attr;
+    bool hit = false;
+
+    switch (instance.intersectionType) {
+        case IntersectionShaderType::AnalyticPrimitive:
+            hit = CpuShaders::rayAnalyticGeometryIntersectionTest(localRay, context, aabbCB.primitiveType, thit, attr);
+            break;
+        case IntersectionShaderType::VolumetricPrimitive:
+            hit = CpuShaders::rayVolumetricGeometryIntersectionTest(localRay, context, aabbCB.primitiveType, thit, attr, m_scene.getSceneConstantBuffer().elapsedTime);
+            break;
+        case IntersectionShaderType::SignedDistancePrimitive:
+            hit = CpuShaders::raySignedDistancePrimitiveTest(localRay, context, aabbCB.primitiveType, thit, attr, materialCB.stepScale);
+            break;
+        default:
+            break;
+    }
+
+    if (!hit) {
+        return false;
+    }
+
+    attr.normal = glm::mat3(aabbAttribute.localSpaceToBottomLevelAS) * attr.normal;
+    normal = glm::normalize(attr.normal * glm::mat3(instance.objectToWorld));
+
+    return true;
+}
+
+bool CCpuRayTracing::traceRay(Ray const& ray, uint32_t rayFlags, float tmin, float tmax, HitInfo& hit) const {
+    bool terminateOnFirstHit = (rayFlags & RayFlags::TerminateOnFirstHit) != 0;
+
+    return m_bvh.traverse(ray.origin, ray.direction, tmin, tmax, terminateOnFirstHit, [&](uint32_t instanceIndex, uint32_t primitiveIndex, glm::vec3 const& objectOrigin, glm::vec3 const& objectDirection, float primitiveTmin, float& primitiveTmax) {
+        Ray objectRay = { objectOrigin, objectDirection };
+        float thit;
+
+        // instance 0 is the plane, instance 1 + index the AABB index
+        if (instanceIndex == 0) {
+            if (!intersectTriangle(m_triangles[primitiveIndex], objectRay, rayFlags, primitiveTmin, primitiveTmax, thit)) {
+                return false;
+            }
+            hit.aabbInstance = -1;
+            hit.normal = m_triangles[primitiveIndex].normal;
+        }
+        else {
+            glm::vec3 normal;
+            if (!intersectAABBInstance(m_aabbInstances[instanceIndex - 1], objectRay, rayFlags, primitiveTmin, primitiveTmax, thit, normal)) {
+                return false;
+            }
+            hit.aabbInstance = static_cast<int32_t>(instanceIndex - 1);
+            hit.normal = normal;
+        }
+
+        primitiveTmax = thit;
+        hit.t = thit;
+        return true;
+    });
+}
+
+glm::vec4 CCpuRayTracing::traceRadianceRay(Ray const& ray, uint32_t currentRayRecursionDepth, ThreadContext& context) const {
+    ++context.rayCount;
+
+    HitInfo hit;
+    if (!traceRay(ray, RayFlags::CullBackFacingTriangles, 0.0f, 10000.0f, hit)) {
+        // miss_ext.rmiss
+        return kBackgroundColor;
+    }
+
+    return closestHit(ray, hit, currentRayRecursionDepth, context);
+}
+
+bool CCpuRayTracing::traceShadowRayAndReportIfHit(Ray const& ray, uint32_t currentRayRecursionDepth, ThreadContext& context) const {
+
+    if (currentRayRecursionDepth > kMaxRecursionDepth) {
+        return false;
+    }
+
+    ++context.rayCount;
+
+    HitInfo hit;
+    return traceRay(ray, RayFlags::CullBackFacingTriangles | RayFlags::TerminateOnFirstHit | RayFlags::Opaque | RayFlags::SkipClosestHitShader, 0.0f, 10000.0f, hit);
+}
+
+glm::vec4 CCpuRayTracing::closestHit(Ray const& ray, HitInfo const& hit, uint32_t recursionDepth, ThreadContext& context) const {
+    SceneConstantBuffer const& params = m_scene.getSceneConstantBuffer();
+
+    bool isPlane = hit.aabbInstance < 0;
+    PrimitiveConstantBuffer const& material = isPlane ? m_scene.getPlaneMaterialBuffer() : m_scene.getAABBMaterialBuffers()[m_aabbInstances[hit.aabbInstance].materialIndex];
+    glm::vec3 const& normal = hit.normal;
+
+    glm::vec3 hitPosition = ray.origin + hit.t * ray.direction;
+
+    Ray shadowRay = { hitPosition, glm::normalize(glm::vec3(params.lightPosition) - hitPosition) };
+    bool shadowRayHit = traceShadowRayAndReportIfHit(shadowRay, recursionDepth, context);
+
+    float checkers = 1.0f;
+    if (isPlane) {
+        checkers = CpuShaders::analyticalCheckersTexture(hitPosition, normal, context.launchId, context.launchSize, params);
+    }
+
+    glm::vec4 reflectedColor = glm::vec4(0.0f, 0.0f, 0.0f, 0.0f);
+    if (material.reflectanceCoef > 0.001f) {
+        Ray reflectionRay = { hitPosition, glm::reflect(ray.direction, normal) };
+
+        glm::vec4 reflectionColor = glm::vec4(0.0f, 0.0f, 0.0f, 0.0f);
+        if (recursionDepth <= kMaxRecursionDepth) {
+            reflectionColor = traceRadianceRay(reflectionRay, recursionDepth + 1, context);
+        }
+
+        glm::vec3 fresnelR = CpuShaders::fresnelReflectanceSchlick(ray.direction, normal, glm::vec3(material.albedo));
+        reflectedColor = material.reflectanceCoef * glm::vec4(fresnelR, 1.0f) * reflectionColor;
+    }
+
+    glm::vec4 phongColor = CpuShaders::calculatePhongLighting(params, hitPosition, ray.direction, material.albedo, normal, shadowRayHit, material.diffuseCoef, material.specularCoef, material.specularPower);
+    glm::vec4 color = checkers * (phongColor + reflectedColor);
+
+    return CpuShaders::applyDistanceFalloff(color, hit.t);
+}
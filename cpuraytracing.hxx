@@ -0,0 +1,86 @@
+#ifndef CPURAYTRACING_HXX
+#define CPURAYTRACING_HXX
+
+#include <stdint.h>
+#include <vector>
+
+#include "raytracingscene.hxx"
+#include "cpushaders.hxx"
+#include "taskscheduler.hxx"
+#include "bvh.hxx"
+
+struct CpuRenderStats {
+    uint32_t threadCount;
+    uint64_t rayCount;
+    double seconds;
+};
+
+/*
+ * CPU reference implementation of the ray tracing pipeline built by CRayTracing.
+ * The image is split into tiles which are distributed over a CTaskScheduler;
+ * shading uses the ports in CpuShaders so the output matches the GPU image for
+ * the same scene state. Rays are traversed through a CTwoLevelBvh with the same
+ * BLAS / instance layout as the acceleration structures of CRayTracing.
+ */
+class CCpuRayTracing
+{
+public:
+    explicit CCpuRayTracing(CRayTracingScene const& scene);
+
+    // Renders the current scene state into rgba (width * height RGBA8 pixels).
+    CpuRenderStats render(CTaskScheduler& scheduler, uint32_t width, uint32_t height, std::vector<uint8_t>& rgba);
+
+    CTwoLevelBvh const& getBvh() const { return m_bvh; }
+
+private:
+    struct Triangle {
+        glm::vec3 v0;
+        glm::vec3 v1;
+        glm::vec3 v2;
+        glm::vec3 normal;
+    };
+
+    struct AABBInstance {
+        glm::mat4 objectToWorld;
+        IntersectionShaderType::Enum intersectionType;
+        uint32_t materialIndex;
+    };
+
+    struct HitInfo {
+        float t;
+        int32_t aabbInstance; // -1 for the plane
+        glm::vec3 normal;
+    };
+
+    // Per ray launch state, also carries the counters. The std::vector holding them only
+    // guarantees the alignment of new, so 128 bytes keep more than a 64 byte cache line between
+    // the 24 bytes of two neighbouring threads wherever the vector starts.
+    struct ThreadContext {
+        glm::uvec2 launchId;
+        glm::uvec2 launchSize;
+        uint64_t rayCount;
+        uint8_t padding[104];
+    };
+
+    static uint32_t const kTileSize = 16;
+    static uint32_t const kMaxRecursionDepth = 3;
+
+    void setupInstances(CTaskScheduler& scheduler);
+    void renderTile(uint32_t tileIndex, uint32_t tilesX, uint32_t width, uint32_t height, uint8_t* rgba, ThreadContext& context) const;
+
+    bool traceRay(CpuShaders::Ray const& ray, uint32_t rayFlags, float tmin, float tmax, HitInfo& hit) const;
+    bool intersectTriangle(Triangle const& triangle, CpuShaders::Ray const& ray, uint32_t rayFlags, float tmin, float tmax, float& thit) const;
+    bool intersectAABBInstance(AABBInstance const& instance, CpuShaders::Ray const& objectRay, uint32_t rayFlags, float tmin, float tmax, float& thit, glm::vec3& normal) const;
+
+    glm::vec4 traceRadianceRay(CpuShaders::Ray const& ray, uint32_t currentRayRecursionDepth, ThreadContext& context) const;
+    bool traceShadowRayAndReportIfHit(CpuShaders::Ray const& ray, uint32_t currentRayRecursionDepth, ThreadContext& context) const;
+    glm::vec4 closestHit(CpuShaders::Ray const& ray, HitInfo const& hit, uint32_t recursionDepth, ThreadContext& context) const;
+
+    CRayTracingScene const& m_scene;
+
+    std::vector<Triangle> m_triangles;
+    std::vector<AABBInstance> m_aabbInstances;
+    CTwoLevelBvh m_bvh;
+};
+
+#endif // CPURAYTRACING_HXX
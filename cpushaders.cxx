@@ -0,0 +1,574 @@
+#include "cpushaders.hxx"
+
+#include <math.h>
+#include <limits>
+
+namespace CpuShaders {
+
+namespace {
+
+    struct Metaball {
+        glm::vec3 center;
+        float radius;
+    };
+
+    glm::vec2 texCoords(glm::vec3 const& position) {
+        return glm::vec2(position.x, position.z);
+    }
+
+    void calculateRayDifferentials(glm::vec2& ddx_uv, glm::vec2& ddy_uv, glm::vec2 const& uv, glm::vec3 const& hitPosition, glm::vec3 const& surfaceNormal, glm::uvec2 const& launchId, glm::uvec2 const& launchSize, glm::vec3 const& cameraPosition, glm::mat4 const& projectionToWorld) {
+        Ray ddx = generateCameraRay(launchId + glm::uvec2(1, 0), launchSize, cameraPosition, projectionToWorld);
+        Ray ddy = generateCameraRay(launchId + glm::uvec2(0, 1), launchSize, cameraPosition, projectionToWorld);
+
+        glm::vec3 ddx_pos = ddx.origin - ddx.direction * glm::dot(ddx.origin - hitPosition, surfaceNormal) / glm::dot(ddx.direction, surfaceNormal);
+        glm::vec3 ddy_pos = ddy.origin - ddy.direction * glm::dot(ddy.origin - hitPosition, surfaceNormal) / glm::dot(ddy.direction, surfaceNormal);
+
+        ddx_uv = texCoords(ddx_pos) - uv;
+        ddy_uv = texCoords(ddy_pos) - uv;
+    }
+
+    float checkersTextureBoxFilter(glm::vec2 const& uv, glm::vec2 const& dpdx, glm::vec2 const& dpdy, uint32_t ratio) {
+        glm::vec2 w = glm::max(glm::abs(dpdx), glm::abs(dpdy));
+        glm::vec2 a = uv + 0.5f * w;
+        glm::vec2 b = uv - 0.5f * w;
+
+        float fRatio = static_cast<float>(ratio);
+        glm::vec2 i = (glm::floor(a) + glm::min(glm::fract(a) * fRatio, glm::vec2(1.0f)) - glm::floor(b) - glm::min(glm::fract(b) * fRatio, glm::vec2(1.0f))) / (fRatio * w);
+        return (1.0f - i.x) * (1.0f - i.y);
+    }
+
+    float calculateAnimationInterpolant(float elapsedTime, float cycleDuration) {
+        float curLinearCycleTime = (elapsedTime - cycleDuration * floorf(elapsedTime / cycleDuration)) / cycleDuration;
+        curLinearCycleTime = (curLinearCycleTime <= 0.5f) ? 2.0f * curLinearCycleTime : 1.0f - 2.0f * (curLinearCycleTime - 0.5f);
+        return glm::smoothstep(0.0f, 1.0f, curLinearCycleTime);
+    }
+
+    bool isInRange(float val, float minVal, float maxVal) {
+        return (val >= minVal && val <= maxVal);
+    }
+
+    bool isCulled(Ray const& ray, RayContext const& context, glm::vec3 const& hitSurfaceNormal) {
+        float rayDirectionNormalDot = glm::dot(ray.direction, hitSurfaceNormal);
+
+        bool isCulled = (((context.incomingRayFlags & RayFlags::CullBackFacingTriangles) != 0) && (rayDirectionNormalDot > 0))
+                        ||
+                        (((context.incomingRayFlags & RayFlags::CullFrontFacingTriangles) != 0) && (rayDirectionNormalDot < 0));
+
+        return isCulled;
+    }
+
+    void swap(float& val0, float& val1) {
+        float tmp = val0;
+        val0 = val1;
+        val1 = tmp;
+    }
+
+    bool solveQuadraticEqn(float a, float b, float c, float& x0, float& x1) {
+        float discr = b * b - 4.0f * a * c;
+        if (discr < 0) return false;
+        else if (discr == 0.0f) x0 = x1 = -0.5f * b / a;
+        else {
+            float q = (b > 0.0f) ?
+                -0.5f * (b + sqrtf(discr)) :
+                -0.5f * (b - sqrtf(discr));
+            x0 = q / a;
+            x1 = c / q;
+        }
+
+        if (x0 > x1) swap(x0, x1);
+
+        return true;
+    }
+
+    glm::vec3 calculateNormalForARaySphereHit(Ray const& ray, float thit, glm::vec3 const& center) {
+        glm::vec3 hitPosition = ray.origin + thit * ray.direction;
+        return glm::normalize(hitPosition - center);
+    }
+
+    bool solveRaySphereIntersectionEquation(Ray const& ray, float& tmin, float& tmax, glm::vec3 const& center, float radius) {
+        glm::vec3 L = ray.origin - center;
+        float a = glm::dot(ray.direction, ray.direction);
+        float b = 2.0f * glm::dot(ray.direction, L);
+        float c = glm::dot(L, L) - radius * radius;
+        return solveQuadraticEqn(a, b, c, tmin, tmax);
+    }
+
+    bool raySphereIntersectionTest(Ray const& ray, RayContext const& context, float& thit, float& tmax, ProceduralPrimitiveAttributes& attr, glm::vec3 const& center, float radius) {
+        float t0, t1;
+
+        if (!solveRaySphereIntersectionEquation(ray, t0, t1, center, radius)) return false;
+
+        tmax = t1;
+
+        if (t0 < context.tmin) {
+            if (t1 < context.tmin) return false;
+
+            attr.normal = calculateNormalForARaySphereHit(ray, t1, center);
+            if (isAValidHit(ray, context, t1, attr.normal)) {
+                thit = t1;
+                return true;
+            }
+        }
+        else {
+            attr.normal = calculateNormalForARaySphereHit(ray, t0, center);
+            if (isAValidHit(ray, context, t0, attr.normal)) {
+                thit = t0;
+                return true;
+            }
+
+            attr.normal = calculateNormalForARaySphereHit(ray, t1, center);
+            if (isAValidHit(ray, context, t1, attr.normal)) {
+                thit = t1;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    bool raySpheresIntersectionTest(Ray const& ray, RayContext const& context, float& thit, ProceduralPrimitiveAttributes& attr) {
+        const int N = 3;
+        glm::vec3 const centers[N] = {
+            glm::vec3(-0.3f, -0.3f, -0.3f),
+            glm::vec3(0.1f, 0.1f, 0.4f),
+            glm::vec3(0.35f, 0.35f, 0.0f)
+        };
+
+        float const radii[N] = { 0.6f, 0.3f, 0.15f };
+        bool hitFound = false;
+
+        thit = context.tmax;
+
+        for (int i = 0; i < N; i++) {
+            float _thit;
+            float _tmax;
+
+            ProceduralPrimitiveAttributes _attr;
+
+            if (raySphereIntersectionTest(ray, context, _thit, _tmax, _attr, centers[i], radii[i])) {
+                if (_thit < thit) {
+                    thit = _thit;
+                    attr = _attr;
+                    hitFound = true;
+                }
+            }
+        }
+
+        return hitFound;
+    }
+
+    bool rayAABBIntersectionTest(Ray const& ray, RayContext const& context, glm::vec3 const aabb[2], float& tmin, float& tmax) {
+
+        glm::vec3 tmin3, tmax3;
+        glm::ivec3 sign3 = glm::ivec3(ray.direction.x > 0 ? 1 : 0, ray.direction.y > 0 ? 1 : 0, ray.direction.z > 0 ? 1 : 0);
+        tmin3.x = (aabb[1 - sign3.x].x - ray.origin.x) / ray.direction.x;
+        tmax3.x = (aabb[sign3.x].x - ray.origin.x) / ray.direction.x;
+
+        tmin3.y = (aabb[1 - sign3.y].y - ray.origin.y) / ray.direction.y;
+        tmax3.y = (aabb[sign3.y].y - ray.origin.y) / ray.direction.y;
+
+        tmin3.z = (aabb[1 - sign3.z].z - ray.origin.z) / ray.direction.z;
+        tmax3.z = (aabb[sign3.z].z - ray.origin.z) / ray.direction.z;
+
+        tmin = glm::max(glm::max(tmin3.x, tmin3.y), tmin3.z);
+        tmax = glm::min(glm::min(tmax3.x, tmax3.y), tmax3.z);
+
+        return tmax > tmin && tmax >= context.tmin && tmin <= context.tmax;
+    }
+
+    bool rayAABBIntersectionTest(Ray const& ray, RayContext const& context, glm::vec3 const aabb[2], float& thit, ProceduralPrimitiveAttributes& attr) {
+
+        float tmin, tmax;
+        if (rayAABBIntersectionTest(ray, context, aabb, tmin, tmax)) {
+            thit = tmin >= context.tmin ? tmin : tmax;
+
+            glm::vec3 hitPosition = ray.origin + thit * ray.direction;
+            glm::vec3 distanceToBounds[2] = {
+                glm::abs(aabb[0] - hitPosition),
+                glm::abs(aabb[1] - hitPosition)
+            };
+
+            const float eps = 0.0001f;
+            if (distanceToBounds[0].x < eps) attr.normal = glm::vec3(-1.0f, 0.0f, 0.0f);
+            else if (distanceToBounds[0].y < eps) attr.normal = glm::vec3(0.0f, -1.0f, 0.0f);
+            else if (distanceToBounds[0].z < eps) attr.normal = glm::vec3(0.0f, 0.0f, -1.0f);
+            else if (distanceToBounds[1].x < eps) attr.normal = glm::vec3(1.0f, 0.0f, 0.0f);
+            else if (distanceToBounds[1].y < eps) attr.normal = glm::vec3(0.0f, 1.0f, 0.0f);
+            else if (distanceToBounds[1].z < eps) attr.normal = glm::vec3(0.0f, 0.0f, 1.0f);
+
+            return isAValidHit(ray, context, thit, attr.normal);
+        }
+
+        return false;
+    }
+
+    bool raySolidSphereIntersectionTest(Ray const& ray, RayContext const& context, float& thit, float& tmax, glm::vec3 const& center, float radius) {
+        float t0, t1;
+
+        if (!solveRaySphereIntersectionEquation(ray, t0, t1, center, radius)) {
+            return false;
+        }
+
+        thit = glm::max(t0, context.tmin);
+        tmax = glm::min(t1, context.tmax);
+
+        return true;
+    }
+
+    float calculateMetaballPotential(glm::vec3 const& position, Metaball const& blob) {
+        float dist = glm::length(position - blob.center);
+
+        if (dist <= blob.radius) {
+            float d = dist;
+
+            d = blob.radius - d;
+
+            float r = blob.radius;
+
+            return 6.0f * (d * d * d * d * d) / (r * r * r * r * r)
+                   - 15.0f * (d * d * d + d) / (r * r * r * r)
+                   + 10.0f * (d * d * d) / (r * r * r);
+        }
+
+        return 0.0f;
+    }
+
+    float calculateMetaballsPotential(glm::vec3 const& position, Metaball const blobs[3]) {
+        float sumFieldPotential = 0.0f;
+
+        for (uint32_t j = 0; j < 3; j++) {
+            sumFieldPotential += calculateMetaballPotential(position, blobs[j]);
+        }
+
+        return sumFieldPotential;
+    }
+
+    glm::vec3 calculateMetaballsNormal(glm::vec3 const& position, Metaball const blobs[3]) {
+        float e = 0.5773f * 0.00001f;
+        return glm::normalize(glm::vec3(
+            calculateMetaballsPotential(position + glm::vec3(-e, 0.0f, 0.0f), blobs) -
+            calculateMetaballsPotential(position + glm::vec3(e, 0.0f, 0.0f), blobs),
+            calculateMetaballsPotential(position + glm::vec3(0.0f, -e, 0.0f), blobs) -
+            calculateMetaballsPotential(position + glm::vec3(0.0f, e, 0.0f), blobs),
+            calculateMetaballsPotential(position + glm::vec3(0.0f, 0.0f, -e), blobs) -
+            calculateMetaballsPotential(position + glm::vec3(0.0f, 0.0f, e), blobs)));
+    }
+
+    void initializeAnimatedMetaballs(Metaball blobs[3], float elapsedTime, float cycleDuration) {
+        glm::vec3 const keyFrameCenters[3][2] = {
+            { glm::vec3(-0.3f, -0.3f, -0.4f), glm::vec3(0.3f, -0.3f, 0.0f) },
+            { glm::vec3(0.0f, -0.2f, 0.5f), glm::vec3(0.0f, 0.4f, 0.5f) },
+            { glm::vec3(0.4f, 0.4f, 0.4f), glm::vec3(-0.4f, 0.2f, -0.4f) }
+        };
+
+        float const radii[3] = { 0.45f, 0.55f, 0.45f };
+
+        float tAnimate = calculateAnimationInterpolant(elapsedTime, cycleDuration);
+
+        for (uint32_t j = 0; j < 3; j++) {
+            blobs[j].center = glm::mix(keyFrameCenters[j][0], keyFrameCenters[j][1], tAnimate);
+            blobs[j].radius = 3.8f * radii[j];
+        }
+    }
+
+    void findIntersectingMetaballs(Ray const& ray, RayContext const& context, float& tmin, float& tmax, Metaball const blobs[3]) {
+        tmin = std::numeric_limits<float>::infinity();
+        tmax = -std::numeric_limits<float>::infinity();
+
+        for (uint32_t i = 0; i < 3; i++) {
+            float _thit, _tmax;
+
+            if (raySolidSphereIntersectionTest(ray, context, _thit, _tmax, blobs[i].center, blobs[i].radius)) {
+                tmin = glm::min(_thit, tmin);
+                tmax = glm::max(_tmax, tmax);
+            }
+        }
+
+        tmin = glm::max(tmin, context.tmin);
+        tmax = glm::min(tmax, context.tmax);
+    }
+
+    bool rayMetaballsIntersectionTest(Ray const& ray, RayContext const& context, float& thit, ProceduralPrimitiveAttributes& attr, float elapsedTime) {
+        Metaball blobs[3];
+        initializeAnimatedMetaballs(blobs, elapsedTime, 12.0f);
+
+        float tmin, tmax;
+        findIntersectingMetaballs(ray, context, tmin, tmax, blobs);
+
+        uint32_t maxSteps = 128;
+        float t = tmin;
+        float minTStep = (tmax - tmin) / maxSteps;
+        uint32_t iStep = 0;
+
+        while (iStep++ < maxSteps) {
+            glm::vec3 position = ray.origin + t * ray.direction;
+            float sumFieldPotential = 0;
+
+            for (uint32_t j = 0; j < 3; j++) {
+                sumFieldPotential += calculateMetaballPotential(position, blobs[j]);
+            }
+
+            if (sumFieldPotential >= 0.25f) {
+                glm::vec3 normal = calculateMetaballsNormal(position, blobs);
+                if (isAValidHit(ray, context, t, normal)) {
+                    thit = t;
+                    attr.normal = normal;
+                    return true;
+                }
+            }
+
+            t += minTStep;
+        }
+
+        return false;
+    }
+
+    float opS(float d1, float d2) {
+        return glm::max(d1, -d2);
+    }
+
+    float opI(float d1, float d2) {
+        return glm::max(d1, d2);
+    }
+
+    glm::vec3 fmod(glm::vec3 const& x, glm::vec3 const& y) {
+        return x - y * glm::trunc(x / y);
+    }
+
+    glm::vec3 opRep(glm::vec3 const& p, glm::vec3 const& c) {
+        return fmod(p, c) - 0.5f * c;
+    }
+
+    glm::vec3 opTwist(glm::vec3 const& p) {
+        float c = cosf(3.0f * p.y);
+        float s = sinf(3.0f * p.y);
+        // GLSL: vec3(p.xz * mat2x2(c, -s, s, c), p.y)
+        return glm::vec3(p.x * c - p.z * s, p.x * s + p.z * c, p.y);
+    }
+
+    float sdSphere(glm::vec3 const& p, float s) {
+        return glm::length(p) - s;
+    }
+
+    float sdBox(glm::vec3 const& p, glm::vec3 const& b) {
+        glm::vec3 d = glm::abs(p) - b;
+        return glm::min(glm::max(d.x, glm::max(d.y, d.z)), 0.0f) + glm::length(glm::max(d, glm::vec3(0.0f)));
+    }
+
+    float udRoundBox(glm::vec3 const& p, glm::vec3 const& b, float r) {
+        return glm::length(glm::max(glm::abs(p) - b, glm::vec3(0.0f))) - r;
+    }
+
+    float sdTorus(glm::vec3 const& p, glm::vec2 const& t) {
+        glm::vec2 q = glm::vec2(glm::length(glm::vec2(p.x, p.z)) - t.x, p.y);
+        return glm::length(q) - t.y;
+    }
+
+    float length_toPow2(glm::vec3 const& p) {
+        return glm::dot(p, p);
+    }
+
+    float length_toPowNegative8(glm::vec2 p) {
+        p = p * p; p = p * p; p = p * p;
+        return powf(p.x + p.y, 1.0f / 8.0f);
+    }
+
+    float sdCylinder(glm::vec3 const& p, glm::vec2 const& h) {
+        glm::vec2 d = glm::abs(glm::vec2(glm::length(glm::vec2(p.x, p.z)), p.y)) - h;
+        return glm::min(glm::max(d.x, d.y), 0.0f) + glm::length(glm::max(d, glm::vec2(0.0f)));
+    }
+
+    float sdOctahedron(glm::vec3 const& p, glm::vec3 const& h) {
+        float d = 0.0f;
+
+        d = glm::dot(glm::vec2(glm::max(fabsf(p.x), fabsf(p.z)), fabsf(p.y)),
+                     glm::vec2(h.x, h.y));
+
+        return d - h.y * h.z;
+    }
+
+    float sdPyramid(glm::vec3 const& p, glm::vec3 const& h) {
+        float octa = sdOctahedron(p, h);
+
+        return opS(octa, p.y);
+    }
+
+    float sdTorus82(glm::vec3 const& p, glm::vec2 const& t) {
+        glm::vec2 q = glm::vec2(glm::length(glm::vec2(p.x, p.z)) - t.x, p.y);
+        return length_toPowNegative8(q) - t.y;
+    }
+
+    float sdFractalPyramid(glm::vec3 position, glm::vec3 const& h, float scale) {
+        float a = h.z * h.y / h.x;
+        glm::vec3 v1 = glm::vec3(0.0f, h.z, 0.0f);
+        glm::vec3 v2 = glm::vec3(-a, 0.0f, a);
+        glm::vec3 v3 = glm::vec3(a, 0.0f, -a);
+        glm::vec3 v4 = glm::vec3(a, 0.0f, a);
+        glm::vec3 v5 = glm::vec3(-a, 0.0f, -a);
+
+        int n = 0;
+        for (n = 0; n < 4; n++) {
+            float dist, d;
+            glm::vec3 v;
+            v = v1; dist = length_toPow2(position - v1);
+            d = length_toPow2(position - v2); if (d < dist) { v = v2; dist = d; }
+            d = length_toPow2(position - v3); if (d < dist) { v = v3; dist = d; }
+            d = length_toPow2(position - v4); if (d < dist) { v = v4; dist = d; }
+            d = length_toPow2(position - v5); if (d < dist) { v = v5; dist = d; }
+
+            position = scale * position - v * (scale - 1.0f);
+        }
+
+        float distance = sdPyramid(position, h);
+
+        return distance * powf(scale, static_cast<float>(-n));
+    }
+}
+
+Ray generateCameraRay(glm::uvec2 const& index, glm::uvec2 const& launchSize, glm::vec3 const& cameraPosition, glm::mat4 const& projectionToWorld) {
+
+    glm::vec2 xy = glm::vec2(index) + 0.5f;
+    glm::vec2 screenPos = xy / glm::vec2(launchSize) * 2.0f - 1.0f;
+
+    screenPos.y = -screenPos.y;
+
+    glm::vec4 world = projectionToWorld * glm::vec4(screenPos, 0.0f, 1.0f);
+    glm::vec3 worldPos = glm::vec3(world) / world.w;
+
+    Ray ray;
+    ray.origin = cameraPosition;
+    ray.direction = glm::normalize(worldPos - ray.origin);
+
+    return ray;
+}
+
+float analyticalCheckersTexture(glm::vec3 const& hitPosition, glm::vec3 const& surfaceNormal, glm::uvec2 const& launchId, glm::uvec2 const& launchSize, SceneConstantBuffer const& params) {
+    glm::vec2 ddx_uv;
+    glm::vec2 ddy_uv;
+    glm::vec2 uv = texCoords(hitPosition);
+
+    calculateRayDifferentials(ddx_uv, ddy_uv, uv, hitPosition, surfaceNormal, launchId, launchSize, glm::vec3(params.cameraPosition), params.projectionToWorld);
+    return checkersTextureBoxFilter(uv, ddx_uv, ddy_uv, 50);
+}
+
+glm::vec4 calculatePhongLighting(SceneConstantBuffer const& params, glm::vec3 const& hitPosition, glm::vec3 const& worldRayDirection, glm::vec4 const& albedo, glm::vec3 const& normal, bool isInShadow, float diffuseCoeff, float specularCoef, float specularPower) {
+    glm::vec3 lightPosition = glm::vec3(params.lightPosition);
+    float shadowFactor = isInShadow ? kInShadowRadiance : 1.0f;
+    glm::vec3 incidentLightRay = glm::normalize(hitPosition - lightPosition);
+
+    glm::vec4 lightDiffuseColor = params.lightDiffuseColor;
+    float kd = glm::clamp(glm::dot(-incidentLightRay, normal), 0.0f, 1.0f);
+    glm::vec4 diffuseColor = shadowFactor * diffuseCoeff * kd * lightDiffuseColor * albedo;
+
+    glm::vec4 specularColor = glm::vec4(0.0f, 0.0f, 0.0f, 0.0f);
+    if (!isInShadow) {
+        glm::vec4 lightSpecularColor = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
+        glm::vec3 reflectedLightRay = glm::normalize(glm::reflect(incidentLightRay, normal));
+        float ks = powf(glm::clamp(glm::dot(reflectedLightRay, glm::normalize(-worldRayDirection)), 0.0f, 1.0f), specularPower);
+        specularColor = specularCoef * ks * lightSpecularColor;
+    }
+
+    glm::vec4 ambientColor = params.lightAmbientColor;
+    glm::vec4 ambientColorMin = params.lightAmbientColor - 0.1f;
+    glm::vec4 ambientColorMax = params.lightAmbientColor;
+    float a = 1.0f - glm::clamp(glm::dot(normal, glm::vec3(0.0f, -1.0f, 0.0f)), 0.0f, 1.0f);
+    ambientColor = albedo * glm::mix(ambientColorMin, ambientColorMax, a);
+
+    return ambientColor + diffuseColor + specularColor;
+}
+
+glm::vec3 fresnelReflectanceSchlick(glm::vec3 const& I, glm::vec3 const& N, glm::vec3 const& f0) {
+    float cosi = glm::clamp(glm::dot(-I, N), 0.0f, 1.0f);
+    return f0 + (1.0f - f0) * powf(1.0f - cosi, 5.0f);
+}
+
+glm::vec4 applyDistanceFalloff(glm::vec4 const& color, float t) {
+    return glm::mix(color, kBackgroundColor, 1.0f - expf(-0.000002f * t * t * t));
+}
+
+bool isAValidHit(Ray const& ray, RayContext const& context, float thit, glm::vec3 const& hitSurfaceNormal) {
+    return isInRange(thit, context.tmin, context.tmax) && !isCulled(ray, context, hitSurfaceNormal);
+}
+
+bool rayAnalyticGeometryIntersectionTest(Ray const& ray, RayContext const& context, uint32_t analyticPrimitiveType, float& thit, ProceduralPrimitiveAttributes& attr) {
+    glm::vec3 const aabb[2] = {
+        glm::vec3(-1.0f, -1.0f, -1.0f),
+        glm::vec3(1.0f, 1.0f, 1.0f)
+    };
+
+    switch (analyticPrimitiveType) {
+        case AnalyticPrimitive::AABB: return rayAABBIntersectionTest(ray, context, aabb, thit, attr);
+        case AnalyticPrimitive::Spheres: return raySpheresIntersectionTest(ray, context, thit, attr);
+        default: return false;
+    }
+}
+
+bool rayVolumetricGeometryIntersectionTest(Ray const& ray, RayContext const& context, uint32_t volumetricPrimitive, float& thit, ProceduralPrimitiveAttributes& attr, float elapsedTime) {
+    switch (volumetricPrimitive) {
+        case VolumetricPrimitive::Metaballs: return rayMetaballsIntersectionTest(ray, context, thit, attr, elapsedTime);
+        default: return false;
+    }
+}
+
+float getDistanceFromSignedDistancePrimitive(glm::vec3 const& position, uint32_t signedDistancePrimitive) {
+    switch (signedDistancePrimitive) {
+        case SignedDistancePrimitive::MiniSpheres: return opI(sdSphere(opRep(position + 1.0f, glm::vec3(2.0f / 4.0f)), 0.65f / 4.0f), sdBox(position, glm::vec3(1.0f)));
+        case SignedDistancePrimitive::IntersectedRoundCube: return opS(opS(udRoundBox(position, glm::vec3(0.75f), 0.2f), sdSphere(position, 1.20f)), -sdSphere(position, 1.32f));
+        case SignedDistancePrimitive::SquareTorus: return sdTorus82(position, glm::vec2(0.75f, 0.15f));
+        case SignedDistancePrimitive::TwistedTorus: return sdTorus(opTwist(position), glm::vec2(0.6f, 0.2f));
+        case SignedDistancePrimitive::Cog: return opS(sdTorus82(position, glm::vec2(0.60f, 0.3f)),
+                                                      sdCylinder(opRep(glm::vec3(atan2f(position.x, position.z) / 6.2831f,
+                                                                                 1.0f,
+                                                                                 0.015f + 0.25f * glm::length(position)) + 1.0f,
+                                                                       glm::vec3(0.05f, 1.0f, 0.075f)),
+                                                                 glm::vec2(0.02f, 0.8f)));
+        case SignedDistancePrimitive::Cylinder: return opI(sdCylinder(opRep(position + glm::vec3(1.0f, 1.0f, 1.0f), glm::vec3(1.0f, 2.0f, 1.0f)), glm::vec2(0.3f, 2.0f)),
+                                                           sdBox(position + glm::vec3(1.0f, 1.0f, 1.0f), glm::vec3(2.0f, 2.0f, 2.0f)));
+        case SignedDistancePrimitive::FractalPyramid: return sdFractalPyramid(position + glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.894f, 0.447f, 2.0f), 2.0f);
+        default: return 0.0f;
+    }
+}
+
+glm::vec3 sdCalculateNormal(glm::vec3 const& pos, uint32_t sdPrimitive) {
+
+    float const e = 0.5773f * 0.0001f;
+    glm::vec3 const xyy = glm::vec3(e, -e, -e);
+    glm::vec3 const yyx = glm::vec3(-e, -e, e);
+    glm::vec3 const yxy = glm::vec3(-e, e, -e);
+    glm::vec3 const xxx = glm::vec3(e, e, e);
+    return glm::normalize(
+        xyy * getDistanceFromSignedDistancePrimitive(pos + xyy, sdPrimitive) +
+        yyx * getDistanceFromSignedDistancePrimitive(pos + yyx, sdPrimitive) +
+        yxy * getDistanceFromSignedDistancePrimitive(pos + yxy, sdPrimitive) +
+        xxx * getDistanceFromSignedDistancePrimitive(pos + xxx, sdPrimitive));
+}
+
+bool raySignedDistancePrimitiveTest(Ray const& ray, RayContext const& context, uint32_t sdPrimitive, float& thit, ProceduralPrimitiveAttributes& attr, float stepScale) {
+
+    const float threshold = 0.0001f;
+    float t = context.tmin;
+    const uint32_t maxSteps = 512;
+
+    uint32_t i = 0;
+
+    while (i++ < maxSteps && t <= context.tmax) {
+        glm::vec3 position = ray.origin + t * ray.direction;
+        float distance = getDistanceFromSignedDistancePrimitive(position, sdPrimitive);
+
+        if (distance <= threshold * t) {
+            glm::vec3 hitSurfaceNormal = sdCalculateNormal(position, sdPrimitive);
+
+            if (isAValidHit(ray, context, t, hitSurfaceNormal)) {
+                thit = t;
+                attr.normal = hitSurfaceNormal;
+                return true;
+            }
+        }
+
+        t += stepScale * distance;
+    }
+
+    return false;
+}
+
+}
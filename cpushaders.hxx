@@ -0,0 +1,61 @@
+#ifndef CPUSHADERS_HXX
+#define CPUSHADERS_HXX
+
+#include "raytracingglsldefines.hxx"
+
+/*
+ * C++ ports of the *_ext ray tracing shaders. The functions follow the GLSL
+ * sources line by line so that the CPU renderer produces the same image as the
+ * GPU path. Built-ins like gl_RayTminEXT / gl_RayTmaxEXT / gl_IncomingRayFlagsEXT
+ * are passed in through RayContext.
+ */
+namespace CpuShaders {
+
+    // Same bit values as VkRayFlags / gl_RayFlags*EXT.
+    namespace RayFlags {
+        enum Enum {
+            Opaque = 0x01,
+            TerminateOnFirstHit = 0x04,
+            SkipClosestHitShader = 0x08,
+            CullBackFacingTriangles = 0x10,
+            CullFrontFacingTriangles = 0x20
+        };
+    }
+
+    struct Ray {
+        glm::vec3 origin;
+        glm::vec3 direction;
+    };
+
+    struct RayContext {
+        float tmin;
+        float tmax;
+        uint32_t incomingRayFlags;
+    };
+
+    struct ProceduralPrimitiveAttributes {
+        glm::vec3 normal;
+    };
+
+    // raygen_ext.rgen / closest_hit_*_ext.rchit
+    Ray generateCameraRay(glm::uvec2 const& index, glm::uvec2 const& launchSize, glm::vec3 const& cameraPosition, glm::mat4 const& projectionToWorld);
+    float analyticalCheckersTexture(glm::vec3 const& hitPosition, glm::vec3 const& surfaceNormal, glm::uvec2 const& launchId, glm::uvec2 const& launchSize, SceneConstantBuffer const& params);
+    glm::vec4 calculatePhongLighting(SceneConstantBuffer const& params, glm::vec3 const& hitPosition, glm::vec3 const& worldRayDirection, glm::vec4 const& albedo, glm::vec3 const& normal, bool isInShadow, float diffuseCoeff, float specularCoef, float specularPower);
+    glm::vec3 fresnelReflectanceSchlick(glm::vec3 const& I, glm::vec3 const& N, glm::vec3 const& f0);
+    glm::vec4 applyDistanceFalloff(glm::vec4 const& color, float t);
+
+    // intersection_analytic_ext.rint
+    bool rayAnalyticGeometryIntersectionTest(Ray const& ray, RayContext const& context, uint32_t analyticPrimitiveType, float& thit, ProceduralPrimitiveAttributes& attr);
+
+    // intersection_volumetric_ext.rint
+    bool rayVolumetricGeometryIntersectionTest(Ray const& ray, RayContext const& context, uint32_t volumetricPrimitive, float& thit, ProceduralPrimitiveAttributes& attr, float elapsedTime);
+
+    // intersection_signed_distance_ext.rint
+    float getDistanceFromSignedDistancePrimitive(glm::vec3 const& position, uint32_t signedDistancePrimitive);
+    glm::vec3 sdCalculateNormal(glm::vec3 const& position, uint32_t signedDistancePrimitive);
+    bool raySignedDistancePrimitiveTest(Ray const& ray, RayContext const& context, uint32_t signedDistancePrimitive, float& thit, ProceduralPrimitiveAttributes& attr, float stepScale);
+
+    bool isAValidHit(Ray const& ray, RayContext const& context, float thit, glm::vec3 const& hitSurfaceNormal);
+}
+
+#endif // CPUSHADERS_HXX
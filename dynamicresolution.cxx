@@ -0,0 +1,245 @@
+#include "dynamicresolution.hxx"
+#include "embeddedshaders.hxx"
+
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+
+namespace {
+    // matches the push constant block of upscale.comp
+    struct UpscaleParameters {
+        uint32_t targetWidth;
+        uint32_t targetHeight;
+        float sharpness;
+    };
+}
+
+uint32_t const CDynamicResolution::kStepCount;
+uint32_t const CDynamicResolution::kRaiseFrames;
+
+CDynamicResolution::CDynamicResolution(double budgetMilliseconds, float minScale)
+    : m_budgetMilliseconds(budgetMilliseconds)
+    , m_minStep(std::max(1u, std::min(kStepCount, static_cast<uint32_t>(ceilf(minScale * kStepCount)))))
+    , m_step(kStepCount)
+    , m_fullMilliseconds(-1.0)
+    , m_raiseFrames(0)
+{
+}
+
+bool CDynamicResolution::update(double traceMilliseconds, float traceScale) {
+    if (traceScale <= 0.0f) {
+        return false;
+    }
+
+    // a slower frame is taken at once, faster ones only move the estimate gradually
+    double fullMilliseconds = traceMilliseconds / (static_cast<double>(traceScale) * traceScale);
+    if (m_fullMilliseconds < 0.0 || fullMilliseconds > m_fullMilliseconds) {
+        m_fullMilliseconds = fullMilliseconds;
+    }
+    else {
+        m_fullMilliseconds += (fullMilliseconds - m_fullMilliseconds) * 0.1;
+    }
+
+    // the trace time goes with the pixel count, 10% headroom for the noise of the timestamps
+    double fitScale = sqrt(m_budgetMilliseconds * 0.9 / std::max(m_fullMilliseconds, 1e-6));
+    uint32_t fitStep = static_cast<uint32_t>(std::min(fitScale, 1.0) * kStepCount);
+    fitStep = std::max(m_minStep, fitStep);
+
+    if (fitStep < m_step) {
+        m_step = fitStep;
+        m_raiseFrames = 0;
+        return true;
+    }
+
+    if (fitStep > m_step && ++m_raiseFrames >= kRaiseFrames) {
+        ++m_step;
+        m_raiseFrames = 0;
+        return true;
+    }
+
+    if (fitStep == m_step) {
+        m_raiseFrames = 0;
+    }
+    return false;
+}
+
+uint32_t CDynamicResolution::getSize(uint32_t fullSize) const {
+    return std::max(1u, (fullSize * m_step + kStepCount - 1) / kStepCount);
+}
+
+CUpscaler::CUpscaler(VkDevice device)
+    : m_device(device)
+    , m_sampler(VK_NULL_HANDLE)
+    , m_descriptorSetLayout(VK_NULL_HANDLE)
+    , m_descriptorPool(VK_NULL_HANDLE)
+    , m_pipelineLayout(VK_NULL_HANDLE)
+    , m_pipeline(VK_NULL_HANDLE)
+{
+}
+
+bool CUpscaler::init(uint32_t outputCount) {
+    EmbeddedShader const* shader = findEmbeddedShader("upscale");
+    if (!shader) {
+        printf("upscaler: upscale.comp was not compiled into the executable\n");
+        return false;
+    }
+
+    VkSamplerCreateInfo samplerInfo = {};
+    samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    samplerInfo.magFilter = VK_FILTER_LINEAR;
+    samplerInfo.minFilter = VK_FILTER_LINEAR;
+    samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.maxLod = 0.0f;
+    VK_CHECK(vkCreateSampler(m_device, &samplerInfo, nullptr, &m_sampler));
+
+    VkDescriptorSetLayoutBinding bindings[3] = {};
+    bindings[0].binding = 0;
+    bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    bindings[0].descriptorCount = 1;
+    bindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    bindings[1].binding = 1;
+    bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    bindings[1].descriptorCount = 1;
+    bindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    bindings[2].binding = 2;
+    bindings[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    bindings[2].descriptorCount = 1;
+    bindings[2].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+    VkDescriptorSetLayoutCreateInfo layoutInfo = {};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.bindingCount = 3;
+    layoutInfo.pBindings = bindings;
+    VK_CHECK(vkCreateDescriptorSetLayout(m_device, &layoutInfo, nullptr, &m_descriptorSetLayout));
+
+    VkDescriptorPoolSize poolSizes[3] = {};
+    poolSizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    poolSizes[0].descriptorCount = outputCount;
+    poolSizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    poolSizes[1].descriptorCount = outputCount;
+    poolSizes[2].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    poolSizes[2].descriptorCount = outputCount;
+
+    VkDescriptorPoolCreateInfo poolInfo = {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.maxSets = outputCount;
+    poolInfo.poolSizeCount = 3;
+    poolInfo.pPoolSizes = poolSizes;
+    VK_CHECK(vkCreateDescriptorPool(m_device, &poolInfo, nullptr, &m_descriptorPool));
+
+    std::vector<VkDescriptorSetLayout> setLayouts(outputCount, m_descriptorSetLayout);
+    m_descriptorSets.resize(outputCount);
+
+    VkDescriptorSetAllocateInfo setAllocInfo = {};
+    setAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    setAllocInfo.descriptorPool = m_descriptorPool;
+    setAllocInfo.descriptorSetCount = outputCount;
+    setAllocInfo.pSetLayouts = setLayouts.data();
+    VK_CHECK(vkAllocateDescriptorSets(m_device, &setAllocInfo, m_descriptorSets.data()));
+
+    VkPushConstantRange pushConstantRange = {};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(UpscaleParameters);
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &m_descriptorSetLayout;
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+    VK_CHECK(vkCreatePipelineLayout(m_device, &pipelineLayoutInfo, nullptr, &m_pipelineLayout));
+
+    VkShaderModuleCreateInfo shaderInfo = {};
+    shaderInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    shaderInfo.codeSize = shader->size;
+    shaderInfo.pCode = shader->code;
+
+    VkShaderModule shaderModule = VK_NULL_HANDLE;
+    VK_CHECK(vkCreateShaderModule(m_device, &shaderInfo, nullptr, &shaderModule));
+
+    VkComputePipelineCreateInfo pipelineInfo = {};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipelineInfo.stage.module = shaderModule;
+    pipelineInfo.stage.pName = "main";
+    pipelineInfo.layout = m_pipelineLayout;
+    VK_CHECK(vkCreateComputePipelines(m_device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &m_pipeline));
+
+    vkDestroyShaderModule(m_device, shaderModule, nullptr);
+
+    return m_pipeline != VK_NULL_HANDLE;
+}
+
+void CUpscaler::destroy() {
+    if (m_pipeline != VK_NULL_HANDLE) {
+        vkDestroyPipeline(m_device, m_pipeline, nullptr);
+        m_pipeline = VK_NULL_HANDLE;
+    }
+    if (m_pipelineLayout != VK_NULL_HANDLE) {
+        vkDestroyPipelineLayout(m_device, m_pipelineLayout, nullptr);
+        m_pipelineLayout = VK_NULL_HANDLE;
+    }
+    if (m_descriptorPool != VK_NULL_HANDLE) {
+        vkDestroyDescriptorPool(m_device, m_descriptorPool, nullptr);
+        m_descriptorPool = VK_NULL_HANDLE;
+        m_descriptorSets.clear();
+    }
+    if (m_descriptorSetLayout != VK_NULL_HANDLE) {
+        vkDestroyDescriptorSetLayout(m_device, m_descriptorSetLayout, nullptr);
+        m_descriptorSetLayout = VK_NULL_HANDLE;
+    }
+    if (m_sampler != VK_NULL_HANDLE) {
+        vkDestroySampler(m_device, m_sampler, nullptr);
+        m_sampler = VK_NULL_HANDLE;
+    }
+}
+
+void CUpscaler::setOutput(uint32_t outputIndex, VkImageView source, VkImageView output, VkBuffer traceSizeBuffer, VkDeviceSize traceSizeOffset) {
+    VkDescriptorImageInfo sourceInfo = {};
+    sourceInfo.sampler = m_sampler;
+    sourceInfo.imageView = source;
+    sourceInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+    VkDescriptorImageInfo outputInfo = {};
+    outputInfo.imageView = output;
+    outputInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+    VkDescriptorBufferInfo traceSizeInfo = {};
+    traceSizeInfo.buffer = traceSizeBuffer;
+    traceSizeInfo.offset = traceSizeOffset;
+    traceSizeInfo.range = sizeof(VkTraceRaysIndirectCommandKHR);
+
+    VkWriteDescriptorSet writes[3] = {};
+    for (uint32_t binding = 0; binding < 3; ++binding) {
+        writes[binding].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writes[binding].dstSet = m_descriptorSets[outputIndex];
+        writes[binding].dstBinding = binding;
+        writes[binding].descriptorCount = 1;
+    }
+    writes[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    writes[0].pImageInfo = &sourceInfo;
+    writes[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    writes[1].pImageInfo = &outputInfo;
+    writes[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    writes[2].pBufferInfo = &traceSizeInfo;
+
+    vkUpdateDescriptorSets(m_device, 3, writes, 0, nullptr);
+}
+
+void CUpscaler::record(VkCommandBuffer commandBuffer, uint32_t outputIndex, uint32_t width, uint32_t height, float sharpness) {
+    UpscaleParameters parameters;
+    parameters.targetWidth = width;
+    parameters.targetHeight = height;
+    parameters.sharpness = sharpness;
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelineLayout, 0, 1, &m_descriptorSets[outputIndex], 0, nullptr);
+    vkCmdPushConstants(commandBuffer, m_pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(parameters), &parameters);
+    // 8x8 work groups
+    vkCmdDispatch(commandBuffer, (width + 7) / 8, (height + 7) / 8, 1);
+}
@@ -0,0 +1,66 @@
+#ifndef DYNAMICRESOLUTION_HXX
+#define DYNAMICRESOLUTION_HXX
+
+#include <stdint.h>
+#include <vector>
+
+#include "vulkanhelper.hxx"
+
+/*
+ * Picks the trace resolution from the GPU time of the trace. The scale of both axes moves in
+ * steps of 1 / kStepCount, it drops as soon as a frame does not fit the budget and rises by
+ * one step once kRaiseFrames frames in a row would fit at the higher scale.
+ */
+class CDynamicResolution
+{
+public:
+    CDynamicResolution(double budgetMilliseconds, float minScale);
+
+    // trace time of a frame traced at traceScale, true if the scale changed
+    bool update(double traceMilliseconds, float traceScale);
+
+    float getScale() const { return static_cast<float>(m_step) / kStepCount; }
+    // the launch size of an axis with fullSize pixels at the current scale
+    uint32_t getSize(uint32_t fullSize) const;
+
+    static uint32_t const kStepCount = 16;
+    static uint32_t const kRaiseFrames = 30;
+
+private:
+    double m_budgetMilliseconds;
+    uint32_t m_minStep;
+    uint32_t m_step;
+    // estimated trace time at full resolution, negative before the first frame
+    double m_fullMilliseconds;
+    uint32_t m_raiseFrames;
+};
+
+/*
+ * Compute pass scaling the traced region of the render target up to an output image, bilinear
+ * with optional contrast adaptive sharpening. The region is read from the buffer holding the
+ * VkTraceRaysIndirectCommandKHR of the trace, so it changes without recording the pass again.
+ */
+class CUpscaler
+{
+public:
+    explicit CUpscaler(VkDevice device);
+
+    // false without the embedded upscale shader
+    bool init(uint32_t outputCount);
+    void destroy();
+
+    // source is sampled in GENERAL layout, output is a storage image in GENERAL layout
+    void setOutput(uint32_t outputIndex, VkImageView source, VkImageView output, VkBuffer traceSizeBuffer, VkDeviceSize traceSizeOffset);
+    void record(VkCommandBuffer commandBuffer, uint32_t outputIndex, uint32_t width, uint32_t height, float sharpness);
+
+private:
+    VkDevice m_device;
+    VkSampler m_sampler;
+    VkDescriptorSetLayout m_descriptorSetLayout;
+    VkDescriptorPool m_descriptorPool;
+    std::vector<VkDescriptorSet> m_descriptorSets;
+    VkPipelineLayout m_pipelineLayout;
+    VkPipeline m_pipeline;
+};
+
+#endif // DYNAMICRESOLUTION_HXX
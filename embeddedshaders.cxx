@@ -0,0 +1,11 @@
+#include "embeddedshaders.hxx"
+
+EmbeddedShader const* findEmbeddedShader(std::string const& name) {
+    for (uint32_t index = 0; index < g_embeddedShaderCount; ++index) {
+        if (name == g_embeddedShaders[index].name) {
+            return &g_embeddedShaders[index];
+        }
+    }
+
+    return nullptr;
+}
@@ -0,0 +1,22 @@
+#ifndef EMBEDDEDSHADERS_HXX
+#define EMBEDDEDSHADERS_HXX
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+// SPIR-V compiled from shader/ at build time, the arrays are generated by embedshaders.cmake
+struct EmbeddedShader {
+    char const* name;
+    uint32_t const* code;
+    // in bytes
+    size_t size;
+};
+
+extern EmbeddedShader const g_embeddedShaders[];
+extern uint32_t const g_embeddedShaderCount;
+
+// name is the shader file name without extension, e.g. "raygen_ext", nullptr if unknown
+EmbeddedShader const* findEmbeddedShader(std::string const& name);
+
+#endif // EMBEDDEDSHADERS_HXX
@@ -0,0 +1,44 @@
+# Writes OUTPUT, a C++ source with one constant uint32_t array per SPIR-V file of INPUTS
+# ('|' separated) and the table findEmbeddedShader() searches, see embeddedshaders.hxx.
+# Run with cmake -DOUTPUT=... -DINPUTS=... -P embedshaders.cmake
+
+string(REPLACE "|" ";" INPUTS "${INPUTS}")
+
+set(ARRAYS "")
+set(TABLE "")
+set(COUNT 0)
+
+foreach(INPUT ${INPUTS})
+	get_filename_component(NAME ${INPUT} NAME_WE)
+
+	file(READ ${INPUT} HEX HEX)
+	string(LENGTH "${HEX}" HEX_LENGTH)
+	math(EXPR REMAINDER "${HEX_LENGTH} % 8")
+	if (HEX_LENGTH EQUAL 0 OR NOT REMAINDER EQUAL 0)
+		message(FATAL_ERROR "${INPUT} is not SPIR-V, its size is not a multiple of 4 bytes")
+	endif()
+
+	# SPIR-V is a stream of little endian words
+	string(REGEX REPLACE "(..)(..)(..)(..)" "0x\\4\\3\\2\\1u, " WORDS "${HEX}")
+	# eight words per line, the CMake regex has no {n} repetition
+	set(WORD "0x........u, ")
+	string(REGEX REPLACE "(${WORD}${WORD}${WORD}${WORD}${WORD}${WORD}${WORD}${WORD})" "\\1\n    " WORDS "${WORDS}")
+
+	string(REPLACE " \n" "\n" WORDS "${WORDS}")
+	string(STRIP "${WORDS}" WORDS)
+
+	string(APPEND ARRAYS "static uint32_t const ${NAME}[] = {\n    ${WORDS}\n};\n\n")
+	string(APPEND TABLE "    { \"${NAME}\", ${NAME}, sizeof(${NAME}) },\n")
+	math(EXPR COUNT "${COUNT} + 1")
+endforeach()
+
+file(WRITE ${OUTPUT}.tmp
+	"// generated by embedshaders.cmake, do not edit\n\n"
+	"#include \"embeddedshaders.hxx\"\n\n"
+	"${ARRAYS}"
+	"EmbeddedShader const g_embeddedShaders[] = {\n${TABLE}};\n\n"
+	"uint32_t const g_embeddedShaderCount = ${COUNT};\n")
+
+# keeps the timestamp if nothing changed, so the source is not compiled again
+execute_process(COMMAND ${CMAKE_COMMAND} -E copy_if_different ${OUTPUT}.tmp ${OUTPUT})
+file(REMOVE ${OUTPUT}.tmp)
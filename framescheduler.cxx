@@ -0,0 +1,147 @@
+#include "framescheduler.hxx"
+
+#include <algorithm>
+
+CFrameScheduler::CFrameScheduler(VkDevice device, VkQueue queue, VkSwapchainKHR swapchain, uint32_t imageCount, uint32_t framesInFlight)
+    : m_device(device)
+    , m_queue(queue)
+    , m_swapchain(swapchain)
+    , m_frameFences(std::max(1u, framesInFlight), VK_NULL_HANDLE)
+    , m_imageAvailableSemaphores(std::max(1u, framesInFlight), VK_NULL_HANDLE)
+    , m_renderFinishedSemaphores(imageCount, VK_NULL_HANDLE)
+    , m_imageFences(imageCount, VK_NULL_HANDLE)
+    , m_frameSlot(0)
+    , m_imageIndex(0)
+{
+    VkSemaphoreCreateInfo semaphoreInfo = {};
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+    // signaled, the first wait of every slot returns at once
+    VkFenceCreateInfo fenceInfo = {};
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+
+    for (size_t slot = 0; slot < m_frameFences.size(); ++slot) {
+        VK_CHECK(vkCreateFence(m_device, &fenceInfo, nullptr, &m_frameFences[slot]));
+        VK_CHECK(vkCreateSemaphore(m_device, &semaphoreInfo, nullptr, &m_imageAvailableSemaphores[slot]));
+    }
+
+    for (size_t image = 0; image < m_renderFinishedSemaphores.size(); ++image) {
+        VK_CHECK(vkCreateSemaphore(m_device, &semaphoreInfo, nullptr, &m_renderFinishedSemaphores[image]));
+    }
+}
+
+void CFrameScheduler::destroy() {
+    for (size_t slot = 0; slot < m_frameFences.size(); ++slot) {
+        vkDestroyFence(m_device, m_frameFences[slot], nullptr);
+        vkDestroySemaphore(m_device, m_imageAvailableSemaphores[slot], nullptr);
+    }
+    for (size_t image = 0; image < m_renderFinishedSemaphores.size(); ++image) {
+        vkDestroySemaphore(m_device, m_renderFinishedSemaphores[image], nullptr);
+    }
+
+    m_frameFences.clear();
+    m_imageAvailableSemaphores.clear();
+    m_renderFinishedSemaphores.clear();
+    m_imageFences.clear();
+}
+
+char const* CFrameScheduler::getLatencyModeName(LatencyMode::Enum mode) {
+    switch (mode) {
+        case LatencyMode::MinLatency: return "min latency";
+        case LatencyMode::MaxThroughput: return "max throughput";
+        default: return "unknown";
+    }
+}
+
+uint32_t CFrameScheduler::getDefaultFramesInFlight(LatencyMode::Enum mode) {
+    return mode == LatencyMode::MinLatency ? 1 : 2;
+}
+
+uint32_t CFrameScheduler::getSwapchainImageCount(LatencyMode::Enum mode, uint32_t framesInFlight, VkSurfaceCapabilitiesKHR const& capabilities) {
+    // throughput keeps an image free for the presentation engine beside the ones the frames in
+    // flight render into, so acquiring does not block on the display
+    uint32_t imageCount = capabilities.minImageCount;
+    if (mode == LatencyMode::MaxThroughput) {
+        imageCount = std::max(capabilities.minImageCount + 1, framesInFlight + 1);
+    }
+
+    if (capabilities.maxImageCount > 0) {
+        imageCount = std::min(imageCount, capabilities.maxImageCount);
+    }
+    return imageCount;
+}
+
+void CFrameScheduler::waitForFrameSlot() {
+    VK_CHECK(vkWaitForFences(m_device, 1, &m_frameFences[m_frameSlot], VK_TRUE, UINT64_MAX));
+}
+
+VkResult CFrameScheduler::acquireImage() {
+    return vkAcquireNextImageKHR(m_device, m_swapchain, UINT64_MAX, m_imageAvailableSemaphores[m_frameSlot], VK_NULL_HANDLE, &m_imageIndex);
+}
+
+void CFrameScheduler::waitForImage() {
+    VkFence fence = m_frameFences[m_frameSlot];
+    if (m_imageFences[m_imageIndex] != VK_NULL_HANDLE && m_imageFences[m_imageIndex] != fence) {
+        VK_CHECK(vkWaitForFences(m_device, 1, &m_imageFences[m_imageIndex], VK_TRUE, UINT64_MAX));
+    }
+    m_imageFences[m_imageIndex] = fence;
+}
+
+void CFrameScheduler::waitForTimeline(VkSemaphore timeline, uint64_t value, VkPipelineStageFlags stageMask) {
+    m_waitSemaphores.push_back(timeline);
+    m_waitValues.push_back(value);
+    m_waitStageMasks.push_back(stageMask);
+}
+
+VkResult CFrameScheduler::submit(VkCommandBuffer commandBuffer, VkPipelineStageFlags waitStageMask) {
+    m_waitSemaphores.insert(m_waitSemaphores.begin(), m_imageAvailableSemaphores[m_frameSlot]);
+    m_waitValues.insert(m_waitValues.begin(), 0);
+    m_waitStageMasks.insert(m_waitStageMasks.begin(), waitStageMask);
+
+    uint64_t const signalValue = 0;
+
+    VkTimelineSemaphoreSubmitInfo timelineInfo = {};
+    timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timelineInfo.waitSemaphoreValueCount = static_cast<uint32_t>(m_waitValues.size());
+    timelineInfo.pWaitSemaphoreValues = m_waitValues.data();
+    timelineInfo.signalSemaphoreValueCount = 1;
+    timelineInfo.pSignalSemaphoreValues = &signalValue;
+
+    VkSubmitInfo submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    // only needed with a timeline among the waits
+    submitInfo.pNext = m_waitSemaphores.size() > 1 ? &timelineInfo : nullptr;
+    submitInfo.waitSemaphoreCount = static_cast<uint32_t>(m_waitSemaphores.size());
+    submitInfo.pWaitSemaphores = m_waitSemaphores.data();
+    submitInfo.pWaitDstStageMask = m_waitStageMasks.data();
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &commandBuffer;
+    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.pSignalSemaphores = &m_renderFinishedSemaphores[m_imageIndex];
+
+    // only reset right before the submit, a failed acquire leaves the fence signaled for the next try
+    vkResetFences(m_device, 1, &m_frameFences[m_frameSlot]);
+
+    VkResult result = vkQueueSubmit(m_queue, 1, &submitInfo, m_frameFences[m_frameSlot]);
+
+    m_waitSemaphores.clear();
+    m_waitValues.clear();
+    m_waitStageMasks.clear();
+    return result;
+}
+
+VkResult CFrameScheduler::present() {
+    VkPresentInfoKHR presentInfo = {};
+    presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+    presentInfo.waitSemaphoreCount = 1;
+    presentInfo.pWaitSemaphores = &m_renderFinishedSemaphores[m_imageIndex];
+    presentInfo.swapchainCount = 1;
+    presentInfo.pSwapchains = &m_swapchain;
+    presentInfo.pImageIndices = &m_imageIndex;
+
+    VkResult result = vkQueuePresentKHR(m_queue, &presentInfo);
+
+    m_frameSlot = (m_frameSlot + 1) % getFramesInFlight();
+    return result;
+}
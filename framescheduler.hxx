@@ -0,0 +1,80 @@
+#ifndef FRAMESCHEDULER_HXX
+#define FRAMESCHEDULER_HXX
+
+#include <stdint.h>
+#include <vector>
+
+#include "vulkanhelper.hxx"
+
+namespace LatencyMode {
+    enum Enum {
+        // one frame in flight and as few swapchain images as the surface allows, a frame starts
+        // once the GPU finished the one before, so its input is as fresh as it gets
+        MinLatency,
+        // the CPU updates and submits the next frames while the GPU still traces
+        MaxThroughput,
+        Count
+    };
+}
+
+/*
+ * Paces the windowed frame loop. Every frame slot has a fence and an acquire semaphore, so the CPU
+ * runs at most framesInFlight frames ahead of the GPU however many images the swapchain has. The
+ * render finished semaphores belong to the swapchain images, a present can still wait on one when
+ * the frame slot that signaled it comes around again.
+ */
+class CFrameScheduler
+{
+public:
+    CFrameScheduler(VkDevice device, VkQueue queue, VkSwapchainKHR swapchain, uint32_t imageCount, uint32_t framesInFlight);
+    void destroy();
+
+    static char const* getLatencyModeName(LatencyMode::Enum mode);
+    static uint32_t getDefaultFramesInFlight(LatencyMode::Enum mode);
+    // minImageCount of the swapchain, within the limits of the surface
+    static uint32_t getSwapchainImageCount(LatencyMode::Enum mode, uint32_t framesInFlight, VkSurfaceCapabilitiesKHR const& capabilities);
+
+    // Waits for the last frame submitted from the current slot, its resources can be reused afterwards.
+    void waitForFrameSlot();
+    // the image is getImageIndex() on success
+    VkResult acquireImage();
+    // Waits for the frame of another slot that still renders into the acquired image, the
+    // resources of the image can be reused afterwards.
+    void waitForImage();
+    // The next submit waits for the timeline semaphore to reach value before stageMask as well,
+    // work of another queue the frame depends on for example.
+    void waitForTimeline(VkSemaphore timeline, uint64_t value, VkPipelineStageFlags stageMask);
+    // waitStageMask is the first stage that accesses the swapchain image
+    VkResult submit(VkCommandBuffer commandBuffer, VkPipelineStageFlags waitStageMask);
+    // presents the acquired image and moves on to the next frame slot
+    VkResult present();
+
+    uint32_t getFrameSlot() const { return m_frameSlot; }
+    uint32_t getImageIndex() const { return m_imageIndex; }
+    uint32_t getFramesInFlight() const { return static_cast<uint32_t>(m_frameFences.size()); }
+    uint32_t getImageCount() const { return static_cast<uint32_t>(m_renderFinishedSemaphores.size()); }
+
+private:
+    VkDevice m_device;
+    VkQueue m_queue;
+    VkSwapchainKHR m_swapchain;
+
+    // per frame slot
+    std::vector<VkFence> m_frameFences;
+    std::vector<VkSemaphore> m_imageAvailableSemaphores;
+
+    // per swapchain image
+    std::vector<VkSemaphore> m_renderFinishedSemaphores;
+    // fence of the frame that rendered into the image last
+    std::vector<VkFence> m_imageFences;
+
+    // waits of the next submit after the acquire semaphore, the value of the binary one is ignored
+    std::vector<VkSemaphore> m_waitSemaphores;
+    std::vector<uint64_t> m_waitValues;
+    std::vector<VkPipelineStageFlags> m_waitStageMasks;
+
+    uint32_t m_frameSlot;
+    uint32_t m_imageIndex;
+};
+
+#endif // FRAMESCHEDULER_HXX
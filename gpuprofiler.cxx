@@ -0,0 +1,248 @@
+#include "gpuprofiler.hxx"
+
+#include <algorithm>
+
+CGpuProfiler::CGpuProfiler(VkDevice device, float timestampPeriod, uint32_t timestampValidBits)
+    : m_device(device)
+    , m_timestampPeriod(timestampPeriod)
+    , m_timestampValidBits(timestampValidBits)
+{
+}
+
+uint32_t CGpuProfiler::createSlot() {
+    Slot slot = {};
+    slot.queryPool = VK_NULL_HANDLE;
+    slot.submitted = false;
+
+    if (isEnabled()) {
+        VkQueryPoolCreateInfo queryPoolInfo = {};
+        queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        queryPoolInfo.queryCount = 2 * kMaxScopesPerSlot;
+        VK_CHECK(vkCreateQueryPool(m_device, &queryPoolInfo, nullptr, &slot.queryPool));
+    }
+
+    m_slots.push_back(slot);
+    return static_cast<uint32_t>(m_slots.size() - 1);
+}
+
+void CGpuProfiler::destroy() {
+    for (size_t index = 0; index < m_slots.size(); ++index) {
+        if (m_slots[index].queryPool != VK_NULL_HANDLE) {
+            vkDestroyQueryPool(m_device, m_slots[index].queryPool, nullptr);
+        }
+    }
+    m_slots.clear();
+}
+
+uint32_t CGpuProfiler::findScope(char const* name) {
+    for (uint32_t index = 0; index < m_scopes.size(); ++index) {
+        if (m_scopes[index].name == name) {
+            return index;
+        }
+    }
+
+    Scope scope;
+    scope.name = name;
+    scope.sampleCount = 0;
+    scope.lastMilliseconds = 0.0;
+    m_scopes.push_back(scope);
+    return static_cast<uint32_t>(m_scopes.size() - 1);
+}
+
+void CGpuProfiler::beginFrame(VkCommandBuffer commandBuffer, uint32_t slot) {
+    if (!isEnabled()) {
+        return;
+    }
+
+    m_slots[slot].scopes.clear();
+    m_slots[slot].submitted = false;
+    vkCmdResetQueryPool(commandBuffer, m_slots[slot].queryPool, 0, 2 * kMaxScopesPerSlot);
+}
+
+uint32_t CGpuProfiler::beginScope(VkCommandBuffer commandBuffer, uint32_t slot, char const* name) {
+    if (!isEnabled()) {
+        return UINT32_MAX;
+    }
+
+    Slot& profilerSlot = m_slots[slot];
+    if (profilerSlot.scopes.size() >= kMaxScopesPerSlot) {
+        printf("gpu profiler: more than %u scopes in slot %u, %s is not measured\n", kMaxScopesPerSlot, slot, name);
+        return UINT32_MAX;
+    }
+
+    uint32_t scope = static_cast<uint32_t>(profilerSlot.scopes.size());
+    profilerSlot.scopes.push_back(findScope(name));
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, profilerSlot.queryPool, 2 * scope);
+
+    return scope;
+}
+
+void CGpuProfiler::endScope(VkCommandBuffer commandBuffer, uint32_t slot, uint32_t scope) {
+    if (scope == UINT32_MAX) {
+        return;
+    }
+
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_slots[slot].queryPool, 2 * scope + 1);
+}
+
+void CGpuProfiler::submitted(uint32_t slot) {
+    if (isEnabled()) {
+        m_slots[slot].submitted = true;
+    }
+}
+
+void CGpuProfiler::collect(uint32_t slot) {
+    Slot& profilerSlot = m_slots[slot];
+    if (!profilerSlot.submitted || profilerSlot.scopes.empty()) {
+        return;
+    }
+    profilerSlot.submitted = false;
+
+    uint32_t queryCount = 2 * static_cast<uint32_t>(profilerSlot.scopes.size());
+    std::vector<uint64_t> timestamps(queryCount);
+
+    // no WAIT_BIT, the caller waited for the submission. Queries that were never written
+    // (a scope recorded into a branch that did not run) leave the whole read not ready.
+    VkResult result = vkGetQueryPoolResults(m_device, profilerSlot.queryPool, 0, queryCount, timestamps.size() * sizeof(uint64_t), timestamps.data(), sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+    if (result != VK_SUCCESS) {
+        return;
+    }
+
+    uint64_t const timestampMask = m_timestampValidBits >= 64 ? ~0ull : ((1ull << m_timestampValidBits) - 1);
+
+    for (size_t index = 0; index < profilerSlot.scopes.size(); ++index) {
+        uint64_t ticks = ((timestamps[2 * index + 1] & timestampMask) - (timestamps[2 * index] & timestampMask)) & timestampMask;
+        double milliseconds = ticks * m_timestampPeriod / 1000000.0;
+
+        Scope& scope = m_scopes[profilerSlot.scopes[index]];
+        if (scope.window.size() < kWindowSize) {
+            scope.window.push_back(milliseconds);
+        }
+        else {
+            scope.window[scope.sampleCount % kWindowSize] = milliseconds;
+        }
+        scope.lastMilliseconds = milliseconds;
+        ++scope.sampleCount;
+    }
+}
+
+bool CGpuProfiler::getLastSample(char const* name, uint64_t& sampleCount, double& milliseconds) const {
+    for (size_t index = 0; index < m_scopes.size(); ++index) {
+        if (m_scopes[index].name == name && m_scopes[index].sampleCount > 0) {
+            sampleCount = m_scopes[index].sampleCount;
+            milliseconds = m_scopes[index].lastMilliseconds;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+std::vector<GpuScopeStats> CGpuProfiler::getStats() const {
+    std::vector<GpuScopeStats> stats;
+
+    for (size_t index = 0; index < m_scopes.size(); ++index) {
+        Scope const& scope = m_scopes[index];
+        if (scope.window.empty()) {
+            continue;
+        }
+
+        std::vector<double> sorted = scope.window;
+        std::sort(sorted.begin(), sorted.end());
+
+        double sum = 0.0;
+        for (size_t sample = 0; sample < sorted.size(); ++sample) {
+            sum += sorted[sample];
+        }
+
+        GpuScopeStats scopeStats;
+        scopeStats.name = scope.name;
+        scopeStats.sampleCount = scope.sampleCount;
+        scopeStats.lastMilliseconds = scope.lastMilliseconds;
+        scopeStats.minMilliseconds = sorted.front();
+        scopeStats.avgMilliseconds = sum / sorted.size();
+        // nearest rank
+        scopeStats.p99Milliseconds = sorted[std::min(sorted.size() - 1, (sorted.size() * 99 + 99) / 100 - 1)];
+        scopeStats.maxMilliseconds = sorted.back();
+        stats.push_back(scopeStats);
+    }
+
+    return stats;
+}
+
+void CGpuProfiler::printReport() const {
+    if (!isEnabled()) {
+        printf("gpu profiler: queue has no timestamp support\n");
+        return;
+    }
+
+    std::vector<GpuScopeStats> stats = getStats();
+    for (size_t index = 0; index < stats.size(); ++index) {
+        printf("gpu %-20s %6llu samples, min %8.3f ms, avg %8.3f ms, p99 %8.3f ms, max %8.3f ms\n",
+               stats[index].name.c_str(),
+               static_cast<unsigned long long>(stats[index].sampleCount),
+               stats[index].minMilliseconds,
+               stats[index].avgMilliseconds,
+               stats[index].p99Milliseconds,
+               stats[index].maxMilliseconds);
+    }
+}
+
+bool CGpuProfiler::writeCsv(FILE* file) const {
+    std::vector<GpuScopeStats> stats = getStats();
+
+    fprintf(file, "scope,samples,last_ms,min_ms,avg_ms,p99_ms,max_ms\n");
+    for (size_t index = 0; index < stats.size(); ++index) {
+        fprintf(file, "%s,%llu,%.6f,%.6f,%.6f,%.6f,%.6f\n",
+                stats[index].name.c_str(),
+                static_cast<unsigned long long>(stats[index].sampleCount),
+                stats[index].lastMilliseconds,
+                stats[index].minMilliseconds,
+                stats[index].avgMilliseconds,
+                stats[index].p99Milliseconds,
+                stats[index].maxMilliseconds);
+    }
+
+    return true;
+}
+
+bool CGpuProfiler::writeJson(FILE* file) const {
+    std::vector<GpuScopeStats> stats = getStats();
+
+    // the scope names are string literals of the code, nothing to escape
+    fprintf(file, "{\n  \"timestampPeriod\": %f,\n  \"windowSize\": %u,\n  \"scopes\": [", m_timestampPeriod, kWindowSize);
+    for (size_t index = 0; index < stats.size(); ++index) {
+        fprintf(file, "%s\n    { \"name\": \"%s\", \"samples\": %llu, \"lastMs\": %.6f, \"minMs\": %.6f, \"avgMs\": %.6f, \"p99Ms\": %.6f, \"maxMs\": %.6f }",
+                index > 0 ? "," : "",
+                stats[index].name.c_str(),
+                static_cast<unsigned long long>(stats[index].sampleCount),
+                stats[index].lastMilliseconds,
+                stats[index].minMilliseconds,
+                stats[index].avgMilliseconds,
+                stats[index].p99Milliseconds,
+                stats[index].maxMilliseconds);
+    }
+    fprintf(file, "\n  ]\n}\n");
+
+    return true;
+}
+
+bool CGpuProfiler::writeReport(std::string const& path) const {
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file) {
+        printf("gpu profiler: can not open %s\n", path.c_str());
+        return false;
+    }
+
+    size_t extension = path.find_last_of('.');
+    bool json = extension != std::string::npos && path.substr(extension) == ".json";
+    bool success = json ? writeJson(file) : writeCsv(file);
+
+    fclose(file);
+
+    if (success) {
+        printf("gpu profiler: written to %s\n", path.c_str());
+    }
+    return success;
+}
@@ -0,0 +1,88 @@
+#ifndef GPUPROFILER_HXX
+#define GPUPROFILER_HXX
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "vulkanhelper.hxx"
+
+struct GpuScopeStats {
+    std::string name;
+    // all samples so far, min/avg/p99/max cover the last kWindowSize of them
+    uint64_t sampleCount;
+    double lastMilliseconds;
+    double minMilliseconds;
+    double avgMilliseconds;
+    double p99Milliseconds;
+    double maxMilliseconds;
+};
+
+/*
+ * Named GPU timestamp scopes. Every slot owns a query pool, a frame loop uses one slot per
+ * command buffer in flight and reads a slot only once the fence of its last submission was
+ * waited for, so reading the results never stalls. Scopes with the same name are merged into
+ * rolling statistics. Without timestamp support on the queue all calls do nothing.
+ */
+class CGpuProfiler
+{
+public:
+    // timestampValidBits of the queue family the scopes are recorded for
+    CGpuProfiler(VkDevice device, float timestampPeriod, uint32_t timestampValidBits);
+
+    uint32_t createSlot();
+    void destroy();
+
+    // Records the reset of the slot's queries and forgets the scopes recorded for it before.
+    void beginFrame(VkCommandBuffer commandBuffer, uint32_t slot);
+    // returns the scope for endScope()
+    uint32_t beginScope(VkCommandBuffer commandBuffer, uint32_t slot, char const* name);
+    void endScope(VkCommandBuffer commandBuffer, uint32_t slot, uint32_t scope);
+
+    // the command buffer recorded for the slot was submitted, collect() reads its results
+    void submitted(uint32_t slot);
+    // Adds the results of the slot's last submission to the statistics, the submission has to
+    // be finished and the slot must not be submitted again before.
+    void collect(uint32_t slot);
+
+    bool isEnabled() const { return m_timestampValidBits > 0; }
+    // the sample count tells a new sample from the one seen before, false before the first one
+    bool getLastSample(char const* name, uint64_t& sampleCount, double& milliseconds) const;
+    std::vector<GpuScopeStats> getStats() const;
+    void printReport() const;
+    // the format follows the extension, .json or anything else for CSV
+    bool writeReport(std::string const& path) const;
+
+    static uint32_t const kMaxScopesPerSlot = 32;
+    static uint32_t const kWindowSize = 256;
+
+private:
+    struct Slot {
+        VkQueryPool queryPool;
+        // index into m_scopes per recorded scope, the queries are 2 * index and 2 * index + 1
+        std::vector<uint32_t> scopes;
+        bool submitted;
+    };
+
+    struct Scope {
+        std::string name;
+        uint64_t sampleCount;
+        double lastMilliseconds;
+        // ring of the last kWindowSize samples
+        std::vector<double> window;
+    };
+
+    uint32_t findScope(char const* name);
+    bool writeCsv(FILE* file) const;
+    bool writeJson(FILE* file) const;
+
+    VkDevice m_device;
+    float m_timestampPeriod;
+    uint32_t m_timestampValidBits;
+
+    std::vector<Slot> m_slots;
+    std::vector<Scope> m_scopes;
+};
+
+#endif // GPUPROFILER_HXX
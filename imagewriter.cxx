@@ -0,0 +1,160 @@
+#include "imagewriter.hxx"
+
+#include <stdio.h>
+#include <vector>
+#include <algorithm>
+
+namespace ImageWriter {
+
+bool writePPM(std::string const& path, uint32_t width, uint32_t height, uint8_t const* rgba) {
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file) {
+        printf("failed to open %s for writing\n", path.c_str());
+        return false;
+    }
+
+    fprintf(file, "P6\n%u %u\n255\n", width, height);
+
+    std::vector<uint8_t> row(width * 3);
+    for (uint32_t y = 0; y < height; ++y) {
+        uint8_t const* src = rgba + static_cast<size_t>(y) * width * 4;
+        for (uint32_t x = 0; x < width; ++x) {
+            row[x * 3 + 0] = src[x * 4 + 0];
+            row[x * 3 + 1] = src[x * 4 + 1];
+            row[x * 3 + 2] = src[x * 4 + 2];
+        }
+        fwrite(row.data(), 1, row.size(), file);
+    }
+
+    bool success = ferror(file) == 0;
+    fclose(file);
+
+    if (!success) {
+        printf("failed to write %s\n", path.c_str());
+    }
+
+    return success;
+}
+
+static uint32_t crc32(uint32_t crc, uint8_t const* data, size_t size) {
+    static uint32_t table[256];
+    static bool tableInitialized = false;
+    if (!tableInitialized) {
+        for (uint32_t index = 0; index < 256; ++index) {
+            uint32_t value = index;
+            for (uint32_t bit = 0; bit < 8; ++bit) {
+                value = (value & 1) ? 0xedb88320u ^ (value >> 1) : value >> 1;
+            }
+            table[index] = value;
+        }
+        tableInitialized = true;
+    }
+
+    crc = ~crc;
+    for (size_t index = 0; index < size; ++index) {
+        crc = table[(crc ^ data[index]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static void appendBigEndian(std::vector<uint8_t>& data, uint32_t value) {
+    data.push_back(static_cast<uint8_t>(value >> 24));
+    data.push_back(static_cast<uint8_t>(value >> 16));
+    data.push_back(static_cast<uint8_t>(value >> 8));
+    data.push_back(static_cast<uint8_t>(value));
+}
+
+static void writeChunk(FILE* file, char const* type, std::vector<uint8_t> const& payload) {
+    std::vector<uint8_t> chunk;
+    appendBigEndian(chunk, static_cast<uint32_t>(payload.size()));
+    chunk.insert(chunk.end(), type, type + 4);
+    chunk.insert(chunk.end(), payload.begin(), payload.end());
+    // the crc covers the type and the payload, not the length
+    appendBigEndian(chunk, crc32(0, chunk.data() + 4, chunk.size() - 4));
+    fwrite(chunk.data(), 1, chunk.size(), file);
+}
+
+bool writePNG(std::string const& path, uint32_t width, uint32_t height, uint8_t const* rgba) {
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file) {
+        printf("failed to open %s for writing\n", path.c_str());
+        return false;
+    }
+
+    static uint8_t const signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    fwrite(signature, 1, sizeof(signature), file);
+
+    std::vector<uint8_t> header;
+    appendBigEndian(header, width);
+    appendBigEndian(header, height);
+    header.push_back(8); // bit depth
+    header.push_back(2); // color type RGB
+    header.push_back(0); // deflate
+    header.push_back(0); // adaptive filtering
+    header.push_back(0); // no interlace
+    writeChunk(file, "IHDR", header);
+
+    // every scanline starts with its filter type, 0 leaves the bytes as they are
+    size_t rowSize = static_cast<size_t>(width) * 3 + 1;
+    std::vector<uint8_t> scanlines(rowSize * height);
+    for (uint32_t y = 0; y < height; ++y) {
+        uint8_t const* src = rgba + static_cast<size_t>(y) * width * 4;
+        uint8_t* dst = scanlines.data() + y * rowSize;
+        dst[0] = 0;
+        for (uint32_t x = 0; x < width; ++x) {
+            dst[1 + x * 3 + 0] = src[x * 4 + 0];
+            dst[1 + x * 3 + 1] = src[x * 4 + 1];
+            dst[1 + x * 3 + 2] = src[x * 4 + 2];
+        }
+    }
+
+    // zlib stream made of stored deflate blocks of at most 65535 bytes
+    size_t const kMaxBlockSize = 65535;
+    std::vector<uint8_t> imageData;
+    imageData.reserve(scanlines.size() + (scanlines.size() / kMaxBlockSize + 1) * 5 + 6);
+    imageData.push_back(0x78);
+    imageData.push_back(0x01);
+
+    uint32_t adlerA = 1;
+    uint32_t adlerB = 0;
+    size_t offset = 0;
+    do {
+        size_t blockSize = std::min(kMaxBlockSize, scanlines.size() - offset);
+        bool lastBlock = offset + blockSize == scanlines.size();
+        imageData.push_back(lastBlock ? 1 : 0);
+        imageData.push_back(static_cast<uint8_t>(blockSize));
+        imageData.push_back(static_cast<uint8_t>(blockSize >> 8));
+        imageData.push_back(static_cast<uint8_t>(~blockSize));
+        imageData.push_back(static_cast<uint8_t>(~blockSize >> 8));
+        imageData.insert(imageData.end(), scanlines.begin() + offset, scanlines.begin() + offset + blockSize);
+
+        for (size_t index = offset; index < offset + blockSize; ++index) {
+            adlerA = (adlerA + scanlines[index]) % 65521;
+            adlerB = (adlerB + adlerA) % 65521;
+        }
+        offset += blockSize;
+    } while (offset < scanlines.size());
+
+    appendBigEndian(imageData, (adlerB << 16) | adlerA);
+    writeChunk(file, "IDAT", imageData);
+    writeChunk(file, "IEND", std::vector<uint8_t>());
+
+    bool success = ferror(file) == 0;
+    fclose(file);
+
+    if (!success) {
+        printf("failed to write %s\n", path.c_str());
+    }
+
+    return success;
+}
+
+bool writeImage(std::string const& path, uint32_t width, uint32_t height, uint8_t const* rgba) {
+    if (path.size() >= 4 && path.compare(path.size() - 4, 4, ".png") == 0) {
+        return writePNG(path, width, height, rgba);
+    }
+
+    return writePPM(path, width, height, rgba);
+}
+
+}
@@ -0,0 +1,19 @@
+#ifndef IMAGEWRITER_HXX
+#define IMAGEWRITER_HXX
+
+#include <stdint.h>
+#include <string>
+
+namespace ImageWriter {
+    // Writes tightly packed RGBA8 pixels as binary PPM (alpha is dropped).
+    bool writePPM(std::string const& path, uint32_t width, uint32_t height, uint8_t const* rgba);
+
+    // Writes tightly packed RGBA8 pixels as 8 bit RGB PNG (alpha is dropped). The image data
+    // is stored in uncompressed deflate blocks, so no zlib is needed.
+    bool writePNG(std::string const& path, uint32_t width, uint32_t height, uint8_t const* rgba);
+
+    // Picks the format from the file extension, .png or .ppm (the default).
+    bool writeImage(std::string const& path, uint32_t width, uint32_t height, uint8_t const* rgba);
+}
+
+#endif // IMAGEWRITER_HXX
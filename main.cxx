@@ -1,5 +1,7 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <vector>
 #include <string>
 #include <malloc.h>
@@ -8,6 +10,8 @@
 #include <assert.h>
 #include <algorithm>
 #include <fstream>
+#include <chrono>
+#include <thread>
 
 #ifdef WIN32
 #include <Windows.h>
@@ -18,6 +22,12 @@
 #include "vulkanhelper.hxx"
 
 #include "raytracing.hxx"
+#include "cpuprofiler.hxx"
+#include "dynamicresolution.hxx"
+#include "framescheduler.hxx"
+#include "cpuraytracing.hxx"
+#include "imagewriter.hxx"
+#include "sdfpacket.hxx"
 
 
 #define WIDTH 1280
@@ -38,11 +48,20 @@ uint32_t getMemoryType(VkPhysicalDeviceMemoryProperties& gpuMemProps, VkMemoryRe
     return memoryType;
 }
 
+// keys 1 to 3 select a quality tier, -1 if none was pressed since the last frame
+static int g_requestedQualityTier = -1;
+
 #ifdef WIN32
 LRESULT CALLBACK wndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 {
     switch (message)
     {
+        case WM_KEYDOWN:
+        {
+            if (wParam >= '1' && wParam < '1' + QualityTier::Count) {
+                g_requestedQualityTier = static_cast<int>(wParam - '1');
+            }
+        } break;
         case WM_SIZE:
         {
             int width = LOWORD(lParam);
@@ -82,7 +101,862 @@ VkBool32 VKAPI_PTR debug_callback(
 }
 #endif
 
-int main() {
+// Renders the scene with CCpuRayTracing. Without an explicit thread count the frame is
+// rendered with 1, 2, 4, ... threads up to the hardware thread count to show the scaling.
+int runCpuReference(uint32_t threadCount, float animationTime, std::string const& outputPath) {
+    CRayTracingScene scene;
+    scene.setAspectRatio(static_cast<float>(WIDTH) / static_cast<float>(HEIGHT));
+    scene.initScene();
+    scene.buildProceduralGeometryAABBs();
+    scene.buildPlaneGeometry();
+    scene.setAnimationTime(animationTime);
+
+    std::vector<uint32_t> threadCounts;
+    if (threadCount > 0) {
+        threadCounts.push_back(threadCount);
+    }
+    else {
+        uint32_t hardwareThreads = CTaskScheduler::getHardwareThreadCount();
+        for (uint32_t count = 1; count < hardwareThreads; count *= 2) {
+            threadCounts.push_back(count);
+        }
+        threadCounts.push_back(hardwareThreads);
+    }
+
+    CCpuRayTracing cpuRayTracing(scene);
+    std::vector<uint8_t> pixels;
+    double singleThreadSeconds = 0.0;
+
+    printf("CPU reference: %ux%u, elapsedTime %.3f\n", WIDTH, HEIGHT, animationTime);
+
+    for (size_t index = 0; index < threadCounts.size(); ++index) {
+        CTaskScheduler scheduler(threadCounts[index]);
+        CpuRenderStats stats = cpuRayTracing.render(scheduler, WIDTH, HEIGHT, pixels);
+
+        if (index == 0) {
+            singleThreadSeconds = stats.seconds * stats.threadCount;
+        }
+
+        printf("threads: %2u, time: %8.2f ms, rays: %llu, %.2f Mrays/s, speedup: %.2fx\n",
+               stats.threadCount,
+               stats.seconds * 1000.0,
+               static_cast<unsigned long long>(stats.rayCount),
+               stats.rayCount / stats.seconds / 1000000.0,
+               singleThreadSeconds / stats.seconds);
+    }
+
+    TwoLevelBvhStats const& bvhStats = cpuRayTracing.getBvh().getStats();
+    printf("BVH: %u BLAS (%u nodes), TLAS %u nodes, SAH cost %.2f, build %.3f ms\n",
+           bvhStats.bottomLevelCount,
+           bvhStats.bottomLevelNodeCount,
+           bvhStats.topLevel.nodeCount,
+           bvhStats.sahCost,
+           bvhStats.totalSeconds * 1000.0);
+
+    if (!outputPath.empty() && !ImageWriter::writePPM(outputPath, WIDTH, HEIGHT, pixels.data())) {
+        return 1;
+    }
+
+    return 0;
+}
+
+// Builds the two-level BVH for 10^3 .. 10^6 instances of the procedural AABBs laid out on a grid
+// like the scene, to see how build time, node count and SAH cost scale before the GPU sees it.
+int runBvhBenchmark(uint32_t threadCount) {
+    CRayTracingScene scene;
+    scene.initScene();
+    scene.buildProceduralGeometryAABBs();
+
+    std::vector<VkAabbPositionsKHR> const& aabbs = scene.getAABBs();
+
+    std::vector<std::vector<BvhBounds>> bottomLevelPrimitives;
+    for (size_t index = 0; index < aabbs.size(); ++index) {
+        BvhBounds bounds = {
+            glm::vec3(aabbs[index].minX, aabbs[index].minY, aabbs[index].minZ),
+            glm::vec3(aabbs[index].maxX, aabbs[index].maxY, aabbs[index].maxZ)
+        };
+        bottomLevelPrimitives.push_back(std::vector<BvhBounds>(1, bounds));
+    }
+
+    // the scene AABBs cover a 4 x 4 grid cell pattern, copies of it are placed next to each other
+    float const kCellSize = 4.0f * 4.0f;
+
+    CTaskScheduler scheduler(threadCount);
+    printf("BVH scaling: %u threads\n", scheduler.getThreadCount());
+
+    for (uint32_t instanceCount = 1000; instanceCount <= 1000000; instanceCount *= 10) {
+        uint32_t gridSize = static_cast<uint32_t>(ceil(sqrt(static_cast<double>(instanceCount) / aabbs.size())));
+
+        std::vector<BvhInstance> instances(instanceCount);
+        for (uint32_t index = 0; index < instanceCount; ++index) {
+            uint32_t cell = index / static_cast<uint32_t>(aabbs.size());
+            glm::vec3 offset = glm::vec3((cell % gridSize) * kCellSize, scene.getAABBTransform()[3][1], (cell / gridSize) * kCellSize);
+
+            instances[index].objectToWorld = glm::translate(glm::mat4(1.0f), offset);
+            instances[index].worldToObject = glm::translate(glm::mat4(1.0f), -offset);
+            instances[index].bottomLevelIndex = index % static_cast<uint32_t>(aabbs.size());
+        }
+
+        CTwoLevelBvh bvh;
+        bvh.build(&scheduler, bottomLevelPrimitives, instances);
+
+        TwoLevelBvhStats const& stats = bvh.getStats();
+        printf("instances: %7u, TLAS nodes: %7u, depth: %2u, SAH cost: %7.2f, build: %8.2f ms (%.2f Minstances/s), memory: %.2f MB\n",
+               instanceCount,
+               stats.topLevel.nodeCount,
+               stats.topLevel.maxDepth,
+               stats.sahCost,
+               stats.totalSeconds * 1000.0,
+               instanceCount / stats.totalSeconds / 1000000.0,
+               stats.memoryBytes / (1024.0 * 1024.0));
+    }
+
+    return 0;
+}
+
+// Compares the SIMD packet sphere tracer against the scalar port for every signed distance primitive.
+int runSdfBenchmark(uint32_t rayCount) {
+    CRayTracingScene scene;
+    scene.initScene();
+
+    float stepScales[SignedDistancePrimitive::Count];
+    for (uint32_t primitive = 0; primitive < SignedDistancePrimitive::Count; ++primitive) {
+        stepScales[primitive] = scene.getAABBMaterialBuffers()[AnalyticPrimitive::Count + VolumetricPrimitive::Count + primitive].stepScale;
+    }
+
+    return SdfPacket::runBenchmark(rayCount, stepScales) ? 0 : 1;
+}
+
+struct HeadlessSettings {
+    uint32_t frameCount;
+    // frames read back and written to outputPath, empty captures the last frame
+    std::vector<uint32_t> captureFrames;
+    bool captureAll;
+    std::string outputPath;
+    // frames traced per intersection shader variant for the specialized vs generic comparison, 0 skips it
+    uint32_t intersectionBenchmarkFrames;
+    // requested before the first frame, the frames keep going while it compiles
+    bool switchQualityTier;
+    QualityTier::Enum qualityTier;
+};
+
+struct ShaderBindingTableRegions {
+    VkStridedDeviceAddressRegionKHR raygen;
+    VkStridedDeviceAddressRegionKHR miss;
+    VkStridedDeviceAddressRegionKHR hit;
+    VkStridedDeviceAddressRegionKHR callable;
+};
+
+// path.png -> path_0042.png, so every captured frame gets its own file
+std::string getFramePath(std::string const& path, uint32_t frame) {
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "_%04u", frame);
+
+    size_t extension = path.find_last_of('.');
+    size_t separator = path.find_last_of("/\\");
+    if (extension == std::string::npos || (separator != std::string::npos && extension < separator)) {
+        return path + suffix;
+    }
+
+    return path.substr(0, extension) + suffix + path.substr(extension);
+}
+
+// Traces frameCount frames into the offscreen image without any window system objects. Every frame
+// is submitted on its own and waited for, so the CPU time covers update, submit and GPU execution and
+// the GPU time (the "trace rays" scope of the profiler) is not overlapped by other frames.
+int runHeadless(VkDevice device,
+                VkQueue queue,
+                VkCommandPool commandPool,
+                CVulkanHelper& vulkanHelper,
+                CRayTracing& rayTracing,
+                VkPipelineLayout pipelineLayout,
+                VkDescriptorSet descriptorSet,
+                VulkanImage const& offscreenImage,
+                ShaderBindingTableRegions const& sbtRegions,
+                CGpuProfiler& profiler,
+                CCpuProfiler& cpuProfiler,
+                HeadlessSettings const& settings) {
+    uint32_t const width = offscreenImage.width;
+    uint32_t const height = offscreenImage.height;
+
+    std::vector<bool> captureFrame(settings.frameCount, settings.captureAll);
+    if (!settings.captureAll) {
+        if (settings.captureFrames.empty() && settings.frameCount > 0) {
+            captureFrame[settings.frameCount - 1] = true;
+        }
+        for (size_t index = 0; index < settings.captureFrames.size(); ++index) {
+            if (settings.captureFrames[index] < settings.frameCount) {
+                captureFrame[settings.captureFrames[index]] = true;
+            }
+            else {
+                printf("capture frame %u is out of range, only %u frames are rendered\n", settings.captureFrames[index], settings.frameCount);
+            }
+        }
+    }
+
+    VulkanBuffer readbackBuffer = vulkanHelper.createBuffer(VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                                            static_cast<VkDeviceSize>(width) * height * 4,
+                                                            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                                            VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+    void const* readbackData = readbackBuffer.allocation.mapped;
+
+    // command buffer 0 only traces, command buffer 1 also copies the image into the readback buffer
+    VkCommandBuffer commandBuffers[2];
+
+    VkCommandBufferAllocateInfo cmdBufferAllocInfo = {};
+    cmdBufferAllocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cmdBufferAllocInfo.commandPool = commandPool;
+    cmdBufferAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cmdBufferAllocInfo.commandBufferCount = 2;
+    VK_CHECK(vkAllocateCommandBuffers(device, &cmdBufferAllocInfo, commandBuffers));
+
+    uint32_t profilerSlots[2] = { profiler.createSlot(), profiler.createSlot() };
+
+    // recorded again when the quality tier changes the pipeline
+    auto recordCommandBuffer = [&](uint32_t commandBufferIndex) {
+        VkCommandBuffer commandBuffer = commandBuffers[commandBufferIndex];
+
+        VkCommandBufferBeginInfo beginInfo = {};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+
+        vkBeginCommandBuffer(commandBuffer, &beginInfo);
+
+        profiler.beginFrame(commandBuffer, profilerSlots[commandBufferIndex]);
+
+        VkImageSubresourceRange subresourceRange = {};
+        subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        subresourceRange.baseMipLevel = 0;
+        subresourceRange.levelCount = 1;
+        subresourceRange.baseArrayLayer = 0;
+        subresourceRange.layerCount = 1;
+
+        VkImageMemoryBarrier imageMemoryBarrier {};
+        imageMemoryBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        imageMemoryBarrier.srcAccessMask = 0;
+        imageMemoryBarrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+        imageMemoryBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        imageMemoryBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        imageMemoryBarrier.image = offscreenImage.handle;
+        imageMemoryBarrier.subresourceRange = subresourceRange;
+
+        // the accumulation image is read and written by consecutive frames
+        VkMemoryBarrier accumulationBarrier = {};
+        accumulationBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        accumulationBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        accumulationBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, 0, 1, &accumulationBarrier, 0, nullptr, 1, &imageMemoryBarrier);
+
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, rayTracing.getPipeline());
+        // every frame is waited for, so one frame slot is enough
+        std::vector<uint32_t> dynamicOffsets = rayTracing.getDynamicOffsets(0);
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, pipelineLayout, 0, 1, &descriptorSet, static_cast<uint32_t>(dynamicOffsets.size()), dynamicOffsets.data());
+
+        uint32_t traceScope = profiler.beginScope(commandBuffer, profilerSlots[commandBufferIndex], "trace rays");
+
+        vkCmdTraceRaysKHR(commandBuffer,
+                          &sbtRegions.raygen,
+                          &sbtRegions.miss,
+                          &sbtRegions.hit,
+                          &sbtRegions.callable,
+                          width, height, 1);
+
+        profiler.endScope(commandBuffer, profilerSlots[commandBufferIndex], traceScope);
+
+        if (commandBufferIndex == 1) {
+            uint32_t copyScope = profiler.beginScope(commandBuffer, profilerSlots[commandBufferIndex], "readback copy");
+
+            imageMemoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+            imageMemoryBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+            imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+            imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &imageMemoryBarrier);
+
+            VkBufferImageCopy copyRegion = {};
+            copyRegion.bufferOffset = 0;
+            copyRegion.bufferRowLength = 0;
+            copyRegion.bufferImageHeight = 0;
+            copyRegion.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+            copyRegion.imageOffset = { 0, 0, 0 };
+            copyRegion.imageExtent = { width, height, 1 };
+            vkCmdCopyImageToBuffer(commandBuffer, offscreenImage.handle, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, readbackBuffer.handle, 1, &copyRegion);
+
+            VkBufferMemoryBarrier bufferMemoryBarrier = {};
+            bufferMemoryBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+            bufferMemoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            bufferMemoryBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+            bufferMemoryBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            bufferMemoryBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            bufferMemoryBarrier.buffer = readbackBuffer.handle;
+            bufferMemoryBarrier.offset = 0;
+            bufferMemoryBarrier.size = VK_WHOLE_SIZE;
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &bufferMemoryBarrier, 0, nullptr);
+
+            profiler.endScope(commandBuffer, profilerSlots[commandBufferIndex], copyScope);
+        }
+
+        vkEndCommandBuffer(commandBuffer);
+    };
+
+    for (uint32_t commandBufferIndex = 0; commandBufferIndex < 2; ++commandBufferIndex) {
+        recordCommandBuffer(commandBufferIndex);
+    }
+
+    VkFenceCreateInfo fenceCreateInfo = {};
+    fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+    VkFence fence;
+    VK_CHECK(vkCreateFence(device, &fenceCreateInfo, nullptr, &fence));
+
+    // tells the trace of the frame just collected from the one before, whose results may be unavailable
+    uint64_t traceSampleCount = 0;
+    auto getTraceSample = [&](double& milliseconds) -> bool {
+        uint64_t sampleCount = 0;
+        if (!profiler.getLastSample("trace rays", sampleCount, milliseconds) || sampleCount == traceSampleCount) {
+            return false;
+        }
+        traceSampleCount = sampleCount;
+        return true;
+    };
+
+    std::vector<double> cpuMilliseconds;
+    std::vector<double> gpuMilliseconds;
+    std::vector<uint8_t> pixels(static_cast<size_t>(width) * height * 4);
+    bool swapRedBlue = offscreenImage.format == VK_FORMAT_B8G8R8A8_UNORM || offscreenImage.format == VK_FORMAT_B8G8R8A8_SRGB;
+    bool success = true;
+
+    printf("headless: %ux%u, %u frames\n", width, height, settings.frameCount);
+
+    std::chrono::high_resolution_clock::time_point runStart = std::chrono::high_resolution_clock::now();
+
+    if (settings.switchQualityTier) {
+        rayTracing.requestQualityTier(settings.qualityTier);
+    }
+
+    uint32_t const frameStage = cpuProfiler.registerStage("frame");
+    uint32_t const recordStage = cpuProfiler.registerStage("record");
+    uint32_t const updateStage = cpuProfiler.registerStage("update");
+    uint32_t const submitStage = cpuProfiler.registerStage("submit and wait");
+    uint32_t const captureStage = cpuProfiler.registerStage("capture");
+
+    for (uint32_t frame = 0; frame < settings.frameCount; ++frame) {
+        CCpuScope frameScope(cpuProfiler, frameStage);
+        std::chrono::high_resolution_clock::time_point frameStart = std::chrono::high_resolution_clock::now();
+
+        // the previous frame was waited for, so both command buffers can be recorded again
+        {
+            CCpuScope scope(cpuProfiler, recordStage);
+            if (rayTracing.updateQualityTier()) {
+                printf("frame %4u: quality tier %s\n", frame, CRayTracing::getQualityTierName(rayTracing.getQualityTier()));
+                for (uint32_t commandBufferIndex = 0; commandBufferIndex < 2; ++commandBufferIndex) {
+                    recordCommandBuffer(commandBufferIndex);
+                }
+            }
+        }
+
+        // a converged image only changes with the quality tier, the frames in between are skipped
+        // unless they are captured
+        bool const converged = rayTracing.isConverged();
+        if (converged && !captureFrame[frame]) {
+            continue;
+        }
+
+        {
+            CCpuScope scope(cpuProfiler, updateStage);
+            rayTracing.update(0);
+        }
+
+        if (!converged && rayTracing.isConverged()) {
+            printf("frame %4u: converged after %u samples\n", frame, rayTracing.getAccumulatedSamples());
+        }
+
+        // the trace waits for the TLAS refit of the dynamic scene on the compute queue
+        VkSemaphore topLevelTimeline = rayTracing.getTopLevelTimeline();
+        uint64_t topLevelTimelineValue = rayTracing.getTopLevelTimelineValue();
+        VkPipelineStageFlags topLevelWaitStage = VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR;
+
+        VkTimelineSemaphoreSubmitInfo timelineInfo = {};
+        timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        timelineInfo.waitSemaphoreValueCount = 1;
+        timelineInfo.pWaitSemaphoreValues = &topLevelTimelineValue;
+
+        VkSubmitInfo submitInfo = {};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        if (topLevelTimeline != VK_NULL_HANDLE) {
+            submitInfo.pNext = &timelineInfo;
+            submitInfo.waitSemaphoreCount = 1;
+            submitInfo.pWaitSemaphores = &topLevelTimeline;
+            submitInfo.pWaitDstStageMask = &topLevelWaitStage;
+        }
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &commandBuffers[captureFrame[frame] ? 1 : 0];
+
+        uint64_t submitStart = cpuProfiler.now();
+        VK_CHECK(vkQueueSubmit(queue, 1, &submitInfo, fence));
+        profiler.submitted(profilerSlots[captureFrame[frame] ? 1 : 0]);
+        VK_CHECK(vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX));
+        vkResetFences(device, 1, &fence);
+        cpuProfiler.record(submitStage, submitStart, cpuProfiler.now());
+        profiler.collect(profilerSlots[captureFrame[frame] ? 1 : 0]);
+
+        std::chrono::high_resolution_clock::time_point frameEnd = std::chrono::high_resolution_clock::now();
+        cpuMilliseconds.push_back(std::chrono::duration<double, std::milli>(frameEnd - frameStart).count());
+
+        double traceMilliseconds = 0.0;
+        if (getTraceSample(traceMilliseconds)) {
+            gpuMilliseconds.push_back(traceMilliseconds);
+            printf("frame %4u: cpu %8.3f ms, gpu %8.3f ms\n", frame, cpuMilliseconds.back(), gpuMilliseconds.back());
+        }
+        else {
+            printf("frame %4u: cpu %8.3f ms, gpu n/a\n", frame, cpuMilliseconds.back());
+        }
+
+        if (captureFrame[frame]) {
+            CCpuScope scope(cpuProfiler, captureStage);
+            memcpy(pixels.data(), readbackData, pixels.size());
+            if (swapRedBlue) {
+                for (size_t index = 0; index < pixels.size(); index += 4) {
+                    std::swap(pixels[index], pixels[index + 2]);
+                }
+            }
+
+            std::string path = getFramePath(settings.outputPath, frame);
+            if (ImageWriter::writeImage(path, width, height, pixels.data())) {
+                printf("frame %4u: written to %s\n", frame, path.c_str());
+            }
+            else {
+                success = false;
+            }
+        }
+    }
+
+    double runSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - runStart).count();
+
+    if (!cpuMilliseconds.empty()) {
+        double cpuSum = 0.0;
+        for (size_t index = 0; index < cpuMilliseconds.size(); ++index) {
+            cpuSum += cpuMilliseconds[index];
+        }
+        printf("cpu: avg %8.3f ms, min %8.3f ms, max %8.3f ms\n",
+               cpuSum / cpuMilliseconds.size(),
+               *std::min_element(cpuMilliseconds.begin(), cpuMilliseconds.end()),
+               *std::max_element(cpuMilliseconds.begin(), cpuMilliseconds.end()));
+    }
+
+    if (!gpuMilliseconds.empty()) {
+        double gpuSum = 0.0;
+        for (size_t index = 0; index < gpuMilliseconds.size(); ++index) {
+            gpuSum += gpuMilliseconds[index];
+        }
+        double gpuAverage = gpuSum / gpuMilliseconds.size();
+        printf("gpu: avg %8.3f ms, min %8.3f ms, max %8.3f ms, %.2f Mrays/s (primary)\n",
+               gpuAverage,
+               *std::min_element(gpuMilliseconds.begin(), gpuMilliseconds.end()),
+               *std::max_element(gpuMilliseconds.begin(), gpuMilliseconds.end()),
+               static_cast<double>(width) * height / (gpuAverage / 1000.0) / 1000000.0);
+    }
+
+    printf("%u frames in %.3f s, %.2f frames/s\n", settings.frameCount, runSeconds, settings.frameCount / runSeconds);
+
+    if (settings.intersectionBenchmarkFrames > 0 && profiler.isEnabled()) {
+        // average GPU time of the trace, the hit records switched before are copied ahead of it on the queue
+        auto measureTrace = [&]() -> double {
+            double milliseconds = 0.0;
+            uint32_t sampleCount = 0;
+            for (uint32_t frame = 0; frame < settings.intersectionBenchmarkFrames; ++frame) {
+                VkSubmitInfo submitInfo = {};
+                submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+                submitInfo.commandBufferCount = 1;
+                submitInfo.pCommandBuffers = &commandBuffers[0];
+
+                VK_CHECK(vkQueueSubmit(queue, 1, &submitInfo, fence));
+                profiler.submitted(profilerSlots[0]);
+                VK_CHECK(vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX));
+                vkResetFences(device, 1, &fence);
+                profiler.collect(profilerSlots[0]);
+
+                double traceMilliseconds = 0.0;
+                if (getTraceSample(traceMilliseconds)) {
+                    milliseconds += traceMilliseconds;
+                    ++sampleCount;
+                }
+            }
+            return sampleCount > 0 ? milliseconds / sampleCount : 0.0;
+        };
+
+        uint32_t const variantCount = rayTracing.getIntersectionVariantCount();
+        for (uint32_t variant = 0; variant < variantCount; ++variant) {
+            rayTracing.setIntersectionVariantSpecialized(variant, false);
+        }
+        double genericMilliseconds = measureTrace();
+        printf("intersection shaders: generic %8.3f ms\n", genericMilliseconds);
+
+        // one variant specialized at a time, the difference is what its switch costs the frame
+        for (uint32_t variant = 0; variant < variantCount; ++variant) {
+            rayTracing.setIntersectionVariantSpecialized(variant, true);
+            double milliseconds = measureTrace();
+            rayTracing.setIntersectionVariantSpecialized(variant, false);
+
+            printf("intersection shaders: %-24s specialized %8.3f ms, %+7.2f%%\n",
+                   rayTracing.getIntersectionVariantName(variant).c_str(), milliseconds, (milliseconds / genericMilliseconds - 1.0) * 100.0);
+        }
+
+        for (uint32_t variant = 0; variant < variantCount; ++variant) {
+            rayTracing.setIntersectionVariantSpecialized(variant, true);
+        }
+        double specializedMilliseconds = measureTrace();
+        printf("intersection shaders: all specialized %8.3f ms, %+7.2f%%\n", specializedMilliseconds, (specializedMilliseconds / genericMilliseconds - 1.0) * 100.0);
+    }
+    else if (settings.intersectionBenchmarkFrames > 0) {
+        printf("intersection shaders: queue has no timestamp support\n");
+    }
+
+    rayTracing.printTopLevelUpdateReport();
+    rayTracing.getUploader().printReport();
+    profiler.printReport();
+    cpuProfiler.printReport();
+
+    vkDestroyFence(device, fence, nullptr);
+    vkFreeCommandBuffers(device, commandPool, 2, commandBuffers);
+    vulkanHelper.destroyBuffer(readbackBuffer);
+
+    return success ? 0 : 1;
+}
+
+// Builds blasCount single AABB BLASes (the scene AABBs repeated) once with one build call per BLAS
+// and once batched into a single call, timing both on the GPU. The AS storage is created before
+// the timed region so only the builds themselves are compared.
+int runBlasBenchmark(VkDevice device,
+                     VkPhysicalDevice gpu,
+                     VkQueue queue,
+                     VkCommandPool commandPool,
+                     CVulkanHelper& vulkanHelper,
+                     float timestampPeriod,
+                     uint32_t timestampValidBits) {
+    if (timestampValidBits == 0) {
+        printf("blas benchmark: queue has no timestamp support\n");
+        return 1;
+    }
+
+    CRayTracingScene scene;
+    scene.initScene();
+    std::vector<VkAabbPositionsKHR> const& sceneAabbs = scene.getAABBs();
+
+    uint32_t const blasCounts[] = { 10, 100, 1000, 10000 };
+    uint32_t const maxBlasCount = blasCounts[sizeof(blasCounts) / sizeof(blasCounts[0]) - 1];
+
+    std::vector<VkAabbPositionsKHR> aabbs(maxBlasCount);
+    for (uint32_t index = 0; index < maxBlasCount; ++index) {
+        aabbs[index] = sceneAabbs[index % sceneAabbs.size()];
+    }
+
+    VkDeviceSize aabbBufferSize = sizeof(VkAabbPositionsKHR) * aabbs.size();
+    VulkanBuffer aabbBuffer = vulkanHelper.createBuffer(VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR, aabbBufferSize, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    vulkanHelper.copyToBuffer(aabbBuffer, aabbs.data(), aabbBufferSize);
+
+    // a scope per build mode, every build is waited for before the next one is recorded
+    CGpuProfiler profiler(device, timestampPeriod, timestampValidBits);
+    uint32_t const profilerSlot = profiler.createSlot();
+
+    VkCommandBufferAllocateInfo commandBufferAllocInfo = {};
+    commandBufferAllocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    commandBufferAllocInfo.commandPool = commandPool;
+    commandBufferAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    commandBufferAllocInfo.commandBufferCount = 1;
+
+    VkFenceCreateInfo fenceCreateInfo = {};
+    fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+    VkFence fence;
+    VK_CHECK(vkCreateFence(device, &fenceCreateInfo, nullptr, &fence));
+
+    char const* modeNames[AccelerationStructureBuildMode::Count] = { "serial", "batched" };
+
+    printf("blas benchmark: single AABB BLASes, gpu build time\n");
+
+    for (size_t countIndex = 0; countIndex < sizeof(blasCounts) / sizeof(blasCounts[0]); ++countIndex) {
+        uint32_t blasCount = blasCounts[countIndex];
+        double milliseconds[AccelerationStructureBuildMode::Count] = {};
+
+        for (uint32_t mode = 0; mode < AccelerationStructureBuildMode::Count; ++mode) {
+            CAccelerationStructureBuilder builder(device, gpu, vulkanHelper);
+
+            VkAccelerationStructureBuildRangeInfoKHR buildRange = {};
+            buildRange.primitiveCount = 1;
+
+            for (uint32_t index = 0; index < blasCount; ++index) {
+                VkAccelerationStructureGeometryKHR geometry = {};
+                geometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+                geometry.geometryType = VK_GEOMETRY_TYPE_AABBS_KHR;
+                geometry.geometry.aabbs.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_AABBS_DATA_KHR;
+                geometry.geometry.aabbs.stride = sizeof(VkAabbPositionsKHR);
+                geometry.geometry.aabbs.data.deviceAddress = aabbBuffer.address + index * sizeof(VkAabbPositionsKHR);
+
+                builder.addBottomLevel(std::vector<VkAccelerationStructureGeometryKHR>(1, geometry),
+                                       std::vector<VkAccelerationStructureBuildRangeInfoKHR>(1, buildRange));
+            }
+
+            VkCommandBuffer commandBuffer;
+            VK_CHECK(vkAllocateCommandBuffers(device, &commandBufferAllocInfo, &commandBuffer));
+
+            VkCommandBufferBeginInfo beginInfo = {};
+            beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+            beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+            VK_CHECK(vkBeginCommandBuffer(commandBuffer, &beginInfo));
+            profiler.beginFrame(commandBuffer, profilerSlot);
+            uint32_t buildScope = profiler.beginScope(commandBuffer, profilerSlot, modeNames[mode]);
+            builder.recordBuild(commandBuffer, static_cast<AccelerationStructureBuildMode::Enum>(mode));
+            profiler.endScope(commandBuffer, profilerSlot, buildScope);
+            VK_CHECK(vkEndCommandBuffer(commandBuffer));
+
+            VkSubmitInfo submitInfo = {};
+            submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+            submitInfo.commandBufferCount = 1;
+            submitInfo.pCommandBuffers = &commandBuffer;
+
+            VK_CHECK(vkQueueSubmit(queue, 1, &submitInfo, fence));
+            profiler.submitted(profilerSlot);
+            VK_CHECK(vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX));
+            vkResetFences(device, 1, &fence);
+            profiler.collect(profilerSlot);
+
+            uint64_t sampleCount = 0;
+            profiler.getLastSample(modeNames[mode], sampleCount, milliseconds[mode]);
+
+            printf("%6u BLASes, %-7s: %9.3f ms, %u build calls, scratch %8.2f MB\n",
+                   blasCount,
+                   modeNames[mode],
+                   milliseconds[mode],
+                   mode == AccelerationStructureBuildMode::Serial ? blasCount : builder.getBatchCount(),
+                   builder.getScratchSize() / (1024.0 * 1024.0));
+
+            vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
+            builder.destroy();
+        }
+
+        printf("%6u BLASes, speedup %.2fx\n", blasCount, milliseconds[AccelerationStructureBuildMode::Batched] > 0.0 ? milliseconds[AccelerationStructureBuildMode::Serial] / milliseconds[AccelerationStructureBuildMode::Batched] : 0.0);
+    }
+
+    vkDestroyFence(device, fence, nullptr);
+    profiler.destroy();
+    vulkanHelper.destroyBuffer(aabbBuffer);
+
+    return 0;
+}
+
+int main(int argc, char** argv) {
+
+    bool cpuReference = false;
+    bool sdfBenchmark = false;
+    bool bvhBenchmark = false;
+    uint32_t sdfBenchmarkRays = 65536;
+    uint32_t cpuThreadCount = 0;
+    float animationTime = 0.0f;
+    std::string outputPath;
+    bool headless = false;
+    bool blasBenchmark = false;
+    bool pipelineBenchmark = false;
+    uint32_t pipelineBenchmarkVariants = 1;
+    uint32_t pipelineCompileThreads = 0;
+    bool pipelineLibraries = false;
+    bool specializedIntersectionShaders = false;
+    QualityTier::Enum qualityTier = QualityTier::Final;
+    // overrides the embedded SPIR-V with the files in it, for iterating on shaders without a rebuild
+    std::string shaderDirectory;
+    uint32_t primitiveCopies = 1;
+    bool compactAccelerationStructures = false;
+    bool dynamicScene = false;
+    // the pipeline cache is reused between runs, --pipeline-cache "" turns it off
+    std::string pipelineCachePath = "raytracing.pipelinecache";
+    // GPU scope statistics are written to it at exit, CSV unless it ends in .json
+    std::string profilePath;
+    // frame loop stage histograms as JSON and the last events as a Chrome trace
+    std::string cpuReportPath;
+    std::string cpuTracePath;
+    // the copy from the offscreen image into the swapchain, also where tracing into it would work
+    bool presentCopy = false;
+    // GPU time budget of the trace in milliseconds, the launch size follows it when set
+    double dynamicResolutionBudget = 0.0;
+    float dynamicResolutionMinScale = 0.5f;
+    float upscaleSharpness = 0.0f;
+    // frames averaged into a still image before tracing stops, 0 traces every frame as it is
+    uint32_t accumulationSamples = 0;
+    // no camera, light or geometry animation, so accumulation converges
+    bool stillScene = false;
+    LatencyMode::Enum latencyMode = LatencyMode::MaxThroughput;
+    // 0 takes the default of the latency mode
+    uint32_t framesInFlight = 0;
+    ProceduralGeometryLayout::Enum proceduralGeometryLayout = ProceduralGeometryLayout::PerPrimitive;
+    HeadlessSettings headlessSettings = {};
+    headlessSettings.frameCount = 100;
+
+    for (int argIndex = 1; argIndex < argc; ++argIndex) {
+        std::string arg = argv[argIndex];
+        if (arg == "--cpu") {
+            cpuReference = true;
+        }
+        else if (arg == "--bvh-benchmark") {
+            bvhBenchmark = true;
+        }
+        else if (arg == "--sdf-benchmark") {
+            sdfBenchmark = true;
+            if (argIndex + 1 < argc && argv[argIndex + 1][0] != '-') {
+                sdfBenchmarkRays = static_cast<uint32_t>(atoi(argv[++argIndex]));
+            }
+        }
+        else if (arg == "--threads" && argIndex + 1 < argc) {
+            cpuThreadCount = static_cast<uint32_t>(atoi(argv[++argIndex]));
+        }
+        else if (arg == "--time" && argIndex + 1 < argc) {
+            animationTime = static_cast<float>(atof(argv[++argIndex]));
+        }
+        else if (arg == "--output" && argIndex + 1 < argc) {
+            outputPath = argv[++argIndex];
+        }
+        else if (arg == "--blas-benchmark") {
+            blasBenchmark = true;
+        }
+        else if (arg == "--copies" && argIndex + 1 < argc) {
+            primitiveCopies = static_cast<uint32_t>(std::max(1, atoi(argv[++argIndex])));
+        }
+        else if (arg == "--blas-layout" && argIndex + 1 < argc) {
+            std::string layout = argv[++argIndex];
+            proceduralGeometryLayout = layout == "type" ? ProceduralGeometryLayout::PerIntersectionType : ProceduralGeometryLayout::PerPrimitive;
+        }
+        else if (arg == "--compact-as") {
+            compactAccelerationStructures = true;
+        }
+        else if (arg == "--dynamic") {
+            dynamicScene = true;
+        }
+        else if (arg == "--pipeline-benchmark") {
+            pipelineBenchmark = true;
+            if (argIndex + 1 < argc && argv[argIndex + 1][0] != '-') {
+                pipelineBenchmarkVariants = static_cast<uint32_t>(std::max(1, atoi(argv[++argIndex])));
+            }
+        }
+        else if (arg == "--compile-threads" && argIndex + 1 < argc) {
+            pipelineCompileThreads = static_cast<uint32_t>(atoi(argv[++argIndex]));
+        }
+        else if (arg == "--shader-dir" && argIndex + 1 < argc) {
+            shaderDirectory = argv[++argIndex];
+        }
+        else if (arg == "--pipeline-libraries") {
+            pipelineLibraries = true;
+        }
+        else if ((arg == "--quality" || arg == "--quality-switch") && argIndex + 1 < argc) {
+            std::string name = argv[++argIndex];
+            QualityTier::Enum tier = QualityTier::Count;
+            for (uint32_t index = 0; index < QualityTier::Count; ++index) {
+                if (name == CRayTracing::getQualityTierName(static_cast<QualityTier::Enum>(index))) {
+                    tier = static_cast<QualityTier::Enum>(index);
+                }
+            }
+            if (tier == QualityTier::Count) {
+                printf("unknown quality tier: %s\n", name.c_str());
+                return 1;
+            }
+
+            if (arg == "--quality") {
+                qualityTier = tier;
+            }
+            else {
+                headlessSettings.switchQualityTier = true;
+                headlessSettings.qualityTier = tier;
+            }
+        }
+        else if (arg == "--specialize-intersection") {
+            specializedIntersectionShaders = true;
+        }
+        else if (arg == "--intersection-benchmark") {
+            // runs headless with the specialized groups built
+            headless = true;
+            specializedIntersectionShaders = true;
+            headlessSettings.intersectionBenchmarkFrames = 100;
+            if (argIndex + 1 < argc && argv[argIndex + 1][0] != '-') {
+                headlessSettings.intersectionBenchmarkFrames = static_cast<uint32_t>(std::max(1, atoi(argv[++argIndex])));
+            }
+        }
+        else if (arg == "--pipeline-cache" && argIndex + 1 < argc) {
+            pipelineCachePath = argv[++argIndex];
+        }
+        else if (arg == "--profile" && argIndex + 1 < argc) {
+            profilePath = argv[++argIndex];
+        }
+        else if (arg == "--cpu-report" && argIndex + 1 < argc) {
+            cpuReportPath = argv[++argIndex];
+        }
+        else if (arg == "--cpu-trace" && argIndex + 1 < argc) {
+            cpuTracePath = argv[++argIndex];
+        }
+        else if (arg == "--present" && argIndex + 1 < argc) {
+            presentCopy = std::string(argv[++argIndex]) == "copy";
+        }
+        else if (arg == "--dynamic-resolution" && argIndex + 1 < argc) {
+            dynamicResolutionBudget = std::max(0.0, atof(argv[++argIndex]));
+        }
+        else if (arg == "--min-scale" && argIndex + 1 < argc) {
+            dynamicResolutionMinScale = std::min(1.0f, std::max(0.0f, static_cast<float>(atof(argv[++argIndex]))));
+        }
+        else if (arg == "--sharpen" && argIndex + 1 < argc) {
+            upscaleSharpness = std::max(0.0f, static_cast<float>(atof(argv[++argIndex])));
+        }
+        else if (arg == "--accumulate" && argIndex + 1 < argc) {
+            accumulationSamples = static_cast<uint32_t>(std::max(0, atoi(argv[++argIndex])));
+        }
+        else if (arg == "--still") {
+            stillScene = true;
+        }
+        else if (arg == "--latency" && argIndex + 1 < argc) {
+            latencyMode = std::string(argv[++argIndex]) == "min" ? LatencyMode::MinLatency : LatencyMode::MaxThroughput;
+        }
+        else if (arg == "--frames-in-flight" && argIndex + 1 < argc) {
+            framesInFlight = static_cast<uint32_t>(std::max(1, atoi(argv[++argIndex])));
+        }
+        else if (arg == "--headless") {
+            headless = true;
+        }
+        else if (arg == "--frames" && argIndex + 1 < argc) {
+            headlessSettings.frameCount = std::max(1, atoi(argv[++argIndex]));
+        }
+        else if (arg == "--capture" && argIndex + 1 < argc) {
+            // comma separated frame indices, "all" or "last"
+            std::string frames = argv[++argIndex];
+            headlessSettings.captureAll = frames == "all";
+            if (!headlessSettings.captureAll && frames != "last") {
+                std::stringstream stream(frames);
+                std::string frame;
+                while (std::getline(stream, frame, ',')) {
+                    headlessSettings.captureFrames.push_back(static_cast<uint32_t>(atoi(frame.c_str())));
+                }
+            }
+        }
+        else {
+            printf("unknown argument: %s\n", arg.c_str());
+            printf("usage: %s [--cpu] [--threads count] [--time seconds] [--output file.ppm|png] [--bvh-benchmark] [--sdf-benchmark [rays]] [--blas-benchmark] [--copies count] [--blas-layout primitive|type] [--compact-as] [--dynamic] [--pipeline-cache file] [--profile file.csv|json] [--cpu-report file.json] [--cpu-trace file.json] [--present direct|copy] [--dynamic-resolution milliseconds] [--min-scale scale] [--sharpen amount] [--accumulate samples] [--still] [--latency min|throughput] [--frames-in-flight count] [--compile-threads count] [--pipeline-libraries] [--specialize-intersection] [--intersection-benchmark [frames]] [--quality preview|balanced|final] [--quality-switch preview|balanced|final] [--shader-dir directory] [--pipeline-benchmark [variants]] [--headless] [--frames count] [--capture all|last|frame,...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (bvhBenchmark) {
+        return runBvhBenchmark(cpuThreadCount);
+    }
+
+    if (sdfBenchmark) {
+        return runSdfBenchmark(sdfBenchmarkRays);
+    }
+
+    if (cpuReference) {
+        return runCpuReference(cpuThreadCount, animationTime, outputPath.empty() ? "cpu_reference.ppm" : outputPath);
+    }
+
+    headlessSettings.outputPath = outputPath.empty() ? "headless.png" : outputPath;
+
+    // modes without a window skip the surface and swapchain extensions
+    bool windowless = headless || blasBenchmark || pipelineBenchmark;
 
     CVulkanHelper::initVulkan();
 
@@ -105,7 +979,9 @@ int main() {
     vkEnumerateInstanceExtensionProperties(nullptr, &instanceExtensionCount, instanceExtensions.data());
 
     std::vector<const char*> enabledExtensions;
-    enabledExtensions.push_back(VK_KHR_SURFACE_EXTENSION_NAME);
+    if (!windowless) {
+        enabledExtensions.push_back(VK_KHR_SURFACE_EXTENSION_NAME);
+    }
 
     for (size_t layer_index = 0; layer_index < instanceLayerCount; ++layer_index) {
 
@@ -115,11 +991,13 @@ int main() {
                                                       (instanceLayers[layer_index].specVersion >> 0) & 0xfff);
     }
 
+    if (!windowless) {
 #ifdef WIN32
-    enabledExtensions.push_back(VK_KHR_WIN32_SURFACE_EXTENSION_NAME);
+        enabledExtensions.push_back(VK_KHR_WIN32_SURFACE_EXTENSION_NAME);
 #elif defined(__linux__)
-    enabledExtensions.push_back(VK_KHR_XCB_SURFACE_EXTENSION_NAME);
+        enabledExtensions.push_back(VK_KHR_XCB_SURFACE_EXTENSION_NAME);
 #endif
+    }
 
 #ifdef _DEBUG
    enabledExtensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
@@ -189,15 +1067,65 @@ int main() {
 
     const float queuePriority = 1.0f;
 
+    // the first family with graphics and compute traces and presents
+    uint32_t graphicsQueueFamily = 0;
+    for (uint32_t familyIndex = 0; familyIndex < queuePropertyCount; ++familyIndex) {
+        VkQueueFlags flags = queueProperties[familyIndex].queueFlags;
+        if ((flags & VK_QUEUE_GRAPHICS_BIT) && (flags & VK_QUEUE_COMPUTE_BIT)) {
+            graphicsQueueFamily = familyIndex;
+            break;
+        }
+    }
+
+    // a compute family without graphics runs the TLAS refits of the dynamic scene next to the
+    // trace, they are timed, so it needs timestamps
+    uint32_t computeQueueFamily = graphicsQueueFamily;
+    for (uint32_t familyIndex = 0; familyIndex < queuePropertyCount; ++familyIndex) {
+        VkQueueFlags flags = queueProperties[familyIndex].queueFlags;
+        if ((flags & VK_QUEUE_COMPUTE_BIT) && !(flags & VK_QUEUE_GRAPHICS_BIT) && queueProperties[familyIndex].timestampValidBits > 0) {
+            computeQueueFamily = familyIndex;
+            break;
+        }
+    }
+
+    // a transfer only family is usually backed by the copy engines of a discrete GPU, the
+    // uploads then run next to the render queue
+    uint32_t transferQueueFamily = graphicsQueueFamily;
+    for (uint32_t familyIndex = 0; familyIndex < queuePropertyCount; ++familyIndex) {
+        VkQueueFlags flags = queueProperties[familyIndex].queueFlags;
+        if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+            transferQueueFamily = familyIndex;
+            break;
+        }
+    }
+
+    printf("queue families: graphics %u, compute %u, transfer %u\n", graphicsQueueFamily, computeQueueFamily, transferQueueFamily);
+
+    std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
+
     VkDeviceQueueCreateInfo queueCreateInfo = {};
     queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-    queueCreateInfo.queueFamilyIndex = 0;
+    queueCreateInfo.queueFamilyIndex = graphicsQueueFamily;
     queueCreateInfo.queueCount = 1;
     queueCreateInfo.pQueuePriorities = &queuePriority;
 
+    queueCreateInfos.push_back(queueCreateInfo);
+
+    if (computeQueueFamily != graphicsQueueFamily) {
+        queueCreateInfo.queueFamilyIndex = computeQueueFamily;
+        queueCreateInfos.push_back(queueCreateInfo);
+    }
+
+    if (transferQueueFamily != graphicsQueueFamily) {
+        queueCreateInfo.queueFamilyIndex = transferQueueFamily;
+        queueCreateInfos.push_back(queueCreateInfo);
+    }
+
     std::vector<const char*> activatedDeviceExtensions;
     activatedDeviceExtensions.push_back(VK_KHR_GET_MEMORY_REQUIREMENTS_2_EXTENSION_NAME);
-    activatedDeviceExtensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+    if (!windowless) {
+        activatedDeviceExtensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+    }
     //activatedDeviceExtensions.push_back(VK_NV_RAY_TRACING_EXTENSION_NAME);
     activatedDeviceExtensions.push_back(VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME);
     activatedDeviceExtensions.push_back(VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME);
@@ -229,8 +1157,8 @@ int main() {
     VkDeviceCreateInfo deviceCreateInfo = {};
     deviceCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
     deviceCreateInfo.pNext = &features2;
-    deviceCreateInfo.pQueueCreateInfos = &queueCreateInfo;
-    deviceCreateInfo.queueCreateInfoCount = 1;
+    deviceCreateInfo.pQueueCreateInfos = queueCreateInfos.data();
+    deviceCreateInfo.queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size());
     deviceCreateInfo.enabledExtensionCount = static_cast<uint32_t>(activatedDeviceExtensions.size());
     deviceCreateInfo.ppEnabledExtensionNames = activatedDeviceExtensions.data();
 
@@ -242,11 +1170,19 @@ int main() {
     CVulkanHelper::initVulkanDeviceFunctions(device);
 
     VkQueue queue;
-    vkGetDeviceQueue(device, 0, 0, &queue);
+    vkGetDeviceQueue(device, graphicsQueueFamily, 0, &queue);
+
+    VkQueue computeQueue;
+    vkGetDeviceQueue(device, computeQueueFamily, 0, &computeQueue);
+
+    VkQueue transferQueue;
+    vkGetDeviceQueue(device, transferQueueFamily, 0, &transferQueue);
 
     VkCommandPoolCreateInfo cmdPoolInfo = {};
     cmdPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-    cmdPoolInfo.queueFamilyIndex = 0;
+    cmdPoolInfo.queueFamilyIndex = graphicsQueueFamily;
+    // the frame command buffers are recorded again after a quality tier switch
+    cmdPoolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
 
     VkCommandPool commandPool;
     vkCreateCommandPool(device, &cmdPoolInfo, nullptr, &commandPool);
@@ -263,23 +1199,30 @@ int main() {
     poolSizes.push_back(poolSize0);
 
     VkDescriptorPoolSize poolSize1 = {};
-    poolSize1.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    poolSize1.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
     poolSize1.descriptorCount = 2;
 
     poolSizes.push_back(poolSize1);
 
     VkDescriptorPoolSize poolSize2 = {};
     poolSize2.type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
-    poolSize2.descriptorCount = 2;
+    // the output and the accumulation image
+    poolSize2.descriptorCount = 4;
 
     poolSizes.push_back(poolSize2);
 
     VkDescriptorPoolSize poolSize3 = {};
     poolSize3.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    poolSize3.descriptorCount = 2;
+    poolSize3.descriptorCount = 4;
 
     poolSizes.push_back(poolSize3);
 
+    VkDescriptorPoolSize poolSize4 = {};
+    poolSize4.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+    poolSize4.descriptorCount = 2;
+
+    poolSizes.push_back(poolSize4);
+
     VkDescriptorPoolCreateInfo descriptorPoolInfo = {};
     descriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
     descriptorPoolInfo.maxSets = 3;
@@ -303,9 +1246,36 @@ int main() {
     vkGetPhysicalDeviceProperties2(gpu, &props);
 
     CRayTracing rayTracing(instance, device, gpu, queue, commandPool, raytracingPipelineProperties);
+    rayTracing.setQueueFamilies(graphicsQueueFamily, transferQueue, transferQueueFamily);
+    rayTracing.setComputeQueue(computeQueue, computeQueueFamily);
     rayTracing.init();
+    rayTracing.setProceduralGeometryLayout(proceduralGeometryLayout);
+    rayTracing.setAccelerationStructureCompaction(compactAccelerationStructures);
+    rayTracing.setDynamicScene(dynamicScene);
+    rayTracing.setPipelineCachePath(pipelineCachePath);
+    rayTracing.setPipelineCompileThreads(pipelineCompileThreads);
+    rayTracing.setPipelineLibraries(pipelineLibraries);
+    rayTracing.setSpecializedIntersectionShaders(specializedIntersectionShaders);
+    rayTracing.setQualityTier(qualityTier);
+    rayTracing.setShaderDirectory(shaderDirectory);
+    rayTracing.getScene().setPrimitiveCopies(primitiveCopies);
+    rayTracing.setAccumulation(accumulationSamples);
+    if (stillScene) {
+        rayTracing.getScene().setAnimateCamera(false);
+        rayTracing.getScene().setAnimateLight(false);
+        rayTracing.getScene().setAnimateGeometry(false);
+    }
     rayTracing.initScene();
 
+    if (blasBenchmark) {
+        return runBlasBenchmark(device, gpu, queue, commandPool, rayTracing.getHelper(), props.properties.limits.timestampPeriod, queueProperties[graphicsQueueFamily].timestampValidBits);
+    }
+
+    // timestamps of the graphics queue, which builds the acceleration structures and traces
+    CGpuProfiler profiler(device, props.properties.limits.timestampPeriod, queueProperties[graphicsQueueFamily].timestampValidBits);
+    rayTracing.setProfiler(&profiler);
+    CCpuProfiler cpuProfiler;
+
     rayTracing.buildProceduralGeometryAABBs();
     rayTracing.buildTriangleAccelerationStructure();
 
@@ -331,7 +1301,7 @@ int main() {
 
     VkDescriptorSetLayoutBinding layoutbindingSceneBuffer = {};
     layoutbindingSceneBuffer.binding = 2;
-    layoutbindingSceneBuffer.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    layoutbindingSceneBuffer.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
     layoutbindingSceneBuffer.descriptorCount = 1;
     layoutbindingSceneBuffer.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR | VK_SHADER_STAGE_INTERSECTION_BIT_KHR;
 
@@ -355,12 +1325,28 @@ int main() {
 
     VkDescriptorSetLayoutBinding layoutbindingAABBPrimitiveBuffer = {};
     layoutbindingAABBPrimitiveBuffer.binding = 5;
-    layoutbindingAABBPrimitiveBuffer.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    layoutbindingAABBPrimitiveBuffer.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
     layoutbindingAABBPrimitiveBuffer.descriptorCount = 1;
     layoutbindingAABBPrimitiveBuffer.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR | VK_SHADER_STAGE_INTERSECTION_BIT_KHR;
 
     layoutbindings.push_back(layoutbindingAABBPrimitiveBuffer);
 
+    VkDescriptorSetLayoutBinding layoutbindingAABBPrimitiveDataBuffer = {};
+    layoutbindingAABBPrimitiveDataBuffer.binding = 6;
+    layoutbindingAABBPrimitiveDataBuffer.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    layoutbindingAABBPrimitiveDataBuffer.descriptorCount = 1;
+    layoutbindingAABBPrimitiveDataBuffer.stageFlags = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR | VK_SHADER_STAGE_INTERSECTION_BIT_KHR;
+
+    layoutbindings.push_back(layoutbindingAABBPrimitiveDataBuffer);
+
+    VkDescriptorSetLayoutBinding layoutbindingAccumulationImage = {};
+    layoutbindingAccumulationImage.binding = 7;
+    layoutbindingAccumulationImage.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    layoutbindingAccumulationImage.descriptorCount = 1;
+    layoutbindingAccumulationImage.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR;
+
+    layoutbindings.push_back(layoutbindingAccumulationImage);
+
     VkDescriptorSetLayoutCreateInfo layoutInfo = {};
     layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
     layoutInfo.bindingCount = static_cast<uint32_t>(layoutbindings.size());
@@ -373,7 +1359,10 @@ int main() {
 
     descriptorSetLayouts.push_back(descriptorSetLayout);
 
-    rayTracing.createShaderStages();
+    if (!rayTracing.createShaderStages()) {
+        printf("could not load the shaders\n");
+        return 1;
+    }
 
     //std::vector<VkRayTracingShaderGroupCreateInfoNV> const& shaderGroups = rayTracing.createShaderGroups();
 
@@ -397,7 +1386,64 @@ int main() {
         printf("vkCreatePipelineLayout failed\n");
     }
 
-    VkPipeline raytracingPipeline = rayTracing.createPipeline(pipelineLayout);
+    rayTracing.createPipeline(pipelineLayout);
+
+    if (pipelineBenchmark) {
+        rayTracing.benchmarkPipelineCompilation(pipelineLayout, pipelineBenchmarkVariants);
+        return 0;
+    }
+
+    rayTracing.createSceneBuffer();
+    rayTracing.updateSceneBuffer(0);
+    rayTracing.createAABBPrimitiveBuffer();
+    rayTracing.updateAABBPrimitiveBuffer(0);
+
+    CShaderBindingTable const& shaderBindingTable = rayTracing.getShaderBindingTable();
+    VkStridedDeviceAddressRegionKHR raygenStridedBufferRegion = shaderBindingTable.getRegion(ShaderBindingTableRegion::RayGen);
+    VkStridedDeviceAddressRegionKHR missStridedBufferRegion = shaderBindingTable.getRegion(ShaderBindingTableRegion::Miss);
+    VkStridedDeviceAddressRegionKHR hitStridedBufferRegion = shaderBindingTable.getRegion(ShaderBindingTableRegion::Hit);
+    VkStridedDeviceAddressRegionKHR callableStridedBufferRegion = shaderBindingTable.getRegion(ShaderBindingTableRegion::Callable);
+
+    rayTracing.getAllocator().printReport();
+
+    if (headless) {
+        VulkanImage headlessImage = rayTracing.createOffscreenImage(VK_FORMAT_R8G8B8A8_UNORM, WIDTH, HEIGHT);
+        rayTracing.createAccumulationImage(WIDTH, HEIGHT);
+        rayTracing.updateDescriptors(descriptorSet);
+
+        ShaderBindingTableRegions sbtRegions = {
+            raygenStridedBufferRegion,
+            missStridedBufferRegion,
+            hitStridedBufferRegion,
+            callableStridedBufferRegion
+        };
+
+        int result = runHeadless(device,
+                                 queue,
+                                 commandPool,
+                                 rayTracing.getHelper(),
+                                 rayTracing,
+                                 pipelineLayout,
+                                 descriptorSet,
+                                 headlessImage,
+                                 sbtRegions,
+                                 profiler,
+                                 cpuProfiler,
+                                 headlessSettings);
+
+        if (!profilePath.empty()) {
+            profiler.writeReport(profilePath);
+        }
+        if (!cpuReportPath.empty()) {
+            cpuProfiler.writeReport(cpuReportPath);
+        }
+        if (!cpuTracePath.empty() && cpuProfiler.writeChromeTrace(cpuTracePath)) {
+            printf("cpu profiler: trace written to %s\n", cpuTracePath.c_str());
+        }
+        profiler.destroy();
+
+        return result;
+    }
 
     const char* applicationName = "Vulkan Raytracing Example";
 
@@ -457,7 +1503,7 @@ int main() {
     xcb_window_t window = xcb_generate_id(connection);
 
     uint32_t eventMask = XCB_CW_BACK_PIXEL | XCB_CW_EVENT_MASK;
-    uint32_t valueList[] = { screen->black_pixel, 0 };
+    uint32_t valueList[] = { screen->black_pixel, XCB_EVENT_MASK_KEY_PRESS };
 
     xcb_create_window(connection, XCB_COPY_FROM_PARENT, window, screen->root, 0, 0, WIDTH, HEIGHT, 0, XCB_WINDOW_CLASS_INPUT_OUTPUT, screen->root_visual, eventMask, valueList);
 
@@ -470,7 +1516,7 @@ int main() {
 #endif
 
     VkBool32 queueSupported;
-    vkGetPhysicalDeviceSurfaceSupportKHR(gpu, 0, surface, &queueSupported);
+    vkGetPhysicalDeviceSurfaceSupportKHR(gpu, graphicsQueueFamily, surface, &queueSupported);
 
     uint32_t formatCount;
     vkGetPhysicalDeviceSurfaceFormatsKHR(gpu, surface, &formatCount, nullptr);
@@ -478,10 +1524,10 @@ int main() {
     vkGetPhysicalDeviceSurfaceFormatsKHR(gpu, surface, &formatCount, surfaceFormats.data());
 
     VkBool32 presentSupport = VK_FALSE;
-    vkGetPhysicalDeviceSurfaceSupportKHR(gpu, 0, surface, &presentSupport);
+    vkGetPhysicalDeviceSurfaceSupportKHR(gpu, graphicsQueueFamily, surface, &presentSupport);
 
     VkQueue presentQueue = VK_NULL_HANDLE;
-    vkGetDeviceQueue(device, 0, 0, &presentQueue);
+    vkGetDeviceQueue(device, graphicsQueueFamily, 0, &presentQueue);
 
     VkSurfaceCapabilitiesKHR capabilities;
     vkGetPhysicalDeviceSurfaceCapabilitiesKHR(gpu, surface, &capabilities);
@@ -530,10 +1576,30 @@ int main() {
         swapExtent.height = std::max(capabilities.minImageExtent.height, std::min(capabilities.maxImageExtent.height, swapExtent.height));
     }
 
-    uint32_t imageCount = capabilities.minImageCount + 1;
-    if (capabilities.maxImageCount > 0 && imageCount > capabilities.maxImageCount) {
-        imageCount = capabilities.maxImageCount;
+    // the rays are traced straight into the swapchain images when they can be storage images, which
+    // saves the copy from the offscreen image and two of the four barriers of a frame
+    VkFormatProperties swapFormatProperties;
+    vkGetPhysicalDeviceFormatProperties(gpu, surfaceFormat.format, &swapFormatProperties);
+    // the accumulated image needs every frame at the same size
+    if (dynamicResolutionBudget > 0.0 && accumulationSamples > 0) {
+        printf("dynamic resolution: turned off while accumulating\n");
+        dynamicResolutionBudget = 0.0;
+    }
+
+    bool const storageSwapImages = (capabilities.supportedUsageFlags & VK_IMAGE_USAGE_STORAGE_BIT)
+                                && (swapFormatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT);
+    // dynamic resolution traces a part of the offscreen image and scales it up into the swapchain
+    // image with a compute pass, which writes it as a storage image as well
+    bool const directPresent = !presentCopy && dynamicResolutionBudget <= 0.0 && storageSwapImages;
+    bool const upscaleRequested = dynamicResolutionBudget > 0.0 && storageSwapImages;
+    if (dynamicResolutionBudget > 0.0 && !storageSwapImages) {
+        printf("dynamic resolution: the swapchain images can not be storage images, it is turned off\n");
+    }
+
+    if (framesInFlight == 0) {
+        framesInFlight = CFrameScheduler::getDefaultFramesInFlight(latencyMode);
     }
+    uint32_t imageCount = CFrameScheduler::getSwapchainImageCount(latencyMode, framesInFlight, capabilities);
 
     VkSwapchainCreateInfoKHR swapChainInfo = {};
     swapChainInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
@@ -543,7 +1609,11 @@ int main() {
     swapChainInfo.imageColorSpace = surfaceFormat.colorSpace;
     swapChainInfo.imageExtent = swapExtent;
     swapChainInfo.imageArrayLayers = 1;
-    swapChainInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    // the copy stays possible when the upscale pipeline can not be created
+    swapChainInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | (directPresent ? VK_IMAGE_USAGE_STORAGE_BIT : VK_IMAGE_USAGE_TRANSFER_DST_BIT);
+    if (upscaleRequested) {
+        swapChainInfo.imageUsage |= VK_IMAGE_USAGE_STORAGE_BIT;
+    }
     swapChainInfo.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
     swapChainInfo.queueFamilyIndexCount = 0;
     swapChainInfo.pQueueFamilyIndices = nullptr;
@@ -582,14 +1652,121 @@ int main() {
         vkCreateImageView(device, &imageViewInfo, nullptr, &swapImageViews[swapImageIndex]);
     }
 
-    rayTracing.createSceneBuffer();
-    rayTracing.updateSceneBuffer();
-    rayTracing.createAABBPrimitiveBuffer();
-    rayTracing.updateAABBPrimitiveBuffer();
+    // the frame slots of the scene buffers are the slots of the scheduler
+    CFrameScheduler scheduler(device, queue, swapchain, swapImageCount, framesInFlight);
+    rayTracing.setFramesInFlight(framesInFlight);
+    printf("frames: %s, %u in flight, %u swapchain images\n", CFrameScheduler::getLatencyModeName(latencyMode), framesInFlight, swapImageCount);
 
-    VulkanImage offscreenImage = rayTracing.createOffscreenImage(surfaceFormat.format, swapExtent.width, swapExtent.height);
+    rayTracing.createAccumulationImage(swapExtent.width, swapExtent.height);
 
-    rayTracing.updateDescriptors(descriptorSet);
+    VulkanImage offscreenImage = {};
+    if (!directPresent) {
+        offscreenImage = rayTracing.createOffscreenImage(surfaceFormat.format, swapExtent.width, swapExtent.height);
+    }
+
+    // one set per command buffer, at frameSlot * swapImageCount + imageIndex. The output image
+    // binding differs per swapchain image when tracing into them, the TLAS of the dynamic scene
+    // per frame slot, the entries share a set where neither does.
+    uint32_t const setImageCount = directPresent ? swapImageCount : 1;
+    uint32_t const setSlotCount = rayTracing.getDynamicScene() ? framesInFlight : 1;
+    std::vector<VkDescriptorSet> frameDescriptorSets(framesInFlight * swapImageCount, descriptorSet);
+    VkDescriptorPool imageDescriptorPool = VK_NULL_HANDLE;
+
+    if (setImageCount * setSlotCount > 1) {
+        uint32_t const setCount = setImageCount * setSlotCount;
+
+        std::vector<VkDescriptorPoolSize> imagePoolSizes;
+        for (size_t index = 0; index < layoutbindings.size(); ++index) {
+            VkDescriptorPoolSize imagePoolSize = {};
+            imagePoolSize.type = layoutbindings[index].descriptorType;
+            imagePoolSize.descriptorCount = layoutbindings[index].descriptorCount * setCount;
+            imagePoolSizes.push_back(imagePoolSize);
+        }
+
+        VkDescriptorPoolCreateInfo imageDescriptorPoolInfo = {};
+        imageDescriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+        imageDescriptorPoolInfo.maxSets = setCount;
+        imageDescriptorPoolInfo.poolSizeCount = static_cast<uint32_t>(imagePoolSizes.size());
+        imageDescriptorPoolInfo.pPoolSizes = imagePoolSizes.data();
+        vkCreateDescriptorPool(device, &imageDescriptorPoolInfo, nullptr, &imageDescriptorPool);
+
+        std::vector<VkDescriptorSetLayout> imageSetLayouts(setCount, descriptorSetLayout);
+        std::vector<VkDescriptorSet> sets(setCount);
+
+        VkDescriptorSetAllocateInfo imageSetAllocInfo = {};
+        imageSetAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        imageSetAllocInfo.descriptorPool = imageDescriptorPool;
+        imageSetAllocInfo.descriptorSetCount = setCount;
+        imageSetAllocInfo.pSetLayouts = imageSetLayouts.data();
+        vkAllocateDescriptorSets(device, &imageSetAllocInfo, sets.data());
+
+        for (uint32_t setSlot = 0; setSlot < setSlotCount; ++setSlot) {
+            for (uint32_t setImage = 0; setImage < setImageCount; ++setImage) {
+                VkDescriptorSet set = sets[setSlot * setImageCount + setImage];
+                if (directPresent) {
+                    rayTracing.updateDescriptors(set, swapImageViews[setImage], setSlot);
+                }
+                else {
+                    rayTracing.updateDescriptors(set, setSlot);
+                }
+            }
+        }
+
+        for (uint32_t frameSlot = 0; frameSlot < framesInFlight; ++frameSlot) {
+            for (uint32_t imageIndex = 0; imageIndex < swapImageCount; ++imageIndex) {
+                frameDescriptorSets[frameSlot * swapImageCount + imageIndex] = sets[(frameSlot % setSlotCount) * setImageCount + imageIndex % setImageCount];
+            }
+        }
+    }
+    else {
+        rayTracing.updateDescriptors(descriptorSet);
+    }
+
+    CUpscaler upscaler(device);
+    bool const upscalePresent = upscaleRequested && upscaler.init(swapImageCount);
+    printf("present: %s\n", directPresent ? "trace into the swapchain images" : upscalePresent ? "upscale from the offscreen image" : "copy from the offscreen image");
+
+    // the launch size of each swapchain image's trace as VkTraceRaysIndirectCommandKHR, read by the
+    // indirect trace and the upscale pass, so a new size is a host write instead of a new command buffer
+    bool const indirectTrace = upscalePresent && raytracingPipelineFeatures.rayTracingPipelineTraceRaysIndirect;
+    VkDeviceSize const traceSizeStride = CVulkanHelper::alignTo(sizeof(VkTraceRaysIndirectCommandKHR), static_cast<uint32_t>(props.properties.limits.minStorageBufferOffsetAlignment));
+    VulkanBuffer traceSizeBuffer = {};
+    VkImageView upscaleSourceView = VK_NULL_HANDLE;
+    CDynamicResolution dynamicResolution(dynamicResolutionBudget, dynamicResolutionMinScale);
+    // scale each swapchain image is traced at, and the one each command buffer was recorded with
+    std::vector<float> traceScales(swapImageCount, 1.0f);
+    std::vector<float> recordedScales(framesInFlight * swapImageCount, 1.0f);
+    // scale of the frame last submitted from each frame slot
+    std::vector<float> submittedScales(framesInFlight, 1.0f);
+    uint64_t traceSampleCount = 0;
+
+    auto writeTraceSize = [&](uint32_t imageIndex) {
+        VkTraceRaysIndirectCommandKHR* traceSize = reinterpret_cast<VkTraceRaysIndirectCommandKHR*>(static_cast<uint8_t*>(traceSizeBuffer.allocation.mapped) + traceSizeStride * imageIndex);
+        traceSize->width = dynamicResolution.getSize(swapExtent.width);
+        traceSize->height = dynamicResolution.getSize(swapExtent.height);
+        traceSize->depth = 1;
+    };
+
+    if (upscalePresent) {
+        traceSizeBuffer = rayTracing.getHelper().createBuffer(VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+                                                              traceSizeStride * swapImageCount,
+                                                              VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+
+        VkImageViewCreateInfo sourceViewInfo = {};
+        sourceViewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        sourceViewInfo.image = offscreenImage.handle;
+        sourceViewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        sourceViewInfo.format = offscreenImage.format;
+        sourceViewInfo.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+        vkCreateImageView(device, &sourceViewInfo, nullptr, &upscaleSourceView);
+
+        for (uint32_t swapImageIndex = 0; swapImageIndex < swapImageCount; ++swapImageIndex) {
+            writeTraceSize(swapImageIndex);
+            upscaler.setOutput(swapImageIndex, upscaleSourceView, swapImageViews[swapImageIndex], traceSizeBuffer.handle, traceSizeStride * swapImageIndex);
+        }
+
+        printf("dynamic resolution: %.2f ms budget, %s trace\n", dynamicResolutionBudget, indirectTrace ? "indirect" : "re-recorded");
+    }
 
     VkAttachmentDescription colorAttachment = {};
     colorAttachment.format = surfaceFormat.format;
@@ -639,7 +1816,9 @@ int main() {
         vkCreateFramebuffer(device, &frameBufferInfo, nullptr, &swapFramebuffers[frameBufferIndex]);
     }
 
-    std::vector<VkCommandBuffer> commandBuffers(swapFramebuffers.size());
+    // one command buffer per frame slot and swapchain image, at frameSlot * swapImageCount + imageIndex.
+    // The slot picks the dynamic offsets and is guarded by the slot's fence, the image the output.
+    std::vector<VkCommandBuffer> commandBuffers(framesInFlight * swapImageCount);
 
     VkCommandBufferAllocateInfo cmdBufferAllocInfo = {};
     cmdBufferAllocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
@@ -648,35 +1827,26 @@ int main() {
     cmdBufferAllocInfo.commandBufferCount = static_cast<uint32_t>(commandBuffers.size());
     vkAllocateCommandBuffers(device, &cmdBufferAllocInfo, commandBuffers.data());
 
-    VulkanBuffer raygenShaderGroup = rayTracing.getRayGenShaderGroups();
-    VkStridedDeviceAddressRegionKHR raygenStridedBufferRegion = {};
-    raygenStridedBufferRegion.deviceAddress = raygenShaderGroup.address;
-    raygenStridedBufferRegion.stride = raytracingPipelineProperties.shaderGroupHandleSize;
-    raygenStridedBufferRegion.size = raytracingPipelineProperties.shaderGroupHandleSize;
-    
-    uint32_t raygenAlignment = CVulkanHelper::alignTo(raytracingPipelineProperties.shaderGroupHandleSize, raytracingPipelineProperties.shaderGroupBaseAlignment);
-
-    VkStridedDeviceAddressRegionKHR missStridedBufferRegion = {};
-    missStridedBufferRegion.deviceAddress = raygenShaderGroup.address + raygenAlignment;
-    missStridedBufferRegion.stride = raytracingPipelineProperties.shaderGroupHandleSize;
-    missStridedBufferRegion.size = raytracingPipelineProperties.shaderGroupHandleSize * 2;
+    // pipeline each command buffer was recorded with, it is recorded again once its slot is idle
+    std::vector<VkPipeline> recordedPipelines(commandBuffers.size(), VK_NULL_HANDLE);
+    // the command buffer last submitted from each frame slot, its profiler slot is collected after the fence
+    std::vector<uint32_t> submittedCommandBuffers(framesInFlight, UINT32_MAX);
 
-    uint32_t missAlignment = CVulkanHelper::alignTo(raytracingPipelineProperties.shaderGroupHandleSize * 2, raytracingPipelineProperties.shaderGroupBaseAlignment);
-
-    VkStridedDeviceAddressRegionKHR hitStridedBufferRegion = {};
-    hitStridedBufferRegion.deviceAddress = raygenShaderGroup.address + raygenAlignment + missAlignment;
-    hitStridedBufferRegion.stride = (raytracingPipelineProperties.shaderGroupHandleSize + sizeof(PrimitiveConstantBuffer) + sizeof(PrimitiveInstanceConstantBuffer));
-    hitStridedBufferRegion.size = (raytracingPipelineProperties.shaderGroupHandleSize + sizeof(PrimitiveConstantBuffer) + sizeof(PrimitiveInstanceConstantBuffer)) * 10;
-
-    VkStridedDeviceAddressRegionKHR callableStridedBufferRegion = {};
+    std::vector<uint32_t> profilerSlots(commandBuffers.size());
+    for (size_t index = 0; index < profilerSlots.size(); ++index) {
+        profilerSlots[index] = profiler.createSlot();
+    }
 
-    for (size_t commandBufferIndex = 0; commandBufferIndex < commandBuffers.size(); ++commandBufferIndex) {
+    auto recordCommandBuffer = [&](uint32_t frameSlot, uint32_t imageIndex) {
+        uint32_t const commandBufferIndex = frameSlot * swapImageCount + imageIndex;
+        VkCommandBuffer commandBuffer = commandBuffers[commandBufferIndex];
 
         VkCommandBufferBeginInfo beginInfo = {};
         beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
         beginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
 
-        vkBeginCommandBuffer(commandBuffers[commandBufferIndex], &beginInfo);
+        vkBeginCommandBuffer(commandBuffer, &beginInfo);
+        profiler.beginFrame(commandBuffer, profilerSlots[commandBufferIndex]);
 
         VkImageSubresourceRange subresourceRange = {};
         subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
@@ -685,6 +1855,7 @@ int main() {
         subresourceRange.baseArrayLayer = 0;
         subresourceRange.layerCount = 1;
 
+        // the previous content is not needed in either path, the trace writes every pixel
         VkImageMemoryBarrier imageMemoryBarrier {};
         imageMemoryBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
         imageMemoryBarrier.srcAccessMask = 0;
@@ -693,82 +1864,137 @@ int main() {
         imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
         imageMemoryBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
         imageMemoryBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        imageMemoryBarrier.image = offscreenImage.handle;
+        imageMemoryBarrier.image = directPresent ? swapImages[imageIndex] : offscreenImage.handle;
         imageMemoryBarrier.subresourceRange = subresourceRange;
 
-        vkCmdPipelineBarrier(commandBuffers[commandBufferIndex], VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, 0, nullptr, 1, &imageMemoryBarrier);
-
-        vkCmdBindPipeline(commandBuffers[commandBufferIndex], VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, raytracingPipeline);
-        vkCmdBindDescriptorSets(commandBuffers[commandBufferIndex], VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, pipelineLayout, 0, 1, &descriptorSet, 0, nullptr);
-
-        vkCmdTraceRaysKHR(commandBuffers[commandBufferIndex],
-                       &raygenStridedBufferRegion,
-                       &missStridedBufferRegion,
-                       &hitStridedBufferRegion,
-                       &callableStridedBufferRegion,
-                       WIDTH, HEIGHT, 1);
-
-        imageMemoryBarrier.srcAccessMask = 0;
-        imageMemoryBarrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-        imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-        imageMemoryBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        imageMemoryBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        imageMemoryBarrier.image = swapImages[commandBufferIndex];
-        imageMemoryBarrier.subresourceRange = subresourceRange;
-        vkCmdPipelineBarrier(commandBuffers[commandBufferIndex], VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &imageMemoryBarrier);
-
-        imageMemoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
-        imageMemoryBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-        imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
-        imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-        imageMemoryBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        imageMemoryBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        imageMemoryBarrier.image = offscreenImage.handle;
-        imageMemoryBarrier.subresourceRange = subresourceRange;
-        vkCmdPipelineBarrier(commandBuffers[commandBufferIndex], VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &imageMemoryBarrier);
-
-        VkImageCopy copyRegion;
-        copyRegion.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
-        copyRegion.srcOffset = { 0, 0, 0 };
-        copyRegion.dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
-        copyRegion.dstOffset = { 0, 0, 0 };
-        copyRegion.extent = {swapExtent.width, swapExtent.height, 1};
-        vkCmdCopyImage(commandBuffers[commandBufferIndex], offscreenImage.handle, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, swapImages[commandBufferIndex], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
-
-        imageMemoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-        imageMemoryBarrier.dstAccessMask = 0;
-        imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-        imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-        imageMemoryBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        imageMemoryBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        imageMemoryBarrier.image = swapImages[commandBufferIndex];
-        imageMemoryBarrier.subresourceRange = subresourceRange;
-        vkCmdPipelineBarrier(commandBuffers[commandBufferIndex], VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &imageMemoryBarrier);
-
-        vkEndCommandBuffer(commandBuffers[commandBufferIndex]);
-    }
+        // the accumulation image is read and written by consecutive frames, the ray tracing stage
+        // of the source scope covers the trace of the frame before
+        VkMemoryBarrier accumulationBarrier = {};
+        accumulationBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        accumulationBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        accumulationBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+
+        // the direct path waits for the acquire semaphore at the ray tracing stage, so the barrier chains to it
+        vkCmdPipelineBarrier(commandBuffer, directPresent ? VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR : VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, 0, 1, &accumulationBarrier, 0, nullptr, 1, &imageMemoryBarrier);
+
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, rayTracing.getPipeline());
+        // a command buffer is recorded per frame slot and swapchain image, at frameSlot * swapImageCount + imageIndex,
+        // the dynamic offsets select the scene constants and primitive attributes of its frame slot
+        std::vector<uint32_t> dynamicOffsets = rayTracing.getDynamicOffsets(frameSlot);
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, pipelineLayout, 0, 1, &frameDescriptorSets[commandBufferIndex], static_cast<uint32_t>(dynamicOffsets.size()), dynamicOffsets.data());
+
+        uint32_t traceScope = profiler.beginScope(commandBuffer, profilerSlots[commandBufferIndex], "trace rays");
+        if (indirectTrace) {
+            vkCmdTraceRaysIndirectKHR(commandBuffer,
+                                   &raygenStridedBufferRegion,
+                                   &missStridedBufferRegion,
+                                   &hitStridedBufferRegion,
+                                   &callableStridedBufferRegion,
+                                   traceSizeBuffer.address + traceSizeStride * imageIndex);
+        }
+        else if (upscalePresent) {
+            // without indirect tracing the size is recorded, the slot is recorded again when its scale changes
+            VkTraceRaysIndirectCommandKHR const* traceSize = reinterpret_cast<VkTraceRaysIndirectCommandKHR const*>(static_cast<uint8_t const*>(traceSizeBuffer.allocation.mapped) + traceSizeStride * imageIndex);
+            vkCmdTraceRaysKHR(commandBuffer,
+                           &raygenStridedBufferRegion,
+                           &missStridedBufferRegion,
+                           &hitStridedBufferRegion,
+                           &callableStridedBufferRegion,
+                           traceSize->width, traceSize->height, 1);
+        }
+        else {
+            vkCmdTraceRaysKHR(commandBuffer,
+                           &raygenStridedBufferRegion,
+                           &missStridedBufferRegion,
+                           &hitStridedBufferRegion,
+                           &callableStridedBufferRegion,
+                           swapExtent.width, swapExtent.height, 1);
+        }
+        profiler.endScope(commandBuffer, profilerSlots[commandBufferIndex], traceScope);
 
-    VkSemaphoreCreateInfo semaphoreInfo = {};
-    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        if (directPresent) {
+            uint32_t transitionScope = profiler.beginScope(commandBuffer, profilerSlots[commandBufferIndex], "present transition");
 
-    std::vector<VkSemaphore> imageAvailableSemaphores(swapImageCount);
-    for (size_t index = 0; index < imageAvailableSemaphores.size(); ++index) {
-        vkCreateSemaphore(device, &semaphoreInfo, nullptr, &imageAvailableSemaphores[index]);
-    }
+            imageMemoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+            imageMemoryBarrier.dstAccessMask = 0;
+            imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+            imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &imageMemoryBarrier);
 
-    std::vector<VkSemaphore> renderFinishedSemaphores(swapImageCount);
-    for (size_t index = 0; index < renderFinishedSemaphores.size(); ++index) {
-        vkCreateSemaphore(device, &semaphoreInfo, nullptr, &renderFinishedSemaphores[index]);
-    }
+            profiler.endScope(commandBuffer, profilerSlots[commandBufferIndex], transitionScope);
+        }
+        else if (upscalePresent) {
+            uint32_t upscaleScope = profiler.beginScope(commandBuffer, profilerSlots[commandBufferIndex], "upscale");
+
+            imageMemoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+            imageMemoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+            imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+            imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &imageMemoryBarrier);
+
+            imageMemoryBarrier.srcAccessMask = 0;
+            imageMemoryBarrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+            imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+            imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+            imageMemoryBarrier.image = swapImages[imageIndex];
+            // chains to the acquire semaphore, which is waited for at the compute stage
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &imageMemoryBarrier);
+
+            upscaler.record(commandBuffer, imageIndex, swapExtent.width, swapExtent.height, upscaleSharpness);
+
+            imageMemoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+            imageMemoryBarrier.dstAccessMask = 0;
+            imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+            imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &imageMemoryBarrier);
+
+            profiler.endScope(commandBuffer, profilerSlots[commandBufferIndex], upscaleScope);
+        }
+        else {
+            uint32_t copyScope = profiler.beginScope(commandBuffer, profilerSlots[commandBufferIndex], "present copy");
+
+            imageMemoryBarrier.srcAccessMask = 0;
+            imageMemoryBarrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+            imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+            imageMemoryBarrier.image = swapImages[imageIndex];
+            // chains to the acquire semaphore, which is waited for at the transfer stage
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &imageMemoryBarrier);
+
+            imageMemoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+            imageMemoryBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+            imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+            imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+            imageMemoryBarrier.image = offscreenImage.handle;
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &imageMemoryBarrier);
+
+            VkImageCopy copyRegion;
+            copyRegion.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+            copyRegion.srcOffset = { 0, 0, 0 };
+            copyRegion.dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+            copyRegion.dstOffset = { 0, 0, 0 };
+            copyRegion.extent = {swapExtent.width, swapExtent.height, 1};
+            vkCmdCopyImage(commandBuffer, offscreenImage.handle, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, swapImages[imageIndex], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
+
+            imageMemoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            imageMemoryBarrier.dstAccessMask = 0;
+            imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+            imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+            imageMemoryBarrier.image = swapImages[imageIndex];
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &imageMemoryBarrier);
+
+            profiler.endScope(commandBuffer, profilerSlots[commandBufferIndex], copyScope);
+        }
 
-    VkFenceCreateInfo fenceCreateInfo = {};
-    fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    fenceCreateInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+        vkEndCommandBuffer(commandBuffer);
+        recordedPipelines[commandBufferIndex] = rayTracing.getPipeline();
+        recordedScales[commandBufferIndex] = traceScales[imageIndex];
+    };
 
-    std::vector<VkFence> fences(swapImageCount);
-    for (uint32_t fenceIndex = 0; fenceIndex < fences.size(); ++fenceIndex) {
-        vkCreateFence(device, &fenceCreateInfo, nullptr, &fences[fenceIndex]);
+    for (uint32_t frameSlot = 0; frameSlot < framesInFlight; ++frameSlot) {
+        for (uint32_t imageIndex = 0; imageIndex < swapImageCount; ++imageIndex) {
+            recordCommandBuffer(frameSlot, imageIndex);
+        }
     }
 
     bool running = true;
@@ -792,9 +2018,26 @@ int main() {
     xcb_client_message_event_t *cm;
 #endif
 
-    uint32_t frameIndex = 0;
+    if (headlessSettings.switchQualityTier) {
+        rayTracing.requestQualityTier(headlessSettings.qualityTier);
+    }
+
+    uint32_t const frameStage = cpuProfiler.registerStage("frame");
+    uint32_t const eventsStage = cpuProfiler.registerStage("window events");
+    uint32_t const fenceStage = cpuProfiler.registerStage("wait for fence");
+    uint32_t const acquireStage = cpuProfiler.registerStage("acquire");
+    uint32_t const recordStage = cpuProfiler.registerStage("record");
+    uint32_t const updateStage = cpuProfiler.registerStage("update");
+    uint32_t const submitStage = cpuProfiler.registerStage("submit");
+    uint32_t const presentStage = cpuProfiler.registerStage("present");
+    uint32_t const idleStage = cpuProfiler.registerStage("idle");
+
+    uint64_t summaryStart = cpuProfiler.now();
+    uint32_t summaryCount = 0;
 
     while (running) {
+        CCpuScope frameScope(cpuProfiler, frameStage);
+        uint64_t eventsStart = cpuProfiler.now();
 #ifdef WIN32
         MSG msg;
         while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
@@ -814,44 +2057,157 @@ int main() {
                         running = false;
                     }
                 } break;
+                case XCB_KEY_PRESS: {
+                    // keycodes 10 to 12 are the keys 1 to 3 with the usual evdev keymap
+                    xcb_key_press_event_t* keyPress = reinterpret_cast<xcb_key_press_event_t*>(event);
+                    if (keyPress->detail >= 10 && keyPress->detail < 10 + QualityTier::Count) {
+                        g_requestedQualityTier = keyPress->detail - 10;
+                    }
+                } break;
             }
             free(event);
         }
 #endif
-        rayTracing.update();
+        cpuProfiler.record(eventsStage, eventsStart, cpuProfiler.now());
+
+        // the converged image stays on screen, nothing is traced or presented until a quality tier
+        // is requested. The scene constants can not change in between, they only hold the animation.
+        if (g_requestedQualityTier < 0 && rayTracing.isConverged()) {
+            CCpuScope scope(cpuProfiler, idleStage);
+            std::this_thread::sleep_for(std::chrono::milliseconds(16));
+            continue;
+        }
 
-        uint32_t imageIndex;
-        vkAcquireNextImageKHR(device, swapchain, std::numeric_limits<uint64_t>::max(), imageAvailableSemaphores[frameIndex], VK_NULL_HANDLE, &imageIndex);
+        // the slot's fence guards its acquire semaphore, scene buffers and the command buffers of
+        // its row. The other slots may still be in flight.
+        uint32_t const frameSlot = scheduler.getFrameSlot();
+        {
+            CCpuScope scope(cpuProfiler, fenceStage);
+            scheduler.waitForFrameSlot();
+        }
+        if (submittedCommandBuffers[frameSlot] != UINT32_MAX) {
+            profiler.collect(profilerSlots[submittedCommandBuffers[frameSlot]]);
+        }
 
-        VkPipelineStageFlags waitStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+        // the trace just collected ran at the scale this slot submitted with
+        if (upscalePresent) {
+            uint64_t sampleCount = 0;
+            double traceMilliseconds = 0.0;
+            if (profiler.getLastSample("trace rays", sampleCount, traceMilliseconds) && sampleCount != traceSampleCount) {
+                traceSampleCount = sampleCount;
+                if (dynamicResolution.update(traceMilliseconds, submittedScales[frameSlot])) {
+                    printf("dynamic resolution: %ux%u\n", dynamicResolution.getSize(swapExtent.width), dynamicResolution.getSize(swapExtent.height));
+                }
+            }
+        }
 
-        VkSubmitInfo submitInfo = {};
-        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        submitInfo.waitSemaphoreCount = 1;
-        submitInfo.pWaitSemaphores = &imageAvailableSemaphores[frameIndex];
-        submitInfo.pWaitDstStageMask = &waitStageMask;
-        submitInfo.commandBufferCount = 1;
-        submitInfo.pCommandBuffers = &commandBuffers[frameIndex];
-        submitInfo.signalSemaphoreCount = 1;
-        submitInfo.pSignalSemaphores = &renderFinishedSemaphores[frameIndex];
+        VkResult acquireResult;
+        {
+            CCpuScope scope(cpuProfiler, acquireStage);
+            acquireResult = scheduler.acquireImage();
+        }
+        if (acquireResult != VK_SUCCESS && acquireResult != VK_SUBOPTIMAL_KHR) {
+            printf("acquiring a swapchain image failed: %d\n", acquireResult);
+            continue;
+        }
 
-        VkFence fence = fences[frameIndex];
-        vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX);
-        vkResetFences(device, 1, &fence);
+        // a frame of another slot may still render into the image, its launch size, upscale
+        // descriptors and render finished semaphore are free once that frame is done
+        uint32_t const imageIndex = scheduler.getImageIndex();
+        {
+            CCpuScope scope(cpuProfiler, fenceStage);
+            scheduler.waitForImage();
+        }
+        if (upscalePresent) {
+            traceScales[imageIndex] = dynamicResolution.getScale();
+            writeTraceSize(imageIndex);
+        }
+
+        if (g_requestedQualityTier >= 0) {
+            rayTracing.requestQualityTier(static_cast<QualityTier::Enum>(g_requestedQualityTier));
+            g_requestedQualityTier = -1;
+        }
+
+        // swaps in a finished background compile, the other command buffers pick it up once they are idle
+        uint32_t const commandBufferIndex = frameSlot * swapImageCount + imageIndex;
+        {
+            CCpuScope scope(cpuProfiler, recordStage);
+            rayTracing.updateQualityTier();
+            if (recordedPipelines[commandBufferIndex] != rayTracing.getPipeline()
+                || (upscalePresent && !indirectTrace && recordedScales[commandBufferIndex] != traceScales[imageIndex])) {
+                recordCommandBuffer(frameSlot, imageIndex);
+            }
+        }
+
+        {
+            CCpuScope scope(cpuProfiler, updateStage);
+            rayTracing.update(frameSlot);
+        }
+        if (rayTracing.getTopLevelTimeline() != VK_NULL_HANDLE) {
+            scheduler.waitForTimeline(rayTracing.getTopLevelTimeline(), rayTracing.getTopLevelTimelineValue(), VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR);
+        }
+
+        // the first access to the swapchain image is the trace, the upscale or the copy into it
+        VkPipelineStageFlags waitStageMask = directPresent ? VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR
+                                           : upscalePresent ? VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT
+                                           : VK_PIPELINE_STAGE_TRANSFER_BIT;
+
+        {
+            CCpuScope scope(cpuProfiler, submitStage);
+            VK_CHECK(scheduler.submit(commandBuffers[commandBufferIndex], waitStageMask));
+        }
+        profiler.submitted(profilerSlots[commandBufferIndex]);
+        submittedCommandBuffers[frameSlot] = commandBufferIndex;
+        submittedScales[frameSlot] = traceScales[imageIndex];
+
+        {
+            CCpuScope scope(cpuProfiler, presentStage);
+            scheduler.present();
+        }
+
+        // once a second the stage averages go to the console and the window title
+        if (cpuProfiler.now() - summaryStart >= 1000000000ull) {
+            std::string summary = cpuProfiler.takeIntervalSummary();
+            printf("cpu: %s\n", summary.c_str());
 
-        vkQueueSubmit(queue, 1, &submitInfo, fence);
+            std::string title = std::string(applicationName) + " - " + summary;
+#ifdef WIN32
+            SetWindowText(hWnd, title.c_str());
+#elif defined(__linux__)
+            xcb_change_property(connection, XCB_PROP_MODE_REPLACE, window, XCB_ATOM_WM_NAME, XCB_ATOM_STRING, 8, static_cast<uint32_t>(title.size()), title.c_str());
+            xcb_flush(connection);
+#endif
 
-        VkPresentInfoKHR presentInfo = {};
-        presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-        presentInfo.waitSemaphoreCount = 1;
-        presentInfo.pWaitSemaphores = &renderFinishedSemaphores[frameIndex];
-        presentInfo.swapchainCount = 1;
-        presentInfo.pSwapchains = &swapchain;
-        presentInfo.pImageIndices = &imageIndex;
+            // the trace is rewritten every 10 seconds, so a run that is killed still leaves one behind
+            if (!cpuTracePath.empty() && ++summaryCount % 10 == 0) {
+                cpuProfiler.writeChromeTrace(cpuTracePath);
+            }
+            summaryStart = cpuProfiler.now();
+        }
+    }
 
-        vkQueuePresentKHR(queue, &presentInfo);
+    rayTracing.printTopLevelUpdateReport();
+    rayTracing.getUploader().printReport();
+    profiler.printReport();
+    if (!profilePath.empty()) {
+        profiler.writeReport(profilePath);
+    }
+    cpuProfiler.printReport();
+    if (!cpuReportPath.empty()) {
+        cpuProfiler.writeReport(cpuReportPath);
+    }
+    if (!cpuTracePath.empty() && cpuProfiler.writeChromeTrace(cpuTracePath)) {
+        printf("cpu profiler: trace written to %s\n", cpuTracePath.c_str());
+    }
 
-        frameIndex = (frameIndex + 1) % swapImageCount;
+    vkDeviceWaitIdle(device);
+    profiler.destroy();
+    vkDestroyDescriptorPool(device, imageDescriptorPool, nullptr);
+    upscaler.destroy();
+    scheduler.destroy();
+    if (upscalePresent) {
+        vkDestroyImageView(device, upscaleSourceView, nullptr);
+        rayTracing.getHelper().destroyBuffer(traceSizeBuffer);
     }
 
 #ifdef WIN32
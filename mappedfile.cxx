@@ -0,0 +1,99 @@
+#include "mappedfile.hxx"
+
+#ifdef WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+CMappedFile::CMappedFile()
+    : m_data(nullptr)
+    , m_size(0)
+#ifdef WIN32
+    , m_file(INVALID_HANDLE_VALUE)
+    , m_mapping(nullptr)
+#endif
+{
+}
+
+#ifdef WIN32
+bool CMappedFile::open(std::string const& path) {
+    close();
+
+    m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0) {
+        close();
+        return false;
+    }
+
+    m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    m_data = m_mapping ? MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    if (!m_data) {
+        close();
+        return false;
+    }
+
+    m_size = static_cast<size_t>(size.QuadPart);
+    return true;
+}
+
+void CMappedFile::close() {
+    if (m_data) {
+        UnmapViewOfFile(m_data);
+    }
+    if (m_mapping) {
+        CloseHandle(m_mapping);
+    }
+    if (m_file != INVALID_HANDLE_VALUE) {
+        CloseHandle(m_file);
+    }
+
+    m_data = nullptr;
+    m_size = 0;
+    m_mapping = nullptr;
+    m_file = INVALID_HANDLE_VALUE;
+}
+#else
+bool CMappedFile::open(std::string const& path) {
+    close();
+
+    int file = ::open(path.c_str(), O_RDONLY);
+    if (file < 0) {
+        return false;
+    }
+
+    struct stat fileStat;
+    if (fstat(file, &fileStat) != 0 || fileStat.st_size == 0) {
+        ::close(file);
+        return false;
+    }
+
+    // the mapping stays valid after the descriptor is closed
+    void* data = mmap(nullptr, static_cast<size_t>(fileStat.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+    ::close(file);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+
+    m_data = data;
+    m_size = static_cast<size_t>(fileStat.st_size);
+    return true;
+}
+
+void CMappedFile::close() {
+    if (m_data) {
+        munmap(const_cast<void*>(m_data), m_size);
+    }
+
+    m_data = nullptr;
+    m_size = 0;
+}
+#endif
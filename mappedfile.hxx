@@ -0,0 +1,31 @@
+#ifndef MAPPEDFILE_HXX
+#define MAPPEDFILE_HXX
+
+#include <stddef.h>
+#include <string>
+
+/*
+ * Read only memory mapping of a whole file. The mapping is page aligned, so the data can be
+ * handed to APIs that need 4 byte aligned words, e.g. SPIR-V, without a copy.
+ */
+class CMappedFile
+{
+public:
+    CMappedFile();
+
+    bool open(std::string const& path);
+    void close();
+
+    void const* getData() const { return m_data; }
+    size_t getSize() const { return m_size; }
+
+private:
+    void const* m_data;
+    size_t m_size;
+#ifdef WIN32
+    void* m_file;
+    void* m_mapping;
+#endif
+};
+
+#endif // MAPPEDFILE_HXX
@@ -0,0 +1,176 @@
+#include "pipelinecache.hxx"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <Windows.h>
+#endif
+
+// "RTPC"
+static uint32_t const kPipelineCacheMagic = 0x43505452;
+static uint32_t const kPipelineCacheVersion = 1;
+// headerSize, headerVersion, vendorID, deviceID, pipelineCacheUUID of the Vulkan cache header
+static size_t const kVulkanCacheHeaderSize = 16 + VK_UUID_SIZE;
+static uint64_t const kHashSeed = 14695981039346656037ull;
+
+CPipelineCache::CPipelineCache(VkDevice device, VkPhysicalDevice gpu)
+    : m_device(device)
+    , m_gpu(gpu)
+    , m_gpuProperties()
+    , m_path()
+    , m_inputHash(kHashSeed)
+    , m_cache(VK_NULL_HANDLE)
+    , m_stats()
+{
+}
+
+uint64_t CPipelineCache::hash(void const* data, size_t size, uint64_t seed) {
+    // FNV-1a
+    uint8_t const* bytes = static_cast<uint8_t const*>(data);
+    uint64_t value = seed;
+    for (size_t index = 0; index < size; ++index) {
+        value ^= bytes[index];
+        value *= 1099511628211ull;
+    }
+    return value;
+}
+
+void CPipelineCache::addKeyData(void const* data, size_t size) {
+    // the size goes in as well, so moving bytes between two inputs changes the key
+    uint64_t size64 = size;
+    m_inputHash = hash(&size64, sizeof(size64), m_inputHash);
+    m_inputHash = hash(data, size, m_inputHash);
+}
+
+void CPipelineCache::fillHeader(FileHeader& header) const {
+    memset(&header, 0, sizeof(header));
+    header.magic = kPipelineCacheMagic;
+    header.version = kPipelineCacheVersion;
+    header.vendorID = m_gpuProperties.vendorID;
+    header.deviceID = m_gpuProperties.deviceID;
+    header.driverVersion = m_gpuProperties.driverVersion;
+    memcpy(header.pipelineCacheUUID, m_gpuProperties.pipelineCacheUUID, VK_UUID_SIZE);
+    header.inputHash = m_inputHash;
+}
+
+bool CPipelineCache::load(std::vector<uint8_t>& data) const {
+    FILE* file = fopen(m_path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+
+    FileHeader header;
+    bool valid = fread(&header, sizeof(header), 1, file) == 1;
+
+    FileHeader expected;
+    fillHeader(expected);
+
+    valid = valid
+            && header.magic == expected.magic
+            && header.version == expected.version
+            && header.vendorID == expected.vendorID
+            && header.deviceID == expected.deviceID
+            && header.driverVersion == expected.driverVersion
+            && memcmp(header.pipelineCacheUUID, expected.pipelineCacheUUID, VK_UUID_SIZE) == 0
+            && header.inputHash == expected.inputHash
+            && header.dataSize >= kVulkanCacheHeaderSize
+            && header.dataSize < (1ull << 31);
+
+    if (valid) {
+        data.resize(static_cast<size_t>(header.dataSize));
+        valid = fread(data.data(), 1, data.size(), file) == data.size()
+                && hash(data.data(), data.size(), kHashSeed) == header.dataHash;
+    }
+    fclose(file);
+
+    if (valid) {
+        // the driver checks this as well, but an old driver may not and then crashes on foreign data
+        uint32_t vulkanHeader[4];
+        memcpy(vulkanHeader, data.data(), sizeof(vulkanHeader));
+        valid = vulkanHeader[0] >= kVulkanCacheHeaderSize
+                && vulkanHeader[1] == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+                && vulkanHeader[2] == m_gpuProperties.vendorID
+                && vulkanHeader[3] == m_gpuProperties.deviceID
+                && memcmp(data.data() + sizeof(vulkanHeader), m_gpuProperties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+    }
+
+    if (!valid) {
+        printf("pipeline cache: ignoring %s, it was written for other shaders, another device or is damaged\n", m_path.c_str());
+        data.clear();
+    }
+
+    return valid;
+}
+
+void CPipelineCache::create(std::string const& path) {
+    m_path = path;
+    vkGetPhysicalDeviceProperties(m_gpu, &m_gpuProperties);
+
+    std::vector<uint8_t> data;
+    m_stats.warm = !m_path.empty() && load(data);
+    m_stats.loadedBytes = data.size();
+
+    VkPipelineCacheCreateInfo cacheInfo = {};
+    cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    cacheInfo.initialDataSize = data.size();
+    cacheInfo.pInitialData = data.empty() ? nullptr : data.data();
+    VK_CHECK(vkCreatePipelineCache(m_device, &cacheInfo, nullptr, &m_cache));
+}
+
+void CPipelineCache::save() {
+    if (m_path.empty() || m_cache == VK_NULL_HANDLE) {
+        return;
+    }
+
+    size_t dataSize = 0;
+    VK_CHECK(vkGetPipelineCacheData(m_device, m_cache, &dataSize, nullptr));
+    std::vector<uint8_t> data(dataSize);
+    VK_CHECK(vkGetPipelineCacheData(m_device, m_cache, &dataSize, data.data()));
+    data.resize(dataSize);
+
+    FileHeader header;
+    fillHeader(header);
+    header.dataSize = data.size();
+    header.dataHash = hash(data.data(), data.size(), kHashSeed);
+
+    std::string temporaryPath = m_path + ".tmp";
+    FILE* file = fopen(temporaryPath.c_str(), "wb");
+    if (!file) {
+        printf("pipeline cache: could not write %s\n", temporaryPath.c_str());
+        return;
+    }
+
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1
+                   && fwrite(data.data(), 1, data.size(), file) == data.size();
+    written = fclose(file) == 0 && written;
+
+#ifdef WIN32
+    written = written && MoveFileExA(temporaryPath.c_str(), m_path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+    written = written && rename(temporaryPath.c_str(), m_path.c_str()) == 0;
+#endif
+
+    if (!written) {
+        printf("pipeline cache: could not write %s\n", m_path.c_str());
+        remove(temporaryPath.c_str());
+        return;
+    }
+
+    m_stats.savedBytes = data.size();
+}
+
+void CPipelineCache::destroy() {
+    if (m_cache != VK_NULL_HANDLE) {
+        vkDestroyPipelineCache(m_device, m_cache, nullptr);
+        m_cache = VK_NULL_HANDLE;
+    }
+}
+
+void CPipelineCache::printReport() const {
+    printf("pipeline cache: %s start, %.2f ms pipeline creation, %llu bytes loaded, %llu bytes saved\n",
+           m_stats.warm ? "warm" : "cold",
+           m_stats.createMilliseconds,
+           static_cast<unsigned long long>(m_stats.loadedBytes),
+           static_cast<unsigned long long>(m_stats.savedBytes));
+}
@@ -0,0 +1,75 @@
+#ifndef PIPELINECACHE_HXX
+#define PIPELINECACHE_HXX
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "vulkanhelper.hxx"
+
+struct PipelineCacheStats {
+    // the cache file was accepted and handed to the driver
+    bool warm;
+    uint64_t loadedBytes;
+    uint64_t savedBytes;
+    double createMilliseconds;
+};
+
+/*
+ * VkPipelineCache persisted to a file. The file starts with our own header holding a key
+ * made of pipelineCacheUUID, vendor and device ID, driver version and a hash of everything
+ * passed to addKeyData() (SPIR-V and specialization data), followed by the data of
+ * vkGetPipelineCacheData. A file with another key, a broken header or a Vulkan cache header
+ * of another device is ignored and the pipeline gets compiled cold. save() writes a
+ * temporary file and renames it over the old one, so a crash never leaves half a cache.
+ */
+class CPipelineCache
+{
+public:
+    CPipelineCache(VkDevice device, VkPhysicalDevice gpu);
+
+    // has to be called for all pipeline inputs before create()
+    void addKeyData(void const* data, size_t size);
+
+    // an empty path creates a cache that is neither loaded nor saved
+    void create(std::string const& path);
+    void save();
+    void destroy();
+
+    VkPipelineCache getHandle() const { return m_cache; }
+
+    // time of the pipeline creation that used the cache, for the report
+    void setCreateMilliseconds(double milliseconds) { m_stats.createMilliseconds = milliseconds; }
+    PipelineCacheStats const& getStats() const { return m_stats; }
+    void printReport() const;
+
+private:
+    struct FileHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t vendorID;
+        uint32_t deviceID;
+        uint32_t driverVersion;
+        uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+        uint64_t inputHash;
+        uint64_t dataSize;
+        uint64_t dataHash;
+    };
+
+    static uint64_t hash(void const* data, size_t size, uint64_t seed);
+    // returns false if the file is missing or was written for other inputs or another device
+    bool load(std::vector<uint8_t>& data) const;
+    void fillHeader(FileHeader& header) const;
+
+    VkDevice m_device;
+    VkPhysicalDevice m_gpu;
+    VkPhysicalDeviceProperties m_gpuProperties;
+
+    std::string m_path;
+    uint64_t m_inputHash;
+    VkPipelineCache m_cache;
+
+    PipelineCacheStats m_stats;
+};
+
+#endif // PIPELINECACHE_HXX
@@ -0,0 +1,82 @@
+#include "pipelinecompiler.hxx"
+
+#include <stdio.h>
+#include <algorithm>
+
+CPipelineCompiler::CPipelineCompiler(VkDevice device, uint32_t threadCount)
+    : m_device(device)
+    , m_scheduler(threadCount)
+    , m_lastConcurrency(0)
+{
+}
+
+bool CPipelineCompiler::createRayTracingPipelines(VkPipelineCache cache, std::vector<VkRayTracingPipelineCreateInfoKHR> const& infos, std::vector<VkPipeline>& pipelines) {
+    uint32_t const pipelineCount = static_cast<uint32_t>(infos.size());
+    pipelines.assign(pipelineCount, VK_NULL_HANDLE);
+
+    if (getThreadCount() == 1) {
+        m_lastConcurrency = 1;
+        VkResult result = vkCreateRayTracingPipelinesKHR(m_device, VK_NULL_HANDLE, cache, pipelineCount, infos.data(), nullptr, pipelines.data());
+        if (result != VK_SUCCESS) {
+            printf("vkCreateRayTracingPipelinesKHR failed: %d\n", result);
+        }
+        return result == VK_SUCCESS;
+    }
+
+    std::vector<VkDeferredOperationKHR> operations(pipelineCount, VK_NULL_HANDLE);
+    std::vector<VkResult> results(pipelineCount);
+
+    // a deferred operation covers exactly one command, so every variant gets its own
+    m_lastConcurrency = 0;
+    for (uint32_t index = 0; index < pipelineCount; ++index) {
+        VK_CHECK(vkCreateDeferredOperationKHR(m_device, nullptr, &operations[index]));
+        results[index] = vkCreateRayTracingPipelinesKHR(m_device, operations[index], cache, 1, &infos[index], nullptr, &pipelines[index]);
+
+        if (results[index] == VK_OPERATION_DEFERRED_KHR) {
+            m_lastConcurrency += vkGetDeferredOperationMaxConcurrencyKHR(m_device, operations[index]);
+        }
+    }
+
+    // more workers than the driver can use would only return VK_THREAD_DONE_KHR right away
+    uint32_t workerCount = std::min(getThreadCount(), m_lastConcurrency);
+
+    m_scheduler.parallelFor(workerCount, [&](uint32_t taskIndex, uint32_t) {
+        // start at different operations so the variants get their workers from the beginning
+        for (uint32_t offset = 0; offset < pipelineCount; ++offset) {
+            uint32_t index = (taskIndex + offset) % pipelineCount;
+            if (results[index] != VK_OPERATION_DEFERRED_KHR) {
+                continue;
+            }
+
+            // VK_THREAD_IDLE_KHR: no work right now but the operation is not done, join again
+            VkResult joinResult = vkDeferredOperationJoinKHR(m_device, operations[index]);
+            while (joinResult == VK_THREAD_IDLE_KHR) {
+                std::this_thread::yield();
+                joinResult = vkDeferredOperationJoinKHR(m_device, operations[index]);
+            }
+        }
+    });
+
+    bool success = true;
+    for (uint32_t index = 0; index < pipelineCount; ++index) {
+        // VK_THREAD_DONE_KHR only tells that a thread ran out of work, the result is queried here
+        if (results[index] == VK_OPERATION_DEFERRED_KHR) {
+            results[index] = vkGetDeferredOperationResultKHR(m_device, operations[index]);
+        }
+        else if (results[index] == VK_OPERATION_NOT_DEFERRED_KHR) {
+            results[index] = VK_SUCCESS;
+        }
+        vkDestroyDeferredOperationKHR(m_device, operations[index], nullptr);
+
+        if (results[index] != VK_SUCCESS) {
+            printf("vkCreateRayTracingPipelinesKHR failed for pipeline %u: %d\n", index, results[index]);
+            if (pipelines[index] != VK_NULL_HANDLE) {
+                vkDestroyPipeline(m_device, pipelines[index], nullptr);
+                pipelines[index] = VK_NULL_HANDLE;
+            }
+            success = false;
+        }
+    }
+
+    return success;
+}
@@ -0,0 +1,35 @@
+#ifndef PIPELINECOMPILER_HXX
+#define PIPELINECOMPILER_HXX
+
+#include <stdint.h>
+#include <vector>
+
+#include "vulkanhelper.hxx"
+#include "taskscheduler.hxx"
+
+/*
+ * Creates ray tracing pipelines through VK_KHR_deferred_host_operations. Every pipeline gets
+ * its own deferred operation, so several variants compile at the same time, and the workers
+ * of a CTaskScheduler join the operations until all of them are finished. With one thread
+ * the pipelines are created directly on the calling thread.
+ */
+class CPipelineCompiler
+{
+public:
+    // threadCount == 0 uses one worker per hardware thread
+    CPipelineCompiler(VkDevice device, uint32_t threadCount = 0);
+
+    // pipelines[i] is VK_NULL_HANDLE for every info that failed, returns false if one did
+    bool createRayTracingPipelines(VkPipelineCache cache, std::vector<VkRayTracingPipelineCreateInfoKHR> const& infos, std::vector<VkPipeline>& pipelines);
+
+    uint32_t getThreadCount() const { return m_scheduler.getThreadCount(); }
+    // threads the driver could use for the last createRayTracingPipelines(), summed over all pipelines
+    uint32_t getLastConcurrency() const { return m_lastConcurrency; }
+
+private:
+    VkDevice m_device;
+    CTaskScheduler m_scheduler;
+    uint32_t m_lastConcurrency;
+};
+
+#endif // PIPELINECOMPILER_HXX
@@ -1,8 +1,21 @@
 #include "raytracing.hxx"
+#include "embeddedshaders.hxx"
 
 #include <string.h>
+#include <stddef.h>
+#include <algorithm>
 #include <iostream>
-#include <fstream>
+#include <chrono>
+
+static VkTransformMatrixKHR toTransformMatrix(glm::mat4 const& transform) {
+    VkTransformMatrixKHR matrix = {};
+    for (uint32_t row = 0; row < 3; ++row) {
+        for (uint32_t column = 0; column < 4; ++column) {
+            matrix.matrix[row][column] = transform[column][row];
+        }
+    }
+    return matrix;
+}
 
 CRayTracing::CRayTracing(VkInstance instance, VkDevice device, VkPhysicalDevice gpu, VkQueue queue, VkCommandPool commandPool, VkPhysicalDeviceRayTracingPipelinePropertiesKHR const& raytracingProperties)
     : m_instance(instance)
@@ -10,166 +23,233 @@ CRayTracing::CRayTracing(VkInstance instance, VkDevice device, VkPhysicalDevice
     , m_gpu(gpu)
     , m_queue(queue)
     , m_commandPool(commandPool)
-    , m_helper(CVulkanHelper(instance, device, gpu))
+    , m_allocator(device, gpu)
+    , m_helper(CVulkanHelper(instance, device, gpu, &m_allocator))
+    , m_blasBuilder(device, gpu, m_helper)
+    , m_uploader(device, m_helper)
+    , m_queueFamily(0)
+    , m_transferQueue(queue)
+    , m_transferQueueFamily(0)
+    , m_computeQueue(queue)
+    , m_computeQueueFamily(0)
     , m_raytracingPipelineProperties(raytracingProperties)
+    , m_shaderBindingTable(device, m_helper, m_uploader, raytracingProperties)
+    , m_pipelineCache(device, gpu)
+    , m_pipelineCachePath()
+    , m_pipelineCompileThreads(0)
+    , m_shaderDirectory()
+    , m_usePipelineLibraries(false)
+    , m_pipelineLayout(VK_NULL_HANDLE)
+    , m_pipelineLibraryInterface({})
+    , m_specializedIntersectionShaders(false)
+    , m_qualityTier(QualityTier::Final)
+    , m_requestedQualityTier(QualityTier::Final)
+    , m_pipelineLibraryTier(QualityTier::Final)
+    , m_qualityTierThread()
+    , m_qualityTierPipelineReady(false)
+    , m_buildingQualityTier(QualityTier::Final)
+    , m_builtQualityTierPipeline(VK_NULL_HANDLE)
+    , m_sceneBuffer({})
+    , m_aabbPrimitiveBuffer({})
+    , m_proceduralGeometryLayout(ProceduralGeometryLayout::PerPrimitive)
+    , m_accelerationStructureCompaction(false)
+    , m_offscreenImageView(VK_NULL_HANDLE)
+    , m_dynamicScene(false)
+    , m_topLevelInstanceBuffer({})
+    , m_topLevelInstanceSlotSize(0)
+    , m_topLevelScratchBuffer({})
+    , m_topLevelGeometry({})
+    , m_topLevelBuildFlags(0)
+    , m_topLevelLatestSlot(0)
+    , m_computeCommandPool(VK_NULL_HANDLE)
+    , m_topLevelTimeline(VK_NULL_HANDLE)
+    , m_topLevelTimelineValue(0)
+    , m_topLevelUpdateQueryPool(VK_NULL_HANDLE)
+    , m_topLevelUpdatesSinceRebuild(0)
+    , m_topLevelUpdateStats({})
+    , m_timestampPeriod(0.0f)
+    , m_profiler(nullptr)
+    , m_profilerSlot(0)
+    , m_framesInFlight(1)
+    , m_sceneBufferSlotSize(0)
+    , m_aabbPrimitiveBufferSlotSize(0)
+    , m_minUniformBufferOffsetAlignment(1)
+    , m_minStorageBufferOffsetAlignment(1)
+    , m_accumulationImage({})
+    , m_accumulationImageView(VK_NULL_HANDLE)
+    , m_accumulationTarget(0)
+    , m_accumulatedSamples(0)
 {
+    for (uint32_t tier = 0; tier < QualityTier::Count; ++tier) {
+        m_qualityTierPipelines[tier] = VK_NULL_HANDLE;
+    }
 }
 
-void CRayTracing::init() {
-    vkGetPhysicalDeviceMemoryProperties(m_gpu, &m_gpuMemProps);
+CRayTracing::~CRayTracing() {
+    joinQualityTierThread();
 }
 
-void CRayTracing::initScene() {
-
-    // Setup materials.
-    {
-        auto setAttributes = [&] (
-            uint32_t primitiveIndex,
-            glm::vec4 const& albedo,
-            float reflectanceCoef = 0.0f,
-            float diffuseCoef = 0.9f,
-            float specularCoef = 0.7f,
-            float specularPower = 50.0f,
-            float stepScale = 1.0f)
-        {
-            PrimitiveConstantBuffer& attributes = m_aabbMaterialCB[primitiveIndex];
-            attributes.albedo = albedo;
-            attributes.reflectanceCoef = reflectanceCoef;
-            attributes.diffuseCoef = diffuseCoef;
-            attributes.specularCoef = specularCoef;
-            attributes.specularPower = specularPower;
-            attributes.stepScale = stepScale;
-        };
-
-        m_planeMaterialCB = { glm::vec4(0.9f, 0.9f, 0.9f, 1.0f), 0.25f, 1.0f, 0.4f, 50.0f, 1.0f, /*padding*/ glm::vec3(0.0f) };
-
-        glm::vec4 green = glm::vec4(0.1f, 1.0f, 0.5f, 1.0f);
-        glm::vec4 red = glm::vec4(1.0f, 0.5f, 0.5f, 1.0f);
-        glm::vec4 yellow = glm::vec4(1.0f, 1.0f, 0.5f, 1.0f);
-
-        uint32_t offset = 0;
-
-        {
-            setAttributes(offset + AnalyticPrimitive::AABB, red);
-            setAttributes(offset + AnalyticPrimitive::Spheres, kChromiumReflectance, 1.0f);
-            offset += AnalyticPrimitive::Count;
-        }
-
-        {
-            setAttributes(offset + VolumetricPrimitive::Metaballs, kChromiumReflectance, 1.0f);
-            offset += VolumetricPrimitive::Count;
-        }
-
-        {
-            setAttributes(offset + SignedDistancePrimitive::MiniSpheres, green);
-            setAttributes(offset + SignedDistancePrimitive::IntersectedRoundCube, green);
-            setAttributes(offset + SignedDistancePrimitive::SquareTorus, kChromiumReflectance, 1.0f);
-            setAttributes(offset + SignedDistancePrimitive::TwistedTorus, yellow, 0.0f, 1.0f, 0.7f, 50.0f, 0.5f);
-            setAttributes(offset + SignedDistancePrimitive::Cog, yellow, 0.0f, 1.0f, 0.1f, 2.0f);
-            setAttributes(offset + SignedDistancePrimitive::Cylinder, red);
-            setAttributes(offset + SignedDistancePrimitive::FractalPyramid, green, 0.0f, 1.0f, 0.1f, 4.0f, 0.8f);
-        }
-    }
+void CRayTracing::setQueueFamilies(uint32_t queueFamily, VkQueue transferQueue, uint32_t transferQueueFamily) {
+    m_queueFamily = queueFamily;
+    m_transferQueue = transferQueue;
+    m_transferQueueFamily = transferQueueFamily;
+}
 
-    // Setup camera.
-    {
-        m_eye = { 0.0f, 5.3f, -17.0f, 1.0f };
-        m_at = { 0.0f, 0.0f, 0.0f, 1.0f };
-        glm::vec4 right = { 1.0f, 0.0f, 0.0f, 0.0f };
+void CRayTracing::setComputeQueue(VkQueue computeQueue, uint32_t computeQueueFamily) {
+    m_computeQueue = computeQueue;
+    m_computeQueueFamily = computeQueueFamily;
+}
 
-        glm::vec4 direction = glm::normalize(m_at - m_eye);
-        m_up = glm::vec4(glm::normalize(glm::cross(glm::vec3(direction), glm::vec3(right))), 0.0f);
+void CRayTracing::init() {
+    vkGetPhysicalDeviceMemoryProperties(m_gpu, &m_gpuMemProps);
 
+    m_uploader.init(m_queue, m_queueFamily, m_transferQueue, m_transferQueueFamily);
 
-        glm::mat4 rotate = glm::rotate(glm::mat4(1.0f), glm::radians(45.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-        m_eye = rotate * m_eye;
-        m_up = rotate * m_up;
+    VkPhysicalDeviceProperties gpuProperties;
+    vkGetPhysicalDeviceProperties(m_gpu, &gpuProperties);
+    m_timestampPeriod = gpuProperties.limits.timestampPeriod;
+    m_minUniformBufferOffsetAlignment = static_cast<uint32_t>(gpuProperties.limits.minUniformBufferOffsetAlignment);
+    m_minStorageBufferOffsetAlignment = static_cast<uint32_t>(gpuProperties.limits.minStorageBufferOffsetAlignment);
+}
 
-        updateCameraMatrices();
+void CRayTracing::setFramesInFlight(uint32_t framesInFlight) {
+    framesInFlight = std::max(1u, framesInFlight);
+    if (framesInFlight == m_framesInFlight) {
+        return;
     }
 
-    // Setup lights.
-    {
-        glm::vec4 lightPosition;
-        glm::vec4 lightAmbientColor;
-        glm::vec4 lightDiffuseColor;
-
-        lightPosition = glm::vec4(0.0f, 18.0f, -20.0f, 0.0f);
-        m_sceneCB.lightPosition = lightPosition;
+    m_framesInFlight = framesInFlight;
 
-        lightAmbientColor = glm::vec4(0.25f, 0.25f, 0.25f, 1.0f);
-        m_sceneCB.lightAmbientColor = lightAmbientColor;
-
-        float d = 0.6f;
-        lightDiffuseColor = glm::vec4(d, d, d, 1.0f);
-        m_sceneCB.lightDiffuseColor = lightDiffuseColor;
+    // the buffers are only rebuilt if they exist, the slots get written by the next update()
+    if (m_sceneBuffer.handle != VK_NULL_HANDLE) {
+        m_helper.destroyBuffer(m_sceneBuffer);
+        createSceneBuffer();
+    }
+    if (m_aabbPrimitiveBuffer.handle != VK_NULL_HANDLE) {
+        m_helper.destroyBuffer(m_aabbPrimitiveBuffer);
+        createAABBPrimitiveFrameBuffer();
     }
+    if (m_dynamicScene && !m_topLevelSlots.empty()) {
+        createTopLevelSlots();
+    }
+}
 
-    uint32_t instanceIndex = 0;
+std::vector<uint32_t> CRayTracing::getDynamicOffsets(uint32_t frameSlot) const {
+    // in binding order: scene buffer (2), per frame primitive attributes (5)
+    std::vector<uint32_t> offsets;
+    offsets.push_back(frameSlot * m_sceneBufferSlotSize);
+    offsets.push_back(frameSlot * m_aabbPrimitiveBufferSlotSize);
+    return offsets;
+}
 
-    for (uint32_t primitiveIndex = 0; primitiveIndex < AnalyticPrimitive::Count; ++primitiveIndex) {
-        m_aabbInstanceCB[instanceIndex].instanceIndex = instanceIndex;
-        m_aabbInstanceCB[instanceIndex].primitiveType = primitiveIndex;
-        ++instanceIndex;
-    }
+void CRayTracing::setDynamicScene(bool dynamicScene) {
+    m_dynamicScene = dynamicScene;
+    m_scene.setAnimateInstances(dynamicScene);
 
-    for (uint32_t primitiveIndex = 0; primitiveIndex < VolumetricPrimitive::Count; ++primitiveIndex) {
-        m_aabbInstanceCB[instanceIndex].instanceIndex = instanceIndex;
-        m_aabbInstanceCB[instanceIndex].primitiveType = primitiveIndex;
-        ++instanceIndex;
+    // the acceleration structures and their inputs are built on the queue and refit on the compute queue
+    std::vector<uint32_t> sharedQueueFamilies(1, m_queueFamily);
+    if (m_dynamicScene && m_computeQueueFamily != m_queueFamily) {
+        sharedQueueFamilies.push_back(m_computeQueueFamily);
     }
+    m_helper.setSharedQueueFamilies(sharedQueueFamilies);
+}
 
-    for (uint32_t primitiveIndex = 0; primitiveIndex < SignedDistancePrimitive::Count; ++primitiveIndex) {
-        m_aabbInstanceCB[instanceIndex].instanceIndex = instanceIndex;
-        m_aabbInstanceCB[instanceIndex].primitiveType = primitiveIndex;
-        ++instanceIndex;
-    }
+void CRayTracing::initScene() {
+    m_scene.initScene();
 }
 
 void CRayTracing::createSceneBuffer() {
 
-    m_sceneBuffer = m_helper.createBuffer(VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, sizeof(SceneConstantBuffer), VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    // one slot per frame in flight, bound with a dynamic offset
+    m_sceneBufferSlotSize = CVulkanHelper::alignTo(static_cast<uint32_t>(sizeof(SceneConstantBuffer)), m_minUniformBufferOffsetAlignment);
+    m_sceneBuffer = m_helper.createBuffer(VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, m_sceneBufferSlotSize * m_framesInFlight, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
 }
 
-void CRayTracing::updateSceneBuffer() {
-    m_helper.copyToBuffer(m_sceneBuffer, &m_sceneCB, sizeof(SceneConstantBuffer));
+void CRayTracing::updateSceneBuffer(uint32_t frameSlot) {
+    m_helper.copyToBuffer(m_sceneBuffer, &m_scene.getSceneConstantBuffer(), sizeof(SceneConstantBuffer), frameSlot * m_sceneBufferSlotSize);
 }
 
-void CRayTracing::createAABBPrimitiveBuffer() {
-    m_aabbPrimitiveBuffer = m_helper.createBuffer(VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, sizeof(PrimitiveInstancePerFrameBuffer) * IntersectionShaderType::kTotalPrimitiveCount, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+void CRayTracing::createAABBPrimitiveFrameBuffer() {
+    m_aabbPrimitiveBufferSlotSize = CVulkanHelper::alignTo(static_cast<uint32_t>(sizeof(PrimitiveInstancePerFrameBuffer) * m_scene.getPrimitiveCount()), m_minStorageBufferOffsetAlignment);
+    m_aabbPrimitiveBuffer = m_helper.createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, m_aabbPrimitiveBufferSlotSize * m_framesInFlight, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
 }
 
-void CRayTracing::updateAABBPrimitiveBuffer() {
-    m_helper.copyToBuffer(m_aabbPrimitiveBuffer, m_aabbPrimitiveAttributeBuffer, sizeof(PrimitiveInstancePerFrameBuffer) * IntersectionShaderType::kTotalPrimitiveCount);
+void CRayTracing::createAABBPrimitiveBuffer() {
+    uint32_t primitiveCount = m_scene.getPrimitiveCount();
+
+    createAABBPrimitiveFrameBuffer();
+
+    // materials and primitive types do not change, they are written once
+    std::vector<PrimitiveData> primitiveData(primitiveCount);
+    for (uint32_t index = 0; index < primitiveCount; ++index) {
+        primitiveData[index].material = m_scene.getAABBMaterialBuffers()[index];
+        primitiveData[index].instance = m_scene.getAABBInstanceBuffers()[index];
+    }
+
+    m_aabbPrimitiveDataBuffer = m_uploader.createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, primitiveData.data(), sizeof(PrimitiveData) * primitiveCount);
+    m_uploader.flush();
 }
 
-void CRayTracing::createShader(VkShaderStageFlagBits type, std::string const& shader_source) {
+void CRayTracing::updateAABBPrimitiveBuffer(uint32_t frameSlot) {
+    m_helper.copyToBuffer(m_aabbPrimitiveBuffer, const_cast<PrimitiveInstancePerFrameBuffer*>(m_scene.getAABBPrimitiveAttributes()), sizeof(PrimitiveInstancePerFrameBuffer) * m_scene.getPrimitiveCount(), frameSlot * m_aabbPrimitiveBufferSlotSize);
+}
 
-  uint8_t* memory = nullptr;
+bool CRayTracing::getShaderCode(std::string const& name, ShaderCode& code) {
+    if (!m_shaderDirectory.empty() && code.file.open(m_shaderDirectory + "/" + name + ".spv")) {
+        code.code = static_cast<uint32_t const*>(code.file.getData());
+        code.size = code.file.getSize();
+        return true;
+    }
 
-  std::streampos size = 0;
-  std::ifstream file(shader_source, std::ios::in | std::ios::binary | std::ios::ate);
-  if (file.is_open()) {
-    size = file.tellg();
-    memory = new uint8_t[size];
-    file.seekg(0, std::ios::beg);
-    file.read(reinterpret_cast<char*>(memory), size);
-    file.close();
-  }
+    EmbeddedShader const* shader = findEmbeddedShader(name);
+    if (!shader) {
+        printf("shader %s is neither embedded nor in the shader directory\n", name.c_str());
+        return false;
+    }
 
+    code.code = shader->code;
+    code.size = shader->size;
+    return true;
+}
 
+VkShaderModule CRayTracing::createShaderModule(ShaderCode const& code) {
+    // straight from the embedded array or the mapping, both are 4 byte aligned
     VkShaderModuleCreateInfo shaderInfo = {};
     shaderInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    shaderInfo.codeSize = static_cast<size_t>(size);
-    shaderInfo.pCode = reinterpret_cast<uint32_t*>(memory);
+    shaderInfo.codeSize = code.size;
+    shaderInfo.pCode = code.code;
 
-    VkShaderModule shaderModule;
+    VkShaderModule shaderModule = VK_NULL_HANDLE;
     VkResult res = vkCreateShaderModule(m_device, &shaderInfo, nullptr, &shaderModule);
     if (res != VK_SUCCESS) {
         printf("could not create shader module\n");
     }
 
-  delete[] memory;
+    return shaderModule;
+}
+
+VkShaderModule CRayTracing::loadShaderModule(std::string const& name) {
+    ShaderCode code = {};
+    if (!getShaderCode(name, code)) {
+        return VK_NULL_HANDLE;
+    }
+
+    VkShaderModule shaderModule = createShaderModule(code);
+    code.file.close();
+
+    return shaderModule;
+}
+
+void CRayTracing::createShader(VkShaderStageFlagBits type, std::string const& name) {
+    // the stages created before the pipeline cache make up its key
+    ShaderCode code = {};
+    VkShaderModule shaderModule = VK_NULL_HANDLE;
+    if (getShaderCode(name, code)) {
+        m_pipelineCache.addKeyData(&type, sizeof(type));
+        m_pipelineCache.addKeyData(code.code, code.size);
+        shaderModule = createShaderModule(code);
+        code.file.close();
+    }
 
     VkPipelineShaderStageCreateInfo shaderStageInfo = {};
     shaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
@@ -180,31 +260,30 @@ void CRayTracing::createShader(VkShaderStageFlagBits type, std::string const& sh
     m_shaderStages.push_back(shaderStageInfo);
 }
 
-VkPipeline CRayTracing::createPipeline(VkPipelineLayout pipelineLayout) {
-
-    m_shaderGroups.clear();
-
-    createRayGenShaderGroups();
+VkRayTracingPipelineCreateInfoKHR CRayTracing::getPipelineCreateInfo(VkPipelineLayout pipelineLayout) {
+    if (m_shaderGroups.empty()) {
+        createRayGenShaderGroups();
 
-    for (size_t index = 0; index < m_rayGenShaderGroups.size(); ++index) {
-        m_shaderGroups.push_back(m_rayGenShaderGroups[index]);
-    }
+        for (size_t index = 0; index < m_rayGenShaderGroups.size(); ++index) {
+            m_shaderGroups.push_back(m_rayGenShaderGroups[index]);
+        }
 
-    createMissShaderGroups();
+        createMissShaderGroups();
 
-    for (size_t index = 0; index < m_missShaderGroups.size(); ++index) {
-        m_shaderGroups.push_back(m_missShaderGroups[index]);
-    }
+        for (size_t index = 0; index < m_missShaderGroups.size(); ++index) {
+            m_shaderGroups.push_back(m_missShaderGroups[index]);
+        }
 
-    createHitShaderGroups();
+        createHitShaderGroups();
 
-    for (size_t index = 0; index < m_hitShaderGroups.size(); ++index) {
-        m_shaderGroups.push_back(m_hitShaderGroups[index]);
+        for (size_t index = 0; index < m_hitShaderGroups.size(); ++index) {
+            m_shaderGroups.push_back(m_hitShaderGroups[index]);
+        }
     }
 
     VkRayTracingPipelineCreateInfoKHR raytracingPipelineInfo = {};
     raytracingPipelineInfo.sType = VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR;
-    raytracingPipelineInfo.maxPipelineRayRecursionDepth = 3;
+    raytracingPipelineInfo.maxPipelineRayRecursionDepth = getPipelineRecursionDepth(m_qualityTier);
     raytracingPipelineInfo.stageCount = static_cast<uint32_t>(m_shaderStages.size());
     raytracingPipelineInfo.pStages = m_shaderStages.data();
     raytracingPipelineInfo.groupCount = static_cast<uint32_t>(m_shaderGroups.size());
@@ -213,127 +292,481 @@ VkPipeline CRayTracing::createPipeline(VkPipelineLayout pipelineLayout) {
     raytracingPipelineInfo.basePipelineIndex = 0;
     raytracingPipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
 
-    vkCreateRayTracingPipelinesKHR(m_device, VK_NULL_HANDLE, VK_NULL_HANDLE, 1, &raytracingPipelineInfo, nullptr, &m_raytracingPipeline);
+    return raytracingPipelineInfo;
+}
+
+VkPipeline CRayTracing::createPipeline(VkPipelineLayout pipelineLayout) {
+    m_pipelineLayout = pipelineLayout;
+
+    m_pipelineCache.create(m_pipelineCachePath);
+
+    std::chrono::high_resolution_clock::time_point createStart = std::chrono::high_resolution_clock::now();
+
+    if (m_usePipelineLibraries) {
+        createPipelineLibraries();
+
+        std::vector<uint32_t> libraries;
+        for (uint32_t index = 0; index < m_pipelineLibraries.size(); ++index) {
+            libraries.push_back(index);
+        }
+        compilePipelineLibraries(libraries);
+        m_pipelineLibraryTier = m_qualityTier;
 
-    createRayGenShaderTable();
-    //createMissShaderTable();
-    //createHitShaderTable();
+        m_raytracingPipeline = linkPipelineLibraries();
+    }
+    else {
+        std::vector<VkRayTracingPipelineCreateInfoKHR> pipelineInfos(1, getPipelineCreateInfo(pipelineLayout));
+        std::vector<VkPipeline> pipelines;
+
+        CPipelineCompiler compiler(m_device, m_pipelineCompileThreads);
+        compiler.createRayTracingPipelines(m_pipelineCache.getHandle(), pipelineInfos, pipelines);
+        m_raytracingPipeline = pipelines[0];
+    }
+
+    m_pipelineCache.setCreateMilliseconds(std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - createStart).count());
+    m_qualityTierPipelines[m_qualityTier] = m_raytracingPipeline;
+
+    // the cache stays alive for libraries compiled later by setIntersectionShader()
+    m_pipelineCache.save();
+    m_pipelineCache.printReport();
+
+    createShaderBindingTable();
 
     return m_raytracingPipeline;
 }
 
-VulkanBuffer CRayTracing::getRayGenShaderGroups() {
-    return m_raygenShaderGroupBuffer;
+void CRayTracing::createPipelineLibraries() {
+    // fills m_shaderGroups
+    getPipelineCreateInfo(m_pipelineLayout);
+
+    // raygen and miss groups form one library, every hit group gets its own
+    uint32_t firstHitGroup = static_cast<uint32_t>(m_rayGenShaderGroups.size() + m_missShaderGroups.size());
+
+    m_pipelineLibraries.clear();
+    for (uint32_t firstGroup = 0; firstGroup < m_shaderGroups.size();) {
+        PipelineLibrary library = {};
+        library.firstGroup = firstGroup;
+        library.groupCount = firstGroup < firstHitGroup ? firstHitGroup : 1;
+        library.pipeline = VK_NULL_HANDLE;
+
+        m_pipelineLibraries.push_back(library);
+        firstGroup += library.groupCount;
+    }
+
+    m_pipelineLibraryInterface = {};
+    m_pipelineLibraryInterface.sType = VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_INTERFACE_CREATE_INFO_KHR;
+    m_pipelineLibraryInterface.maxPipelineRayPayloadSize = kMaxRayPayloadSize;
+    m_pipelineLibraryInterface.maxPipelineRayHitAttributeSize = kMaxRayHitAttributeSize;
 }
 
-VulkanBuffer CRayTracing::getMissShaderGroups() {
-    return m_missShaderGroupBuffer;
+VkRayTracingPipelineCreateInfoKHR CRayTracing::getPipelineLibraryCreateInfo(PipelineLibrary& library) {
+    // the stages of the groups are copied into the library and the indices remapped
+    std::vector<uint32_t> libraryStage(m_shaderStages.size(), VK_SHADER_UNUSED_KHR);
+
+    auto remapStage = [&](uint32_t& stage) {
+        if (stage == VK_SHADER_UNUSED_KHR) {
+            return;
+        }
+        if (libraryStage[stage] == VK_SHADER_UNUSED_KHR) {
+            libraryStage[stage] = static_cast<uint32_t>(library.stages.size());
+            library.stages.push_back(m_shaderStages[stage]);
+        }
+        stage = libraryStage[stage];
+    };
+
+    library.stages.clear();
+    library.groups.clear();
+    for (uint32_t index = 0; index < library.groupCount; ++index) {
+        VkRayTracingShaderGroupCreateInfoKHR group = m_shaderGroups[library.firstGroup + index];
+        remapStage(group.generalShader);
+        remapStage(group.closestHitShader);
+        remapStage(group.anyHitShader);
+        remapStage(group.intersectionShader);
+        library.groups.push_back(group);
+    }
+
+    VkRayTracingPipelineCreateInfoKHR libraryInfo = {};
+    libraryInfo.sType = VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR;
+    libraryInfo.flags = VK_PIPELINE_CREATE_LIBRARY_BIT_KHR;
+    libraryInfo.stageCount = static_cast<uint32_t>(library.stages.size());
+    libraryInfo.pStages = library.stages.data();
+    libraryInfo.groupCount = static_cast<uint32_t>(library.groups.size());
+    libraryInfo.pGroups = library.groups.data();
+    // has to match the linked pipeline
+    libraryInfo.maxPipelineRayRecursionDepth = getPipelineRecursionDepth(m_qualityTier);
+    libraryInfo.pLibraryInterface = &m_pipelineLibraryInterface;
+    libraryInfo.layout = m_pipelineLayout;
+    libraryInfo.basePipelineIndex = -1;
+    libraryInfo.basePipelineHandle = VK_NULL_HANDLE;
+
+    return libraryInfo;
 }
 
-VulkanBuffer CRayTracing::getHitShaderGroups() {
-    return m_hitShaderGroupBuffer;
+bool CRayTracing::compilePipelineLibraries(std::vector<uint32_t> const& libraries) {
+    std::vector<VkRayTracingPipelineCreateInfoKHR> libraryInfos;
+    for (size_t index = 0; index < libraries.size(); ++index) {
+        libraryInfos.push_back(getPipelineLibraryCreateInfo(m_pipelineLibraries[libraries[index]]));
+    }
+
+    // the libraries compile at the same time, one deferred operation each
+    std::vector<VkPipeline> pipelines;
+    CPipelineCompiler compiler(m_device, m_pipelineCompileThreads);
+    bool success = compiler.createRayTracingPipelines(m_pipelineCache.getHandle(), libraryInfos, pipelines);
+
+    for (size_t index = 0; index < libraries.size(); ++index) {
+        PipelineLibrary& library = m_pipelineLibraries[libraries[index]];
+        if (library.pipeline != VK_NULL_HANDLE) {
+            vkDestroyPipeline(m_device, library.pipeline, nullptr);
+        }
+        library.pipeline = pipelines[index];
+    }
+
+    return success;
 }
 
-void CRayTracing::createRayGenShaderTable() {
-    uint32_t raygenAlignment = CVulkanHelper::alignTo(m_raytracingPipelineProperties.shaderGroupHandleSize * m_rayGenShaderGroups.size(), m_raytracingPipelineProperties.shaderGroupBaseAlignment);
-    uint32_t missAlignment = CVulkanHelper::alignTo(m_raytracingPipelineProperties.shaderGroupHandleSize * m_missShaderGroups.size(), m_raytracingPipelineProperties.shaderGroupBaseAlignment);
+VkPipeline CRayTracing::linkPipelineLibraries() {
+    // the groups of the libraries follow each other in order, so the group indices stay the same
+    std::vector<VkPipeline> libraries;
+    for (size_t index = 0; index < m_pipelineLibraries.size(); ++index) {
+        libraries.push_back(m_pipelineLibraries[index].pipeline);
+    }
+
+    VkPipelineLibraryCreateInfoKHR libraryInfo = {};
+    libraryInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LIBRARY_CREATE_INFO_KHR;
+    libraryInfo.libraryCount = static_cast<uint32_t>(libraries.size());
+    libraryInfo.pLibraries = libraries.data();
+
+    VkRayTracingPipelineCreateInfoKHR raytracingPipelineInfo = {};
+    raytracingPipelineInfo.sType = VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR;
+    raytracingPipelineInfo.maxPipelineRayRecursionDepth = getPipelineRecursionDepth(m_qualityTier);
+    raytracingPipelineInfo.pLibraryInfo = &libraryInfo;
+    raytracingPipelineInfo.pLibraryInterface = &m_pipelineLibraryInterface;
+    raytracingPipelineInfo.layout = m_pipelineLayout;
+    raytracingPipelineInfo.basePipelineIndex = -1;
+    raytracingPipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
 
-    VkDeviceSize bufferSize =
-            raygenAlignment
-            + missAlignment
-            // we don't need to align the last part as only the base addresses must be aligned and not the buffer itself
-            + (m_raytracingPipelineProperties.shaderGroupHandleSize + sizeof(PrimitiveConstantBuffer) + sizeof(PrimitiveInstanceConstantBuffer)) * m_aabbs.size();
-    m_raygenShaderGroupBuffer = m_helper.createBuffer(VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, bufferSize, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    std::vector<VkRayTracingPipelineCreateInfoKHR> pipelineInfos(1, raytracingPipelineInfo);
+    std::vector<VkPipeline> pipelines;
 
-    void* data = nullptr;
-    vkMapMemory(m_device, m_raygenShaderGroupBuffer.memory, 0, bufferSize, 0, &data);
-    uint8_t* mappedMemory = (uint8_t*)data;
-    VK_CHECK(vkGetRayTracingShaderGroupHandlesKHR(m_device, m_raytracingPipeline, 0, static_cast<uint32_t>(m_rayGenShaderGroups.size()), m_raytracingPipelineProperties.shaderGroupHandleSize * m_rayGenShaderGroups.size(), mappedMemory));
-    mappedMemory += raygenAlignment;
-    VK_CHECK(vkGetRayTracingShaderGroupHandlesKHR(m_device, m_raytracingPipeline, static_cast<uint32_t>(m_rayGenShaderGroups.size()), static_cast<uint32_t>(m_missShaderGroups.size()), m_raytracingPipelineProperties.shaderGroupHandleSize * m_missShaderGroups.size(), mappedMemory));
-    mappedMemory += missAlignment;
-    VK_CHECK(vkGetRayTracingShaderGroupHandlesKHR(m_device, m_raytracingPipeline, static_cast<uint32_t>(m_rayGenShaderGroups.size() + m_missShaderGroups.size()), 1, m_raytracingPipelineProperties.shaderGroupHandleSize, mappedMemory));
-    mappedMemory += m_raytracingPipelineProperties.shaderGroupHandleSize;
-    memcpy(mappedMemory, &m_planeMaterialCB, sizeof(PrimitiveConstantBuffer));
-    mappedMemory += sizeof(PrimitiveConstantBuffer) + sizeof(PrimitiveInstanceConstantBuffer);
+    CPipelineCompiler compiler(m_device, m_pipelineCompileThreads);
+    compiler.createRayTracingPipelines(m_pipelineCache.getHandle(), pipelineInfos, pipelines);
 
-    uint32_t offset = 0;
+    return pipelines[0];
+}
 
-    for (size_t index = 0; index < AnalyticPrimitive::Count; ++index) {
-        VK_CHECK(vkGetRayTracingShaderGroupHandlesKHR(m_device, m_raytracingPipeline, static_cast<uint32_t>(m_rayGenShaderGroups.size() + m_missShaderGroups.size() + 1), 1, m_raytracingPipelineProperties.shaderGroupHandleSize, mappedMemory));
-        mappedMemory += m_raytracingPipelineProperties.shaderGroupHandleSize;
-        memcpy(mappedMemory, &m_aabbMaterialCB[index + offset], sizeof(PrimitiveConstantBuffer));
-        mappedMemory += sizeof(m_aabbMaterialCB[0]);
-        memcpy(mappedMemory, &m_aabbInstanceCB[index + offset], sizeof(PrimitiveInstanceConstantBuffer));
-        mappedMemory += sizeof(m_aabbInstanceCB[0]);
+VkPipeline CRayTracing::setIntersectionShader(IntersectionShaderType::Enum type, std::string const& name) {
+    uint32_t hitGroup = getGenericHitGroup(type);
+    uint32_t stage = m_shaderGroups[hitGroup].intersectionShader;
+
+    // nothing may use the old pipeline or its library anymore
+    m_uploader.waitIdle();
+    vkQueueWaitIdle(m_queue);
+
+    // the pipelines of the other tiers still have the old shader, they are built again on request
+    joinQualityTierThread();
+    destroyQualityTierPipelines();
+
+    vkDestroyShaderModule(m_device, m_shaderStages[stage].module, nullptr);
+    m_shaderStages[stage].module = loadShaderModule(name);
+
+    // the specialized variants of the type share the module
+    std::vector<uint32_t> hitGroups(1, hitGroup);
+    for (size_t index = 0; index < m_intersectionVariants.size(); ++index) {
+        if (m_intersectionVariants[index].type == type) {
+            m_shaderStages[m_intersectionVariants[index].stage].module = m_shaderStages[stage].module;
+            hitGroups.push_back(m_intersectionVariants[index].hitGroup);
+        }
     }
 
-    offset += AnalyticPrimitive::Count;
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    if (m_usePipelineLibraries) {
+        // only the libraries of these hit groups are compiled again, the rest is linked as is,
+        // unless the libraries were compiled for another quality tier
+        std::vector<uint32_t> libraries;
+        for (uint32_t index = 0; index < m_pipelineLibraries.size(); ++index) {
+            if (m_pipelineLibraryTier != m_qualityTier || std::find(hitGroups.begin(), hitGroups.end(), m_pipelineLibraries[index].firstGroup) != hitGroups.end()) {
+                libraries.push_back(index);
+            }
+        }
+        compilePipelineLibraries(libraries);
+        m_pipelineLibraryTier = m_qualityTier;
+        pipeline = linkPipelineLibraries();
+    }
+    else {
+        std::vector<VkRayTracingPipelineCreateInfoKHR> pipelineInfos(1, getPipelineCreateInfo(m_pipelineLayout));
+        std::vector<VkPipeline> pipelines;
 
-    for (size_t index = 0; index < VolumetricPrimitive::Count; ++index) {
-        VK_CHECK(vkGetRayTracingShaderGroupHandlesKHR(m_device, m_raytracingPipeline, static_cast<uint32_t>(m_rayGenShaderGroups.size() + m_missShaderGroups.size() + 2), 1, m_raytracingPipelineProperties.shaderGroupHandleSize, mappedMemory));
-        mappedMemory += m_raytracingPipelineProperties.shaderGroupHandleSize;
-        memcpy(mappedMemory, &m_aabbMaterialCB[index + offset], sizeof(PrimitiveConstantBuffer));
-        mappedMemory += sizeof(m_aabbMaterialCB[0]);
-        memcpy(mappedMemory, &m_aabbInstanceCB[index + offset], sizeof(PrimitiveInstanceConstantBuffer));
-        mappedMemory += sizeof(m_aabbInstanceCB[0]);
+        CPipelineCompiler compiler(m_device, m_pipelineCompileThreads);
+        compiler.createRayTracingPipelines(m_pipelineCache.getHandle(), pipelineInfos, pipelines);
+        pipeline = pipelines[0];
     }
+    m_pipelineCache.save();
 
-    offset += VolumetricPrimitive::Count;
+    vkDestroyPipeline(m_device, m_raytracingPipeline, nullptr);
+    m_raytracingPipeline = pipeline;
+    m_qualityTierPipelines[m_qualityTier] = pipeline;
 
-    for (size_t index = 0; index < SignedDistancePrimitive::Count; ++index) {
-        VK_CHECK(vkGetRayTracingShaderGroupHandlesKHR(m_device, m_raytracingPipeline, static_cast<uint32_t>(m_rayGenShaderGroups.size() + m_missShaderGroups.size() + 3), 1, m_raytracingPipelineProperties.shaderGroupHandleSize, mappedMemory));
-        mappedMemory += m_raytracingPipelineProperties.shaderGroupHandleSize;
-        memcpy(mappedMemory, &m_aabbMaterialCB[index + offset], sizeof(PrimitiveConstantBuffer));
-        mappedMemory += sizeof(m_aabbMaterialCB[0]);
-        memcpy(mappedMemory, &m_aabbInstanceCB[index + offset], sizeof(PrimitiveInstanceConstantBuffer));
-        mappedMemory += sizeof(m_aabbInstanceCB[0]);
+    m_shaderBindingTable.setPipeline(m_raytracingPipeline);
+    m_shaderBindingTable.uploadDirtyRecords();
+
+    return m_raytracingPipeline;
+}
+
+QualitySettings CRayTracing::getQualitySettings(QualityTier::Enum tier) {
+    static QualitySettings const settings[QualityTier::Count] = {
+        // shadows and reflections of the primary hits only, coarse marching
+        { 1, 128, 0.001f, 32 },
+        { 2, 256, 0.0004f, 64 },
+        { 3, 512, 0.0001f, 128 },
+    };
+
+    return settings[tier];
+}
+
+char const* CRayTracing::getQualityTierName(QualityTier::Enum tier) {
+    static char const* const names[QualityTier::Count] = { "preview", "balanced", "final" };
+    return names[tier];
+}
+
+uint32_t CRayTracing::getPipelineRecursionDepth(QualityTier::Enum tier) const {
+    // a closest hit at depth maxRecursionDepth still traces its shadow and reflection rays
+    return std::min(getQualitySettings(tier).maxRecursionDepth + 1, m_raytracingPipelineProperties.maxRayRecursionDepth);
+}
+
+void CRayTracing::requestQualityTier(QualityTier::Enum tier) {
+    m_requestedQualityTier = tier;
+
+    // a tier requested while another one compiles is started by updateQualityTier()
+    if (m_qualityTierPipelines[tier] == VK_NULL_HANDLE && !m_qualityTierThread.joinable()) {
+        buildQualityTierPipeline();
     }
+}
+
+void CRayTracing::buildQualityTierPipeline() {
+    m_buildingQualityTier = m_requestedQualityTier;
+    m_qualityTierPipelineReady = false;
 
-    vkUnmapMemory(m_device, m_raygenShaderGroupBuffer.memory);
+    printf("quality tier: compiling %s in the background\n", getQualityTierName(m_buildingQualityTier));
+
+    // the thread gets its own stages, m_shaderStages keeps the specialization of the current tier
+    std::vector<VkPipelineShaderStageCreateInfo> stages = m_shaderStages;
+    for (size_t stage = 0; stage < stages.size(); ++stage) {
+        stages[stage].pSpecializationInfo = &m_shaderSpecializationInfos[m_buildingQualityTier][stage];
+    }
+
+    VkRayTracingPipelineCreateInfoKHR pipelineInfo = getPipelineCreateInfo(m_pipelineLayout);
+    pipelineInfo.maxPipelineRayRecursionDepth = getPipelineRecursionDepth(m_buildingQualityTier);
+
+    m_qualityTierThread = std::thread([this, stages, pipelineInfo]() {
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+        std::vector<VkRayTracingPipelineCreateInfoKHR> pipelineInfos(1, pipelineInfo);
+        pipelineInfos[0].pStages = stages.data();
+        std::vector<VkPipeline> pipelines;
+
+        // the pipeline cache is internally synchronized
+        CPipelineCompiler compiler(m_device, m_pipelineCompileThreads);
+        compiler.createRayTracingPipelines(m_pipelineCache.getHandle(), pipelineInfos, pipelines);
+        m_builtQualityTierPipeline = pipelines[0];
+
+        printf("quality tier: %s compiled in %.2f ms\n", getQualityTierName(m_buildingQualityTier),
+               std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count());
+
+        m_qualityTierPipelineReady = true;
+    });
 }
 
-void CRayTracing::createMissShaderTable() {
-    VkDeviceSize bufferSize = m_raytracingPipelineProperties.shaderGroupHandleSize * m_missShaderGroups.size();
-    m_missShaderGroupBuffer = m_helper.createBuffer(VK_BUFFER_USAGE_TRANSFER_SRC_BIT, bufferSize, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+void CRayTracing::joinQualityTierThread() {
+    if (!m_qualityTierThread.joinable()) {
+        return;
+    }
+
+    m_qualityTierThread.join();
 
-    void* data = nullptr;
-    vkMapMemory(m_device, m_missShaderGroupBuffer.memory, 0, bufferSize, 0, &data);
-    uint8_t* mappedMemory = (uint8_t*)data;
-    vkGetRayTracingShaderGroupHandlesKHR(m_device, m_raytracingPipeline, static_cast<uint32_t>(m_rayGenShaderGroups.size()), static_cast<uint32_t>(m_missShaderGroups.size()), bufferSize, mappedMemory);
-    vkUnmapMemory(m_device, m_missShaderGroupBuffer.memory);
+    if (m_builtQualityTierPipeline != VK_NULL_HANDLE) {
+        m_qualityTierPipelines[m_buildingQualityTier] = m_builtQualityTierPipeline;
+        m_builtQualityTierPipeline = VK_NULL_HANDLE;
+    }
+    else if (m_requestedQualityTier == m_buildingQualityTier) {
+        printf("quality tier: compiling %s failed, staying at %s\n", getQualityTierName(m_buildingQualityTier), getQualityTierName(m_qualityTier));
+        m_requestedQualityTier = m_qualityTier;
+    }
 }
 
-void CRayTracing::createHitShaderTable() {
-    VkDeviceSize bufferSize = (m_raytracingPipelineProperties.shaderGroupHandleSize + sizeof(PrimitiveConstantBuffer) + sizeof(PrimitiveInstanceConstantBuffer)) * m_hitShaderGroups.size();
-    m_hitShaderGroupBuffer = m_helper.createBuffer(VK_BUFFER_USAGE_TRANSFER_SRC_BIT, bufferSize, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+void CRayTracing::destroyQualityTierPipelines() {
+    for (uint32_t tier = 0; tier < QualityTier::Count; ++tier) {
+        if (tier != m_qualityTier && m_qualityTierPipelines[tier] != VK_NULL_HANDLE) {
+            vkDestroyPipeline(m_device, m_qualityTierPipelines[tier], nullptr);
+            m_qualityTierPipelines[tier] = VK_NULL_HANDLE;
+        }
+    }
+}
 
-    void* data = nullptr;
-    vkMapMemory(m_device, m_hitShaderGroupBuffer.memory, 0, bufferSize, 0, &data);
-    uint8_t* mappedMemory = (uint8_t*)data;
+bool CRayTracing::updateQualityTier() {
+    if (m_qualityTierThread.joinable()) {
+        if (!m_qualityTierPipelineReady) {
+            return false;
+        }
+        joinQualityTierThread();
+        m_pipelineCache.save();
+    }
+
+    if (m_requestedQualityTier == m_qualityTier) {
+        return false;
+    }
+
+    if (m_qualityTierPipelines[m_requestedQualityTier] == VK_NULL_HANDLE) {
+        buildQualityTierPipeline();
+        return false;
+    }
 
-    vkGetRayTracingShaderGroupHandlesKHR(m_device, m_raytracingPipeline, static_cast<uint32_t>(m_rayGenShaderGroups.size() + m_missShaderGroups.size()), m_raytracingPipelineProperties.shaderGroupHandleSize, bufferSize, mappedMemory);
-    mappedMemory += m_raytracingPipelineProperties.shaderGroupHandleSize;
-    memcpy(mappedMemory, &m_planeMaterialCB, sizeof(PrimitiveConstantBuffer));
-    mappedMemory += sizeof(PrimitiveConstantBuffer) + sizeof(PrimitiveInstanceConstantBuffer);
+    m_qualityTier = m_requestedQualityTier;
+    m_raytracingPipeline = m_qualityTierPipelines[m_qualityTier];
+    setStageSpecializations(m_qualityTier);
 
-    //for (size_t index = 1; index < m_hitShaderGroups.size(); ++index) {
-        vkGetRayTracingShaderGroupHandlesKHR(m_device, m_raytracingPipeline, static_cast<uint32_t>(m_rayGenShaderGroups.size() + m_missShaderGroups.size() /*+ index*/ + 1), m_raytracingPipelineProperties.shaderGroupHandleSize, bufferSize, mappedMemory);
-        mappedMemory += m_raytracingPipelineProperties.shaderGroupHandleSize;
-        memcpy(mappedMemory, &m_aabbMaterialCB[/*index - 1*/2], sizeof(PrimitiveConstantBuffer));
-        mappedMemory += sizeof(PrimitiveConstantBuffer);
-        memcpy(mappedMemory, &m_aabbInstanceCB[/*index - 1*/2], sizeof(PrimitiveInstanceConstantBuffer));
-        mappedMemory += sizeof(PrimitiveInstanceConstantBuffer);
+    // all tiers have the same groups, only the handles change. The copy runs on the queue
+    // after the frames submitted so far, which still trace with the old pipeline.
+    m_shaderBindingTable.setPipeline(m_raytracingPipeline);
+    m_shaderBindingTable.uploadDirtyRecords();
 
-    //    vkGetRayTracingShaderGroupHandles(m_device, m_raytracingPipeline, m_rayGenShaderGroups.size() + m_missShaderGroups.size() /*+ index*/ + 2, m_raytracingProperties.shaderGroupHandleSize, bufferSize, mappedMemory);
-    //    mappedMemory += m_raytracingProperties.shaderGroupHandleSize;
-    //    memcpy(mappedMemory, &m_aabbMaterialCB[/*index - 1*/2], sizeof(PrimitiveConstantBuffer));
-    //    mappedMemory += sizeof(PrimitiveConstantBuffer);
-    //    memcpy(mappedMemory, &m_aabbInstanceCB[/*index - 1*/2], sizeof(PrimitiveInstanceConstantBuffer));
-    //    mappedMemory += sizeof(PrimitiveInstanceConstantBuffer);
+    printf("quality tier: switched to %s\n", getQualityTierName(m_qualityTier));
 
-    //}
-    vkUnmapMemory(m_device, m_hitShaderGroupBuffer.memory);
+    // the accumulated frames were traced with the old tier
+    m_accumulatedSamples = 0;
+    return true;
+}
+
+void CRayTracing::benchmarkPipelineCompilation(VkPipelineLayout pipelineLayout, uint32_t variantCount) {
+    // no pipeline cache, every run compiles from SPIR-V
+    m_pipelineCache.destroy();
+    std::vector<VkRayTracingPipelineCreateInfoKHR> pipelineInfos(variantCount, getPipelineCreateInfo(pipelineLayout));
+
+    uint32_t threadCounts[2] = { 1, m_pipelineCompileThreads > 0 ? m_pipelineCompileThreads : CTaskScheduler::getHardwareThreadCount() };
+    double milliseconds[2] = {};
+
+    for (uint32_t run = 0; run < 2; ++run) {
+        CPipelineCompiler compiler(m_device, threadCounts[run]);
+        std::vector<VkPipeline> pipelines;
+
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        compiler.createRayTracingPipelines(VK_NULL_HANDLE, pipelineInfos, pipelines);
+        milliseconds[run] = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+        printf("pipeline compilation: %u variant(s) with %u thread(s) in %.2f ms, driver concurrency %u\n",
+               variantCount, threadCounts[run], milliseconds[run], compiler.getLastConcurrency());
+
+        for (size_t index = 0; index < pipelines.size(); ++index) {
+            if (pipelines[index] != VK_NULL_HANDLE) {
+                vkDestroyPipeline(m_device, pipelines[index], nullptr);
+            }
+        }
+    }
+
+    printf("pipeline compilation: %.2fx faster with %u threads\n", milliseconds[0] / std::max(milliseconds[1], 0.001), threadCounts[1]);
+
+    // swapping one intersection shader, with libraries only its hit group compiles again
+    std::chrono::high_resolution_clock::time_point swapStart = std::chrono::high_resolution_clock::now();
+    setIntersectionShader(IntersectionShaderType::AnalyticPrimitive, "intersection_analytic_ext");
+    double swapMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - swapStart).count();
+
+    printf("pipeline compilation: intersection shader swap in %.2f ms (%s)\n", swapMilliseconds, m_usePipelineLibraries ? "pipeline libraries" : "monolithic");
+}
+
+std::string CRayTracing::getIntersectionVariantName(uint32_t variant) const {
+    static char const* const analyticNames[AnalyticPrimitive::Count] = { "AABB", "spheres" };
+    static char const* const volumetricNames[VolumetricPrimitive::Count] = { "metaballs" };
+    static char const* const signedDistanceNames[SignedDistancePrimitive::Count] = {
+        "mini spheres", "intersected round cube", "square torus", "twisted torus", "cog", "cylinder", "fractal pyramid"
+    };
+    static char const* const* const names[IntersectionShaderType::Count] = { analyticNames, volumetricNames, signedDistanceNames };
+
+    IntersectionVariant const& intersectionVariant = m_intersectionVariants[variant];
+    return names[intersectionVariant.type][intersectionVariant.primitiveType];
+}
+
+uint32_t CRayTracing::findIntersectionVariant(IntersectionShaderType::Enum type, uint32_t primitiveType) const {
+    for (uint32_t index = 0; index < m_intersectionVariants.size(); ++index) {
+        if (m_intersectionVariants[index].type == type && m_intersectionVariants[index].primitiveType == primitiveType) {
+            return index;
+        }
+    }
+    return UINT32_MAX;
+}
+
+uint32_t CRayTracing::getGenericHitGroup(IntersectionShaderType::Enum type) const {
+    // after raygen, miss and the plane hit group, in type order
+    return static_cast<uint32_t>(m_rayGenShaderGroups.size() + m_missShaderGroups.size()) + 1 + type;
+}
+
+void CRayTracing::setIntersectionVariantSpecialized(uint32_t variant, bool specialized) {
+    if (m_proceduralGeometryLayout != ProceduralGeometryLayout::PerPrimitive) {
+        printf("specialized intersection shaders need the per primitive BLAS layout\n");
+        return;
+    }
+
+    IntersectionVariant const& intersectionVariant = m_intersectionVariants[variant];
+    uint32_t hitGroup = specialized ? intersectionVariant.hitGroup : getGenericHitGroup(intersectionVariant.type);
+
+    PrimitiveInstanceConstantBuffer const* aabbInstanceCB = m_scene.getAABBInstanceBuffers();
+    for (uint32_t index = 0; index < m_scene.getPrimitiveCount(); ++index) {
+        if (m_scene.getIntersectionShaderType(index) == intersectionVariant.type && aabbInstanceCB[index].primitiveType == intersectionVariant.primitiveType) {
+            // record 0 is the plane
+            m_shaderBindingTable.setRecordGroup(ShaderBindingTableRegion::Hit, index + 1, hitGroup);
+        }
+    }
+
+    m_shaderBindingTable.uploadDirtyRecords();
+}
+
+void CRayTracing::createShaderBindingTable() {
+    uint32_t groupIndex = 0;
+
+    for (size_t index = 0; index < m_rayGenShaderGroups.size(); ++index) {
+        m_shaderBindingTable.addRecord(ShaderBindingTableRegion::RayGen, groupIndex++);
+    }
+
+    for (size_t index = 0; index < m_missShaderGroups.size(); ++index) {
+        m_shaderBindingTable.addRecord(ShaderBindingTableRegion::Miss, groupIndex++);
+    }
+
+    // the hit record of an instance is its SBT offset, the plane comes first and only reads the material
+    uint32_t planeGroup = groupIndex;
+
+    PrimitiveData planeRecord = {};
+    planeRecord.material = m_scene.getPlaneMaterialBuffer();
+    m_shaderBindingTable.addRecord(ShaderBindingTableRegion::Hit, planeGroup, planeRecord);
+
+    PrimitiveConstantBuffer const* aabbMaterialCB = m_scene.getAABBMaterialBuffers();
+    PrimitiveInstanceConstantBuffer const* aabbInstanceCB = m_scene.getAABBInstanceBuffers();
+
+    if (m_proceduralGeometryLayout == ProceduralGeometryLayout::PerIntersectionType) {
+        // instanceIndex of the record is the first primitive of the BLAS, the shaders add gl_PrimitiveID
+        for (uint32_t type = 0; type < IntersectionShaderType::Count; ++type) {
+            uint32_t firstPrimitive = m_scene.getFirstPrimitive(static_cast<IntersectionShaderType::Enum>(type));
+
+            PrimitiveData record;
+            record.material = aabbMaterialCB[firstPrimitive];
+            record.instance = aabbInstanceCB[firstPrimitive];
+            record.instance.instanceIndex = firstPrimitive;
+
+            m_shaderBindingTable.addRecord(ShaderBindingTableRegion::Hit, getGenericHitGroup(static_cast<IntersectionShaderType::Enum>(type)), record);
+        }
+    }
+    else {
+        for (uint32_t index = 0; index < m_scene.getPrimitiveCount(); ++index) {
+            PrimitiveData record;
+            record.material = aabbMaterialCB[index];
+            record.instance = aabbInstanceCB[index];
+
+            IntersectionShaderType::Enum type = m_scene.getIntersectionShaderType(index);
+            uint32_t variant = findIntersectionVariant(type, record.instance.primitiveType);
+            uint32_t hitGroup = variant != UINT32_MAX ? m_intersectionVariants[variant].hitGroup : getGenericHitGroup(type);
+
+            m_shaderBindingTable.addRecord(ShaderBindingTableRegion::Hit, hitGroup, record);
+        }
+    }
+
+    m_shaderBindingTable.build(m_raytracingPipeline, static_cast<uint32_t>(m_shaderGroups.size()));
 }
 
 VulkanImage CRayTracing::createOffscreenImage(VkFormat format, uint32_t width, uint32_t height) {
@@ -343,7 +776,7 @@ VulkanImage CRayTracing::createOffscreenImage(VkFormat format, uint32_t width, u
     imageInfo.format = format;
     imageInfo.extent = { width, height, 1 };
     imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
-    imageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    imageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
     imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
     imageInfo.mipLevels = 1;
     imageInfo.arrayLayers = 1;
@@ -358,32 +791,94 @@ VulkanImage CRayTracing::createOffscreenImage(VkFormat format, uint32_t width, u
     VkMemoryRequirements memoryRequirements;
     vkGetImageMemoryRequirements(m_device, offscreenImage, &memoryRequirements);
 
-    uint32_t memoryType = m_helper.getMemoryType(memoryRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-
-    VkMemoryAllocateInfo memoryAllocInfo = {};
-    memoryAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    memoryAllocInfo.allocationSize = memoryRequirements.size;
-    memoryAllocInfo.memoryTypeIndex = memoryType;
+    VulkanAllocation allocation = m_allocator.allocate(memoryRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, false);
 
-    VkDeviceMemory offsreenImageMemory;
-    vkAllocateMemory(m_device, &memoryAllocInfo, nullptr, &offsreenImageMemory);
-
-    vkBindImageMemory(m_device, offscreenImage, offsreenImageMemory, 0);
+    vkBindImageMemory(m_device, offscreenImage, allocation.memory, allocation.offset);
 
     VulkanImage image;
     image.handle = offscreenImage;
-    image.memory = offsreenImageMemory;
+    image.memory = allocation.memory;
     image.size = memoryRequirements.size;
     image.format = format;
     image.width = width;
     image.height = height;
+    image.allocation = allocation;
 
     m_offscreenImage = image;
+    m_offscreenImageView = VK_NULL_HANDLE;
 
     return image;
 }
 
-void CRayTracing::updateDescriptors(VkDescriptorSet descriptorSet) {
+void CRayTracing::createAccumulationImage(uint32_t width, uint32_t height) {
+    if (m_accumulationTarget == 0) {
+        width = 1;
+        height = 1;
+    }
+
+    VkImageCreateInfo imageInfo = {};
+    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.format = VK_FORMAT_R32G32B32A32_SFLOAT;
+    imageInfo.extent = { width, height, 1 };
+    imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT;
+    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageInfo.mipLevels = 1;
+    imageInfo.arrayLayers = 1;
+    imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    VkImage accumulationImage;
+    VK_CHECK(vkCreateImage(m_device, &imageInfo, nullptr, &accumulationImage));
+
+    VkMemoryRequirements memoryRequirements;
+    vkGetImageMemoryRequirements(m_device, accumulationImage, &memoryRequirements);
+
+    VulkanAllocation allocation = m_allocator.allocate(memoryRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, false);
+
+    vkBindImageMemory(m_device, accumulationImage, allocation.memory, allocation.offset);
+
+    m_accumulationImage.handle = accumulationImage;
+    m_accumulationImage.memory = allocation.memory;
+    m_accumulationImage.size = memoryRequirements.size;
+    m_accumulationImage.format = imageInfo.format;
+    m_accumulationImage.width = width;
+    m_accumulationImage.height = height;
+    m_accumulationImage.allocation = allocation;
+
+    VkImageViewCreateInfo viewInfo = {};
+    viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    viewInfo.format = imageInfo.format;
+    viewInfo.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+    viewInfo.image = accumulationImage;
+    VK_CHECK(vkCreateImageView(m_device, &viewInfo, nullptr, &m_accumulationImageView));
+
+    // sample 0 of a pixel does not read it, the content does not matter
+    VkImageMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = accumulationImage;
+    barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+
+    VkCommandBuffer cmdBuffer = beginSingleTimeCommands();
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+    endSingleTimeCommands(cmdBuffer);
+
+    m_accumulatedSamples = 0;
+}
+
+void CRayTracing::updateDescriptors(VkDescriptorSet descriptorSet, uint32_t frameSlot) {
+    if (m_offscreenImageView != VK_NULL_HANDLE) {
+        updateDescriptors(descriptorSet, m_offscreenImageView, frameSlot);
+        return;
+    }
 
     VkImageViewCreateInfo offscreenImageViewInfo = {};
     offscreenImageViewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
@@ -396,13 +891,18 @@ void CRayTracing::updateDescriptors(VkDescriptorSet descriptorSet) {
     offscreenImageViewInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
     offscreenImageViewInfo.image = m_offscreenImage.handle;
 
-    VkImageView offscreenImageView;
-    vkCreateImageView(m_device, &offscreenImageViewInfo, nullptr, &offscreenImageView);
+    vkCreateImageView(m_device, &offscreenImageViewInfo, nullptr, &m_offscreenImageView);
+
+    updateDescriptors(descriptorSet, m_offscreenImageView, frameSlot);
+}
+
+void CRayTracing::updateDescriptors(VkDescriptorSet descriptorSet, VkImageView outputImageView, uint32_t frameSlot) {
+    VkAccelerationStructureKHR topLevelAs = frameSlot < m_topLevelSlots.size() ? m_topLevelSlots[frameSlot].accelerationStructure : m_topLevelAs;
 
     VkWriteDescriptorSetAccelerationStructureKHR descriptorAccelerationStructureInfo = {};
     descriptorAccelerationStructureInfo.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_KHR;
     descriptorAccelerationStructureInfo.accelerationStructureCount = 1;
-    descriptorAccelerationStructureInfo.pAccelerationStructures = &m_topLevelAs;
+    descriptorAccelerationStructureInfo.pAccelerationStructures = &topLevelAs;
 
     VkWriteDescriptorSet accelerationStructureWrite = {};
     accelerationStructureWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
@@ -414,7 +914,7 @@ void CRayTracing::updateDescriptors(VkDescriptorSet descriptorSet) {
 
     VkDescriptorImageInfo descriptorOutputImageInfo = {};
     descriptorOutputImageInfo.sampler = VK_NULL_HANDLE;
-    descriptorOutputImageInfo.imageView = offscreenImageView;
+    descriptorOutputImageInfo.imageView = outputImageView;
     descriptorOutputImageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
 
     VkWriteDescriptorSet outputImageWrite = {};
@@ -428,7 +928,7 @@ void CRayTracing::updateDescriptors(VkDescriptorSet descriptorSet) {
 
     VkDescriptorBufferInfo descriptorSceneBufferInfo = {};
     descriptorSceneBufferInfo.buffer = m_sceneBuffer.handle;
-    descriptorSceneBufferInfo.range = m_sceneBuffer.size;
+    descriptorSceneBufferInfo.range = sizeof(SceneConstantBuffer);
 
     VkWriteDescriptorSet sceneBufferWrite = {};
     sceneBufferWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
@@ -436,7 +936,7 @@ void CRayTracing::updateDescriptors(VkDescriptorSet descriptorSet) {
     sceneBufferWrite.dstBinding = 2;
     sceneBufferWrite.dstArrayElement = 0;
     sceneBufferWrite.descriptorCount = 1;
-    sceneBufferWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    sceneBufferWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
     sceneBufferWrite.pBufferInfo = &descriptorSceneBufferInfo;
 
     VkDescriptorBufferInfo descriptorFacesBufferInfo = {};
@@ -467,7 +967,7 @@ void CRayTracing::updateDescriptors(VkDescriptorSet descriptorSet) {
 
     VkDescriptorBufferInfo descriptorAABBPrimitiveBufferInfo = {};
     descriptorAABBPrimitiveBufferInfo.buffer = m_aabbPrimitiveBuffer.handle;
-    descriptorAABBPrimitiveBufferInfo.range = m_aabbPrimitiveBuffer.size;
+    descriptorAABBPrimitiveBufferInfo.range = sizeof(PrimitiveInstancePerFrameBuffer) * m_scene.getPrimitiveCount();
 
     VkWriteDescriptorSet sceneAABBPrimitiveBufferWrite = {};
     sceneAABBPrimitiveBufferWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
@@ -475,10 +975,37 @@ void CRayTracing::updateDescriptors(VkDescriptorSet descriptorSet) {
     sceneAABBPrimitiveBufferWrite.dstBinding = 5;
     sceneAABBPrimitiveBufferWrite.dstArrayElement = 0;
     sceneAABBPrimitiveBufferWrite.descriptorCount = 1;
-    sceneAABBPrimitiveBufferWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    sceneAABBPrimitiveBufferWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
     sceneAABBPrimitiveBufferWrite.pBufferInfo = &descriptorAABBPrimitiveBufferInfo;
 
-    std::vector<VkWriteDescriptorSet> descriptorWrites({accelerationStructureWrite, outputImageWrite, sceneBufferWrite, facesBufferWrite, normalBufferWrite, sceneAABBPrimitiveBufferWrite});
+    VkDescriptorBufferInfo descriptorAABBPrimitiveDataBufferInfo = {};
+    descriptorAABBPrimitiveDataBufferInfo.buffer = m_aabbPrimitiveDataBuffer.handle;
+    descriptorAABBPrimitiveDataBufferInfo.range = m_aabbPrimitiveDataBuffer.size;
+
+    VkWriteDescriptorSet sceneAABBPrimitiveDataBufferWrite = {};
+    sceneAABBPrimitiveDataBufferWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    sceneAABBPrimitiveDataBufferWrite.dstSet = descriptorSet;
+    sceneAABBPrimitiveDataBufferWrite.dstBinding = 6;
+    sceneAABBPrimitiveDataBufferWrite.dstArrayElement = 0;
+    sceneAABBPrimitiveDataBufferWrite.descriptorCount = 1;
+    sceneAABBPrimitiveDataBufferWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    sceneAABBPrimitiveDataBufferWrite.pBufferInfo = &descriptorAABBPrimitiveDataBufferInfo;
+
+    VkDescriptorImageInfo descriptorAccumulationImageInfo = {};
+    descriptorAccumulationImageInfo.sampler = VK_NULL_HANDLE;
+    descriptorAccumulationImageInfo.imageView = m_accumulationImageView;
+    descriptorAccumulationImageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+    VkWriteDescriptorSet accumulationImageWrite = {};
+    accumulationImageWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    accumulationImageWrite.dstSet = descriptorSet;
+    accumulationImageWrite.dstBinding = 7;
+    accumulationImageWrite.dstArrayElement = 0;
+    accumulationImageWrite.descriptorCount = 1;
+    accumulationImageWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    accumulationImageWrite.pImageInfo = &descriptorAccumulationImageInfo;
+
+    std::vector<VkWriteDescriptorSet> descriptorWrites({accelerationStructureWrite, outputImageWrite, sceneBufferWrite, facesBufferWrite, normalBufferWrite, sceneAABBPrimitiveBufferWrite, sceneAABBPrimitiveDataBufferWrite, accumulationImageWrite});
     vkUpdateDescriptorSets(m_device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, nullptr);
 }
 
@@ -486,7 +1013,7 @@ void CRayTracing::createPrimitives() {
 
 }
 
-void CRayTracing::createShaderStages() {
+bool CRayTracing::createShaderStages() {
     //createShader(VK_SHADER_STAGE_RAYGEN_BIT_NV, "shader/raygen_nv.spv");
     //createShader(VK_SHADER_STAGE_CLOSEST_HIT_BIT_NV, "shader/closest_hit_triangle_nv.spv");
     //createShader(VK_SHADER_STAGE_CLOSEST_HIT_BIT_NV, "shader/closest_hit_aabb_nv.spv");
@@ -495,14 +1022,156 @@ void CRayTracing::createShaderStages() {
     //createShader(VK_SHADER_STAGE_INTERSECTION_BIT_NV, "shader/intersection_analytic_nv.spv");
     //createShader(VK_SHADER_STAGE_INTERSECTION_BIT_NV, "shader/intersection_volumetric_nv.spv");
     //createShader(VK_SHADER_STAGE_INTERSECTION_BIT_NV, "shader/intersection_signed_distance_nv.spv");
-    createShader(VK_SHADER_STAGE_RAYGEN_BIT_KHR, "shader/raygen_ext.spv");
-    createShader(VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, "shader/closest_hit_triangle_ext.spv");
-    createShader(VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, "shader/closest_hit_aabb_ext.spv");
-    createShader(VK_SHADER_STAGE_MISS_BIT_KHR, "shader/miss_ext.spv");
-    createShader(VK_SHADER_STAGE_MISS_BIT_KHR, "shader/miss_shadow_ray_ext.spv");
-    createShader(VK_SHADER_STAGE_INTERSECTION_BIT_KHR, "shader/intersection_analytic_ext.spv");
-    createShader(VK_SHADER_STAGE_INTERSECTION_BIT_KHR, "shader/intersection_volumetric_ext.spv");
-    createShader(VK_SHADER_STAGE_INTERSECTION_BIT_KHR, "shader/intersection_signed_distance_ext.spv");
+    struct StageSource {
+        VkShaderStageFlagBits stage;
+        char const* name;
+    };
+
+    // the shader groups refer to the stages by their index in this list
+    static StageSource const stageSources[] = {
+        { VK_SHADER_STAGE_RAYGEN_BIT_KHR, "raygen_ext" },
+        { VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, "closest_hit_triangle_ext" },
+        { VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, "closest_hit_aabb_ext" },
+        { VK_SHADER_STAGE_MISS_BIT_KHR, "miss_ext" },
+        { VK_SHADER_STAGE_MISS_BIT_KHR, "miss_shadow_ray_ext" },
+        { VK_SHADER_STAGE_INTERSECTION_BIT_KHR, "intersection_analytic_ext" },
+        { VK_SHADER_STAGE_INTERSECTION_BIT_KHR, "intersection_volumetric_ext" },
+        { VK_SHADER_STAGE_INTERSECTION_BIT_KHR, "intersection_signed_distance_ext" },
+    };
+    uint32_t const stageCount = static_cast<uint32_t>(sizeof(stageSources) / sizeof(stageSources[0]));
+
+    // the lookups and the pipeline cache key go in stage order, only the module creation is parallel
+    std::vector<ShaderCode> codes(stageCount);
+    bool shadersFound = true;
+    for (uint32_t index = 0; index < stageCount; ++index) {
+        if (!getShaderCode(stageSources[index].name, codes[index])) {
+            shadersFound = false;
+            continue;
+        }
+
+        m_pipelineCache.addKeyData(&stageSources[index].stage, sizeof(stageSources[index].stage));
+        m_pipelineCache.addKeyData(codes[index].code, codes[index].size);
+    }
+
+    if (!shadersFound) {
+        for (uint32_t index = 0; index < stageCount; ++index) {
+            codes[index].file.close();
+        }
+        return false;
+    }
+
+    uint32_t threadCount = m_pipelineCompileThreads > 0 ? m_pipelineCompileThreads : CTaskScheduler::getHardwareThreadCount();
+    CTaskScheduler scheduler(std::min(threadCount, stageCount));
+
+    std::vector<VkShaderModule> modules(stageCount, VK_NULL_HANDLE);
+    scheduler.parallelFor(stageCount, [&](uint32_t index, uint32_t) {
+        if (codes[index].code) {
+            modules[index] = createShaderModule(codes[index]);
+        }
+    });
+
+    for (uint32_t index = 0; index < stageCount; ++index) {
+        codes[index].file.close();
+
+        VkPipelineShaderStageCreateInfo shaderStageInfo = {};
+        shaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        shaderStageInfo.stage = stageSources[index].stage;
+        shaderStageInfo.module = modules[index];
+        shaderStageInfo.pName = "main";
+
+        m_shaderStages.push_back(shaderStageInfo);
+    }
+
+    if (m_specializedIntersectionShaders) {
+        createIntersectionVariants();
+    }
+
+    createShaderSpecializations();
+    return true;
+}
+
+void CRayTracing::createShaderSpecializations() {
+    uint32_t const offsets[5] = {
+        offsetof(ShaderSpecialization, primitiveType),
+        offsetof(ShaderSpecialization, maxRecursionDepth),
+        offsetof(ShaderSpecialization, signedDistanceMaxSteps),
+        offsetof(ShaderSpecialization, signedDistanceThreshold),
+        offsetof(ShaderSpecialization, metaballMaxSteps)
+    };
+
+    // every stage gets all constants, the ones a shader does not declare are ignored
+    for (uint32_t constant = 0; constant < 5; ++constant) {
+        m_specializationMapEntries[constant].constantID = constant;
+        m_specializationMapEntries[constant].offset = offsets[constant];
+        m_specializationMapEntries[constant].size = sizeof(uint32_t);
+    }
+
+    for (uint32_t tier = 0; tier < QualityTier::Count; ++tier) {
+        QualitySettings settings = getQualitySettings(static_cast<QualityTier::Enum>(tier));
+
+        ShaderSpecialization specialization = {};
+        specialization.primitiveType = 0xffffffff;
+        specialization.maxRecursionDepth = getPipelineRecursionDepth(static_cast<QualityTier::Enum>(tier)) - 1;
+        specialization.signedDistanceMaxSteps = settings.signedDistanceMaxSteps;
+        specialization.signedDistanceThreshold = settings.signedDistanceThreshold;
+        specialization.metaballMaxSteps = settings.metaballMaxSteps;
+
+        m_shaderSpecializations[tier].assign(m_shaderStages.size(), specialization);
+        for (size_t index = 0; index < m_intersectionVariants.size(); ++index) {
+            m_shaderSpecializations[tier][m_intersectionVariants[index].stage].primitiveType = m_intersectionVariants[index].primitiveType;
+        }
+
+        m_shaderSpecializationInfos[tier].resize(m_shaderStages.size());
+        for (size_t stage = 0; stage < m_shaderStages.size(); ++stage) {
+            VkSpecializationInfo& specializationInfo = m_shaderSpecializationInfos[tier][stage];
+            specializationInfo.mapEntryCount = 5;
+            specializationInfo.pMapEntries = m_specializationMapEntries;
+            specializationInfo.dataSize = sizeof(ShaderSpecialization);
+            specializationInfo.pData = &m_shaderSpecializations[tier][stage];
+        }
+    }
+
+    setStageSpecializations(m_qualityTier);
+}
+
+void CRayTracing::setStageSpecializations(QualityTier::Enum tier) {
+    for (size_t stage = 0; stage < m_shaderStages.size(); ++stage) {
+        m_shaderStages[stage].pSpecializationInfo = &m_shaderSpecializationInfos[tier][stage];
+    }
+}
+
+void CRayTracing::createIntersectionVariants() {
+    // the intersection shaders follow the miss shaders in type order
+    uint32_t const firstIntersectionStage = 5;
+    uint32_t const primitiveTypeCounts[IntersectionShaderType::Count] = {
+        AnalyticPrimitive::Count,
+        VolumetricPrimitive::Count,
+        SignedDistancePrimitive::Count
+    };
+
+    m_intersectionVariants.clear();
+    for (uint32_t type = 0; type < IntersectionShaderType::Count; ++type) {
+        for (uint32_t primitiveType = 0; primitiveType < primitiveTypeCounts[type]; ++primitiveType) {
+            IntersectionVariant variant = {};
+            variant.type = static_cast<IntersectionShaderType::Enum>(type);
+            variant.primitiveType = primitiveType;
+            variant.stage = static_cast<uint32_t>(m_shaderStages.size() + m_intersectionVariants.size());
+            // set by createHitShaderGroups()
+            variant.hitGroup = UINT32_MAX;
+
+            m_intersectionVariants.push_back(variant);
+        }
+    }
+
+    // the stages share the module of their type, only the specialization differs, see createShaderSpecializations()
+    for (size_t index = 0; index < m_intersectionVariants.size(); ++index) {
+        IntersectionVariant const& variant = m_intersectionVariants[index];
+        VkPipelineShaderStageCreateInfo shaderStageInfo = m_shaderStages[firstIntersectionStage + variant.type];
+        m_shaderStages.push_back(shaderStageInfo);
+
+        m_pipelineCache.addKeyData(&variant.type, sizeof(variant.type));
+        m_pipelineCache.addKeyData(&variant.primitiveType, sizeof(variant.primitiveType));
+    }
 }
 
 void CRayTracing::createRayGenShaderGroups() {
@@ -576,54 +1245,32 @@ void CRayTracing::createHitShaderGroups() {
     closestHitShaderGroupInfo.intersectionShader = 7;
 
     m_hitShaderGroups.push_back(closestHitShaderGroupInfo);
-}
 
-void CRayTracing::createCommandBuffers() {
+    // the specialized groups come after the generic ones, which keep their indices
+    uint32_t firstHitGroup = static_cast<uint32_t>(m_rayGenShaderGroups.size() + m_missShaderGroups.size());
+    for (size_t index = 0; index < m_intersectionVariants.size(); ++index) {
+        closestHitShaderGroupInfo.intersectionShader = m_intersectionVariants[index].stage;
+        m_intersectionVariants[index].hitGroup = firstHitGroup + static_cast<uint32_t>(m_hitShaderGroups.size());
 
+        m_hitShaderGroups.push_back(closestHitShaderGroupInfo);
+    }
 }
 
-void CRayTracing::buildAccelerationStructurePlane() {
-
+void CRayTracing::createCommandBuffers() {
 
 }
 
-BottomLevelAccelerationStructure CRayTracing::createBottomLevelAccelerationStructure(VkAccelerationStructureBuildSizesInfoKHR const& asBuildSizes) {
-
-    VkBufferCreateInfo bufferInfo = {};
-    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    bufferInfo.usage = VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR;
-    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    bufferInfo.size = asBuildSizes.accelerationStructureSize;
-
-    VulkanBuffer accelerationBuffer = m_helper.createBuffer(VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, asBuildSizes.accelerationStructureSize, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-
-    VkAccelerationStructureCreateInfoKHR accelerationStructureInfo = {};
-    accelerationStructureInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
-    accelerationStructureInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-    accelerationStructureInfo.buffer = accelerationBuffer.handle;
-    accelerationStructureInfo.offset = 0;
-    accelerationStructureInfo.size = asBuildSizes.accelerationStructureSize;
-
-    VkAccelerationStructureKHR accelerationStructure;
-    VK_CHECK(vkCreateAccelerationStructureKHR(m_device, &accelerationStructureInfo, nullptr, &accelerationStructure));
-
-    VkAccelerationStructureDeviceAddressInfoKHR accDeviceAddressInfo = {};
-    accDeviceAddressInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
-    accDeviceAddressInfo.accelerationStructure = accelerationStructure;
+void CRayTracing::buildAccelerationStructurePlane() {
 
-    VkDeviceAddress accelerationStructureHandle = vkGetAccelerationStructureDeviceAddressKHR(m_device, &accDeviceAddressInfo);    
 
-    BottomLevelAccelerationStructure accStruct = {};
-    accStruct.buffer = accelerationBuffer;
-    accStruct.handle = accelerationStructure;
-    accStruct.gpuAddress = accelerationStructureHandle;
-    return accStruct;
 }
 
 void CRayTracing::buildTriangleAccelerationStructure() {
 
     buildPlaneGeometry();
 
+    m_blasBuilder.setCompaction(m_accelerationStructureCompaction);
+
     VkAccelerationStructureGeometryKHR triangleGeometry = {};
     triangleGeometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
     triangleGeometry.pNext = nullptr;
@@ -639,86 +1286,91 @@ void CRayTracing::buildTriangleAccelerationStructure() {
     triangleGeometry.geometry.triangles.indexType = VK_INDEX_TYPE_UINT16;
     triangleGeometry.geometry.triangles.maxVertex = 4;
 
-    VkAccelerationStructureBuildGeometryInfoKHR triangleGeometryInfo = {};
-    triangleGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-    triangleGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-    triangleGeometryInfo.geometryCount = 1;
-    triangleGeometryInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-    triangleGeometryInfo.pGeometries = &triangleGeometry;
+    VkAccelerationStructureBuildRangeInfoKHR triangleBuildRangeInfo = {};
+    triangleBuildRangeInfo.primitiveCount = 2;
+    triangleBuildRangeInfo.primitiveOffset = 0;
+    triangleBuildRangeInfo.firstVertex = 0;
+    triangleBuildRangeInfo.transformOffset = 0;
 
-    VkAccelerationStructureBuildSizesInfoKHR triangleAccelerationStructureSizes;
-    triangleAccelerationStructureSizes.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
-    vkGetAccelerationStructureBuildSizesKHR(m_device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &triangleGeometryInfo, &triangleGeometryInfo.geometryCount, &triangleAccelerationStructureSizes);
+    uint32_t triangleBlas = m_blasBuilder.addBottomLevel(std::vector<VkAccelerationStructureGeometryKHR>(1, triangleGeometry),
+                                                         std::vector<VkAccelerationStructureBuildRangeInfoKHR>(1, triangleBuildRangeInfo));
+
+    // per primitive: one BLAS for every AABB, per type: one BLAS for every intersection shader type
+    // covering its whole range of the AABB buffer
+    std::vector<uint32_t> aabbBlases;
+
+    auto addAABBBottomLevel = [&](uint32_t firstPrimitive, uint32_t primitiveCount) {
+        VkAccelerationStructureGeometryKHR aabbGeometry = {};
+        aabbGeometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+        aabbGeometry.pNext = nullptr;
+        aabbGeometry.geometryType = VK_GEOMETRY_TYPE_AABBS_KHR;
+        aabbGeometry.geometry = {};
+        aabbGeometry.geometry.aabbs.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_AABBS_DATA_KHR;
+        aabbGeometry.geometry.aabbs.stride = sizeof(VkAabbPositionsKHR);
+        aabbGeometry.geometry.aabbs.data.deviceAddress = m_aabbBuffer.address + firstPrimitive * sizeof(VkAabbPositionsKHR);
+        aabbGeometry.flags = 0;
+
+        VkAccelerationStructureBuildRangeInfoKHR aabbBuildRangeInfo = {};
+        aabbBuildRangeInfo.primitiveCount = primitiveCount;
+        aabbBuildRangeInfo.primitiveOffset = 0;
+        aabbBuildRangeInfo.firstVertex = 0;
+        aabbBuildRangeInfo.transformOffset = 0;
+
+        aabbBlases.push_back(m_blasBuilder.addBottomLevel(std::vector<VkAccelerationStructureGeometryKHR>(1, aabbGeometry),
+                                                          std::vector<VkAccelerationStructureBuildRangeInfoKHR>(1, aabbBuildRangeInfo)));
+    };
 
-    BottomLevelAccelerationStructure triangleAccStruct = createBottomLevelAccelerationStructure(triangleAccelerationStructureSizes);
+    if (m_proceduralGeometryLayout == ProceduralGeometryLayout::PerIntersectionType) {
+        for (uint32_t type = 0; type < IntersectionShaderType::Count; ++type) {
+            addAABBBottomLevel(m_scene.getFirstPrimitive(static_cast<IntersectionShaderType::Enum>(type)), m_scene.getPrimitiveCount(static_cast<IntersectionShaderType::Enum>(type)));
+        }
+    }
+    else {
+        for (uint32_t index = 0; index < m_scene.getPrimitiveCount(); ++index) {
+            addAABBBottomLevel(index, 1);
+        }
+    }
 
-    std::vector<VkAccelerationStructureGeometryKHR> aabbGeometries(m_aabbBuffers.size());
-    std::vector<VkAccelerationStructureBuildSizesInfoKHR> aabbAsBuildSizes(m_aabbBuffers.size());
-    std::vector<BottomLevelAccelerationStructure> accStructs(m_aabbBuffers.size());
-    
-    for (size_t index = 0; index < m_aabbBuffers.size(); ++index) {
-        aabbGeometries[index] = {};
-        aabbGeometries[index].sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
-        aabbGeometries[index].pNext = nullptr;
-        aabbGeometries[index].geometryType = VK_GEOMETRY_TYPE_AABBS_KHR;
-        aabbGeometries[index].geometry = {};
-        aabbGeometries[index].geometry.aabbs.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_AABBS_DATA_KHR;
-        aabbGeometries[index].geometry.aabbs.stride = sizeof(VkAabbPositionsKHR);
-        aabbGeometries[index].geometry.aabbs.data.deviceAddress = m_aabbBuffers[index].address;
-        aabbGeometries[index].flags = 0;
-
-        VkAccelerationStructureBuildGeometryInfoKHR aabbGeometryInfo = {};
-        aabbGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-        aabbGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-        aabbGeometryInfo.geometryCount = 1;
-        aabbGeometryInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-        aabbGeometryInfo.pGeometries = &aabbGeometries[index];
-
-        aabbAsBuildSizes[index] = {};
-        aabbAsBuildSizes[index].sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
-        vkGetAccelerationStructureBuildSizesKHR(m_device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &aabbGeometryInfo, &aabbGeometryInfo.geometryCount, &aabbAsBuildSizes[index]);
-
-        accStructs[index] = createBottomLevelAccelerationStructure(aabbAsBuildSizes[index]);
-    }
-
-    glm::uvec3 const kNumAabb = glm::uvec3(700, 1, 700);
-    glm::vec3 const vWidth = glm::vec3(
-        kNumAabb.x * kAabbWidth + (kNumAabb.x - 1) * kAabbDistance,
-        kNumAabb.y * kAabbWidth + (kNumAabb.y - 1) * kAabbDistance,
-        kNumAabb.z * kAabbWidth + (kNumAabb.z - 1) * kAabbDistance
-    );
-
-    glm::vec3 basePosition = vWidth * glm::vec3(-0.35f, 0.0f, -0.35f);
-
-    float triangleTransform[3][4] = {
-        { vWidth.x, 0.0f, 0.0f, basePosition.x },
-        { 0.0f, vWidth.y, 0.0f, basePosition.y },
-        { 0.0f, 0.0f, vWidth.z, basePosition.z }
-    };
+    // the geometry uploads are submitted ahead of the builds on the same queue
+    m_uploader.flush();
+
+    VkCommandBuffer cmdBuffer = beginSingleTimeCommands();
+
+    // all BLAS builds in one call, followed by the one barrier the TLAS build waits on
+    uint32_t blasScope = beginProfilerScope(cmdBuffer, "blas build");
+    m_blasBuilder.recordBuild(cmdBuffer, AccelerationStructureBuildMode::Batched);
+    endProfilerScope(cmdBuffer, blasScope);
+
+    if (m_accelerationStructureCompaction) {
+        // the compacted sizes are only known once the builds have finished
+        endSingleTimeCommands(cmdBuffer);
+        m_blasBuilder.releaseScratch();
+
+        cmdBuffer = beginSingleTimeCommands();
+        uint32_t compactionScope = beginProfilerScope(cmdBuffer, "blas compaction");
+        m_blasBuilder.recordCompaction(cmdBuffer);
+        endProfilerScope(cmdBuffer, compactionScope);
+    }
+
+    VkTransformMatrixKHR triangleTransform = toTransformMatrix(m_scene.getPlaneTransform());
 
     VkAccelerationStructureInstanceKHR triangleGeomInstance = {};
-    memcpy(&triangleGeomInstance.transform.matrix, &triangleTransform, sizeof(triangleTransform));
+    triangleGeomInstance.transform = triangleTransform;
     triangleGeomInstance.mask = 1;
     triangleGeomInstance.instanceShaderBindingTableRecordOffset = 0;
-    triangleGeomInstance.accelerationStructureReference = triangleAccStruct.gpuAddress;
+    triangleGeomInstance.accelerationStructureReference = m_blasBuilder.getBottomLevel(triangleBlas).gpuAddress;
 
 
     std::vector<VkAccelerationStructureInstanceKHR> instances;
     instances.push_back(triangleGeomInstance);
     
-    float aabbTransform[3][4] =
-    {
-        { 1.0f, 0.0f, 0.0f, 0.0f },
-        { 0.0f, 1.0f, 0.0f, kAabbWidth / 2.0f },
-        { 0.0f, 0.0f, 1.0f, 0.0f }
-    };
-    
-    for (size_t index = 0; index < aabbGeometries.size(); ++index) {
+    for (size_t index = 0; index < aabbBlases.size(); ++index) {
         VkAccelerationStructureInstanceKHR aabbGeomInstance = {};
-        memcpy(&aabbGeomInstance.transform.matrix, &aabbTransform, sizeof(aabbTransform));
+        aabbGeomInstance.transform = toTransformMatrix(m_scene.getAABBInstanceTransform(static_cast<uint32_t>(index)));
         aabbGeomInstance.mask = 1;
+        // the hit records follow the order of the BLASes in both layouts
         aabbGeomInstance.instanceShaderBindingTableRecordOffset = 1 + index;
-        aabbGeomInstance.accelerationStructureReference = accStructs[index].gpuAddress;
+        aabbGeomInstance.accelerationStructureReference = m_blasBuilder.getBottomLevel(aabbBlases[index]).gpuAddress;
         instances.push_back(aabbGeomInstance);
     }
     
@@ -736,9 +1388,21 @@ void CRayTracing::buildTriangleAccelerationStructure() {
     topLevelGeometry.geometry.instances.arrayOfPointers = VK_FALSE;
     topLevelGeometry.geometry.instances.data.deviceAddress = instanceBuffer.address;
 
+    // a compacted TLAS can not be updated in place, so the dynamic scene keeps it at full size
+    bool compactTopLevel = m_accelerationStructureCompaction && !m_dynamicScene;
+
+    VkBuildAccelerationStructureFlagsKHR topLevelBuildFlags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+    if (compactTopLevel) {
+        topLevelBuildFlags |= VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR;
+    }
+    if (m_dynamicScene) {
+        topLevelBuildFlags |= VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
+    }
+
     VkAccelerationStructureBuildGeometryInfoKHR topAccelerationStructureGeometryInfo = {};
     topAccelerationStructureGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
     topAccelerationStructureGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+    topAccelerationStructureGeometryInfo.flags = topLevelBuildFlags;
     topAccelerationStructureGeometryInfo.geometryCount = 1;
     topAccelerationStructureGeometryInfo.pGeometries = &topLevelGeometry;
 
@@ -748,13 +1412,8 @@ void CRayTracing::buildTriangleAccelerationStructure() {
     topAccelerationStructureSizes.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
     vkGetAccelerationStructureBuildSizesKHR(m_device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &topAccelerationStructureGeometryInfo, &count, &topAccelerationStructureSizes);
 
-    VkBufferCreateInfo bufferInfo = {};
-    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    bufferInfo.usage = VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR;
-    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    bufferInfo.size = topAccelerationStructureSizes.accelerationStructureSize;
-
-    VulkanBuffer topAccelerationBuffer = m_helper.createBuffer(VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, topAccelerationStructureSizes.accelerationStructureSize, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    // the dynamic scene refits it on the compute queue
+    VulkanBuffer topAccelerationBuffer = m_helper.createBuffer(VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, topAccelerationStructureSizes.accelerationStructureSize, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, m_dynamicScene);
 
     VkAccelerationStructureCreateInfoKHR topAccInfo = {};
     topAccInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
@@ -766,111 +1425,157 @@ void CRayTracing::buildTriangleAccelerationStructure() {
     VkAccelerationStructureKHR topAccelerationStructure;
     VK_CHECK(vkCreateAccelerationStructureKHR(m_device, &topAccInfo, nullptr, &topAccelerationStructure));
 
-    VkDeviceSize bottomTriangleAccelerationStructureBufferSize = triangleAccelerationStructureSizes.buildScratchSize;
-
-    VkDeviceSize bottomAabbAccelerationStructureBufferSize = 0;
-
-    for (size_t index = 0; index < accStructs.size(); ++index) {
-        bottomAabbAccelerationStructureBufferSize = std::max(aabbAsBuildSizes[index].buildScratchSize, bottomAabbAccelerationStructureBufferSize);
+    // the dynamic scene reuses the scratch buffer for every update and rebuild
+    VkDeviceSize scratchSize = topAccelerationStructureSizes.buildScratchSize;
+    if (m_dynamicScene) {
+        scratchSize = std::max(scratchSize, topAccelerationStructureSizes.updateScratchSize);
     }
 
-    VkDeviceSize scratchBufferSize = std::max(bottomTriangleAccelerationStructureBufferSize, bottomAabbAccelerationStructureBufferSize);
-    VulkanBuffer scratchBuffer = m_helper.createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, scratchBufferSize, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    VulkanBuffer scratchBuffer = m_helper.createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, scratchSize, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, m_dynamicScene);
 
-    VkCommandBufferAllocateInfo commandBufferAllocInfo = {};
-    commandBufferAllocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    commandBufferAllocInfo.commandPool = m_commandPool;
-    commandBufferAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    commandBufferAllocInfo.commandBufferCount = 1;
-
-    VkCommandBuffer cmdBuffer;
-    VK_CHECK(vkAllocateCommandBuffers(m_device, &commandBufferAllocInfo, &cmdBuffer));
-
-    VkCommandBufferBeginInfo beginInfo = {};
-    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-
-    VK_CHECK(vkBeginCommandBuffer(cmdBuffer, &beginInfo));
-
-    VkMemoryBarrier memoryBarrier = {};
-    memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
-    memoryBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
-    memoryBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
-
-    VkAccelerationStructureBuildRangeInfoKHR triangleBuildRangeInfo = {};
-    triangleBuildRangeInfo.primitiveCount = 2;
-    triangleBuildRangeInfo.primitiveOffset = 0;
-    triangleBuildRangeInfo.firstVertex = 0;
-    triangleBuildRangeInfo.transformOffset = 0;
+    VkAccelerationStructureBuildRangeInfoKHR topLevelBuildRangeInfo = {};
+    topLevelBuildRangeInfo.primitiveCount = static_cast<uint32_t>(instances.size());
+    topLevelBuildRangeInfo.primitiveOffset = 0;
+    topLevelBuildRangeInfo.firstVertex = 0;
+    topLevelBuildRangeInfo.transformOffset = 0;
 
     {
         VkAccelerationStructureBuildGeometryInfoKHR asBuildInfo = {};
         asBuildInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-        asBuildInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+        asBuildInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
         asBuildInfo.geometryCount = 1;
-        asBuildInfo.pGeometries = &triangleGeometry;
-        asBuildInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+        asBuildInfo.pGeometries = &topLevelGeometry;
+        asBuildInfo.flags = topLevelBuildFlags;
         asBuildInfo.srcAccelerationStructure = VK_NULL_HANDLE;
-        asBuildInfo.dstAccelerationStructure = triangleAccStruct.handle;
+        asBuildInfo.dstAccelerationStructure = topAccelerationStructure;
         asBuildInfo.scratchData.deviceAddress = scratchBuffer.address;
 
-        std::vector<VkAccelerationStructureBuildRangeInfoKHR*> asOffsetInfos = { &triangleBuildRangeInfo };
+        std::vector<VkAccelerationStructureBuildRangeInfoKHR*> asOffsetInfos = { &topLevelBuildRangeInfo };
 
         //VK_CHECK(vkBuildAccelerationStructureKHR(m_device, 1, &asBuildInfo, asOffsetInfos.data()));
+        uint32_t tlasScope = beginProfilerScope(cmdBuffer, "tlas build");
         vkCmdBuildAccelerationStructuresKHR(cmdBuffer, 1, &asBuildInfo, asOffsetInfos.data());
+        endProfilerScope(cmdBuffer, tlasScope);
     }
-    
-    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
-    
-    VkAccelerationStructureBuildRangeInfoKHR aabbBuildRangeInfo = {};
-    aabbBuildRangeInfo.primitiveCount = 1;
-    aabbBuildRangeInfo.primitiveOffset = 0;
-    aabbBuildRangeInfo.firstVertex = 0;
-    aabbBuildRangeInfo.transformOffset = 0;
 
-    for (size_t index = 0; index < accStructs.size(); ++index)
-    {
-        VkAccelerationStructureBuildGeometryInfoKHR asBuildInfo = {};
-        asBuildInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-        asBuildInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-        asBuildInfo.geometryCount = 1;//aabbGeometries.size();
-        asBuildInfo.pGeometries = &aabbGeometries[index];
-        asBuildInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-        asBuildInfo.srcAccelerationStructure = VK_NULL_HANDLE;
-        asBuildInfo.dstAccelerationStructure = accStructs[index].handle;
-        asBuildInfo.scratchData.deviceAddress = scratchBuffer.address;
+    VkQueryPool compactedSizeQueryPool = VK_NULL_HANDLE;
 
-        std::vector<VkAccelerationStructureBuildRangeInfoKHR*> asOffsetInfos = { &aabbBuildRangeInfo };
+    if (compactTopLevel) {
+        VkQueryPoolCreateInfo queryPoolInfo = {};
+        queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        queryPoolInfo.queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR;
+        queryPoolInfo.queryCount = 1;
 
-        //VK_CHECK(vkBuildAccelerationStructureKHR(m_device, 1, &asBuildInfo, asOffsetInfos.data()));
-        vkCmdBuildAccelerationStructuresKHR(cmdBuffer, 1, &asBuildInfo, asOffsetInfos.data());
+        VK_CHECK(vkCreateQueryPool(m_device, &queryPoolInfo, nullptr, &compactedSizeQueryPool));
+
+        VkMemoryBarrier memoryBarrier = {};
+        memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        memoryBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+        memoryBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
 
         vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+        vkCmdResetQueryPool(cmdBuffer, compactedSizeQueryPool, 0, 1);
+        vkCmdWriteAccelerationStructuresPropertiesKHR(cmdBuffer, 1, &topAccelerationStructure, VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR, compactedSizeQueryPool, 0);
     }
 
-    VkAccelerationStructureBuildRangeInfoKHR topLevelBuildRangeInfo = {};
-    topLevelBuildRangeInfo.primitiveCount = static_cast<uint32_t>(instances.size());
-    topLevelBuildRangeInfo.primitiveOffset = 0;
-    topLevelBuildRangeInfo.firstVertex = 0;
-    topLevelBuildRangeInfo.transformOffset = 0;
+    endSingleTimeCommands(cmdBuffer);
+
+    // the build inputs are not needed anymore, their ranges go back to the free lists
+    if (m_dynamicScene) {
+        m_topLevelInstances = instances;
+        m_topLevelInstanceBuffer = instanceBuffer;
+        m_topLevelScratchBuffer = scratchBuffer;
+        m_topLevelGeometry = topLevelGeometry;
+        m_topLevelBuildFlags = topLevelBuildFlags;
+        m_topLevelBuildPositions.clear();
+        for (size_t index = 0; index < instances.size(); ++index) {
+            m_topLevelBuildPositions.push_back(getInstancePosition(instances[index]));
+        }
+    }
+    else {
+        m_helper.destroyBuffer(scratchBuffer);
+        m_helper.destroyBuffer(instanceBuffer);
+    }
+    m_blasBuilder.releaseScratch();
+    m_blasBuilder.releaseUncompacted();
 
-    {
-        VkAccelerationStructureBuildGeometryInfoKHR asBuildInfo = {};
-        asBuildInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-        asBuildInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-        asBuildInfo.geometryCount = 1;
-        asBuildInfo.pGeometries = &topLevelGeometry;
-        asBuildInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-        asBuildInfo.srcAccelerationStructure = VK_NULL_HANDLE;
-        asBuildInfo.dstAccelerationStructure = topAccelerationStructure;
-        asBuildInfo.scratchData.deviceAddress = scratchBuffer.address;
+    m_topLevelAs = topAccelerationStructure;
+    m_topLevelAsBuffer = topAccelerationBuffer;
 
-        std::vector<VkAccelerationStructureBuildRangeInfoKHR*> asOffsetInfos = { &topLevelBuildRangeInfo };
+    if (m_dynamicScene) {
+        createTopLevelSlots();
+    }
 
-        //VK_CHECK(vkBuildAccelerationStructureKHR(m_device, 1, &asBuildInfo, asOffsetInfos.data()));
-        vkCmdBuildAccelerationStructuresKHR(cmdBuffer, 1, &asBuildInfo, asOffsetInfos.data());
+    if (compactedSizeQueryPool != VK_NULL_HANDLE) {
+        VkDeviceSize compactedSize = 0;
+        VK_CHECK(vkGetQueryPoolResults(m_device, compactedSizeQueryPool, 0, 1, sizeof(compactedSize), &compactedSize, sizeof(VkDeviceSize), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+        vkDestroyQueryPool(m_device, compactedSizeQueryPool, nullptr);
+
+        compactTopLevelAccelerationStructure(compactedSize);
     }
+}
+
+void CRayTracing::compactTopLevelAccelerationStructure(VkDeviceSize compactedSize) {
+    VulkanBuffer compactedBuffer = m_helper.createBuffer(VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, compactedSize, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+    VkAccelerationStructureCreateInfoKHR compactedInfo = {};
+    compactedInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+    compactedInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+    compactedInfo.buffer = compactedBuffer.handle;
+    compactedInfo.offset = 0;
+    compactedInfo.size = compactedSize;
+
+    VkAccelerationStructureKHR compactedAccelerationStructure;
+    VK_CHECK(vkCreateAccelerationStructureKHR(m_device, &compactedInfo, nullptr, &compactedAccelerationStructure));
+
+    VkCopyAccelerationStructureInfoKHR copyInfo = {};
+    copyInfo.sType = VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR;
+    copyInfo.src = m_topLevelAs;
+    copyInfo.dst = compactedAccelerationStructure;
+    copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR;
+
+    VkCommandBuffer cmdBuffer = beginSingleTimeCommands();
+    uint32_t compactionScope = beginProfilerScope(cmdBuffer, "tlas compaction");
+    vkCmdCopyAccelerationStructureKHR(cmdBuffer, &copyInfo);
+    endProfilerScope(cmdBuffer, compactionScope);
+    endSingleTimeCommands(cmdBuffer);
+
+    printf("tlas compaction: %llu -> %llu bytes, saved %llu\n",
+           static_cast<unsigned long long>(m_topLevelAsBuffer.size),
+           static_cast<unsigned long long>(compactedSize),
+           static_cast<unsigned long long>(m_topLevelAsBuffer.size - std::min(compactedSize, m_topLevelAsBuffer.size)));
+
+    vkDestroyAccelerationStructureKHR(m_device, m_topLevelAs, nullptr);
+    m_helper.destroyBuffer(m_topLevelAsBuffer);
+
+    m_topLevelAs = compactedAccelerationStructure;
+    m_topLevelAsBuffer = compactedBuffer;
+}
+
+VkCommandBuffer CRayTracing::beginSingleTimeCommands() {
+    VkCommandBufferAllocateInfo commandBufferAllocInfo = {};
+    commandBufferAllocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    commandBufferAllocInfo.commandPool = m_commandPool;
+    commandBufferAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    commandBufferAllocInfo.commandBufferCount = 1;
+
+    VkCommandBuffer cmdBuffer;
+    VK_CHECK(vkAllocateCommandBuffers(m_device, &commandBufferAllocInfo, &cmdBuffer));
 
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+    VK_CHECK(vkBeginCommandBuffer(cmdBuffer, &beginInfo));
+
+    if (m_profiler) {
+        m_profiler->beginFrame(cmdBuffer, m_profilerSlot);
+    }
+
+    return cmdBuffer;
+}
+
+void CRayTracing::endSingleTimeCommands(VkCommandBuffer cmdBuffer) {
     VK_CHECK(vkEndCommandBuffer(cmdBuffer));
 
     VkSubmitInfo submitInfo = {};
@@ -886,201 +1591,341 @@ void CRayTracing::buildTriangleAccelerationStructure() {
     VK_CHECK(vkQueueSubmit(m_queue, 1, &submitInfo, fence));
     VK_CHECK(vkWaitForFences(m_device, 1, &fence, VK_TRUE, UINT64_MAX));
 
+    if (m_profiler) {
+        m_profiler->submitted(m_profilerSlot);
+        m_profiler->collect(m_profilerSlot);
+    }
+
     vkDestroyFence(m_device, fence, nullptr);
     vkFreeCommandBuffers(m_device, m_commandPool, 1, &cmdBuffer);
+}
 
-    m_topLevelAs = topAccelerationStructure;
+void CRayTracing::setProfiler(CGpuProfiler* profiler) {
+    m_profiler = profiler;
+    if (m_profiler) {
+        m_profilerSlot = m_profiler->createSlot();
+    }
 }
 
-void CRayTracing::updateCameraMatrices() {
-    m_sceneCB.cameraPosition = m_eye;
-    float fovAngleY = 45.0f;
-    glm::mat4 view = glm::lookAtLH(glm::vec3(m_eye), glm::vec3(m_at), glm::vec3(m_up));
-    glm::mat4 proj = glm::perspectiveLH(glm::radians(fovAngleY), m_aspectRatio, 0.01f, 125.0f);
-    glm::mat4 viewProj = proj * view;
-    m_sceneCB.projectionToWorld = glm::inverse(viewProj);
+uint32_t CRayTracing::beginProfilerScope(VkCommandBuffer cmdBuffer, char const* name) {
+    return m_profiler ? m_profiler->beginScope(cmdBuffer, m_profilerSlot, name) : UINT32_MAX;
+}
+
+void CRayTracing::endProfilerScope(VkCommandBuffer cmdBuffer, uint32_t scope) {
+    if (m_profiler) {
+        m_profiler->endScope(cmdBuffer, m_profilerSlot, scope);
+    }
 }
 
 void CRayTracing::updateAABBPrimitivesAttributes(float animationTime) {
-    glm::mat4 identity = glm::mat4(1.0f);
+    m_scene.updateAABBPrimitivesAttributes(animationTime);
+}
 
-    glm::mat4 scale15y = glm::scale(glm::mat4(1.0f), glm::vec3(1.0f, 1.5f, 1.0f));
-    glm::mat4 scale15 = glm::scale(glm::mat4(1.0f), glm::vec3(1.5f, 1.5f, 1.5f));
-    //glm::mat4 scale2 = glm::scale(glm::mat4(1.0f), glm::vec3(2.0f, 2.0f, 2.0f));
-    glm::mat4 scale3 = glm::scale(glm::mat4(1.0f), glm::vec3(3.0f, 3.0f, 3.0f));
+void CRayTracing::buildProceduralGeometryAABBs() {
 
-    glm::mat4 rotation = glm::rotate(glm::mat4(1.0f), -2.0f * animationTime, glm::vec3(0.0f, 1.0f, 0.0f));
+    m_scene.buildProceduralGeometryAABBs();
 
-    auto setTransformAABB = [&](uint32_t primitiveIndex, glm::mat4& this_scale, glm::mat4& this_rotation) {
-      glm::vec3 vTranslation =
-              0.5f * (glm::vec3(m_aabbs[primitiveIndex].minX, m_aabbs[primitiveIndex].minY, m_aabbs[primitiveIndex].minZ)
-                      + glm::vec3(m_aabbs[primitiveIndex].maxX, m_aabbs[primitiveIndex].maxY, m_aabbs[primitiveIndex].maxZ));
-      glm::mat4 translation = glm::translate(glm::mat4(1.0f), vTranslation);
+    std::vector<VkAabbPositionsKHR> const& aabbs = m_scene.getAABBs();
+    VkDeviceSize aabbBufferSize = sizeof(VkAabbPositionsKHR) * aabbs.size();
 
-      glm::mat4 transform = translation * this_rotation * this_scale;
-      m_aabbPrimitiveAttributeBuffer[primitiveIndex].localSpaceToBottomLevelAS = transform;
-      m_aabbPrimitiveAttributeBuffer[primitiveIndex].bottomLevelASToLocalSpace = glm::inverse(transform);
-    };
+    m_aabbBuffer = m_uploader.createBuffer(VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR, aabbs.data(), aabbBufferSize);
+}
 
-    uint32_t offset = 0;
+void CRayTracing::buildPlaneGeometry() {
+    m_scene.buildPlaneGeometry();
 
-    {
-        setTransformAABB(offset + AnalyticPrimitive::AABB, scale15y, identity);
-        setTransformAABB(offset + AnalyticPrimitive::Spheres, scale15, rotation);
-        offset += AnalyticPrimitive::Count;
+    std::vector<Index> indices = m_scene.getPlaneIndices();
+    std::vector<Vertex> vertices = m_scene.getPlaneVertices();
+
+    uint32_t indicesSize = static_cast<uint32_t>(indices.size() * sizeof(Index));
+    uint32_t verticesSize = static_cast<uint32_t>(vertices.size() * sizeof(Vertex));
+
+    m_indexBuffer = m_uploader.createBuffer(VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR, indices.data(), indicesSize);
+    m_vertexBuffer = m_uploader.createBuffer(VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR, vertices.data(), verticesSize);
+
+    std::vector<uint32_t> faces;
+    for(uint32_t index = 0; index < indices.size(); index += 3) {
+        faces.push_back(indices[index + 0]);
+        faces.push_back(indices[index + 1]);
+        faces.push_back(indices[index + 2]);
+        faces.push_back(0);
     }
 
-    {
-        setTransformAABB(offset + VolumetricPrimitive::Metaballs, scale15, rotation);
-        offset += VolumetricPrimitive::Count;
+    m_facesBuffer = m_uploader.createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, faces.data(), faces.size() * sizeof(uint32_t));
+
+    std::vector<glm::vec4> normals = m_scene.getPlaneNormals();
+    uint32_t normalsSize = static_cast<uint32_t>(normals.size() * sizeof(glm::vec4));
+
+    m_normalBuffer = m_uploader.createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, normals.data(), normalsSize);
+    // TODO: create buffers
+}
+
+void CRayTracing::update(uint32_t frameSlot) {
+
+    float elapsedTime = 1.0f / 60.0f;
+
+    m_scene.update(elapsedTime);
+
+    updateAccumulation();
+
+    updateSceneBuffer(frameSlot);
+
+    updateAABBPrimitiveBuffer(frameSlot);
+
+    m_uploader.nextFrame();
+
+    if (m_dynamicScene) {
+        updateTopLevelAccelerationStructure(frameSlot);
     }
+}
 
-    {
-        setTransformAABB(offset + SignedDistancePrimitive::MiniSpheres, identity, identity);
-        setTransformAABB(offset + SignedDistancePrimitive::IntersectedRoundCube, identity, identity);
-        setTransformAABB(offset + SignedDistancePrimitive::SquareTorus, scale15, identity);
-        setTransformAABB(offset + SignedDistancePrimitive::TwistedTorus, identity, rotation);
-        setTransformAABB(offset + SignedDistancePrimitive::Cog, identity, rotation);
-        setTransformAABB(offset + SignedDistancePrimitive::Cylinder, scale15y, identity);
-        setTransformAABB(offset + SignedDistancePrimitive::FractalPyramid, scale3, identity);
+void CRayTracing::updateAccumulation() {
+    SceneConstantBuffer& sceneConstants = m_scene.getSceneConstantBuffer();
+    sceneConstants.sampleIndex = 0;
+    sceneConstants.accumulate = m_accumulationTarget > 0 ? 1 : 0;
+
+    if (m_accumulationTarget == 0) {
+        return;
+    }
+
+    // camera, light and geometry time all end up in the scene constants, any change of them
+    // makes the average so far stale
+    if (m_accumulatedSamples > 0 && memcmp(&sceneConstants, &m_accumulatedSceneConstants, sizeof(SceneConstantBuffer)) != 0) {
+        m_accumulatedSamples = 0;
+    }
+    if (m_accumulatedSamples == 0) {
+        m_accumulatedSceneConstants = sceneConstants;
     }
+
+    sceneConstants.sampleIndex = m_accumulatedSamples++;
 }
 
-void CRayTracing::buildProceduralGeometryAABBs() {
+bool CRayTracing::isConverged() const {
+    return m_accumulationTarget > 0 && m_accumulatedSamples >= m_accumulationTarget && m_requestedQualityTier == m_qualityTier;
+}
 
-    {
-        glm::ivec3 aabbGrid = glm::ivec3(4, 1, 4);
-        glm::vec3 const basePosition = glm::vec3(
-            -(aabbGrid.x * kAabbWidth + (aabbGrid.x - 1) * kAabbDistance) / 2.0f,
-            -(aabbGrid.y * kAabbWidth + (aabbGrid.y - 1) * kAabbDistance) / 2.0f,
-            -(aabbGrid.z * kAabbWidth + (aabbGrid.z - 1) * kAabbDistance) / 2.0f
-        );
-
-        glm::vec3 stride = glm::vec3(kAabbWidth + kAabbDistance, kAabbWidth + kAabbDistance, kAabbWidth + kAabbDistance);
-
-        auto initializeAABB = [&](glm::vec3 const& offsetIndex, glm::vec3 const& size) {
-            return VkAabbPositionsKHR {
-                basePosition.x + offsetIndex.x * stride.x,
-                basePosition.y + offsetIndex.y * stride.y,
-                basePosition.z + offsetIndex.z * stride.z,
-                basePosition.x + offsetIndex.x * stride.x + size.x,
-                basePosition.y + offsetIndex.y * stride.y + size.y,
-                basePosition.z + offsetIndex.z * stride.z + size.z,
-            };
-        };
-
-        m_aabbs.resize(IntersectionShaderType::kTotalPrimitiveCount);
-
-        uint32_t offset = 0;
-
-        {
-            m_aabbs[offset + AnalyticPrimitive::AABB] = initializeAABB(glm::ivec3(3, 0, 0), glm::vec3(2.0f, 3.0f, 2.0f));
-            m_aabbs[offset + AnalyticPrimitive::Spheres] = initializeAABB(glm::vec3(2.25f, 0.0f, 0.75f), glm::vec3(3.0f, 3.0f, 3.0f));
-            offset += AnalyticPrimitive::Count;
-        }
+void CRayTracing::createTopLevelSlots() {
+    for (uint32_t frameSlot = 0; frameSlot < m_topLevelSlots.size(); ++frameSlot) {
+        finishTopLevelUpdate(frameSlot);
+    }
 
-        {
-            m_aabbs[offset + VolumetricPrimitive::Metaballs] = initializeAABB(glm::ivec3(0, 0, 0), glm::vec3(3.0f, 3.0f, 3.0f));
-            offset += VolumetricPrimitive::Count;
-        }
+    // the latest TLAS becomes the one of slot 0, the others are created again
+    if (m_topLevelLatestSlot != 0) {
+        std::swap(m_topLevelAs, m_topLevelSlots[m_topLevelLatestSlot].accelerationStructure);
+        std::swap(m_topLevelAsBuffer, m_topLevelSlots[m_topLevelLatestSlot].buffer);
+    }
+    for (size_t frameSlot = 1; frameSlot < m_topLevelSlots.size(); ++frameSlot) {
+        vkDestroyAccelerationStructureKHR(m_device, m_topLevelSlots[frameSlot].accelerationStructure, nullptr);
+        m_helper.destroyBuffer(m_topLevelSlots[frameSlot].buffer);
+    }
+    for (size_t frameSlot = 0; frameSlot < m_topLevelSlots.size(); ++frameSlot) {
+        vkFreeCommandBuffers(m_device, m_computeCommandPool, 1, &m_topLevelSlots[frameSlot].commandBuffer);
+    }
+    if (m_topLevelUpdateQueryPool != VK_NULL_HANDLE) {
+        vkDestroyQueryPool(m_device, m_topLevelUpdateQueryPool, nullptr);
+    }
 
-        {
-            m_aabbs[offset + SignedDistancePrimitive::MiniSpheres] = initializeAABB(glm::ivec3(2, 0, 0), glm::vec3(2.0f, 2.0f, 2.0f));
-            m_aabbs[offset + SignedDistancePrimitive::TwistedTorus] = initializeAABB(glm::ivec3(0, 0, 1), glm::vec3(2.0f, 2.0f, 2.0f));
-            m_aabbs[offset + SignedDistancePrimitive::IntersectedRoundCube] = initializeAABB(glm::ivec3(0, 0, 2), glm::vec3(2.0f, 2.0f, 2.0f));
-            m_aabbs[offset + SignedDistancePrimitive::SquareTorus] = initializeAABB(glm::vec3(0.75f, -0.1f, 2.25f), glm::vec3(3.0f, 3.0f, 3.0f));
-            m_aabbs[offset + SignedDistancePrimitive::Cog] = initializeAABB(glm::ivec3(1, 0, 0), glm::vec3(2.0f, 2.0f, 2.0f));
-            m_aabbs[offset + SignedDistancePrimitive::Cylinder] = initializeAABB(glm::ivec3(0, 0, 3), glm::vec3(2.0f, 3.0f, 2.0f));
-            m_aabbs[offset + SignedDistancePrimitive::FractalPyramid] = initializeAABB(glm::ivec3(2, 0, 2), glm::vec3(6.0f, 6.0f, 6.0f));
-        }
+    if (m_computeCommandPool == VK_NULL_HANDLE) {
+        // the command buffer of a slot is recorded again for every refit
+        VkCommandPoolCreateInfo commandPoolInfo = {};
+        commandPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        commandPoolInfo.queueFamilyIndex = m_computeQueueFamily;
+        commandPoolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+        VK_CHECK(vkCreateCommandPool(m_device, &commandPoolInfo, nullptr, &m_computeCommandPool));
+
+        VkSemaphoreTypeCreateInfo semaphoreTypeInfo = {};
+        semaphoreTypeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+        semaphoreTypeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+        semaphoreTypeInfo.initialValue = m_topLevelTimelineValue;
+
+        VkSemaphoreCreateInfo semaphoreInfo = {};
+        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        semaphoreInfo.pNext = &semaphoreTypeInfo;
+        VK_CHECK(vkCreateSemaphore(m_device, &semaphoreInfo, nullptr, &m_topLevelTimeline));
+    }
 
-        for (size_t index = 0; index < m_aabbs.size(); ++index) {
-            VulkanBuffer aabbBuffer = m_helper.createBuffer(VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR, sizeof(VkAabbPositionsKHR), VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-            m_helper.copyToBuffer(aabbBuffer, &m_aabbs[index], sizeof(VkAabbPositionsKHR));
-            m_aabbBuffers.push_back(aabbBuffer);
+    // the refit of a slot reads its instances while the CPU writes the ones of the next slot
+    m_helper.destroyBuffer(m_topLevelInstanceBuffer);
+    m_topLevelInstanceSlotSize = static_cast<uint32_t>(sizeof(VkAccelerationStructureInstanceKHR) * m_topLevelInstances.size());
+    m_topLevelInstanceBuffer = m_helper.createBuffer(VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR, m_topLevelInstanceSlotSize * m_framesInFlight, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 0, true);
+
+    m_topLevelSlots.assign(m_framesInFlight, TopLevelSlot());
+    for (uint32_t frameSlot = 0; frameSlot < m_framesInFlight; ++frameSlot) {
+        TopLevelSlot& slot = m_topLevelSlots[frameSlot];
+        if (frameSlot == 0) {
+            slot.accelerationStructure = m_topLevelAs;
+            slot.buffer = m_topLevelAsBuffer;
         }
+        else {
+            slot.buffer = m_helper.createBuffer(VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, m_topLevelAsBuffer.size, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, true);
+
+            VkAccelerationStructureCreateInfoKHR accelerationStructureInfo = {};
+            accelerationStructureInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+            accelerationStructureInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+            accelerationStructureInfo.buffer = slot.buffer.handle;
+            accelerationStructureInfo.size = m_topLevelAsBuffer.size;
+            VK_CHECK(vkCreateAccelerationStructureKHR(m_device, &accelerationStructureInfo, nullptr, &slot.accelerationStructure));
+        }
+
+        VkCommandBufferAllocateInfo commandBufferAllocInfo = {};
+        commandBufferAllocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        commandBufferAllocInfo.commandPool = m_computeCommandPool;
+        commandBufferAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        commandBufferAllocInfo.commandBufferCount = 1;
+        VK_CHECK(vkAllocateCommandBuffers(m_device, &commandBufferAllocInfo, &slot.commandBuffer));
     }
+    m_topLevelLatestSlot = 0;
+
+    VkQueryPoolCreateInfo queryPoolInfo = {};
+    queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    queryPoolInfo.queryCount = 2 * m_framesInFlight;
+    VK_CHECK(vkCreateQueryPool(m_device, &queryPoolInfo, nullptr, &m_topLevelUpdateQueryPool));
 }
 
-void CRayTracing::buildPlaneGeometry() {
-    Index indices[] = {
-        3, 1, 0,
-        2, 1, 3
-    };
+void CRayTracing::updateTopLevelAccelerationStructure(uint32_t frameSlot) {
+    // the frame of the slot waited for the refit before tracing and is done, so this does not block
+    finishTopLevelUpdate(frameSlot);
 
-    Vertex vertices[] = {
-        { glm::vec3(0.0f, 0.0f, 0.0f) },
-        { glm::vec3(1.0f, 0.0f, 0.0f) },
-        { glm::vec3(1.0f, 0.0f, 1.0f) },
-        { glm::vec3(0.0f, 0.0f, 1.0f) },
-    };
+    TopLevelSlot& slot = m_topLevelSlots[frameSlot];
+    VkAccelerationStructureKHR sourceAs = m_topLevelSlots[m_topLevelLatestSlot].accelerationStructure;
 
-    m_indexBuffer = m_helper.createBuffer(VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR, sizeof(indices), VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-    m_helper.copyToBuffer(m_indexBuffer, indices, sizeof(indices));
-    m_vertexBuffer = m_helper.createBuffer(VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR, sizeof(vertices), VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-    m_helper.copyToBuffer(m_vertexBuffer, vertices, sizeof(vertices));
-
-    std::vector<uint32_t> faces;
-    for(uint32_t index = 0; index < sizeof(indices) / sizeof(Index); index += 3) {
-        faces.push_back(indices[index + 0]);
-        faces.push_back(indices[index + 1]);
-        faces.push_back(indices[index + 2]);
-        faces.push_back(0);
+    // the plane instance stays put, the AABB instances follow the scene
+    float maxDisplacement = 0.0f;
+    for (size_t index = 1; index < m_topLevelInstances.size(); ++index) {
+        m_topLevelInstances[index].transform = toTransformMatrix(m_scene.getAABBInstanceTransform(static_cast<uint32_t>(index - 1)));
+        maxDisplacement = std::max(maxDisplacement, glm::length(getInstancePosition(m_topLevelInstances[index]) - m_topLevelBuildPositions[index]));
     }
 
-    m_facesBuffer = m_helper.createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, faces.size() * sizeof(uint32_t), VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-    m_helper.copyToBuffer(m_facesBuffer, faces.data(), static_cast<uint32_t>(faces.size() * sizeof(uint32_t)));
+    // a refit only moves the bounds of the existing nodes, the further the instances get from
+    // where the tree was built, the more the nodes overlap and the slower traversal gets
+    bool rebuild = maxDisplacement > kTopLevelRebuildDisplacement || m_topLevelUpdatesSinceRebuild >= kTopLevelMaxUpdates;
 
-    glm::vec4 normals[] = {
-        glm::vec4(0.0f, 1.0f, 0.0f, 0.0f),
-        glm::vec4(0.0f, 1.0f, 0.0f, 0.0f),
-        glm::vec4(0.0f, 1.0f, 0.0f, 0.0f),
-        glm::vec4(0.0f, 1.0f, 0.0f, 0.0f),
-    };
+    m_helper.copyToBuffer(m_topLevelInstanceBuffer, m_topLevelInstances.data(), m_topLevelInstanceSlotSize, frameSlot * m_topLevelInstanceSlotSize);
 
-    m_normalBuffer = m_helper.createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, sizeof(normals), VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-    m_helper.copyToBuffer(m_normalBuffer, normals, sizeof(normals));
-    // TODO: create buffers
-}
+    VkAccelerationStructureGeometryKHR topLevelGeometry = m_topLevelGeometry;
+    topLevelGeometry.geometry.instances.data.deviceAddress = m_topLevelInstanceBuffer.address + frameSlot * m_topLevelInstanceSlotSize;
 
-void CRayTracing::update() {
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    VK_CHECK(vkBeginCommandBuffer(slot.commandBuffer, &beginInfo));
 
-    float elapsedTime = 1.0f / 60.0f;
+    vkCmdResetQueryPool(slot.commandBuffer, m_topLevelUpdateQueryPool, 2 * frameSlot, 2);
 
-    // Rotate the camera around Y axis.
-    {
+    // the refit before wrote the source TLAS and the scratch buffer on this queue. The frames
+    // tracing the TLAS of this slot are done, they only read it, so nothing waits for the graphics queue.
+    VkMemoryBarrier buildBarrier = {};
+    buildBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    buildBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    buildBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    vkCmdPipelineBarrier(slot.commandBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &buildBarrier, 0, nullptr, 0, nullptr);
 
-        if (m_animateCamera)
-        {
-            float secondsToRotateAround = 48.0f;
-            float angleToRotateBy = 360.0f * (elapsedTime / secondsToRotateAround);
-            glm::mat4 rotate = glm::rotate(glm::mat4(1.0), glm::radians(angleToRotateBy), glm::vec3(0.0f, 1.0f, 0.0f));
-            m_eye = rotate * m_eye;
-            m_up = rotate * m_up;
-            m_at = rotate * m_at;
-            updateCameraMatrices();
-        }
+    vkCmdWriteTimestamp(slot.commandBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, m_topLevelUpdateQueryPool, 2 * frameSlot);
+
+    VkAccelerationStructureBuildRangeInfoKHR topLevelBuildRangeInfo = {};
+    topLevelBuildRangeInfo.primitiveCount = static_cast<uint32_t>(m_topLevelInstances.size());
+
+    // an update may write a different TLAS than it reads, so the one of the frame before stays intact
+    VkAccelerationStructureBuildGeometryInfoKHR asBuildInfo = {};
+    asBuildInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+    asBuildInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+    asBuildInfo.flags = m_topLevelBuildFlags;
+    asBuildInfo.mode = rebuild ? VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR : VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR;
+    asBuildInfo.srcAccelerationStructure = rebuild ? VK_NULL_HANDLE : sourceAs;
+    asBuildInfo.dstAccelerationStructure = slot.accelerationStructure;
+    asBuildInfo.geometryCount = 1;
+    asBuildInfo.pGeometries = &topLevelGeometry;
+    asBuildInfo.scratchData.deviceAddress = m_topLevelScratchBuffer.address;
+
+    VkAccelerationStructureBuildRangeInfoKHR* asOffsetInfo = &topLevelBuildRangeInfo;
+    vkCmdBuildAccelerationStructuresKHR(slot.commandBuffer, 1, &asBuildInfo, &asOffsetInfo);
+
+    vkCmdWriteTimestamp(slot.commandBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, m_topLevelUpdateQueryPool, 2 * frameSlot + 1);
+
+    VK_CHECK(vkEndCommandBuffer(slot.commandBuffer));
+
+    // the frame traces once the timeline reaches the value, the semaphore makes the build visible to it
+    ++m_topLevelTimelineValue;
 
+    VkTimelineSemaphoreSubmitInfo timelineInfo = {};
+    timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timelineInfo.signalSemaphoreValueCount = 1;
+    timelineInfo.pSignalSemaphoreValues = &m_topLevelTimelineValue;
 
-        if (m_animateLight)
-        {
-            float secondsToRotateAround = 8.0f;
-            float angleToRotateBy = -360.0f * (elapsedTime / secondsToRotateAround);
-            glm::mat4 rotate = glm::rotate(glm::mat4(1.0), glm::radians(angleToRotateBy), glm::vec3(0.0f, 1.0f, 0.0f));
-            glm::vec4 prevLightPosition = m_sceneCB.lightPosition;
-            m_sceneCB.lightPosition = rotate * prevLightPosition;
+    VkSubmitInfo submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.pNext = &timelineInfo;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &slot.commandBuffer;
+    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.pSignalSemaphores = &m_topLevelTimeline;
+    VK_CHECK(vkQueueSubmit(m_computeQueue, 1, &submitInfo, VK_NULL_HANDLE));
+
+    slot.pendingValue = m_topLevelTimelineValue;
+    slot.pendingRebuild = rebuild;
+    m_topLevelLatestSlot = frameSlot;
+
+    if (rebuild) {
+        for (size_t index = 0; index < m_topLevelInstances.size(); ++index) {
+            m_topLevelBuildPositions[index] = getInstancePosition(m_topLevelInstances[index]);
         }
+        m_topLevelUpdatesSinceRebuild = 0;
+    }
+    else {
+        ++m_topLevelUpdatesSinceRebuild;
+    }
+}
 
-        static float animateGeometryTime = 0.0f;
-        animateGeometryTime += elapsedTime;
+void CRayTracing::finishTopLevelUpdate(uint32_t frameSlot) {
+    TopLevelSlot& slot = m_topLevelSlots[frameSlot];
+    if (slot.pendingValue == 0) {
+        return;
+    }
 
-        updateAABBPrimitivesAttributes(animateGeometryTime);
+    VkSemaphoreWaitInfo waitInfo = {};
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    waitInfo.semaphoreCount = 1;
+    waitInfo.pSemaphores = &m_topLevelTimeline;
+    waitInfo.pValues = &slot.pendingValue;
+    VK_CHECK(vkWaitSemaphores(m_device, &waitInfo, UINT64_MAX));
 
-        m_sceneCB.elapsedTime = animateGeometryTime;
+    uint64_t timestamps[2] = {};
+    VK_CHECK(vkGetQueryPoolResults(m_device, m_topLevelUpdateQueryPool, 2 * frameSlot, 2, sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+    double milliseconds = static_cast<double>(timestamps[1] - timestamps[0]) * m_timestampPeriod / 1000000.0;
 
-        updateSceneBuffer();
+    if (slot.pendingRebuild) {
+        ++m_topLevelUpdateStats.rebuildCount;
+        m_topLevelUpdateStats.rebuildMilliseconds += milliseconds;
+    }
+    else {
+        ++m_topLevelUpdateStats.updateCount;
+        m_topLevelUpdateStats.updateMilliseconds += milliseconds;
+    }
+
+    slot.pendingValue = 0;
+}
 
-        updateAABBPrimitiveBuffer();
+void CRayTracing::printTopLevelUpdateReport() {
+    if (!m_dynamicScene) {
+        return;
+    }
 
+    for (uint32_t frameSlot = 0; frameSlot < m_topLevelSlots.size(); ++frameSlot) {
+        finishTopLevelUpdate(frameSlot);
     }
+
+    TopLevelUpdateStats const& stats = m_topLevelUpdateStats;
+    printf("tlas updates: %u refits avg %.4f ms, %u rebuilds avg %.4f ms (%u instances, rebuild after %.2f units or %u refits)\n",
+           stats.updateCount,
+           stats.updateCount > 0 ? stats.updateMilliseconds / stats.updateCount : 0.0,
+           stats.rebuildCount,
+           stats.rebuildCount > 0 ? stats.rebuildMilliseconds / stats.rebuildCount : 0.0,
+           static_cast<uint32_t>(m_topLevelInstances.size()),
+           kTopLevelRebuildDisplacement,
+           kTopLevelMaxUpdates);
+}
+
+glm::vec3 CRayTracing::getInstancePosition(VkAccelerationStructureInstanceKHR const& instance) {
+    return glm::vec3(instance.transform.matrix[0][3], instance.transform.matrix[1][3], instance.transform.matrix[2][3]);
 }
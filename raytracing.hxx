@@ -4,60 +4,283 @@
 #include <stdio.h>
 #include <vector>
 #include <string>
+#include <thread>
+#include <atomic>
 
 //#include "shader.hxx"
 #include "vulkanhelper.hxx"
-#include "raytracingscenedefines.hxx"
+#include "vulkanallocator.hxx"
+#include "accelerationstructurebuilder.hxx"
+#include "uploadmanager.hxx"
+#include "shaderbindingtable.hxx"
+#include "pipelinecache.hxx"
+#include "pipelinecompiler.hxx"
+#include "mappedfile.hxx"
+#include "gpuprofiler.hxx"
+#include "raytracingscene.hxx"
 
-struct BottomLevelAccelerationStructure {
-    VulkanBuffer buffer;
-    VkAccelerationStructureKHR handle;
-    VkDeviceAddress gpuAddress;
+namespace ProceduralGeometryLayout {
+    enum Enum {
+        // one single AABB BLAS, TLAS instance and hit record per procedural primitive
+        PerPrimitive = 0,
+        // one BLAS per intersection shader type with all of its AABBs in one geometry and one
+        // hit record per type, the shaders add gl_PrimitiveID to the first primitive of the record
+        PerIntersectionType,
+        Count
+    };
+}
+
+namespace QualityTier {
+    enum Enum {
+        Preview = 0,
+        Balanced,
+        // the values the shaders were written with
+        Final,
+        Count
+    };
+}
+
+// Set through specialization constants, the constant ids are shared by all shaders:
+// 1 maxRecursionDepth, 2 signedDistanceMaxSteps, 3 signedDistanceThreshold, 4 metaballMaxSteps.
+struct QualitySettings {
+    // the closest hit shaders stop tracing beyond it, the pipeline gets one level more
+    uint32_t maxRecursionDepth;
+    uint32_t signedDistanceMaxSteps;
+    // the sphere tracing stops once the distance is below threshold * t
+    float signedDistanceThreshold;
+    uint32_t metaballMaxSteps;
 };
 
 class CRayTracing
 {
 public:
     CRayTracing(VkInstance instance, VkDevice device, VkPhysicalDevice gpu, VkQueue queue, VkCommandPool commandPool, VkPhysicalDeviceRayTracingPipelinePropertiesKHR const& raytracingPipelineProperties);
+    // waits for a pipeline compile still running in the background
+    ~CRayTracing();
+    // Has to be called before init() if the queue is not from family 0 or there is a separate
+    // transfer queue for the uploads, otherwise the uploads run on the queue.
+    void setQueueFamilies(uint32_t queueFamily, VkQueue transferQueue, uint32_t transferQueueFamily);
+    // The TLAS refits and rebuilds of the dynamic scene go to this queue, on a compute only family
+    // they run beside the trace of the frame before. Has to be called before setDynamicScene(),
+    // otherwise they go to the queue.
+    void setComputeQueue(VkQueue computeQueue, uint32_t computeQueueFamily);
     void init();
     void initScene();
+    // createPipeline() loads the pipeline cache from this file and writes it back, empty disables it
+    void setPipelineCachePath(std::string const& path) { m_pipelineCachePath = path; }
+    // threadCount == 0 uses one per hardware thread, 1 compiles on the calling thread
+    void setPipelineCompileThreads(uint32_t threadCount) { m_pipelineCompileThreads = threadCount; }
+    // Builds raygen/miss and every hit group as a separate pipeline library and links them,
+    // so changing one intersection shader only compiles its hit group again. Otherwise the
+    // pipeline is compiled as a whole, which gives the driver the most room to optimize.
+    void setPipelineLibraries(bool pipelineLibraries) { m_usePipelineLibraries = pipelineLibraries; }
+    // Adds a hit group per procedural primitive type whose intersection shader gets the type as
+    // specialization constant, so its switch over the types folds to the one branch and the
+    // threads of a warp hitting different types no longer run each others code. With the
+    // PerPrimitive layout the hit record of every AABB uses the group of its type, the
+    // PerIntersectionType records cover several types and keep the generic groups.
+    // Has to be set before createShaderStages().
+    void setSpecializedIntersectionShaders(bool specialized) { m_specializedIntersectionShaders = specialized; }
+    uint32_t getIntersectionVariantCount() const { return static_cast<uint32_t>(m_intersectionVariants.size()); }
+    std::string getIntersectionVariantName(uint32_t variant) const;
+    // Points the hit records of the primitives of a variant at its specialized or at the generic
+    // hit group, frames submitted afterwards trace with it.
+    void setIntersectionVariantSpecialized(uint32_t variant, bool specialized);
+    // the tier createPipeline() builds, later changes go through requestQualityTier()
+    void setQualityTier(QualityTier::Enum tier) { m_qualityTier = tier; m_requestedQualityTier = tier; }
+    QualityTier::Enum getQualityTier() const { return m_qualityTier; }
+    static QualitySettings getQualitySettings(QualityTier::Enum tier);
+    static char const* getQualityTierName(QualityTier::Enum tier);
     VkPipeline createPipeline(VkPipelineLayout pipelineLayout);
+    VkPipeline getPipeline() const { return m_raytracingPipeline; }
+    // Compiles the pipeline of the tier on a background thread, unless it was built before.
+    // The frame loop keeps running with the current pipeline until updateQualityTier() swaps.
+    void requestQualityTier(QualityTier::Enum tier);
+    // Call once per frame before submitting. Returns true if the pipeline of the requested tier
+    // was swapped in, frames submitted from now on have to bind getPipeline() and the shader
+    // binding table already holds its handles. The pipelines of all tiers stay alive, so frames
+    // in flight keep tracing with the old one.
+    bool updateQualityTier();
+    // Replaces the intersection shader of a type and returns the new pipeline, the shader
+    // binding table is updated for it. Waits for the queue, command buffers recorded with
+    // the old pipeline have to be recorded again.
+    VkPipeline setIntersectionShader(IntersectionShaderType::Enum type, std::string const& name);
+    // compiles variantCount copies of the pipeline without the cache, once on one thread and once
+    // with the compile threads, and prints both times.
+    void benchmarkPipelineCompilation(VkPipelineLayout pipelineLayout, uint32_t variantCount);
     void createCommandBuffers();
-    void createShader(VkShaderStageFlagBits type, std::string const& shader_source);
-    void createShaderStages();
+    // The SPIR-V is embedded at build time, name is the file name in shader/ without extension.
+    // A file <name>.spv in the shader directory is used instead if it exists.
+    void setShaderDirectory(std::string const& directory) { m_shaderDirectory = directory; }
+    void createShader(VkShaderStageFlagBits type, std::string const& name);
+    // false if a shader is neither embedded nor in the shader directory
+    bool createShaderStages();
     //std::vector<VkRayTracingShaderGroupCreateInfoNV> const& createShaderGroups();
     void createSceneBuffer();
-    void updateSceneBuffer();
+    void updateSceneBuffer(uint32_t frameSlot);
     void createAABBPrimitiveBuffer();
-    void updateAABBPrimitiveBuffer();
+    void updateAABBPrimitiveBuffer(uint32_t frameSlot);
     void createPrimitives();
-    void updateCameraMatrices();
     void updateAABBPrimitivesAttributes(float animationTime);
     void buildProceduralGeometryAABBs();
     void buildPlaneGeometry();
     void buildTriangleAccelerationStructure();
     void buildAccelerationStructurePlane();
-    BottomLevelAccelerationStructure createBottomLevelAccelerationStructure(VkAccelerationStructureBuildSizesInfoKHR const& asBuildSizes);
 
-    void updateDescriptors(VkDescriptorSet descriptorSet);
+    // The rays are traced into the offscreen image. The dynamic scene has a TLAS per frame slot,
+    // the set binds the one of frameSlot.
+    void updateDescriptors(VkDescriptorSet descriptorSet, uint32_t frameSlot = 0);
+    // the rays are traced into the view, a swapchain image created with storage usage for example
+    void updateDescriptors(VkDescriptorSet descriptorSet, VkImageView outputImageView, uint32_t frameSlot = 0);
     VulkanImage createOffscreenImage(VkFormat format, uint32_t width, uint32_t height);
 
-    PrimitiveConstantBuffer& getPlaneMaterialBuffer() { return m_planeMaterialCB; }
+    PrimitiveConstantBuffer& getPlaneMaterialBuffer() { return m_scene.getPlaneMaterialBuffer(); }
+    CRayTracingScene& getScene() { return m_scene; }
+
+    // built by createPipeline(), the hit region has one record per BLAS
+    CShaderBindingTable& getShaderBindingTable() { return m_shaderBindingTable; }
+
+    CVulkanHelper& getHelper() { return m_helper; }
+    CVulkanAllocator& getAllocator() { return m_allocator; }
+    CUploadManager& getUploader() { return m_uploader; }
 
-    VulkanBuffer getRayGenShaderGroups();
-    VulkanBuffer getMissShaderGroups();
-    VulkanBuffer getHitShaderGroups();
+    // Has to be set before the acceleration structures and the shader binding table are built.
+    void setProceduralGeometryLayout(ProceduralGeometryLayout::Enum layout) { m_proceduralGeometryLayout = layout; }
+    ProceduralGeometryLayout::Enum getProceduralGeometryLayout() const { return m_proceduralGeometryLayout; }
+    // Builds the BLASes and the TLAS with ALLOW_COMPACTION and copies them into right-sized buffers.
+    void setAccelerationStructureCompaction(bool compaction) { m_accelerationStructureCompaction = compaction; }
+    // Moves the AABB instances every frame and refits the TLAS (built with ALLOW_UPDATE) in
+    // update(), with a full rebuild once the instances got too far from the built tree.
+    // Every frame slot has its own TLAS, the refit into it starts from the one of the frame
+    // before, which can still be traced meanwhile. Has to be set before the acceleration
+    // structures are built.
+    void setDynamicScene(bool dynamicScene);
+    bool getDynamicScene() const { return m_dynamicScene; }
+    // Timeline semaphore the refits signal on the compute queue. The frame submitted after
+    // update() has to wait for getTopLevelTimelineValue() before it traces, VK_NULL_HANDLE
+    // without a dynamic scene.
+    VkSemaphore getTopLevelTimeline() const { return m_topLevelTimeline; }
+    uint64_t getTopLevelTimelineValue() const { return m_topLevelTimelineValue; }
+    // average GPU time of the TLAS refits vs rebuilds so far
+    void printTopLevelUpdateReport();
+    // times the acceleration structure builds, has to be set before they are built
+    void setProfiler(CGpuProfiler* profiler);
 
-    void update();
+    // The scene buffer, the per frame primitive attributes and the TLAS of the dynamic scene have
+    // one slot per frame in flight, update() writes the slot of its frame while the GPU still reads
+    // the others. Recreates them if they exist, the descriptors have to be updated afterwards.
+    void setFramesInFlight(uint32_t framesInFlight);
+    uint32_t getFramesInFlight() const { return m_framesInFlight; }
+    // dynamic offsets of a frame slot for vkCmdBindDescriptorSets
+    std::vector<uint32_t> getDynamicOffsets(uint32_t frameSlot) const;
+
+    // frameSlot must not be in use by the GPU anymore
+    void update(uint32_t frameSlot);
+
+    // Averages the frames in an rgba32f image (binding 7) while the scene constants and the
+    // pipeline stay the same, with the camera rays jittered within their pixel. Any change starts
+    // over. 0 turns it off, has to be set before createAccumulationImage().
+    void setAccumulation(uint32_t targetSamples) { m_accumulationTarget = targetSamples; }
+    uint32_t getAccumulatedSamples() const { return m_accumulatedSamples; }
+    // The target sample count is reached, tracing further frames would not change the image. A
+    // requested quality tier keeps it false until its pipeline is swapped in.
+    bool isConverged() const;
+    // the size of the traced image, 1x1 without accumulation as the shader binds it either way
+    void createAccumulationImage(uint32_t width, uint32_t height);
 
 private:
     void createRayGenShaderGroups();
     void createMissShaderGroups();
     void createHitShaderGroups();
 
-    void createRayGenShaderTable();
-    void createMissShaderTable();
-    void createHitShaderTable();
+    struct ShaderCode {
+        uint32_t const* code;
+        // in bytes
+        size_t size;
+        // only open if the code comes from the shader directory
+        CMappedFile file;
+    };
+
+    bool getShaderCode(std::string const& name, ShaderCode& code);
+    // can be called from several threads at once
+    VkShaderModule createShaderModule(ShaderCode const& code);
+    // not part of the pipeline cache key, which create() has fixed before a module is replaced
+    VkShaderModule loadShaderModule(std::string const& name);
+    VkRayTracingPipelineCreateInfoKHR getPipelineCreateInfo(VkPipelineLayout pipelineLayout);
+
+    struct IntersectionVariant {
+        IntersectionShaderType::Enum type;
+        // specialization constant 0 of the intersection shader
+        uint32_t primitiveType;
+        // in m_shaderStages and m_shaderGroups
+        uint32_t stage;
+        uint32_t hitGroup;
+    };
+
+    // the specialization constants of a stage, constant id 0 to 4 in order
+    struct ShaderSpecialization {
+        // 0xffffffff unless the stage belongs to an intersection variant
+        uint32_t primitiveType;
+        uint32_t maxRecursionDepth;
+        uint32_t signedDistanceMaxSteps;
+        float signedDistanceThreshold;
+        uint32_t metaballMaxSteps;
+    };
+
+    void createIntersectionVariants();
+    // UINT32_MAX if there is no specialized variant for it
+    uint32_t findIntersectionVariant(IntersectionShaderType::Enum type, uint32_t primitiveType) const;
+    uint32_t getGenericHitGroup(IntersectionShaderType::Enum type) const;
+
+    // fills the specialization of every stage for every tier, m_shaderStages points at the current tier
+    void createShaderSpecializations();
+    void setStageSpecializations(QualityTier::Enum tier);
+    // maxPipelineRayRecursionDepth of the tier, limited by the device
+    uint32_t getPipelineRecursionDepth(QualityTier::Enum tier) const;
+    // starts the background compile of m_requestedQualityTier
+    void buildQualityTierPipeline();
+    void joinQualityTierThread();
+    // destroys the pipelines of all tiers but the current one
+    void destroyQualityTierPipelines();
+
+    struct PipelineLibrary {
+        // range in m_shaderGroups, the linked pipeline keeps the group indices
+        uint32_t firstGroup;
+        uint32_t groupCount;
+        std::vector<VkPipelineShaderStageCreateInfo> stages;
+        std::vector<VkRayTracingShaderGroupCreateInfoKHR> groups;
+        VkPipeline pipeline;
+    };
+
+    void createPipelineLibraries();
+    VkRayTracingPipelineCreateInfoKHR getPipelineLibraryCreateInfo(PipelineLibrary& library);
+    // compiles the libraries at the given indices again, replacing the old ones
+    bool compilePipelineLibraries(std::vector<uint32_t> const& libraries);
+    VkPipeline linkPipelineLibraries();
+    void createShaderBindingTable();
+
+    void createAABBPrimitiveFrameBuffer();
+    // sets the accumulation fields of the scene constants, update() calls it before they are written
+    void updateAccumulation();
+
+    void compactTopLevelAccelerationStructure(VkDeviceSize compactedSize);
+
+    // (re)creates the TLAS, instances, command buffer and timestamps of every frame slot, the
+    // first slot keeps the latest TLAS
+    void createTopLevelSlots();
+    // writes the instance transforms of the slot and submits a refit or rebuild of its TLAS to
+    // the compute queue, signaling the next value of the timeline
+    void updateTopLevelAccelerationStructure(uint32_t frameSlot);
+    // waits for the last refit into the slot and adds its GPU time to the stats
+    void finishTopLevelUpdate(uint32_t frameSlot);
+    static glm::vec3 getInstancePosition(VkAccelerationStructureInstanceKHR const& instance);
+
+    // records into a fresh command buffer, the end submits it and waits for it
+    VkCommandBuffer beginSingleTimeCommands();
+    void endSingleTimeCommands(VkCommandBuffer cmdBuffer);
+    // profiler scopes in the single time command buffers, endSingleTimeCommands() collects them
+    uint32_t beginProfilerScope(VkCommandBuffer cmdBuffer, char const* name);
+    void endProfilerScope(VkCommandBuffer cmdBuffer, uint32_t scope);
 
 private:
   VkInstance m_instance;
@@ -65,8 +288,48 @@ private:
     VkPhysicalDevice m_gpu;
     VkQueue m_queue;
     VkCommandPool m_commandPool;
+    CVulkanAllocator m_allocator;
     CVulkanHelper m_helper;
+    CAccelerationStructureBuilder m_blasBuilder;
+    // static scene data and the shader binding table go to device local memory through it
+    CUploadManager m_uploader;
+    uint32_t m_queueFamily;
+    VkQueue m_transferQueue;
+    uint32_t m_transferQueueFamily;
+    VkQueue m_computeQueue;
+    uint32_t m_computeQueueFamily;
     VkPhysicalDeviceRayTracingPipelinePropertiesKHR const& m_raytracingPipelineProperties;
+    CShaderBindingTable m_shaderBindingTable;
+    // keyed by the SPIR-V of all stages, createShader() adds each one
+    CPipelineCache m_pipelineCache;
+    std::string m_pipelineCachePath;
+    uint32_t m_pipelineCompileThreads;
+    std::string m_shaderDirectory;
+    bool m_usePipelineLibraries;
+    VkPipelineLayout m_pipelineLayout;
+    std::vector<PipelineLibrary> m_pipelineLibraries;
+    VkRayTracingPipelineInterfaceCreateInfoKHR m_pipelineLibraryInterface;
+    bool m_specializedIntersectionShaders;
+    std::vector<IntersectionVariant> m_intersectionVariants;
+
+    QualityTier::Enum m_qualityTier;
+    QualityTier::Enum m_requestedQualityTier;
+    // tier the pipeline libraries were compiled for
+    QualityTier::Enum m_pipelineLibraryTier;
+    // pipelines of the tiers built so far, the one of m_qualityTier is m_raytracingPipeline
+    VkPipeline m_qualityTierPipelines[QualityTier::Count];
+    // one entry per stage, the specialization infos point into it
+    std::vector<ShaderSpecialization> m_shaderSpecializations[QualityTier::Count];
+    std::vector<VkSpecializationInfo> m_shaderSpecializationInfos[QualityTier::Count];
+    VkSpecializationMapEntry m_specializationMapEntries[5];
+    // compiles m_buildingQualityTier, m_qualityTierPipelineReady is set once it is done
+    std::thread m_qualityTierThread;
+    std::atomic<bool> m_qualityTierPipelineReady;
+    QualityTier::Enum m_buildingQualityTier;
+    VkPipeline m_builtQualityTierPipeline;
+    // RayPayload {vec4 color; uint recursionDepth;} is the largest payload, the hit attribute is the vec3 normal
+    uint32_t const kMaxRayPayloadSize = sizeof(glm::vec4) + sizeof(uint32_t);
+    uint32_t const kMaxRayHitAttributeSize = sizeof(glm::vec3);
     //std::vector<CShader> m_shaders;
     std::vector<VkPipelineShaderStageCreateInfo> m_shaderStages;
     std::vector<VkRayTracingShaderGroupCreateInfoKHR> m_shaderGroups;
@@ -81,47 +344,99 @@ private:
     VkPhysicalDeviceMemoryProperties m_gpuMemProps;
 
     uint32_t const kNumBlas = 2;
-    float const kAabbWidth = 2.0f;
-    float const kAabbDistance = 2.0f;
-
-    float m_aspectRatio = 1280.0f / 720.0f;
-    std::vector<VkAabbPositionsKHR> m_aabbs;
 
-    SceneConstantBuffer m_sceneCB;
-
-    PrimitiveInstancePerFrameBuffer m_aabbPrimitiveAttributeBuffer[IntersectionShaderType::kTotalPrimitiveCount];
-
-    PrimitiveConstantBuffer m_planeMaterialCB;
-    PrimitiveConstantBuffer m_aabbMaterialCB[IntersectionShaderType::kTotalPrimitiveCount];
-    PrimitiveInstanceConstantBuffer m_aabbInstanceCB[IntersectionShaderType::kTotalPrimitiveCount];
+    CRayTracingScene m_scene;
 
 
     VulkanBuffer m_indexBuffer;
     VulkanBuffer m_vertexBuffer;
-    std::vector<VulkanBuffer> m_aabbBuffers;
+    // all AABBs of the scene, sorted by intersection shader type
+    VulkanBuffer m_aabbBuffer;
     VulkanBuffer m_facesBuffer;
     VulkanBuffer m_normalBuffer;
 
-    VulkanBuffer m_raygenShaderGroupBuffer;
-    VulkanBuffer m_missShaderGroupBuffer;
-    VulkanBuffer m_hitShaderGroupBuffer;
-
+    // m_framesInFlight slots each
     VulkanBuffer m_sceneBuffer;
     VulkanBuffer m_aabbPrimitiveBuffer;
+    VulkanBuffer m_aabbPrimitiveDataBuffer;
+
+    ProceduralGeometryLayout::Enum m_proceduralGeometryLayout;
+    bool m_accelerationStructureCompaction;
 
     VulkanImage m_offscreenImage;
+    // created by the first updateDescriptors() for it
+    VkImageView m_offscreenImageView;
+
+    // in GENERAL layout from its creation on
+    VulkanImage m_accumulationImage;
+    VkImageView m_accumulationImageView;
+    uint32_t m_accumulationTarget;
+    // frames update() has handed out since the last reset
+    uint32_t m_accumulatedSamples;
+    // scene constants of the accumulated frames, with sampleIndex 0
+    SceneConstantBuffer m_accumulatedSceneConstants;
 
     VkAccelerationStructureKHR m_bottomLevelAS[BottomLevelASType::Count];
     VkAccelerationStructureKHR m_topLevelAs;
+    VulkanBuffer m_topLevelAsBuffer;
 
-    VkPipeline m_raytracingPipeline;
+    struct TopLevelUpdateStats {
+        uint32_t updateCount;
+        uint32_t rebuildCount;
+        double updateMilliseconds;
+        double rebuildMilliseconds;
+    };
+
+    // rebuild once an instance moved further than this from where the TLAS was built ...
+    float const kTopLevelRebuildDisplacement = 1.0f;
+    // ... or after this many refits in a row
+    uint32_t const kTopLevelMaxUpdates = 300;
+
+    struct TopLevelSlot {
+        // the one of slot 0 is m_topLevelAs
+        VkAccelerationStructureKHR accelerationStructure;
+        VulkanBuffer buffer;
+        VkCommandBuffer commandBuffer;
+        // value of m_topLevelTimeline the last refit into the slot signals, 0 once it was waited for
+        uint64_t pendingValue;
+        bool pendingRebuild;
+    };
 
-    glm::vec4 m_eye;
-    glm::vec4 m_at;
-    glm::vec4 m_up;
+    bool m_dynamicScene;
+    std::vector<VkAccelerationStructureInstanceKHR> m_topLevelInstances;
+    // instance translations at the last full build
+    std::vector<glm::vec3> m_topLevelBuildPositions;
+    // m_framesInFlight slots of m_topLevelInstanceSlotSize bytes
+    VulkanBuffer m_topLevelInstanceBuffer;
+    uint32_t m_topLevelInstanceSlotSize;
+    // the refits run one after the other on the compute queue, so they share it
+    VulkanBuffer m_topLevelScratchBuffer;
+    VkAccelerationStructureGeometryKHR m_topLevelGeometry;
+    VkBuildAccelerationStructureFlagsKHR m_topLevelBuildFlags;
+    std::vector<TopLevelSlot> m_topLevelSlots;
+    // the slot refit last, the next refit starts from its TLAS
+    uint32_t m_topLevelLatestSlot;
+    VkCommandPool m_computeCommandPool;
+    VkSemaphore m_topLevelTimeline;
+    // value signaled by the last submitted refit
+    uint64_t m_topLevelTimelineValue;
+    // two timestamps per slot
+    VkQueryPool m_topLevelUpdateQueryPool;
+    uint32_t m_topLevelUpdatesSinceRebuild;
+    TopLevelUpdateStats m_topLevelUpdateStats;
+    float m_timestampPeriod;
 
-    bool m_animateCamera = true;
-    bool m_animateLight = false;
+    CGpuProfiler* m_profiler;
+    // slot of the single time command buffers
+    uint32_t m_profilerSlot;
+
+    uint32_t m_framesInFlight;
+    uint32_t m_sceneBufferSlotSize;
+    uint32_t m_aabbPrimitiveBufferSlotSize;
+    uint32_t m_minUniformBufferOffsetAlignment;
+    uint32_t m_minStorageBufferOffsetAlignment;
+
+    VkPipeline m_raytracingPipeline;
 };
 
 #endif // RAYTRACING_H
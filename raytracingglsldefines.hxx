@@ -13,6 +13,11 @@ struct SceneConstantBuffer {
     glm::vec4 lightDiffuseColor;
     float reflectance;
     float elapsedTime;
+    // only read by the ray generation shader: the frames averaged into the accumulation image so
+    // far, the camera rays of frame n are jittered by sample n of the sequence
+    uint32_t sampleIndex;
+    // 0 writes every frame as traced, without jitter
+    uint32_t accumulate;
 };
 
 struct PrimitiveConstantBuffer {
@@ -34,6 +39,13 @@ struct PrimitiveInstanceConstantBuffer
     glm::vec2 padding;
 };
 
+// one entry per procedural primitive in the storage buffer at binding 6, the hit
+// record only holds the index of the first primitive of its BLAS
+struct PrimitiveData {
+    PrimitiveConstantBuffer material;
+    PrimitiveInstanceConstantBuffer instance;
+};
+
 struct PrimitiveInstancePerFrameBuffer {
     glm::mat4 localSpaceToBottomLevelAS;
     glm::mat4 bottomLevelASToLocalSpace;
@@ -0,0 +1,411 @@
+#include "raytracingscene.hxx"
+
+#include <math.h>
+
+// index of the first primitive of the type inside the ten primitive cluster
+static uint32_t getClusterFirstPrimitive(IntersectionShaderType::Enum type) {
+    uint32_t first = 0;
+    for (uint32_t index = 0; index < static_cast<uint32_t>(type); ++index) {
+        first += IntersectionShaderType::perPrimitiveTypeCount(static_cast<IntersectionShaderType::Enum>(index));
+    }
+    return first;
+}
+
+static IntersectionShaderType::Enum getClusterIntersectionShaderType(uint32_t clusterIndex) {
+    if (clusterIndex < AnalyticPrimitive::Count) {
+        return IntersectionShaderType::AnalyticPrimitive;
+    }
+    if (clusterIndex < AnalyticPrimitive::Count + VolumetricPrimitive::Count) {
+        return IntersectionShaderType::VolumetricPrimitive;
+    }
+    return IntersectionShaderType::SignedDistancePrimitive;
+}
+
+CRayTracingScene::CRayTracingScene()
+    : m_sceneCB()
+    , m_planeMaterialCB()
+{
+}
+
+uint32_t CRayTracingScene::getFirstPrimitive(IntersectionShaderType::Enum type) const {
+    return getClusterFirstPrimitive(type) * m_primitiveCopies;
+}
+
+IntersectionShaderType::Enum CRayTracingScene::getIntersectionShaderType(uint32_t primitiveIndex) const {
+    if (primitiveIndex < getFirstPrimitive(IntersectionShaderType::VolumetricPrimitive)) {
+        return IntersectionShaderType::AnalyticPrimitive;
+    }
+    if (primitiveIndex < getFirstPrimitive(IntersectionShaderType::SignedDistancePrimitive)) {
+        return IntersectionShaderType::VolumetricPrimitive;
+    }
+    return IntersectionShaderType::SignedDistancePrimitive;
+}
+
+uint32_t CRayTracingScene::getPrimitiveIndex(uint32_t clusterIndex, uint32_t copy) const {
+    IntersectionShaderType::Enum type = getClusterIntersectionShaderType(clusterIndex);
+    uint32_t clusterFirst = getClusterFirstPrimitive(type);
+    return getFirstPrimitive(type) + copy * IntersectionShaderType::perPrimitiveTypeCount(type) + (clusterIndex - clusterFirst);
+}
+
+glm::vec3 CRayTracingScene::getCopyOffset(uint32_t copy) const {
+    // odd grid size, copy 0 takes the center cell so a single copy stays where the original scene is
+    uint32_t gridSize = static_cast<uint32_t>(ceil(sqrt(static_cast<double>(m_primitiveCopies)))) | 1;
+    uint32_t cell = (copy + gridSize * gridSize / 2) % (gridSize * gridSize);
+    float center = static_cast<float>(gridSize / 2);
+
+    return glm::vec3((static_cast<float>(cell % gridSize) - center) * kCopyDistance,
+                     0.0f,
+                     (static_cast<float>(cell / gridSize) - center) * kCopyDistance);
+}
+
+void CRayTracingScene::initScene() {
+
+    PrimitiveConstantBuffer clusterMaterials[IntersectionShaderType::kTotalPrimitiveCount];
+
+    // Setup materials.
+    {
+        auto setAttributes = [&] (
+            uint32_t primitiveIndex,
+            glm::vec4 const& albedo,
+            float reflectanceCoef = 0.0f,
+            float diffuseCoef = 0.9f,
+            float specularCoef = 0.7f,
+            float specularPower = 50.0f,
+            float stepScale = 1.0f)
+        {
+            PrimitiveConstantBuffer& attributes = clusterMaterials[primitiveIndex];
+            attributes.albedo = albedo;
+            attributes.reflectanceCoef = reflectanceCoef;
+            attributes.diffuseCoef = diffuseCoef;
+            attributes.specularCoef = specularCoef;
+            attributes.specularPower = specularPower;
+            attributes.stepScale = stepScale;
+        };
+
+        m_planeMaterialCB = { glm::vec4(0.9f, 0.9f, 0.9f, 1.0f), 0.25f, 1.0f, 0.4f, 50.0f, 1.0f, /*padding*/ glm::vec3(0.0f) };
+
+        glm::vec4 green = glm::vec4(0.1f, 1.0f, 0.5f, 1.0f);
+        glm::vec4 red = glm::vec4(1.0f, 0.5f, 0.5f, 1.0f);
+        glm::vec4 yellow = glm::vec4(1.0f, 1.0f, 0.5f, 1.0f);
+
+        uint32_t offset = 0;
+
+        {
+            setAttributes(offset + AnalyticPrimitive::AABB, red);
+            setAttributes(offset + AnalyticPrimitive::Spheres, kChromiumReflectance, 1.0f);
+            offset += AnalyticPrimitive::Count;
+        }
+
+        {
+            setAttributes(offset + VolumetricPrimitive::Metaballs, kChromiumReflectance, 1.0f);
+            offset += VolumetricPrimitive::Count;
+        }
+
+        {
+            setAttributes(offset + SignedDistancePrimitive::MiniSpheres, green);
+            setAttributes(offset + SignedDistancePrimitive::IntersectedRoundCube, green);
+            setAttributes(offset + SignedDistancePrimitive::SquareTorus, kChromiumReflectance, 1.0f);
+            setAttributes(offset + SignedDistancePrimitive::TwistedTorus, yellow, 0.0f, 1.0f, 0.7f, 50.0f, 0.5f);
+            setAttributes(offset + SignedDistancePrimitive::Cog, yellow, 0.0f, 1.0f, 0.1f, 2.0f);
+            setAttributes(offset + SignedDistancePrimitive::Cylinder, red);
+            setAttributes(offset + SignedDistancePrimitive::FractalPyramid, green, 0.0f, 1.0f, 0.1f, 4.0f, 0.8f);
+        }
+    }
+
+    // Setup camera.
+    {
+        m_eye = { 0.0f, 5.3f, -17.0f, 1.0f };
+        m_at = { 0.0f, 0.0f, 0.0f, 1.0f };
+        glm::vec4 right = { 1.0f, 0.0f, 0.0f, 0.0f };
+
+        glm::vec4 direction = glm::normalize(m_at - m_eye);
+        m_up = glm::vec4(glm::normalize(glm::cross(glm::vec3(direction), glm::vec3(right))), 0.0f);
+
+
+        glm::mat4 rotate = glm::rotate(glm::mat4(1.0f), glm::radians(45.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+        m_eye = rotate * m_eye;
+        m_up = rotate * m_up;
+
+        m_initialEye = m_eye;
+        m_initialAt = m_at;
+        m_initialUp = m_up;
+
+        updateCameraMatrices();
+    }
+
+    // Setup lights.
+    {
+        glm::vec4 lightPosition;
+        glm::vec4 lightAmbientColor;
+        glm::vec4 lightDiffuseColor;
+
+        lightPosition = glm::vec4(0.0f, 18.0f, -20.0f, 0.0f);
+        m_sceneCB.lightPosition = lightPosition;
+        m_initialLightPosition = lightPosition;
+
+        lightAmbientColor = glm::vec4(0.25f, 0.25f, 0.25f, 1.0f);
+        m_sceneCB.lightAmbientColor = lightAmbientColor;
+
+        float d = 0.6f;
+        lightDiffuseColor = glm::vec4(d, d, d, 1.0f);
+        m_sceneCB.lightDiffuseColor = lightDiffuseColor;
+    }
+
+    // set per frame by CRayTracing::update() while accumulating
+    m_sceneCB.sampleIndex = 0;
+    m_sceneCB.accumulate = 0;
+
+    m_aabbMaterialCB.resize(getPrimitiveCount());
+    m_aabbInstanceCB.resize(getPrimitiveCount());
+    m_aabbPrimitiveAttributeBuffer.resize(getPrimitiveCount());
+
+    for (uint32_t copy = 0; copy < m_primitiveCopies; ++copy) {
+        for (uint32_t clusterIndex = 0; clusterIndex < IntersectionShaderType::kTotalPrimitiveCount; ++clusterIndex) {
+            uint32_t instanceIndex = getPrimitiveIndex(clusterIndex, copy);
+            m_aabbMaterialCB[instanceIndex] = clusterMaterials[clusterIndex];
+            m_aabbInstanceCB[instanceIndex].instanceIndex = instanceIndex;
+            m_aabbInstanceCB[instanceIndex].primitiveType = clusterIndex - getClusterFirstPrimitive(getClusterIntersectionShaderType(clusterIndex));
+        }
+    }
+}
+
+void CRayTracingScene::buildProceduralGeometryAABBs() {
+
+    glm::ivec3 aabbGrid = glm::ivec3(4, 1, 4);
+    glm::vec3 const basePosition = glm::vec3(
+        -(aabbGrid.x * kAabbWidth + (aabbGrid.x - 1) * kAabbDistance) / 2.0f,
+        -(aabbGrid.y * kAabbWidth + (aabbGrid.y - 1) * kAabbDistance) / 2.0f,
+        -(aabbGrid.z * kAabbWidth + (aabbGrid.z - 1) * kAabbDistance) / 2.0f
+    );
+
+    glm::vec3 stride = glm::vec3(kAabbWidth + kAabbDistance, kAabbWidth + kAabbDistance, kAabbWidth + kAabbDistance);
+
+    auto initializeAABB = [&](glm::vec3 const& offsetIndex, glm::vec3 const& size) {
+        return VkAabbPositionsKHR {
+            basePosition.x + offsetIndex.x * stride.x,
+            basePosition.y + offsetIndex.y * stride.y,
+            basePosition.z + offsetIndex.z * stride.z,
+            basePosition.x + offsetIndex.x * stride.x + size.x,
+            basePosition.y + offsetIndex.y * stride.y + size.y,
+            basePosition.z + offsetIndex.z * stride.z + size.z,
+        };
+    };
+
+    VkAabbPositionsKHR clusterAabbs[IntersectionShaderType::kTotalPrimitiveCount];
+
+    uint32_t offset = 0;
+
+    {
+        clusterAabbs[offset + AnalyticPrimitive::AABB] = initializeAABB(glm::ivec3(3, 0, 0), glm::vec3(2.0f, 3.0f, 2.0f));
+        clusterAabbs[offset + AnalyticPrimitive::Spheres] = initializeAABB(glm::vec3(2.25f, 0.0f, 0.75f), glm::vec3(3.0f, 3.0f, 3.0f));
+        offset += AnalyticPrimitive::Count;
+    }
+
+    {
+        clusterAabbs[offset + VolumetricPrimitive::Metaballs] = initializeAABB(glm::ivec3(0, 0, 0), glm::vec3(3.0f, 3.0f, 3.0f));
+        offset += VolumetricPrimitive::Count;
+    }
+
+    {
+        clusterAabbs[offset + SignedDistancePrimitive::MiniSpheres] = initializeAABB(glm::ivec3(2, 0, 0), glm::vec3(2.0f, 2.0f, 2.0f));
+        clusterAabbs[offset + SignedDistancePrimitive::TwistedTorus] = initializeAABB(glm::ivec3(0, 0, 1), glm::vec3(2.0f, 2.0f, 2.0f));
+        clusterAabbs[offset + SignedDistancePrimitive::IntersectedRoundCube] = initializeAABB(glm::ivec3(0, 0, 2), glm::vec3(2.0f, 2.0f, 2.0f));
+        clusterAabbs[offset + SignedDistancePrimitive::SquareTorus] = initializeAABB(glm::vec3(0.75f, -0.1f, 2.25f), glm::vec3(3.0f, 3.0f, 3.0f));
+        clusterAabbs[offset + SignedDistancePrimitive::Cog] = initializeAABB(glm::ivec3(1, 0, 0), glm::vec3(2.0f, 2.0f, 2.0f));
+        clusterAabbs[offset + SignedDistancePrimitive::Cylinder] = initializeAABB(glm::ivec3(0, 0, 3), glm::vec3(2.0f, 3.0f, 2.0f));
+        clusterAabbs[offset + SignedDistancePrimitive::FractalPyramid] = initializeAABB(glm::ivec3(2, 0, 2), glm::vec3(6.0f, 6.0f, 6.0f));
+    }
+
+    m_aabbs.resize(getPrimitiveCount());
+
+    for (uint32_t copy = 0; copy < m_primitiveCopies; ++copy) {
+        glm::vec3 copyOffset = getCopyOffset(copy);
+
+        for (uint32_t clusterIndex = 0; clusterIndex < IntersectionShaderType::kTotalPrimitiveCount; ++clusterIndex) {
+            VkAabbPositionsKHR aabb = clusterAabbs[clusterIndex];
+            aabb.minX += copyOffset.x;
+            aabb.minY += copyOffset.y;
+            aabb.minZ += copyOffset.z;
+            aabb.maxX += copyOffset.x;
+            aabb.maxY += copyOffset.y;
+            aabb.maxZ += copyOffset.z;
+            m_aabbs[getPrimitiveIndex(clusterIndex, copy)] = aabb;
+        }
+    }
+}
+
+void CRayTracingScene::buildPlaneGeometry() {
+    Index indices[] = {
+        3, 1, 0,
+        2, 1, 3
+    };
+
+    Vertex vertices[] = {
+        { glm::vec3(0.0f, 0.0f, 0.0f) },
+        { glm::vec3(1.0f, 0.0f, 0.0f) },
+        { glm::vec3(1.0f, 0.0f, 1.0f) },
+        { glm::vec3(0.0f, 0.0f, 1.0f) },
+    };
+
+    glm::vec4 normals[] = {
+        glm::vec4(0.0f, 1.0f, 0.0f, 0.0f),
+        glm::vec4(0.0f, 1.0f, 0.0f, 0.0f),
+        glm::vec4(0.0f, 1.0f, 0.0f, 0.0f),
+        glm::vec4(0.0f, 1.0f, 0.0f, 0.0f),
+    };
+
+    m_planeIndices.assign(indices, indices + sizeof(indices) / sizeof(Index));
+    m_planeVertices.assign(vertices, vertices + sizeof(vertices) / sizeof(Vertex));
+    m_planeNormals.assign(normals, normals + sizeof(normals) / sizeof(glm::vec4));
+}
+
+glm::mat4 CRayTracingScene::getPlaneTransform() const {
+    glm::uvec3 const kNumAabb = glm::uvec3(700, 1, 700);
+    glm::vec3 const vWidth = glm::vec3(
+        kNumAabb.x * kAabbWidth + (kNumAabb.x - 1) * kAabbDistance,
+        kNumAabb.y * kAabbWidth + (kNumAabb.y - 1) * kAabbDistance,
+        kNumAabb.z * kAabbWidth + (kNumAabb.z - 1) * kAabbDistance
+    );
+
+    glm::vec3 basePosition = vWidth * glm::vec3(-0.35f, 0.0f, -0.35f);
+
+    glm::mat4 translation = glm::translate(glm::mat4(1.0f), basePosition);
+    return glm::scale(translation, vWidth);
+}
+
+glm::mat4 CRayTracingScene::getAABBTransform() const {
+    return glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, kAabbWidth / 2.0f, 0.0f));
+}
+
+glm::mat4 CRayTracingScene::getAABBInstanceTransform(uint32_t instanceIndex) const {
+    if (!m_animateInstances) {
+        return getAABBTransform();
+    }
+
+    float height = kInstanceAmplitude * sinf(2.0f * m_animateGeometryTime + 0.7f * static_cast<float>(instanceIndex));
+    return glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, height, 0.0f)) * getAABBTransform();
+}
+
+void CRayTracingScene::updateCameraMatrices() {
+    m_sceneCB.cameraPosition = m_eye;
+    float fovAngleY = 45.0f;
+    glm::mat4 view = glm::lookAtLH(glm::vec3(m_eye), glm::vec3(m_at), glm::vec3(m_up));
+    glm::mat4 proj = glm::perspectiveLH(glm::radians(fovAngleY), m_aspectRatio, 0.01f, 125.0f);
+    glm::mat4 viewProj = proj * view;
+    m_sceneCB.projectionToWorld = glm::inverse(viewProj);
+}
+
+void CRayTracingScene::updateAABBPrimitivesAttributes(float animationTime) {
+    glm::mat4 identity = glm::mat4(1.0f);
+
+    glm::mat4 scale15y = glm::scale(glm::mat4(1.0f), glm::vec3(1.0f, 1.5f, 1.0f));
+    glm::mat4 scale15 = glm::scale(glm::mat4(1.0f), glm::vec3(1.5f, 1.5f, 1.5f));
+    //glm::mat4 scale2 = glm::scale(glm::mat4(1.0f), glm::vec3(2.0f, 2.0f, 2.0f));
+    glm::mat4 scale3 = glm::scale(glm::mat4(1.0f), glm::vec3(3.0f, 3.0f, 3.0f));
+
+    glm::mat4 rotation = glm::rotate(glm::mat4(1.0f), -2.0f * animationTime, glm::vec3(0.0f, 1.0f, 0.0f));
+
+    // all copies share rotation and scale, so only the translation is inverted per copy
+    auto setTransformAABB = [&](uint32_t clusterIndex, glm::mat4& this_scale, glm::mat4& this_rotation) {
+      glm::mat4 rotationScale = this_rotation * this_scale;
+      glm::mat4 inverseRotationScale = glm::inverse(rotationScale);
+
+      for (uint32_t copy = 0; copy < m_primitiveCopies; ++copy) {
+          uint32_t primitiveIndex = getPrimitiveIndex(clusterIndex, copy);
+          glm::vec3 vTranslation =
+                  0.5f * (glm::vec3(m_aabbs[primitiveIndex].minX, m_aabbs[primitiveIndex].minY, m_aabbs[primitiveIndex].minZ)
+                          + glm::vec3(m_aabbs[primitiveIndex].maxX, m_aabbs[primitiveIndex].maxY, m_aabbs[primitiveIndex].maxZ));
+
+          m_aabbPrimitiveAttributeBuffer[primitiveIndex].localSpaceToBottomLevelAS = glm::translate(glm::mat4(1.0f), vTranslation) * rotationScale;
+          m_aabbPrimitiveAttributeBuffer[primitiveIndex].bottomLevelASToLocalSpace = inverseRotationScale * glm::translate(glm::mat4(1.0f), -vTranslation);
+      }
+    };
+
+    uint32_t offset = 0;
+
+    {
+        setTransformAABB(offset + AnalyticPrimitive::AABB, scale15y, identity);
+        setTransformAABB(offset + AnalyticPrimitive::Spheres, scale15, rotation);
+        offset += AnalyticPrimitive::Count;
+    }
+
+    {
+        setTransformAABB(offset + VolumetricPrimitive::Metaballs, scale15, rotation);
+        offset += VolumetricPrimitive::Count;
+    }
+
+    {
+        setTransformAABB(offset + SignedDistancePrimitive::MiniSpheres, identity, identity);
+        setTransformAABB(offset + SignedDistancePrimitive::IntersectedRoundCube, identity, identity);
+        setTransformAABB(offset + SignedDistancePrimitive::SquareTorus, scale15, identity);
+        setTransformAABB(offset + SignedDistancePrimitive::TwistedTorus, identity, rotation);
+        setTransformAABB(offset + SignedDistancePrimitive::Cog, identity, rotation);
+        setTransformAABB(offset + SignedDistancePrimitive::Cylinder, scale15y, identity);
+        setTransformAABB(offset + SignedDistancePrimitive::FractalPyramid, scale3, identity);
+    }
+}
+
+void CRayTracingScene::update(float elapsedTime) {
+
+    // Rotate the camera around Y axis.
+    if (m_animateCamera)
+    {
+        float secondsToRotateAround = 48.0f;
+        float angleToRotateBy = 360.0f * (elapsedTime / secondsToRotateAround);
+        glm::mat4 rotate = glm::rotate(glm::mat4(1.0), glm::radians(angleToRotateBy), glm::vec3(0.0f, 1.0f, 0.0f));
+        m_eye = rotate * m_eye;
+        m_up = rotate * m_up;
+        m_at = rotate * m_at;
+        updateCameraMatrices();
+    }
+
+    if (m_animateLight)
+    {
+        float secondsToRotateAround = 8.0f;
+        float angleToRotateBy = -360.0f * (elapsedTime / secondsToRotateAround);
+        glm::mat4 rotate = glm::rotate(glm::mat4(1.0), glm::radians(angleToRotateBy), glm::vec3(0.0f, 1.0f, 0.0f));
+        glm::vec4 prevLightPosition = m_sceneCB.lightPosition;
+        m_sceneCB.lightPosition = rotate * prevLightPosition;
+    }
+
+    if (m_animateGeometry)
+    {
+        m_animateGeometryTime += elapsedTime;
+    }
+
+    updateAABBPrimitivesAttributes(m_animateGeometryTime);
+
+    m_sceneCB.elapsedTime = m_animateGeometryTime;
+}
+
+void CRayTracingScene::setAnimationTime(float animationTime) {
+
+    m_eye = m_initialEye;
+    m_at = m_initialAt;
+    m_up = m_initialUp;
+    m_sceneCB.lightPosition = m_initialLightPosition;
+
+    if (m_animateCamera)
+    {
+        float angleToRotateBy = 360.0f * (animationTime / 48.0f);
+        glm::mat4 rotate = glm::rotate(glm::mat4(1.0), glm::radians(angleToRotateBy), glm::vec3(0.0f, 1.0f, 0.0f));
+        m_eye = rotate * m_eye;
+        m_up = rotate * m_up;
+        m_at = rotate * m_at;
+    }
+
+    if (m_animateLight)
+    {
+        float angleToRotateBy = -360.0f * (animationTime / 8.0f);
+        glm::mat4 rotate = glm::rotate(glm::mat4(1.0), glm::radians(angleToRotateBy), glm::vec3(0.0f, 1.0f, 0.0f));
+        m_sceneCB.lightPosition = rotate * m_sceneCB.lightPosition;
+    }
+
+    updateCameraMatrices();
+
+    m_animateGeometryTime = animationTime;
+
+    updateAABBPrimitivesAttributes(m_animateGeometryTime);
+
+    m_sceneCB.elapsedTime = m_animateGeometryTime;
+}
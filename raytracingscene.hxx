@@ -0,0 +1,114 @@
+#ifndef RAYTRACINGSCENE_HXX
+#define RAYTRACINGSCENE_HXX
+
+#include <vector>
+
+#include "vulkanhelper.hxx"
+#include "raytracingscenedefines.hxx"
+
+/*
+ * Host side description of the procedural scene: materials, camera, light,
+ * AABB placement and the per frame primitive transforms. It does not touch the
+ * Vulkan device so the GPU path (CRayTracing) and the CPU reference renderer
+ * render from the same data.
+ */
+class CRayTracingScene
+{
+public:
+    CRayTracingScene();
+
+    // Number of copies of the ten primitive cluster, laid out on a grid around the original.
+    // Has to be set before initScene().
+    void setPrimitiveCopies(uint32_t copies) { m_primitiveCopies = copies > 0 ? copies : 1; }
+    uint32_t getPrimitiveCopies() const { return m_primitiveCopies; }
+
+    void initScene();
+    void buildProceduralGeometryAABBs();
+    void buildPlaneGeometry();
+    void updateCameraMatrices();
+    void updateAABBPrimitivesAttributes(float animationTime);
+
+    // Advances camera, light and geometry animation by one frame.
+    void update(float elapsedTime);
+    // Puts the scene into the state update() reaches after animationTime seconds.
+    void setAnimationTime(float animationTime);
+
+    glm::mat4 getPlaneTransform() const;
+    glm::mat4 getAABBTransform() const;
+    // TLAS instance transform of an AABB instance. With instance animation every instance
+    // moves up and down with its own phase, otherwise it is getAABBTransform().
+    glm::mat4 getAABBInstanceTransform(uint32_t instanceIndex) const;
+
+    void setAnimateInstances(bool animateInstances) { m_animateInstances = animateInstances; }
+    bool getAnimateInstances() const { return m_animateInstances; }
+    // with all three off update() leaves the scene constants as they are
+    void setAnimateCamera(bool animateCamera) { m_animateCamera = animateCamera; }
+    void setAnimateLight(bool animateLight) { m_animateLight = animateLight; }
+    // stops the clock of the procedural geometry and the instance animation
+    void setAnimateGeometry(bool animateGeometry) { m_animateGeometry = animateGeometry; }
+
+    // The primitives are sorted by intersection shader type, every type is one contiguous
+    // range holding all copies of its primitives.
+    uint32_t getPrimitiveCount() const { return IntersectionShaderType::kTotalPrimitiveCount * m_primitiveCopies; }
+    uint32_t getPrimitiveCount(IntersectionShaderType::Enum type) const { return IntersectionShaderType::perPrimitiveTypeCount(type) * m_primitiveCopies; }
+    uint32_t getFirstPrimitive(IntersectionShaderType::Enum type) const;
+    IntersectionShaderType::Enum getIntersectionShaderType(uint32_t primitiveIndex) const;
+
+    SceneConstantBuffer& getSceneConstantBuffer() { return m_sceneCB; }
+    SceneConstantBuffer const& getSceneConstantBuffer() const { return m_sceneCB; }
+    PrimitiveConstantBuffer& getPlaneMaterialBuffer() { return m_planeMaterialCB; }
+    PrimitiveConstantBuffer const& getPlaneMaterialBuffer() const { return m_planeMaterialCB; }
+    PrimitiveConstantBuffer const* getAABBMaterialBuffers() const { return m_aabbMaterialCB.data(); }
+    PrimitiveInstanceConstantBuffer const* getAABBInstanceBuffers() const { return m_aabbInstanceCB.data(); }
+    PrimitiveInstancePerFrameBuffer const* getAABBPrimitiveAttributes() const { return m_aabbPrimitiveAttributeBuffer.data(); }
+    std::vector<VkAabbPositionsKHR> const& getAABBs() const { return m_aabbs; }
+    std::vector<Index> const& getPlaneIndices() const { return m_planeIndices; }
+    std::vector<Vertex> const& getPlaneVertices() const { return m_planeVertices; }
+    std::vector<glm::vec4> const& getPlaneNormals() const { return m_planeNormals; }
+
+    void setAspectRatio(float aspectRatio) { m_aspectRatio = aspectRatio; }
+
+private:
+    float const kAabbWidth = 2.0f;
+    float const kAabbDistance = 2.0f;
+    // distance between the origins of two copies of the cluster
+    float const kCopyDistance = 20.0f;
+    float const kInstanceAmplitude = 1.0f;
+
+    uint32_t getPrimitiveIndex(uint32_t clusterIndex, uint32_t copy) const;
+    glm::vec3 getCopyOffset(uint32_t copy) const;
+
+    float m_aspectRatio = 1280.0f / 720.0f;
+    uint32_t m_primitiveCopies = 1;
+    std::vector<VkAabbPositionsKHR> m_aabbs;
+
+    std::vector<Index> m_planeIndices;
+    std::vector<Vertex> m_planeVertices;
+    std::vector<glm::vec4> m_planeNormals;
+
+    SceneConstantBuffer m_sceneCB;
+
+    std::vector<PrimitiveInstancePerFrameBuffer> m_aabbPrimitiveAttributeBuffer;
+
+    PrimitiveConstantBuffer m_planeMaterialCB;
+    std::vector<PrimitiveConstantBuffer> m_aabbMaterialCB;
+    std::vector<PrimitiveInstanceConstantBuffer> m_aabbInstanceCB;
+
+    glm::vec4 m_eye;
+    glm::vec4 m_at;
+    glm::vec4 m_up;
+
+    glm::vec4 m_initialEye;
+    glm::vec4 m_initialAt;
+    glm::vec4 m_initialUp;
+    glm::vec4 m_initialLightPosition;
+
+    float m_animateGeometryTime = 0.0f;
+
+    bool m_animateCamera = true;
+    bool m_animateLight = false;
+    bool m_animateGeometry = true;
+    bool m_animateInstances = false;
+};
+
+#endif // RAYTRACINGSCENE_HXX
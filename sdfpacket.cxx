@@ -0,0 +1,339 @@
+#include "sdfpacket.hxx"
+#include "cpushaders.hxx"
+
+#include <stdio.h>
+#include <math.h>
+#include <vector>
+#include <chrono>
+
+#if defined(SDF_PACKET_X86)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+namespace SdfPacket {
+
+#if defined(SDF_PACKET_X86)
+// implemented in sdfpacketsse41.cxx, sdfpacketavx2.cxx and sdfpacketavx512.cxx
+void raySignedDistancePrimitiveTestSSE41(RayPacket const& packet, uint32_t signedDistancePrimitive, float stepScale, PacketHits& hits);
+void raySignedDistancePrimitiveTestAVX2(RayPacket const& packet, uint32_t signedDistancePrimitive, float stepScale, PacketHits& hits);
+void raySignedDistancePrimitiveTestAVX512(RayPacket const& packet, uint32_t signedDistancePrimitive, float stepScale, PacketHits& hits);
+void getDistanceFromSignedDistancePrimitiveSSE41(uint32_t signedDistancePrimitive, uint32_t count, float const* x, float const* y, float const* z, float* distance);
+void getDistanceFromSignedDistancePrimitiveAVX2(uint32_t signedDistancePrimitive, uint32_t count, float const* x, float const* y, float const* z, float* distance);
+void getDistanceFromSignedDistancePrimitiveAVX512(uint32_t signedDistancePrimitive, uint32_t count, float const* x, float const* y, float const* z, float* distance);
+#endif
+
+namespace {
+
+    struct CpuFeatures {
+        bool isa[Isa::Count];
+
+        CpuFeatures() {
+            isa[Isa::Scalar] = true;
+            isa[Isa::SSE41] = false;
+            isa[Isa::AVX2] = false;
+            isa[Isa::AVX512] = false;
+
+#if defined(SDF_PACKET_X86)
+            uint32_t leaf1[4] = {};
+            uint32_t leaf7[4] = {};
+            cpuid(0, 0, leaf1);
+            uint32_t maxLeaf = leaf1[0];
+
+            cpuid(1, 0, leaf1);
+            if (maxLeaf >= 7) {
+                cpuid(7, 0, leaf7);
+            }
+
+            bool sse41 = (leaf1[2] & (1u << 19)) != 0;
+            bool osxsave = (leaf1[2] & (1u << 27)) != 0;
+            bool avx = (leaf1[2] & (1u << 28)) != 0;
+            bool avx2 = (leaf7[1] & (1u << 5)) != 0;
+            bool avx512f = (leaf7[1] & (1u << 16)) != 0;
+
+            // the OS has to save the ymm / zmm state on context switches
+            uint64_t xcr0 = osxsave ? xgetbv() : 0;
+            bool osAvx = (xcr0 & 0x06) == 0x06;
+            bool osAvx512 = (xcr0 & 0xe6) == 0xe6;
+
+            isa[Isa::SSE41] = sse41;
+            isa[Isa::AVX2] = avx && avx2 && osAvx;
+            isa[Isa::AVX512] = avx512f && osAvx512;
+#endif
+        }
+
+#if defined(SDF_PACKET_X86)
+        static void cpuid(uint32_t leaf, uint32_t subLeaf, uint32_t registers[4]) {
+#if defined(_MSC_VER)
+            int values[4];
+            __cpuidex(values, static_cast<int>(leaf), static_cast<int>(subLeaf));
+            for (int index = 0; index < 4; ++index) {
+                registers[index] = static_cast<uint32_t>(values[index]);
+            }
+#else
+            __cpuid_count(leaf, subLeaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+        }
+
+        static uint64_t xgetbv() {
+#if defined(_MSC_VER)
+            return _xgetbv(0);
+#else
+            uint32_t eax, edx;
+            __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+            return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+        }
+#endif
+    };
+
+    CpuFeatures const& getCpuFeatures() {
+        static CpuFeatures features;
+        return features;
+    }
+
+    char const* const kPrimitiveNames[SignedDistancePrimitive::Count] = {
+        "MiniSpheres",
+        "IntersectedRoundCube",
+        "SquareTorus",
+        "TwistedTorus",
+        "Cog",
+        "Cylinder",
+        "FractalPyramid"
+    };
+
+    void raySignedDistancePrimitiveTestScalar(RayPacket const& packet, uint32_t signedDistancePrimitive, float stepScale, PacketHits& hits) {
+        hits.hitMask = 0;
+
+        for (uint32_t lane = 0; lane < packet.count; ++lane) {
+            CpuShaders::Ray ray;
+            ray.origin = glm::vec3(packet.originX[lane], packet.originY[lane], packet.originZ[lane]);
+            ray.direction = glm::vec3(packet.directionX[lane], packet.directionY[lane], packet.directionZ[lane]);
+
+            CpuShaders::RayContext context;
+            context.tmin = packet.tmin[lane];
+            context.tmax = packet.tmax[lane];
+            context.incomingRayFlags = packet.rayFlags;
+
+            float thit = 0.0f;
+            CpuShaders::ProceduralPrimitiveAttributes attr;
+            attr.normal = glm::vec3(0.0f);
+
+            if (CpuShaders::raySignedDistancePrimitiveTest(ray, context, signedDistancePrimitive, thit, attr, stepScale)) {
+                hits.hitMask |= 1u << lane;
+            }
+            else {
+                thit = 0.0f;
+                attr.normal = glm::vec3(0.0f);
+            }
+
+            hits.thit[lane] = thit;
+            hits.normalX[lane] = attr.normal.x;
+            hits.normalY[lane] = attr.normal.y;
+            hits.normalZ[lane] = attr.normal.z;
+        }
+    }
+
+    // deterministic rays from a sphere around the primitive towards points inside its bounds
+    void generateRayPackets(uint32_t rayCount, std::vector<RayPacket>& packets) {
+        uint32_t seed = 0x12345678u;
+        auto random = [&seed]() {
+            seed = seed * 1664525u + 1013904223u;
+            return static_cast<float>(seed >> 8) / 16777216.0f;
+        };
+
+        uint32_t packetCount = (rayCount + kMaxPacketSize - 1) / kMaxPacketSize;
+        packets.resize(packetCount);
+
+        for (uint32_t packetIndex = 0; packetIndex < packetCount; ++packetIndex) {
+            RayPacket& packet = packets[packetIndex];
+            packet.count = kMaxPacketSize;
+            packet.rayFlags = CpuShaders::RayFlags::CullBackFacingTriangles;
+
+            for (uint32_t lane = 0; lane < kMaxPacketSize; ++lane) {
+                float z = 2.0f * random() - 1.0f;
+                float phi = 6.2831853f * random();
+                float r = sqrtf(glm::max(0.0f, 1.0f - z * z));
+                glm::vec3 origin = 2.5f * glm::vec3(r * cosf(phi), z, r * sinf(phi));
+                glm::vec3 target = 0.9f * glm::vec3(2.0f * random() - 1.0f, 2.0f * random() - 1.0f, 2.0f * random() - 1.0f);
+                glm::vec3 direction = glm::normalize(target - origin);
+
+                packet.originX[lane] = origin.x;
+                packet.originY[lane] = origin.y;
+                packet.originZ[lane] = origin.z;
+                packet.directionX[lane] = direction.x;
+                packet.directionY[lane] = direction.y;
+                packet.directionZ[lane] = direction.z;
+                packet.tmin[lane] = 0.0f;
+                packet.tmax[lane] = 10.0f;
+            }
+        }
+    }
+}
+
+bool isSupported(Isa::Enum isa) {
+    if (isa >= Isa::Count) {
+        return false;
+    }
+    return getCpuFeatures().isa[isa];
+}
+
+Isa::Enum getBestIsa() {
+    static Isa::Enum const bestIsa = isSupported(Isa::AVX512) ? Isa::AVX512
+                                   : isSupported(Isa::AVX2) ? Isa::AVX2
+                                   : isSupported(Isa::SSE41) ? Isa::SSE41
+                                   : Isa::Scalar;
+    return bestIsa;
+}
+
+char const* getIsaName(Isa::Enum isa) {
+    switch (isa) {
+        case Isa::Scalar: return "scalar";
+        case Isa::SSE41: return "SSE4.1";
+        case Isa::AVX2: return "AVX2";
+        case Isa::AVX512: return "AVX-512";
+        default: return "unknown";
+    }
+}
+
+void raySignedDistancePrimitiveTest(Isa::Enum isa, RayPacket const& packet, uint32_t signedDistancePrimitive, float stepScale, PacketHits& hits) {
+    switch (isa) {
+#if defined(SDF_PACKET_X86)
+        case Isa::SSE41: raySignedDistancePrimitiveTestSSE41(packet, signedDistancePrimitive, stepScale, hits); break;
+        case Isa::AVX2: raySignedDistancePrimitiveTestAVX2(packet, signedDistancePrimitive, stepScale, hits); break;
+        case Isa::AVX512: raySignedDistancePrimitiveTestAVX512(packet, signedDistancePrimitive, stepScale, hits); break;
+#endif
+        default: raySignedDistancePrimitiveTestScalar(packet, signedDistancePrimitive, stepScale, hits); break;
+    }
+}
+
+void raySignedDistancePrimitiveTest(RayPacket const& packet, uint32_t signedDistancePrimitive, float stepScale, PacketHits& hits) {
+    raySignedDistancePrimitiveTest(getBestIsa(), packet, signedDistancePrimitive, stepScale, hits);
+}
+
+void getDistanceFromSignedDistancePrimitive(Isa::Enum isa, uint32_t signedDistancePrimitive, uint32_t count, float const* x, float const* y, float const* z, float* distance) {
+    switch (isa) {
+#if defined(SDF_PACKET_X86)
+        case Isa::SSE41: getDistanceFromSignedDistancePrimitiveSSE41(signedDistancePrimitive, count, x, y, z, distance); return;
+        case Isa::AVX2: getDistanceFromSignedDistancePrimitiveAVX2(signedDistancePrimitive, count, x, y, z, distance); return;
+        case Isa::AVX512: getDistanceFromSignedDistancePrimitiveAVX512(signedDistancePrimitive, count, x, y, z, distance); return;
+#endif
+        default: break;
+    }
+
+    for (uint32_t index = 0; index < count; ++index) {
+        distance[index] = CpuShaders::getDistanceFromSignedDistancePrimitive(glm::vec3(x[index], y[index], z[index]), signedDistancePrimitive);
+    }
+}
+
+bool runBenchmark(uint32_t rayCount, float const* stepScales) {
+    typedef std::chrono::high_resolution_clock Clock;
+
+    std::vector<RayPacket> packets;
+    generateRayPackets(rayCount, packets);
+    uint32_t totalRays = static_cast<uint32_t>(packets.size()) * kMaxPacketSize;
+
+    // distance samples inside and around the bounds of the primitives
+    uint32_t const kSampleCount = 1 << 16;
+    std::vector<float> sampleX(kSampleCount), sampleY(kSampleCount), sampleZ(kSampleCount);
+    {
+        uint32_t seed = 0x9e3779b9u;
+        for (uint32_t index = 0; index < kSampleCount; ++index) {
+            seed = seed * 1664525u + 1013904223u; sampleX[index] = 3.0f * (static_cast<float>(seed >> 8) / 16777216.0f) - 1.5f;
+            seed = seed * 1664525u + 1013904223u; sampleY[index] = 3.0f * (static_cast<float>(seed >> 8) / 16777216.0f) - 1.5f;
+            seed = seed * 1664525u + 1013904223u; sampleZ[index] = 3.0f * (static_cast<float>(seed >> 8) / 16777216.0f) - 1.5f;
+        }
+    }
+
+    printf("SDF packet benchmark: %u rays per primitive, best instruction set: %s\n", totalRays, getIsaName(getBestIsa()));
+    printf("tolerance: distance %g, hit t %g * max(1, t), hit/miss mismatches %.1f%%\n", kDistanceTolerance, kHitTolerance, kMaxHitMismatchRatio * 100.0f);
+
+    bool withinTolerance = true;
+
+    std::vector<PacketHits> referenceHits(packets.size());
+    std::vector<PacketHits> hits(packets.size());
+    std::vector<float> referenceDistances(kSampleCount), distances(kSampleCount);
+
+    for (uint32_t primitive = 0; primitive < SignedDistancePrimitive::Count; ++primitive) {
+        float stepScale = stepScales[primitive];
+        double scalarSeconds = 0.0;
+
+        getDistanceFromSignedDistancePrimitive(Isa::Scalar, primitive, kSampleCount, sampleX.data(), sampleY.data(), sampleZ.data(), referenceDistances.data());
+
+        for (uint32_t isaIndex = 0; isaIndex < Isa::Count; ++isaIndex) {
+            Isa::Enum isa = static_cast<Isa::Enum>(isaIndex);
+            if (!isSupported(isa)) {
+                continue;
+            }
+
+            std::vector<PacketHits>& results = isa == Isa::Scalar ? referenceHits : hits;
+
+            Clock::time_point start = Clock::now();
+            for (size_t packetIndex = 0; packetIndex < packets.size(); ++packetIndex) {
+                raySignedDistancePrimitiveTest(isa, packets[packetIndex], primitive, stepScale, results[packetIndex]);
+            }
+            double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+            if (isa == Isa::Scalar) {
+                scalarSeconds = seconds;
+                printf("%-20s %-8s %8.2f Mrays/s\n", kPrimitiveNames[primitive], getIsaName(isa), totalRays / seconds / 1000000.0);
+                continue;
+            }
+
+            getDistanceFromSignedDistancePrimitive(isa, primitive, kSampleCount, sampleX.data(), sampleY.data(), sampleZ.data(), distances.data());
+
+            float maxDistanceError = 0.0f;
+            for (uint32_t index = 0; index < kSampleCount; ++index) {
+                maxDistanceError = glm::max(maxDistanceError, fabsf(distances[index] - referenceDistances[index]));
+            }
+
+            uint32_t mismatches = 0;
+            uint32_t outOfTolerance = 0;
+            float maxHitError = 0.0f;
+            for (size_t packetIndex = 0; packetIndex < packets.size(); ++packetIndex) {
+                PacketHits const& reference = referenceHits[packetIndex];
+                PacketHits const& result = hits[packetIndex];
+
+                for (uint32_t lane = 0; lane < packets[packetIndex].count; ++lane) {
+                    bool referenceHit = (reference.hitMask & (1u << lane)) != 0;
+                    bool resultHit = (result.hitMask & (1u << lane)) != 0;
+
+                    if (referenceHit != resultHit) {
+                        ++mismatches;
+                    }
+                    else if (referenceHit) {
+                        float error = fabsf(result.thit[lane] - reference.thit[lane]);
+                        maxHitError = glm::max(maxHitError, error);
+                        if (error > kHitTolerance * glm::max(1.0f, reference.thit[lane])) {
+                            ++outOfTolerance;
+                        }
+                    }
+                }
+            }
+
+            // grazing rays that hit in one version and not in the other march off into a different t entirely,
+            // they are counted as mismatches and not as hit t errors
+            bool passed = maxDistanceError <= kDistanceTolerance
+                       && mismatches + outOfTolerance <= static_cast<uint32_t>(kMaxHitMismatchRatio * totalRays);
+            withinTolerance = withinTolerance && passed;
+
+            printf("%-20s %-8s %8.2f Mrays/s, speedup %5.2fx, max distance error %.2e, max hit t error %.2e, mismatches %u/%u %s\n",
+                   kPrimitiveNames[primitive],
+                   getIsaName(isa),
+                   totalRays / seconds / 1000000.0,
+                   scalarSeconds / seconds,
+                   maxDistanceError,
+                   maxHitError,
+                   mismatches + outOfTolerance,
+                   totalRays,
+                   passed ? "ok" : "FAILED");
+        }
+    }
+
+    return withinTolerance;
+}
+
+}
@@ -0,0 +1,76 @@
+#ifndef SDFPACKET_HXX
+#define SDFPACKET_HXX
+
+#include <stdint.h>
+
+/*
+ * Packet version of raySignedDistancePrimitiveTest / getDistanceFromSignedDistancePrimitive
+ * from intersection_signed_distance_ext.rint. Up to kMaxPacketSize rays are sphere traced
+ * together; lanes that hit, leave [tmin, tmax] or run out of steps are masked off while the
+ * rest keep marching. The kernel is compiled once per instruction set and picked at runtime,
+ * CpuShaders is the scalar fallback and the reference for the tolerance check.
+ *
+ * Tolerance against the scalar GLSL port:
+ *   distance:  |d_simd - d_scalar| <= kDistanceTolerance
+ *   hit t:     |t_simd - t_scalar| <= kHitTolerance * max(1, t_scalar) when both report a hit
+ *   hit/miss:  at most kMaxHitMismatchRatio of the rays may disagree (grazing rays where the
+ *              march is decided by the last ulp of the distance)
+ */
+namespace SdfPacket {
+
+    static uint32_t const kMaxPacketSize = 16;
+
+    static float const kDistanceTolerance = 1.0e-4f;
+    static float const kHitTolerance = 1.0e-3f;
+    static float const kMaxHitMismatchRatio = 0.005f;
+
+    namespace Isa {
+        enum Enum {
+            Scalar = 0,
+            SSE41,
+            AVX2,
+            AVX512,
+            Count
+        };
+    }
+
+    // Structure of arrays, lanes [count, kMaxPacketSize) are ignored.
+    struct RayPacket {
+        alignas(64) float originX[kMaxPacketSize];
+        alignas(64) float originY[kMaxPacketSize];
+        alignas(64) float originZ[kMaxPacketSize];
+        alignas(64) float directionX[kMaxPacketSize];
+        alignas(64) float directionY[kMaxPacketSize];
+        alignas(64) float directionZ[kMaxPacketSize];
+        alignas(64) float tmin[kMaxPacketSize];
+        alignas(64) float tmax[kMaxPacketSize];
+        uint32_t count;
+        uint32_t rayFlags;
+    };
+
+    struct PacketHits {
+        alignas(64) float thit[kMaxPacketSize];
+        alignas(64) float normalX[kMaxPacketSize];
+        alignas(64) float normalY[kMaxPacketSize];
+        alignas(64) float normalZ[kMaxPacketSize];
+        uint32_t hitMask;
+    };
+
+    bool isSupported(Isa::Enum isa);
+    Isa::Enum getBestIsa();
+    char const* getIsaName(Isa::Enum isa);
+
+    // Sphere traces all rays of the packet against one signed distance primitive (local space).
+    void raySignedDistancePrimitiveTest(Isa::Enum isa, RayPacket const& packet, uint32_t signedDistancePrimitive, float stepScale, PacketHits& hits);
+    void raySignedDistancePrimitiveTest(RayPacket const& packet, uint32_t signedDistancePrimitive, float stepScale, PacketHits& hits);
+
+    // Evaluates the distance function for count positions.
+    void getDistanceFromSignedDistancePrimitive(Isa::Enum isa, uint32_t signedDistancePrimitive, uint32_t count, float const* x, float const* y, float const* z, float* distance);
+
+    // Checks every supported instruction set against the scalar port and prints Mrays/s
+    // per primitive. stepScales holds the material stepScale per SignedDistancePrimitive.
+    // Returns false if any result is outside the tolerance.
+    bool runBenchmark(uint32_t rayCount, float const* stepScales);
+}
+
+#endif // SDFPACKET_HXX
@@ -0,0 +1,67 @@
+#include <math.h>
+#include <immintrin.h>
+
+#include "sdfpacketkernel.hxx"
+
+// compiled with AVX2 enabled, only called after SdfPacket::isSupported(Isa::AVX2)
+namespace SdfPacketAVX2 {
+
+struct Mask {
+    __m256 v;
+
+    Mask(__m256 value) : v(value) {}
+};
+
+struct Float {
+    static uint32_t const kWidth = 8;
+    typedef SdfPacketAVX2::Mask Mask;
+
+    __m256 v;
+
+    Float(__m256 value) : v(value) {}
+    Float(float value) : v(_mm256_set1_ps(value)) {}
+
+    static Float load(float const* data) { return _mm256_loadu_ps(data); }
+    void store(float* data) const { _mm256_storeu_ps(data, v); }
+    static Float laneIndices() { return _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f); }
+};
+
+inline Float operator+(Float const& a, Float const& b) { return _mm256_add_ps(a.v, b.v); }
+inline Float operator-(Float const& a, Float const& b) { return _mm256_sub_ps(a.v, b.v); }
+inline Float operator*(Float const& a, Float const& b) { return _mm256_mul_ps(a.v, b.v); }
+inline Float operator/(Float const& a, Float const& b) { return _mm256_div_ps(a.v, b.v); }
+inline Float operator-(Float const& a) { return _mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f)); }
+
+inline Mask operator<(Float const& a, Float const& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline Mask operator<=(Float const& a, Float const& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+inline Mask operator>(Float const& a, Float const& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+inline Mask operator>=(Float const& a, Float const& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+inline Mask operator==(Float const& a, Float const& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ); }
+
+inline Mask operator&(Mask const& a, Mask const& b) { return _mm256_and_ps(a.v, b.v); }
+inline Mask operator|(Mask const& a, Mask const& b) { return _mm256_or_ps(a.v, b.v); }
+inline Mask andNot(Mask const& a, Mask const& b) { return _mm256_andnot_ps(b.v, a.v); }
+inline bool any(Mask const& m) { return _mm256_movemask_ps(m.v) != 0; }
+inline uint32_t bits(Mask const& m) { return static_cast<uint32_t>(_mm256_movemask_ps(m.v)); }
+
+inline Float select(Mask const& m, Float const& a, Float const& b) { return _mm256_blendv_ps(b.v, a.v, m.v); }
+inline Float min(Float const& a, Float const& b) { return _mm256_min_ps(a.v, b.v); }
+inline Float max(Float const& a, Float const& b) { return _mm256_max_ps(a.v, b.v); }
+inline Float abs(Float const& a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+inline Float sqrt(Float const& a) { return _mm256_sqrt_ps(a.v); }
+inline Float floor(Float const& a) { return _mm256_round_ps(a.v, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC); }
+inline Float trunc(Float const& a) { return _mm256_round_ps(a.v, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC); }
+
+}
+
+namespace SdfPacket {
+
+void raySignedDistancePrimitiveTestAVX2(RayPacket const& packet, uint32_t signedDistancePrimitive, float stepScale, PacketHits& hits) {
+    SdfPacketKernel::raySignedDistancePrimitiveTest<SdfPacketAVX2::Float>(packet, signedDistancePrimitive, stepScale, hits);
+}
+
+void getDistanceFromSignedDistancePrimitiveAVX2(uint32_t signedDistancePrimitive, uint32_t count, float const* x, float const* y, float const* z, float* distance) {
+    SdfPacketKernel::getDistanceFromSignedDistancePrimitive<SdfPacketAVX2::Float>(signedDistancePrimitive, count, x, y, z, distance);
+}
+
+}
@@ -0,0 +1,67 @@
+#include <math.h>
+#include <immintrin.h>
+
+#include "sdfpacketkernel.hxx"
+
+// compiled with AVX-512F enabled, only called after SdfPacket::isSupported(Isa::AVX512)
+namespace SdfPacketAVX512 {
+
+struct Mask {
+    __mmask16 v;
+
+    Mask(__mmask16 value) : v(value) {}
+};
+
+struct Float {
+    static uint32_t const kWidth = 16;
+    typedef SdfPacketAVX512::Mask Mask;
+
+    __m512 v;
+
+    Float(__m512 value) : v(value) {}
+    Float(float value) : v(_mm512_set1_ps(value)) {}
+
+    static Float load(float const* data) { return _mm512_loadu_ps(data); }
+    void store(float* data) const { _mm512_storeu_ps(data, v); }
+    static Float laneIndices() { return _mm512_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f, 8.0f, 9.0f, 10.0f, 11.0f, 12.0f, 13.0f, 14.0f, 15.0f); }
+};
+
+inline Float operator+(Float const& a, Float const& b) { return _mm512_add_ps(a.v, b.v); }
+inline Float operator-(Float const& a, Float const& b) { return _mm512_sub_ps(a.v, b.v); }
+inline Float operator*(Float const& a, Float const& b) { return _mm512_mul_ps(a.v, b.v); }
+inline Float operator/(Float const& a, Float const& b) { return _mm512_div_ps(a.v, b.v); }
+inline Float operator-(Float const& a) { return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a.v), _mm512_set1_epi32(static_cast<int>(0x80000000u)))); }
+
+inline Mask operator<(Float const& a, Float const& b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ); }
+inline Mask operator<=(Float const& a, Float const& b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ); }
+inline Mask operator>(Float const& a, Float const& b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_GT_OQ); }
+inline Mask operator>=(Float const& a, Float const& b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_GE_OQ); }
+inline Mask operator==(Float const& a, Float const& b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_EQ_OQ); }
+
+inline Mask operator&(Mask const& a, Mask const& b) { return static_cast<__mmask16>(a.v & b.v); }
+inline Mask operator|(Mask const& a, Mask const& b) { return static_cast<__mmask16>(a.v | b.v); }
+inline Mask andNot(Mask const& a, Mask const& b) { return static_cast<__mmask16>(a.v & ~b.v); }
+inline bool any(Mask const& m) { return m.v != 0; }
+inline uint32_t bits(Mask const& m) { return static_cast<uint32_t>(m.v); }
+
+inline Float select(Mask const& m, Float const& a, Float const& b) { return _mm512_mask_blend_ps(m.v, b.v, a.v); }
+inline Float min(Float const& a, Float const& b) { return _mm512_min_ps(a.v, b.v); }
+inline Float max(Float const& a, Float const& b) { return _mm512_max_ps(a.v, b.v); }
+inline Float abs(Float const& a) { return _mm512_abs_ps(a.v); }
+inline Float sqrt(Float const& a) { return _mm512_sqrt_ps(a.v); }
+inline Float floor(Float const& a) { return _mm512_roundscale_ps(a.v, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC); }
+inline Float trunc(Float const& a) { return _mm512_roundscale_ps(a.v, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC); }
+
+}
+
+namespace SdfPacket {
+
+void raySignedDistancePrimitiveTestAVX512(RayPacket const& packet, uint32_t signedDistancePrimitive, float stepScale, PacketHits& hits) {
+    SdfPacketKernel::raySignedDistancePrimitiveTest<SdfPacketAVX512::Float>(packet, signedDistancePrimitive, stepScale, hits);
+}
+
+void getDistanceFromSignedDistancePrimitiveAVX512(uint32_t signedDistancePrimitive, uint32_t count, float const* x, float const* y, float const* z, float* distance) {
+    SdfPacketKernel::getDistanceFromSignedDistancePrimitive<SdfPacketAVX512::Float>(signedDistancePrimitive, count, x, y, z, distance);
+}
+
+}
@@ -0,0 +1,335 @@
+#ifndef SDFPACKETKERNEL_HXX
+#define SDFPACKETKERNEL_HXX
+
+#include <math.h>
+
+#include "sdfpacket.hxx"
+
+/*
+ * Instruction set independent sphere tracing kernel. F is a SIMD float wrapper providing
+ * kWidth, load/store, broadcast from float, arithmetic operators, comparisons returning
+ * F::Mask and the free functions min, max, abs, sqrt, floor, trunc, select, any, bits and
+ * andNot. Only included by the sdfpacket*.cxx files that are compiled for one instruction set,
+ * so it must not pull in headers with inline code (glm) that other translation units share.
+ */
+namespace SdfPacketKernel {
+
+template<typename F>
+struct Vec3 {
+    F x;
+    F y;
+    F z;
+
+    Vec3() {}
+    Vec3(F const& x_, F const& y_, F const& z_) : x(x_), y(y_), z(z_) {}
+};
+
+template<typename F> inline Vec3<F> operator+(Vec3<F> const& a, Vec3<F> const& b) { return Vec3<F>(a.x + b.x, a.y + b.y, a.z + b.z); }
+template<typename F> inline Vec3<F> operator-(Vec3<F> const& a, Vec3<F> const& b) { return Vec3<F>(a.x - b.x, a.y - b.y, a.z - b.z); }
+template<typename F> inline Vec3<F> operator*(F const& s, Vec3<F> const& a) { return Vec3<F>(s * a.x, s * a.y, s * a.z); }
+
+template<typename F> inline F dot(Vec3<F> const& a, Vec3<F> const& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+template<typename F> inline F length(Vec3<F> const& a) { return sqrt(dot(a, a)); }
+template<typename F> inline F length(F const& x, F const& y) { return sqrt(x * x + y * y); }
+template<typename F> inline Vec3<F> abs3(Vec3<F> const& a) { return Vec3<F>(abs(a.x), abs(a.y), abs(a.z)); }
+template<typename F> inline Vec3<F> max3(Vec3<F> const& a, F const& b) { return Vec3<F>(max(a.x, b), max(a.y, b), max(a.z, b)); }
+
+template<typename F> inline Vec3<F> normalize(Vec3<F> const& a) {
+    F inverseLength = F(1.0f) / length(a);
+    return Vec3<F>(a.x * inverseLength, a.y * inverseLength, a.z * inverseLength);
+}
+
+// sin/cos with Cody-Waite reduction to [-pi/4, pi/4] and the cephes single precision polynomials
+template<typename F>
+inline void sinCos(F const& x, F& sinResult, F& cosResult) {
+    F j = floor(x * F(0.63661977236758134f) + F(0.5f));
+    F y = x - j * F(1.5703125f) - j * F(4.837512969970703125e-4f) - j * F(7.54978995489188216e-8f);
+    F z = y * y;
+
+    F s = y + y * z * (F(-1.6666654611e-1f) + z * (F(8.3321608736e-3f) + z * F(-1.9515295891e-4f)));
+    F c = F(1.0f) - F(0.5f) * z + z * z * (F(4.166664568298827e-2f) + z * (F(-1.388731625493765e-3f) + z * F(2.443315711809948e-5f)));
+
+    F quadrant = j - F(4.0f) * floor(j * F(0.25f));
+    typename F::Mask swap = (quadrant == F(1.0f)) | (quadrant == F(3.0f));
+    typename F::Mask negateSin = quadrant >= F(2.0f);
+    typename F::Mask negateCos = (quadrant == F(1.0f)) | (quadrant == F(2.0f));
+
+    F sinValue = select(swap, c, s);
+    F cosValue = select(swap, s, c);
+    sinResult = select(negateSin, -sinValue, sinValue);
+    cosResult = select(negateCos, -cosValue, cosValue);
+}
+
+template<typename F>
+inline F atan(F const& x) {
+    F const kPi2 = F(1.5707963267948966f);
+    F const kPi4 = F(0.78539816339744831f);
+
+    F t = abs(x);
+    typename F::Mask large = t > F(2.414213562373095f);
+    typename F::Mask medium = andNot(t > F(0.4142135623730950f), large);
+
+    F offset = select(large, kPi2, select(medium, kPi4, F(0.0f)));
+    F reduced = select(large, F(-1.0f) / t, select(medium, (t - F(1.0f)) / (t + F(1.0f)), t));
+
+    F z = reduced * reduced;
+    F result = offset + ((((F(8.05374449538e-2f) * z - F(1.38776856032e-1f)) * z + F(1.99777106478e-1f)) * z - F(3.33329491539e-1f)) * z * reduced + reduced);
+
+    return select(x < F(0.0f), -result, result);
+}
+
+template<typename F>
+inline F atan2(F const& y, F const& x) {
+    F const kPi = F(3.14159265358979323f);
+
+    F result = atan(y / x);
+    result = select(x < F(0.0f), result + select(y < F(0.0f), -kPi, kPi), result);
+    // atan2(+-y, 0) = +-pi/2, atan2(0, 0) = 0
+    result = select(x == F(0.0f), select(y > F(0.0f), F(1.5707963267948966f), select(y < F(0.0f), F(-1.5707963267948966f), F(0.0f))), result);
+    return result;
+}
+
+template<typename F> inline F opS(F const& d1, F const& d2) { return max(d1, -d2); }
+template<typename F> inline F opI(F const& d1, F const& d2) { return max(d1, d2); }
+
+template<typename F>
+inline F fmod(F const& x, F const& y) {
+    return x - y * trunc(x / y);
+}
+
+template<typename F>
+inline Vec3<F> opRep(Vec3<F> const& p, Vec3<F> const& c) {
+    return Vec3<F>(fmod(p.x, c.x) - F(0.5f) * c.x, fmod(p.y, c.y) - F(0.5f) * c.y, fmod(p.z, c.z) - F(0.5f) * c.z);
+}
+
+template<typename F>
+inline Vec3<F> opTwist(Vec3<F> const& p) {
+    F s(0.0f), c(0.0f);
+    sinCos(F(3.0f) * p.y, s, c);
+    return Vec3<F>(p.x * c - p.z * s, p.x * s + p.z * c, p.y);
+}
+
+template<typename F> inline F sdSphere(Vec3<F> const& p, float s) { return length(p) - F(s); }
+
+template<typename F>
+inline F sdBox(Vec3<F> const& p, Vec3<F> const& b) {
+    Vec3<F> d = abs3(p) - b;
+    return min(max(d.x, max(d.y, d.z)), F(0.0f)) + length(max3(d, F(0.0f)));
+}
+
+template<typename F>
+inline F udRoundBox(Vec3<F> const& p, Vec3<F> const& b, float r) {
+    return length(max3(abs3(p) - b, F(0.0f))) - F(r);
+}
+
+template<typename F>
+inline F sdTorus(Vec3<F> const& p, float tx, float ty) {
+    F qx = length(p.x, p.z) - F(tx);
+    return length(qx, p.y) - F(ty);
+}
+
+template<typename F>
+inline F length_toPowNegative8(F x, F y) {
+    x = x * x; x = x * x; x = x * x;
+    y = y * y; y = y * y; y = y * y;
+    // pow(s, 1 / 8)
+    return sqrt(sqrt(sqrt(x + y)));
+}
+
+template<typename F>
+inline F sdTorus82(Vec3<F> const& p, float tx, float ty) {
+    F qx = length(p.x, p.z) - F(tx);
+    return length_toPowNegative8(qx, p.y) - F(ty);
+}
+
+template<typename F>
+inline F sdCylinder(Vec3<F> const& p, float hx, float hy) {
+    F dx = abs(length(p.x, p.z)) - F(hx);
+    F dy = abs(p.y) - F(hy);
+    return min(max(dx, dy), F(0.0f)) + length(max(dx, F(0.0f)), max(dy, F(0.0f)));
+}
+
+template<typename F>
+inline F sdFractalPyramid(Vec3<F> position, float hx, float hy, float hz, float scale) {
+    float a = hz * hy / hx;
+    Vec3<F> const v[5] = {
+        Vec3<F>(F(0.0f), F(hz), F(0.0f)),
+        Vec3<F>(F(-a), F(0.0f), F(a)),
+        Vec3<F>(F(a), F(0.0f), F(-a)),
+        Vec3<F>(F(a), F(0.0f), F(a)),
+        Vec3<F>(F(-a), F(0.0f), F(-a))
+    };
+
+    int n = 0;
+    for (n = 0; n < 4; n++) {
+        Vec3<F> closest = v[0];
+        Vec3<F> delta = position - v[0];
+        F dist = dot(delta, delta);
+
+        for (int index = 1; index < 5; ++index) {
+            delta = position - v[index];
+            F d = dot(delta, delta);
+            typename F::Mask closer = d < dist;
+            closest = Vec3<F>(select(closer, v[index].x, closest.x), select(closer, v[index].y, closest.y), select(closer, v[index].z, closest.z));
+            dist = select(closer, d, dist);
+        }
+
+        position = F(scale) * position - F(scale - 1.0f) * closest;
+    }
+
+    // sdPyramid: opS(sdOctahedron(p, h), p.y)
+    F octa = max(abs(position.x), abs(position.z)) * F(hx) + abs(position.y) * F(hy) - F(hy * hz);
+    F distance = opS(octa, position.y);
+
+    return distance * F(powf(scale, static_cast<float>(-n)));
+}
+
+template<typename F>
+inline F getDistanceFromSignedDistancePrimitive(Vec3<F> const& position, uint32_t signedDistancePrimitive) {
+    F const one = F(1.0f);
+
+    // numbered like the GLSL switch, see SignedDistancePrimitive::Enum
+
+    switch (signedDistancePrimitive) {
+        case 0: // MiniSpheres
+            return opI(sdSphere(opRep(position + Vec3<F>(one, one, one), Vec3<F>(F(0.5f), F(0.5f), F(0.5f))), 0.65f / 4.0f),
+                       sdBox(position, Vec3<F>(one, one, one)));
+        case 1: // IntersectedRoundCube
+            return opS(opS(udRoundBox(position, Vec3<F>(F(0.75f), F(0.75f), F(0.75f)), 0.2f), sdSphere(position, 1.20f)), -sdSphere(position, 1.32f));
+        case 2: // SquareTorus
+            return sdTorus82(position, 0.75f, 0.15f);
+        case 3: // TwistedTorus
+            return sdTorus(opTwist(position), 0.6f, 0.2f);
+        case 4: { // Cog
+            Vec3<F> cogPosition = Vec3<F>(atan2(position.x, position.z) / F(6.2831f),
+                                          one,
+                                          F(0.015f) + F(0.25f) * length(position)) + Vec3<F>(one, one, one);
+            return opS(sdTorus82(position, 0.60f, 0.3f),
+                       sdCylinder(opRep(cogPosition, Vec3<F>(F(0.05f), one, F(0.075f))), 0.02f, 0.8f));
+        }
+        case 5: // Cylinder
+            return opI(sdCylinder(opRep(position + Vec3<F>(one, one, one), Vec3<F>(one, F(2.0f), one)), 0.3f, 2.0f),
+                       sdBox(position + Vec3<F>(one, one, one), Vec3<F>(F(2.0f), F(2.0f), F(2.0f))));
+        case 6: // FractalPyramid
+            return sdFractalPyramid(position + Vec3<F>(F(0.0f), one, F(0.0f)), 0.894f, 0.447f, 2.0f, 2.0f);
+        default:
+            return F(0.0f);
+    }
+}
+
+template<typename F>
+inline Vec3<F> sdCalculateNormal(Vec3<F> const& pos, uint32_t sdPrimitive) {
+    F const e = F(0.5773f * 0.0001f);
+    F const ne = -e;
+    Vec3<F> const xyy = Vec3<F>(e, ne, ne);
+    Vec3<F> const yyx = Vec3<F>(ne, ne, e);
+    Vec3<F> const yxy = Vec3<F>(ne, e, ne);
+    Vec3<F> const xxx = Vec3<F>(e, e, e);
+
+    return normalize(
+        getDistanceFromSignedDistancePrimitive(pos + xyy, sdPrimitive) * xyy +
+        getDistanceFromSignedDistancePrimitive(pos + yyx, sdPrimitive) * yyx +
+        getDistanceFromSignedDistancePrimitive(pos + yxy, sdPrimitive) * yxy +
+        getDistanceFromSignedDistancePrimitive(pos + xxx, sdPrimitive) * xxx);
+}
+
+// Marches lanes [offset, offset + F::kWidth) of the packet.
+template<typename F>
+inline uint32_t raySignedDistancePrimitiveTest(SdfPacket::RayPacket const& packet, uint32_t offset, uint32_t sdPrimitive, float stepScale, SdfPacket::PacketHits& hits) {
+    typedef typename F::Mask Mask;
+
+    F const threshold = F(0.0001f);
+    uint32_t const maxSteps = 512;
+
+    Vec3<F> origin(F::load(packet.originX + offset), F::load(packet.originY + offset), F::load(packet.originZ + offset));
+    Vec3<F> direction(F::load(packet.directionX + offset), F::load(packet.directionY + offset), F::load(packet.directionZ + offset));
+    F tmin = F::load(packet.tmin + offset);
+    F tmax = F::load(packet.tmax + offset);
+
+    bool cullBackFacing = (packet.rayFlags & 0x10) != 0;
+    bool cullFrontFacing = (packet.rayFlags & 0x20) != 0;
+
+    Mask active = F::laneIndices() < F(static_cast<float>(packet.count - offset));
+    Mask hitMask = F(0.0f) > F(0.0f);
+
+    F t = tmin;
+    F thit = F(0.0f);
+    Vec3<F> hitNormal(F(0.0f), F(0.0f), F(0.0f));
+
+    for (uint32_t i = 0; i < maxSteps; ++i) {
+        active = active & (t <= tmax);
+        if (!any(active)) {
+            break;
+        }
+
+        Vec3<F> position = origin + t * direction;
+        F distance = getDistanceFromSignedDistancePrimitive(position, sdPrimitive);
+
+        Mask candidate = active & (distance <= threshold * t);
+        if (any(candidate)) {
+            Vec3<F> normal = sdCalculateNormal(position, sdPrimitive);
+
+            // isAValidHit()
+            F rayDirectionNormalDot = dot(direction, normal);
+            Mask valid = candidate & (t >= tmin) & (t <= tmax);
+            if (cullBackFacing) {
+                valid = andNot(valid, rayDirectionNormalDot > F(0.0f));
+            }
+            if (cullFrontFacing) {
+                valid = andNot(valid, rayDirectionNormalDot < F(0.0f));
+            }
+
+            thit = select(valid, t, thit);
+            hitNormal = Vec3<F>(select(valid, normal.x, hitNormal.x), select(valid, normal.y, hitNormal.y), select(valid, normal.z, hitNormal.z));
+            hitMask = hitMask | valid;
+            active = andNot(active, valid);
+        }
+
+        t = select(active, t + F(stepScale) * distance, t);
+    }
+
+    thit.store(hits.thit + offset);
+    hitNormal.x.store(hits.normalX + offset);
+    hitNormal.y.store(hits.normalY + offset);
+    hitNormal.z.store(hits.normalZ + offset);
+
+    return bits(hitMask) << offset;
+}
+
+template<typename F>
+inline void raySignedDistancePrimitiveTest(SdfPacket::RayPacket const& packet, uint32_t sdPrimitive, float stepScale, SdfPacket::PacketHits& hits) {
+    hits.hitMask = 0;
+    for (uint32_t offset = 0; offset < packet.count; offset += F::kWidth) {
+        hits.hitMask |= raySignedDistancePrimitiveTest<F>(packet, offset, sdPrimitive, stepScale, hits);
+    }
+}
+
+template<typename F>
+inline void getDistanceFromSignedDistancePrimitive(uint32_t sdPrimitive, uint32_t count, float const* x, float const* y, float const* z, float* distance) {
+    uint32_t index = 0;
+    for (; index + F::kWidth <= count; index += F::kWidth) {
+        Vec3<F> position(F::load(x + index), F::load(y + index), F::load(z + index));
+        getDistanceFromSignedDistancePrimitive(position, sdPrimitive).store(distance + index);
+    }
+
+    if (index < count) {
+        float tail[3][SdfPacket::kMaxPacketSize] = {};
+        float result[SdfPacket::kMaxPacketSize];
+        for (uint32_t lane = 0; index + lane < count; ++lane) {
+            tail[0][lane] = x[index + lane];
+            tail[1][lane] = y[index + lane];
+            tail[2][lane] = z[index + lane];
+        }
+
+        Vec3<F> position(F::load(tail[0]), F::load(tail[1]), F::load(tail[2]));
+        getDistanceFromSignedDistancePrimitive(position, sdPrimitive).store(result);
+
+        for (uint32_t lane = 0; index + lane < count; ++lane) {
+            distance[index + lane] = result[lane];
+        }
+    }
+}
+
+}
+
+#endif // SDFPACKETKERNEL_HXX
@@ -0,0 +1,67 @@
+#include <math.h>
+#include <smmintrin.h>
+
+#include "sdfpacketkernel.hxx"
+
+// compiled with SSE4.1 enabled, only called after SdfPacket::isSupported(Isa::SSE41)
+namespace SdfPacketSSE41 {
+
+struct Mask {
+    __m128 v;
+
+    Mask(__m128 value) : v(value) {}
+};
+
+struct Float {
+    static uint32_t const kWidth = 4;
+    typedef SdfPacketSSE41::Mask Mask;
+
+    __m128 v;
+
+    Float(__m128 value) : v(value) {}
+    Float(float value) : v(_mm_set1_ps(value)) {}
+
+    static Float load(float const* data) { return _mm_loadu_ps(data); }
+    void store(float* data) const { _mm_storeu_ps(data, v); }
+    static Float laneIndices() { return _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f); }
+};
+
+inline Float operator+(Float const& a, Float const& b) { return _mm_add_ps(a.v, b.v); }
+inline Float operator-(Float const& a, Float const& b) { return _mm_sub_ps(a.v, b.v); }
+inline Float operator*(Float const& a, Float const& b) { return _mm_mul_ps(a.v, b.v); }
+inline Float operator/(Float const& a, Float const& b) { return _mm_div_ps(a.v, b.v); }
+inline Float operator-(Float const& a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.0f)); }
+
+inline Mask operator<(Float const& a, Float const& b) { return _mm_cmplt_ps(a.v, b.v); }
+inline Mask operator<=(Float const& a, Float const& b) { return _mm_cmple_ps(a.v, b.v); }
+inline Mask operator>(Float const& a, Float const& b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline Mask operator>=(Float const& a, Float const& b) { return _mm_cmpge_ps(a.v, b.v); }
+inline Mask operator==(Float const& a, Float const& b) { return _mm_cmpeq_ps(a.v, b.v); }
+
+inline Mask operator&(Mask const& a, Mask const& b) { return _mm_and_ps(a.v, b.v); }
+inline Mask operator|(Mask const& a, Mask const& b) { return _mm_or_ps(a.v, b.v); }
+inline Mask andNot(Mask const& a, Mask const& b) { return _mm_andnot_ps(b.v, a.v); }
+inline bool any(Mask const& m) { return _mm_movemask_ps(m.v) != 0; }
+inline uint32_t bits(Mask const& m) { return static_cast<uint32_t>(_mm_movemask_ps(m.v)); }
+
+inline Float select(Mask const& m, Float const& a, Float const& b) { return _mm_blendv_ps(b.v, a.v, m.v); }
+inline Float min(Float const& a, Float const& b) { return _mm_min_ps(a.v, b.v); }
+inline Float max(Float const& a, Float const& b) { return _mm_max_ps(a.v, b.v); }
+inline Float abs(Float const& a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+inline Float sqrt(Float const& a) { return _mm_sqrt_ps(a.v); }
+inline Float floor(Float const& a) { return _mm_round_ps(a.v, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC); }
+inline Float trunc(Float const& a) { return _mm_round_ps(a.v, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC); }
+
+}
+
+namespace SdfPacket {
+
+void raySignedDistancePrimitiveTestSSE41(RayPacket const& packet, uint32_t signedDistancePrimitive, float stepScale, PacketHits& hits) {
+    SdfPacketKernel::raySignedDistancePrimitiveTest<SdfPacketSSE41::Float>(packet, signedDistancePrimitive, stepScale, hits);
+}
+
+void getDistanceFromSignedDistancePrimitiveSSE41(uint32_t signedDistancePrimitive, uint32_t count, float const* x, float const* y, float const* z, float* distance) {
+    SdfPacketKernel::getDistanceFromSignedDistancePrimitive<SdfPacketSSE41::Float>(signedDistancePrimitive, count, x, y, z, distance);
+}
+
+}
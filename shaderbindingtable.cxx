@@ -0,0 +1,202 @@
+#include "shaderbindingtable.hxx"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+CShaderBindingTable::CShaderBindingTable(VkDevice device, CVulkanHelper& helper, CUploadManager& uploader, VkPhysicalDeviceRayTracingPipelinePropertiesKHR const& properties)
+    : m_device(device)
+    , m_helper(helper)
+    , m_uploader(uploader)
+    , m_handleSize(properties.shaderGroupHandleSize)
+    , m_handleAlignment(std::max(properties.shaderGroupHandleAlignment, 1u))
+    , m_baseAlignment(std::max(properties.shaderGroupBaseAlignment, 1u))
+    , m_maxStride(properties.maxShaderGroupStride)
+    , m_groupCount(0)
+    , m_buffer()
+    , m_built(false)
+{
+    for (uint32_t region = 0; region < ShaderBindingTableRegion::Count; ++region) {
+        m_regions[region].offset = 0;
+        m_regions[region].stride = 0;
+    }
+}
+
+uint32_t CShaderBindingTable::addRecord(ShaderBindingTableRegion::Enum region, uint32_t groupIndex, void const* data, uint32_t dataSize) {
+    if (m_built) {
+        printf("shader binding table: records can not be added after build\n");
+        return UINT32_MAX;
+    }
+
+    Record record;
+    record.groupIndex = groupIndex;
+    if (dataSize > 0) {
+        uint8_t const* bytes = static_cast<uint8_t const*>(data);
+        record.data.assign(bytes, bytes + dataSize);
+    }
+
+    m_regions[region].records.push_back(record);
+    return static_cast<uint32_t>(m_regions[region].records.size() - 1);
+}
+
+void CShaderBindingTable::build(VkPipeline pipeline, uint32_t groupCount) {
+    m_groupCount = groupCount;
+    m_handles.resize(static_cast<size_t>(groupCount) * m_handleSize);
+    VK_CHECK(vkGetRayTracingShaderGroupHandlesKHR(m_device, pipeline, 0, groupCount, m_handles.size(), m_handles.data()));
+
+    VkDeviceSize tableSize = 0;
+    for (uint32_t regionIndex = 0; regionIndex < ShaderBindingTableRegion::Count; ++regionIndex) {
+        Region& region = m_regions[regionIndex];
+
+        size_t maxDataSize = 0;
+        for (size_t index = 0; index < region.records.size(); ++index) {
+            maxDataSize = std::max(maxDataSize, region.records[index].data.size());
+        }
+
+        region.offset = CVulkanHelper::alignTo(static_cast<uint32_t>(tableSize), m_baseAlignment);
+        region.stride = region.records.empty() ? 0 : CVulkanHelper::alignTo(m_handleSize + static_cast<uint32_t>(maxDataSize), m_handleAlignment);
+        if (region.stride > m_maxStride) {
+            printf("shader binding table: stride %llu of region %u exceeds maxShaderGroupStride %u\n", static_cast<unsigned long long>(region.stride), regionIndex, m_maxStride);
+        }
+
+        region.dirty.assign(region.records.size(), false);
+        tableSize = region.offset + region.stride * region.records.size();
+    }
+
+    m_hostTable.assign(tableSize, 0);
+
+    for (uint32_t regionIndex = 0; regionIndex < ShaderBindingTableRegion::Count; ++regionIndex) {
+        Region& region = m_regions[regionIndex];
+
+        for (uint32_t index = 0; index < region.records.size(); ++index) {
+            Record& record = region.records[index];
+            uint8_t* destination = m_hostTable.data() + region.offset + region.stride * index;
+
+            memcpy(destination, &m_handles[record.groupIndex * m_handleSize], m_handleSize);
+            if (!record.data.empty()) {
+                memcpy(destination + m_handleSize, record.data.data(), record.data.size());
+            }
+            std::vector<uint8_t>().swap(record.data);
+        }
+    }
+
+    // the buffer address is 256 byte aligned, which covers shaderGroupBaseAlignment on current GPUs
+    m_buffer = m_uploader.createBuffer(VK_BUFFER_USAGE_SHADER_BINDING_TABLE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, m_hostTable.data(), tableSize);
+    m_uploader.flush();
+
+    m_built = true;
+}
+
+uint8_t* CShaderBindingTable::getRecord(ShaderBindingTableRegion::Enum region, uint32_t recordIndex) {
+    return m_hostTable.data() + m_regions[region].offset + m_regions[region].stride * recordIndex;
+}
+
+void CShaderBindingTable::markDirty(ShaderBindingTableRegion::Enum region, uint32_t recordIndex) {
+    if (!m_regions[region].dirty[recordIndex]) {
+        m_regions[region].dirty[recordIndex] = true;
+        m_regions[region].dirtyRecords.push_back(recordIndex);
+    }
+}
+
+void CShaderBindingTable::setRecordData(ShaderBindingTableRegion::Enum region, uint32_t recordIndex, void const* data, uint32_t dataSize) {
+    if (!m_built) {
+        uint8_t const* bytes = static_cast<uint8_t const*>(data);
+        m_regions[region].records[recordIndex].data.assign(bytes, bytes + dataSize);
+        return;
+    }
+
+    if (m_handleSize + dataSize > m_regions[region].stride) {
+        printf("shader binding table: %u bytes of record data do not fit into a stride of %llu\n", dataSize, static_cast<unsigned long long>(m_regions[region].stride));
+        return;
+    }
+
+    memcpy(getRecord(region, recordIndex) + m_handleSize, data, dataSize);
+    markDirty(region, recordIndex);
+}
+
+void CShaderBindingTable::setRecordGroup(ShaderBindingTableRegion::Enum region, uint32_t recordIndex, uint32_t groupIndex) {
+    m_regions[region].records[recordIndex].groupIndex = groupIndex;
+
+    if (m_built) {
+        memcpy(getRecord(region, recordIndex), &m_handles[groupIndex * m_handleSize], m_handleSize);
+        markDirty(region, recordIndex);
+    }
+}
+
+void CShaderBindingTable::setPipeline(VkPipeline pipeline) {
+    VK_CHECK(vkGetRayTracingShaderGroupHandlesKHR(m_device, pipeline, 0, m_groupCount, m_handles.size(), m_handles.data()));
+
+    for (uint32_t regionIndex = 0; regionIndex < ShaderBindingTableRegion::Count; ++regionIndex) {
+        ShaderBindingTableRegion::Enum region = static_cast<ShaderBindingTableRegion::Enum>(regionIndex);
+        for (uint32_t index = 0; index < m_regions[regionIndex].records.size(); ++index) {
+            memcpy(getRecord(region, index), &m_handles[m_regions[regionIndex].records[index].groupIndex * m_handleSize], m_handleSize);
+            markDirty(region, index);
+        }
+    }
+}
+
+void CShaderBindingTable::uploadDirtyRecords() {
+    bool uploaded = false;
+
+    for (uint32_t regionIndex = 0; regionIndex < ShaderBindingTableRegion::Count; ++regionIndex) {
+        Region& region = m_regions[regionIndex];
+        if (region.dirtyRecords.empty()) {
+            continue;
+        }
+
+        std::sort(region.dirtyRecords.begin(), region.dirtyRecords.end());
+
+        size_t first = 0;
+        while (first < region.dirtyRecords.size()) {
+            size_t last = first;
+            while (last + 1 < region.dirtyRecords.size() && region.dirtyRecords[last + 1] == region.dirtyRecords[last] + 1) {
+                ++last;
+            }
+
+            uint32_t firstRecord = region.dirtyRecords[first];
+            uint32_t recordCount = region.dirtyRecords[last] - firstRecord + 1;
+            VkDeviceSize offset = region.offset + region.stride * firstRecord;
+            m_uploader.update(m_buffer, offset, m_hostTable.data() + offset, region.stride * recordCount);
+
+            first = last + 1;
+        }
+
+        for (size_t index = 0; index < region.dirtyRecords.size(); ++index) {
+            region.dirty[region.dirtyRecords[index]] = false;
+        }
+        region.dirtyRecords.clear();
+        uploaded = true;
+    }
+
+    if (uploaded) {
+        m_uploader.flush();
+    }
+}
+
+VkStridedDeviceAddressRegionKHR CShaderBindingTable::getRegion(ShaderBindingTableRegion::Enum region, uint32_t rayGenRecord) const {
+    VkStridedDeviceAddressRegionKHR deviceRegion = {};
+
+    Region const& source = m_regions[region];
+    if (source.records.empty()) {
+        return deviceRegion;
+    }
+
+    deviceRegion.deviceAddress = m_buffer.address + source.offset;
+    deviceRegion.stride = source.stride;
+    deviceRegion.size = source.stride * source.records.size();
+
+    if (region == ShaderBindingTableRegion::RayGen) {
+        deviceRegion.deviceAddress += source.stride * rayGenRecord;
+        deviceRegion.size = source.stride;
+    }
+
+    return deviceRegion;
+}
+
+void CShaderBindingTable::destroy() {
+    if (m_buffer.handle != VK_NULL_HANDLE) {
+        m_uploader.waitIdle();
+        m_helper.destroyBuffer(m_buffer);
+        m_buffer = {};
+    }
+}
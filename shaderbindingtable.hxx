@@ -0,0 +1,102 @@
+#ifndef SHADERBINDINGTABLE_HXX
+#define SHADERBINDINGTABLE_HXX
+
+#include <stdint.h>
+#include <vector>
+
+#include "vulkanhelper.hxx"
+#include "uploadmanager.hxx"
+
+namespace ShaderBindingTableRegion {
+    enum Enum {
+        RayGen = 0,
+        Miss,
+        Hit,
+        Callable,
+        Count
+    };
+}
+
+/*
+ * Shader binding table built from a list of records per region. A record is the handle of
+ * a shader group of the pipeline followed by its inline data (shaderRecordEXT). The stride
+ * of a region fits its largest record and is aligned to shaderGroupHandleAlignment, every
+ * region starts at a multiple of shaderGroupBaseAlignment. The table lives in device local
+ * memory, a host copy is kept so records can be patched later and only the dirty records
+ * get uploaded again.
+ */
+class CShaderBindingTable
+{
+public:
+    CShaderBindingTable(VkDevice device, CVulkanHelper& helper, CUploadManager& uploader, VkPhysicalDeviceRayTracingPipelinePropertiesKHR const& properties);
+
+    // groupIndex is the index of the shader group in the pipeline, returns the index of the record in its region
+    uint32_t addRecord(ShaderBindingTableRegion::Enum region, uint32_t groupIndex, void const* data = nullptr, uint32_t dataSize = 0);
+    template <typename T>
+    uint32_t addRecord(ShaderBindingTableRegion::Enum region, uint32_t groupIndex, T const& data) {
+        return addRecord(region, groupIndex, &data, static_cast<uint32_t>(sizeof(T)));
+    }
+
+    // Fetches the handles of all groupCount groups of the pipeline with one call, lays out the
+    // regions and uploads the table. The records can not be added to after this.
+    void build(VkPipeline pipeline, uint32_t groupCount);
+
+    // After build() the data has to fit into the stride of the region. The record is only
+    // changed in the host copy until uploadDirtyRecords().
+    void setRecordData(ShaderBindingTableRegion::Enum region, uint32_t recordIndex, void const* data, uint32_t dataSize);
+    template <typename T>
+    void setRecordData(ShaderBindingTableRegion::Enum region, uint32_t recordIndex, T const& data) {
+        setRecordData(region, recordIndex, &data, static_cast<uint32_t>(sizeof(T)));
+    }
+    void setRecordGroup(ShaderBindingTableRegion::Enum region, uint32_t recordIndex, uint32_t groupIndex);
+    // For a pipeline with the same groups, e.g. relinked from pipeline libraries: fetches the
+    // new handles and marks every record dirty.
+    void setPipeline(VkPipeline pipeline);
+    // Copies the dirty records into the table on the render queue, behind the work already
+    // submitted, neighbouring dirty records go into one copy.
+    void uploadDirtyRecords();
+
+    // the raygen region covers a single record, its size has to match the stride
+    VkStridedDeviceAddressRegionKHR getRegion(ShaderBindingTableRegion::Enum region, uint32_t rayGenRecord = 0) const;
+    uint32_t getRecordCount(ShaderBindingTableRegion::Enum region) const { return static_cast<uint32_t>(m_regions[region].records.size()); }
+    VulkanBuffer const& getBuffer() const { return m_buffer; }
+
+    void destroy();
+
+private:
+    struct Record {
+        uint32_t groupIndex;
+        // only used until build(), the host copy of the table holds the data afterwards
+        std::vector<uint8_t> data;
+    };
+
+    struct Region {
+        std::vector<Record> records;
+        VkDeviceSize offset;
+        VkDeviceSize stride;
+        std::vector<bool> dirty;
+        std::vector<uint32_t> dirtyRecords;
+    };
+
+    void markDirty(ShaderBindingTableRegion::Enum region, uint32_t recordIndex);
+    uint8_t* getRecord(ShaderBindingTableRegion::Enum region, uint32_t recordIndex);
+
+    VkDevice m_device;
+    CVulkanHelper& m_helper;
+    CUploadManager& m_uploader;
+
+    uint32_t m_handleSize;
+    uint32_t m_handleAlignment;
+    uint32_t m_baseAlignment;
+    uint32_t m_maxStride;
+
+    Region m_regions[ShaderBindingTableRegion::Count];
+    // handles of all groups of the pipeline
+    std::vector<uint8_t> m_handles;
+    uint32_t m_groupCount;
+    std::vector<uint8_t> m_hostTable;
+    VulkanBuffer m_buffer;
+    bool m_built;
+};
+
+#endif // SHADERBINDINGTABLE_HXX
@@ -0,0 +1,28 @@
+# shader/spirv_sources.txt records for every checked in SPIR-V file the hash of the source it was
+# compiled from, one "<name> <sha256>" line per shader. Without glslangValidator the build embeds
+# the checked in SPIR-V and compares the hashes, so a changed source can not ship its old SPIR-V.
+#
+# Included it defines spirv_source_hash(), run with
+# cmake -DSHADER_DIR=... -DSHADERS=... ('|' separated) -P spirvmanifest.cmake it writes the
+# manifest of SHADERS into SHADER_DIR.
+
+# the line endings are normalized, a checkout with CRLF hashes the same
+function(spirv_source_hash OUTPUT SOURCE)
+	file(READ ${SOURCE} TEXT)
+	string(REPLACE "\r\n" "\n" TEXT "${TEXT}")
+	string(SHA256 HASH "${TEXT}")
+	set(${OUTPUT} ${HASH} PARENT_SCOPE)
+endfunction()
+
+if (CMAKE_SCRIPT_MODE_FILE)
+	string(REPLACE "|" ";" SHADERS "${SHADERS}")
+
+	set(MANIFEST "")
+	foreach(SHADER ${SHADERS})
+		get_filename_component(SHADER_NAME ${SHADER} NAME_WE)
+		spirv_source_hash(HASH ${SHADER_DIR}/${SHADER})
+		string(APPEND MANIFEST "${SHADER_NAME} ${HASH}\n")
+	endforeach()
+
+	file(WRITE ${SHADER_DIR}/spirv_sources.txt "${MANIFEST}")
+endif()
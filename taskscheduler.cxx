@@ -0,0 +1,138 @@
+#include "taskscheduler.hxx"
+
+CTaskScheduler::CTaskScheduler(uint32_t threadCount) {
+    if (threadCount == 0) {
+        threadCount = getHardwareThreadCount();
+    }
+
+    for (uint32_t index = 0; index < threadCount; ++index) {
+        m_queues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue()));
+    }
+
+    // worker 0 is the thread calling parallelFor
+    for (uint32_t index = 1; index < threadCount; ++index) {
+        m_threads.push_back(std::thread(&CTaskScheduler::workerLoop, this, index));
+    }
+}
+
+CTaskScheduler::~CTaskScheduler() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_wakeCondition.notify_all();
+
+    for (size_t index = 0; index < m_threads.size(); ++index) {
+        m_threads[index].join();
+    }
+}
+
+uint32_t CTaskScheduler::getHardwareThreadCount() {
+    uint32_t count = std::thread::hardware_concurrency();
+    return count > 0 ? count : 1;
+}
+
+void CTaskScheduler::parallelFor(uint32_t taskCount, TaskFunction const& func) {
+    if (taskCount == 0) {
+        return;
+    }
+
+    uint32_t threadCount = getThreadCount();
+
+    // hand out contiguous ranges so neighbouring tasks stay on the same thread until stolen
+    for (uint32_t threadIndex = 0; threadIndex < threadCount; ++threadIndex) {
+        uint32_t begin = static_cast<uint32_t>(static_cast<uint64_t>(taskCount) * threadIndex / threadCount);
+        uint32_t end = static_cast<uint32_t>(static_cast<uint64_t>(taskCount) * (threadIndex + 1) / threadCount);
+
+        WorkQueue& queue = *m_queues[threadIndex];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        for (uint32_t taskIndex = begin; taskIndex < end; ++taskIndex) {
+            queue.tasks.push_back(taskIndex);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_function = &func;
+        ++m_generation;
+    }
+    m_wakeCondition.notify_all();
+
+    runTasks(0, func);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_doneCondition.wait(lock, [this] { return m_busyWorkers == 0; });
+    // workers waking up after this point see no function and go back to sleep
+    m_function = nullptr;
+}
+
+void CTaskScheduler::workerLoop(uint32_t threadIndex) {
+    uint64_t generation = 0;
+
+    for (;;) {
+        TaskFunction const* func = nullptr;
+
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wakeCondition.wait(lock, [&] { return m_quit || m_generation != generation; });
+
+            if (m_quit) {
+                return;
+            }
+
+            generation = m_generation;
+            if (m_function == nullptr) {
+                continue;
+            }
+
+            func = m_function;
+            ++m_busyWorkers;
+        }
+
+        runTasks(threadIndex, *func);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            --m_busyWorkers;
+        }
+        m_doneCondition.notify_one();
+    }
+}
+
+void CTaskScheduler::runTasks(uint32_t threadIndex, TaskFunction const& func) {
+    uint32_t taskIndex = 0;
+
+    while (popTask(threadIndex, taskIndex) || stealTask(threadIndex, taskIndex)) {
+        func(taskIndex, threadIndex);
+    }
+}
+
+bool CTaskScheduler::popTask(uint32_t threadIndex, uint32_t& taskIndex) {
+    WorkQueue& queue = *m_queues[threadIndex];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+
+    if (queue.tasks.empty()) {
+        return false;
+    }
+
+    taskIndex = queue.tasks.front();
+    queue.tasks.pop_front();
+    return true;
+}
+
+bool CTaskScheduler::stealTask(uint32_t threadIndex, uint32_t& taskIndex) {
+    uint32_t threadCount = getThreadCount();
+
+    for (uint32_t offset = 1; offset < threadCount; ++offset) {
+        WorkQueue& victim = *m_queues[(threadIndex + offset) % threadCount];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+
+        if (!victim.tasks.empty()) {
+            taskIndex = victim.tasks.back();
+            victim.tasks.pop_back();
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,58 @@
+#ifndef TASKSCHEDULER_HXX
+#define TASKSCHEDULER_HXX
+
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+
+/*
+ * Small work-stealing scheduler. Every worker owns a queue of task indices,
+ * takes work from the front of its own queue and steals from the back of the
+ * others once it runs dry. The thread calling parallelFor() works as worker 0.
+ */
+class CTaskScheduler
+{
+public:
+    typedef std::function<void(uint32_t taskIndex, uint32_t threadIndex)> TaskFunction;
+
+    // threadCount == 0 uses one worker per hardware thread.
+    explicit CTaskScheduler(uint32_t threadCount = 0);
+    ~CTaskScheduler();
+
+    // Runs func for every index in [0, taskCount) and returns once all of them are done.
+    // Not reentrant: func must not call parallelFor on the same scheduler.
+    void parallelFor(uint32_t taskCount, TaskFunction const& func);
+
+    uint32_t getThreadCount() const { return static_cast<uint32_t>(m_queues.size()); }
+
+    static uint32_t getHardwareThreadCount();
+
+private:
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<uint32_t> tasks;
+    };
+
+    void workerLoop(uint32_t threadIndex);
+    void runTasks(uint32_t threadIndex, TaskFunction const& func);
+    bool popTask(uint32_t threadIndex, uint32_t& taskIndex);
+    bool stealTask(uint32_t threadIndex, uint32_t& taskIndex);
+
+    std::vector<std::unique_ptr<WorkQueue>> m_queues;
+    std::vector<std::thread> m_threads;
+
+    std::mutex m_mutex;
+    std::condition_variable m_wakeCondition;
+    std::condition_variable m_doneCondition;
+    TaskFunction const* m_function = nullptr;
+    uint64_t m_generation = 0;
+    uint32_t m_busyWorkers = 0;
+    bool m_quit = false;
+};
+
+#endif // TASKSCHEDULER_HXX
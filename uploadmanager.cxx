@@ -0,0 +1,339 @@
+#include "uploadmanager.hxx"
+
+#include <stdio.h>
+#include <algorithm>
+
+// keeps every staging range aligned for any copy source
+static VkDeviceSize const kStagingAlignment = 16;
+
+static VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+CUploadManager::CUploadManager(VkDevice device, CVulkanHelper& helper)
+    : m_device(device)
+    , m_helper(helper)
+    , m_queue(VK_NULL_HANDLE)
+    , m_queueFamily(0)
+    , m_transferQueue(VK_NULL_HANDLE)
+    , m_transferQueueFamily(0)
+    , m_commandPool(VK_NULL_HANDLE)
+    , m_transferCommandPool(VK_NULL_HANDLE)
+    , m_stagingBuffer()
+    , m_stagingHead(0)
+    , m_stagingUsed(0)
+    , m_pendingStagingBytes(0)
+    , m_stats()
+    , m_batchesThisFrame(0)
+    , m_frameStarted(false)
+{
+}
+
+void CUploadManager::init(VkQueue queue, uint32_t queueFamily, VkQueue transferQueue, uint32_t transferQueueFamily, VkDeviceSize stagingSize) {
+    m_queue = queue;
+    m_queueFamily = queueFamily;
+    m_transferQueue = transferQueue;
+    m_transferQueueFamily = transferQueueFamily;
+
+    VkCommandPoolCreateInfo commandPoolInfo = {};
+    commandPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    commandPoolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    commandPoolInfo.queueFamilyIndex = m_queueFamily;
+    VK_CHECK(vkCreateCommandPool(m_device, &commandPoolInfo, nullptr, &m_commandPool));
+
+    if (hasDedicatedTransferQueue()) {
+        commandPoolInfo.queueFamilyIndex = m_transferQueueFamily;
+        VK_CHECK(vkCreateCommandPool(m_device, &commandPoolInfo, nullptr, &m_transferCommandPool));
+    }
+
+    m_stagingBuffer = m_helper.createBuffer(VK_BUFFER_USAGE_TRANSFER_SRC_BIT, alignUp(stagingSize, kStagingAlignment), VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+}
+
+void CUploadManager::destroy() {
+    waitIdle();
+
+    m_helper.destroyBuffer(m_stagingBuffer);
+    m_stagingBuffer = {};
+
+    vkDestroyCommandPool(m_device, m_commandPool, nullptr);
+    m_commandPool = VK_NULL_HANDLE;
+    if (m_transferCommandPool != VK_NULL_HANDLE) {
+        vkDestroyCommandPool(m_device, m_transferCommandPool, nullptr);
+        m_transferCommandPool = VK_NULL_HANDLE;
+    }
+}
+
+VulkanBuffer CUploadManager::createBuffer(VkBufferUsageFlags usage, void const* data, VkDeviceSize size) {
+    VulkanBuffer buffer = m_helper.createBuffer(usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT, size, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    upload(buffer, 0, data, size);
+    return buffer;
+}
+
+void CUploadManager::upload(VulkanBuffer const& buffer, VkDeviceSize offset, void const* data, VkDeviceSize size) {
+    enqueue(buffer, offset, data, size, false);
+}
+
+void CUploadManager::update(VulkanBuffer const& buffer, VkDeviceSize offset, void const* data, VkDeviceSize size) {
+    enqueue(buffer, offset, data, size, true);
+}
+
+void CUploadManager::enqueue(VulkanBuffer const& buffer, VkDeviceSize offset, void const* data, VkDeviceSize size, bool update) {
+    // a quarter of the ring per copy, so a large upload keeps a few batches in flight
+    VkDeviceSize const maxChunkSize = std::max<VkDeviceSize>(m_stagingBuffer.size / 4, kStagingAlignment);
+    uint8_t const* source = static_cast<uint8_t const*>(data);
+
+    ++m_stats.uploadCount;
+    m_stats.uploadBytes += size;
+
+    while (size > 0) {
+        VkDeviceSize chunkSize = std::min(size, maxChunkSize);
+        VkDeviceSize stagingOffset = reserveStaging(chunkSize);
+
+        m_helper.copyToBuffer(m_stagingBuffer, const_cast<uint8_t*>(source), static_cast<uint32_t>(chunkSize), stagingOffset);
+
+        PendingCopy copy;
+        copy.buffer = buffer.handle;
+        copy.region.srcOffset = stagingOffset;
+        copy.region.dstOffset = offset;
+        copy.region.size = chunkSize;
+        copy.update = update;
+        m_pendingCopies.push_back(copy);
+
+        source += chunkSize;
+        offset += chunkSize;
+        size -= chunkSize;
+    }
+}
+
+VkDeviceSize CUploadManager::reserveStaging(VkDeviceSize size) {
+    size = alignUp(size, kStagingAlignment);
+
+    for (;;) {
+        if (m_stagingUsed == 0) {
+            m_stagingHead = 0;
+        }
+
+        // the used range runs from the oldest batch to the head, a range that does not fit
+        // in front of the end of the ring starts over at 0 and the rest of the ring is lost
+        bool wrap = m_stagingHead + size > m_stagingBuffer.size;
+        VkDeviceSize padding = wrap ? m_stagingBuffer.size - m_stagingHead : 0;
+
+        if (m_stagingUsed + padding + size <= m_stagingBuffer.size) {
+            VkDeviceSize offset = wrap ? 0 : m_stagingHead;
+            m_stagingHead = offset + size;
+            m_stagingUsed += padding + size;
+            m_pendingStagingBytes += padding + size;
+            return offset;
+        }
+
+        if (!m_pendingCopies.empty()) {
+            flush();
+        }
+        retireBatch();
+    }
+}
+
+VkCommandBuffer CUploadManager::beginCommandBuffer(VkCommandPool commandPool) {
+    VkCommandBufferAllocateInfo commandBufferAllocInfo = {};
+    commandBufferAllocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    commandBufferAllocInfo.commandPool = commandPool;
+    commandBufferAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    commandBufferAllocInfo.commandBufferCount = 1;
+
+    VkCommandBuffer commandBuffer;
+    VK_CHECK(vkAllocateCommandBuffers(m_device, &commandBufferAllocInfo, &commandBuffer));
+
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    VK_CHECK(vkBeginCommandBuffer(commandBuffer, &beginInfo));
+
+    return commandBuffer;
+}
+
+void CUploadManager::flush() {
+    if (m_pendingCopies.empty()) {
+        return;
+    }
+
+    Batch batch = {};
+    batch.stagingBytes = m_pendingStagingBytes;
+
+    // new buffers go over the transfer queue if there is one, updates of buffers the render
+    // queue already uses are copied on the render queue behind the work that reads them
+    bool useTransferQueue = false;
+    for (size_t index = 0; index < m_pendingCopies.size(); ++index) {
+        useTransferQueue |= hasDedicatedTransferQueue() && !m_pendingCopies[index].update;
+    }
+
+    if (useTransferQueue) {
+        // one ownership transfer per destination buffer
+        std::vector<VkBufferMemoryBarrier> bufferBarriers;
+
+        batch.transferCommandBuffer = beginCommandBuffer(m_transferCommandPool);
+
+        for (size_t index = 0; index < m_pendingCopies.size(); ++index) {
+            PendingCopy const& copy = m_pendingCopies[index];
+            if (copy.update) {
+                continue;
+            }
+
+            vkCmdCopyBuffer(batch.transferCommandBuffer, m_stagingBuffer.handle, copy.buffer, 1, &copy.region);
+
+            bool known = false;
+            for (size_t barrierIndex = 0; barrierIndex < bufferBarriers.size(); ++barrierIndex) {
+                known |= bufferBarriers[barrierIndex].buffer == copy.buffer;
+            }
+            if (!known) {
+                VkBufferMemoryBarrier barrier = {};
+                barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+                barrier.srcQueueFamilyIndex = m_transferQueueFamily;
+                barrier.dstQueueFamilyIndex = m_queueFamily;
+                barrier.buffer = copy.buffer;
+                barrier.offset = 0;
+                barrier.size = VK_WHOLE_SIZE;
+                bufferBarriers.push_back(barrier);
+            }
+        }
+
+        // release on the transfer queue ...
+        for (size_t index = 0; index < bufferBarriers.size(); ++index) {
+            bufferBarriers[index].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            bufferBarriers[index].dstAccessMask = 0;
+        }
+        vkCmdPipelineBarrier(batch.transferCommandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, static_cast<uint32_t>(bufferBarriers.size()), bufferBarriers.data(), 0, nullptr);
+        VK_CHECK(vkEndCommandBuffer(batch.transferCommandBuffer));
+
+        VkSemaphoreCreateInfo semaphoreInfo = {};
+        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        VK_CHECK(vkCreateSemaphore(m_device, &semaphoreInfo, nullptr, &batch.semaphore));
+
+        VkSubmitInfo transferSubmitInfo = {};
+        transferSubmitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        transferSubmitInfo.commandBufferCount = 1;
+        transferSubmitInfo.pCommandBuffers = &batch.transferCommandBuffer;
+        transferSubmitInfo.signalSemaphoreCount = 1;
+        transferSubmitInfo.pSignalSemaphores = &batch.semaphore;
+        VK_CHECK(vkQueueSubmit(m_transferQueue, 1, &transferSubmitInfo, VK_NULL_HANDLE));
+
+        // ... and acquire on the render queue, after the semaphore wait
+        batch.commandBuffer = beginCommandBuffer(m_commandPool);
+        for (size_t index = 0; index < bufferBarriers.size(); ++index) {
+            bufferBarriers[index].srcAccessMask = 0;
+            bufferBarriers[index].dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+        }
+        vkCmdPipelineBarrier(batch.commandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, static_cast<uint32_t>(bufferBarriers.size()), bufferBarriers.data(), 0, nullptr);
+    }
+    else {
+        batch.commandBuffer = beginCommandBuffer(m_commandPool);
+    }
+
+    bool renderQueueCopies = false;
+    for (size_t index = 0; index < m_pendingCopies.size(); ++index) {
+        renderQueueCopies |= m_pendingCopies[index].update || !useTransferQueue;
+    }
+
+    if (renderQueueCopies) {
+        // earlier submissions may still read the ranges that get overwritten
+        vkCmdPipelineBarrier(batch.commandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 0, nullptr);
+
+        for (size_t index = 0; index < m_pendingCopies.size(); ++index) {
+            PendingCopy const& copy = m_pendingCopies[index];
+            if (copy.update || !useTransferQueue) {
+                vkCmdCopyBuffer(batch.commandBuffer, m_stagingBuffer.handle, copy.buffer, 1, &copy.region);
+            }
+        }
+
+        VkMemoryBarrier memoryBarrier = {};
+        memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        memoryBarrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+        vkCmdPipelineBarrier(batch.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+    }
+
+    VK_CHECK(vkEndCommandBuffer(batch.commandBuffer));
+
+    VkFenceCreateInfo fenceInfo = {};
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    VK_CHECK(vkCreateFence(m_device, &fenceInfo, nullptr, &batch.fence));
+
+    // the render queue part waits for the transfer queue part, so its fence covers the whole batch
+    VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+
+    VkSubmitInfo submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.waitSemaphoreCount = useTransferQueue ? 1 : 0;
+    submitInfo.pWaitSemaphores = &batch.semaphore;
+    submitInfo.pWaitDstStageMask = &waitStage;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &batch.commandBuffer;
+    VK_CHECK(vkQueueSubmit(m_queue, 1, &submitInfo, batch.fence));
+
+    batch.submitTime = std::chrono::high_resolution_clock::now();
+    m_batches.push_back(batch);
+
+    m_pendingCopies.clear();
+    m_pendingStagingBytes = 0;
+
+    ++m_stats.batchCount;
+    ++m_batchesThisFrame;
+}
+
+void CUploadManager::retireBatch() {
+    if (m_batches.empty()) {
+        return;
+    }
+
+    Batch& batch = m_batches.front();
+
+    VK_CHECK(vkWaitForFences(m_device, 1, &batch.fence, VK_TRUE, UINT64_MAX));
+    m_stats.batchMilliseconds += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - batch.submitTime).count();
+
+    vkDestroyFence(m_device, batch.fence, nullptr);
+    vkFreeCommandBuffers(m_device, m_commandPool, 1, &batch.commandBuffer);
+    if (batch.transferCommandBuffer != VK_NULL_HANDLE) {
+        vkFreeCommandBuffers(m_device, m_transferCommandPool, 1, &batch.transferCommandBuffer);
+        vkDestroySemaphore(m_device, batch.semaphore, nullptr);
+    }
+
+    m_stagingUsed -= batch.stagingBytes;
+    m_batches.pop_front();
+}
+
+void CUploadManager::waitIdle() {
+    flush();
+    while (!m_batches.empty()) {
+        retireBatch();
+    }
+}
+
+void CUploadManager::nextFrame() {
+    while (!m_batches.empty() && vkGetFenceStatus(m_device, m_batches.front().fence) == VK_SUCCESS) {
+        retireBatch();
+    }
+
+    if (m_frameStarted) {
+        ++m_stats.frameCount;
+        m_stats.frameBatchCount += m_batchesThisFrame;
+        m_stats.maxBatchesPerFrame = std::max(m_stats.maxBatchesPerFrame, m_batchesThisFrame);
+    }
+    m_frameStarted = true;
+    m_batchesThisFrame = 0;
+}
+
+void CUploadManager::printReport() const {
+    double megabytes = static_cast<double>(m_stats.uploadBytes) / (1024.0 * 1024.0);
+    double seconds = m_stats.batchMilliseconds / 1000.0;
+
+    printf("uploads: %llu uploads, %.2f MB in %u batches on the %s queue, %.2f MB/s (submit to retire)\n",
+           static_cast<unsigned long long>(m_stats.uploadCount),
+           megabytes,
+           m_stats.batchCount,
+           hasDedicatedTransferQueue() ? "transfer" : "render",
+           seconds > 0.0 ? megabytes / seconds : 0.0);
+    printf("uploads: %u frames, %.2f batches per frame, at most %u, staging ring %llu KB\n",
+           m_stats.frameCount,
+           m_stats.frameCount > 0 ? static_cast<double>(m_stats.frameBatchCount) / m_stats.frameCount : 0.0,
+           m_stats.maxBatchesPerFrame,
+           static_cast<unsigned long long>(m_stagingBuffer.size / 1024));
+}
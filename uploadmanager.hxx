@@ -0,0 +1,112 @@
+#ifndef UPLOADMANAGER_HXX
+#define UPLOADMANAGER_HXX
+
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <chrono>
+
+#include "vulkanhelper.hxx"
+
+struct UploadStats {
+    uint64_t uploadCount;
+    uint64_t uploadBytes;
+    uint32_t batchCount;
+    // submit to retire of all batches, overlapping batches are counted once per batch
+    double batchMilliseconds;
+    // batches submitted between nextFrame() calls, the uploads before the first frame are not counted
+    uint32_t frameCount;
+    uint32_t frameBatchCount;
+    uint32_t maxBatchesPerFrame;
+};
+
+/*
+ * Moves static data into device local buffers. Uploads are copied into a persistently
+ * mapped staging ring right away and recorded as buffer copies, flush() submits all
+ * pending copies as one batch. With a dedicated transfer queue new buffers are filled there
+ * and handed over to the render queue with a queue family ownership transfer, the render
+ * queue waits on a semaphore for it. Updates of buffers in use are copied on the render
+ * queue. Either way every submission to the render queue after flush() sees the data
+ * without any CPU wait. The staging range of a batch is
+ * reused once its fence is signaled, uploads that do not fit wait for the oldest batches.
+ */
+class CUploadManager
+{
+public:
+    CUploadManager(VkDevice device, CVulkanHelper& helper);
+
+    // transferQueue may be queue, then the copies run on the render queue
+    void init(VkQueue queue, uint32_t queueFamily, VkQueue transferQueue, uint32_t transferQueueFamily, VkDeviceSize stagingSize = kDefaultStagingSize);
+    void destroy();
+
+    // Creates a device local buffer with usage | TRANSFER_DST and uploads data into it.
+    VulkanBuffer createBuffer(VkBufferUsageFlags usage, void const* data, VkDeviceSize size);
+    // data is copied before the call returns, larger uploads are split over several batches
+    void upload(VulkanBuffer const& buffer, VkDeviceSize offset, void const* data, VkDeviceSize size);
+    // For buffers the render queue already reads: the copy runs on the render queue after all
+    // work submitted before the flush, so the range can be patched while frames are in flight.
+    void update(VulkanBuffer const& buffer, VkDeviceSize offset, void const* data, VkDeviceSize size);
+
+    // submits the pending copies as one batch
+    void flush();
+    // flushes and waits for all batches
+    void waitIdle();
+    // retires finished batches without waiting and counts the batches of the frame
+    void nextFrame();
+
+    bool hasDedicatedTransferQueue() const { return m_transferQueueFamily != m_queueFamily; }
+    UploadStats const& getStats() const { return m_stats; }
+    void printReport() const;
+
+    static VkDeviceSize const kDefaultStagingSize = 16ull * 1024 * 1024;
+
+private:
+    struct PendingCopy {
+        VkBuffer buffer;
+        VkBufferCopy region;
+        bool update;
+    };
+
+    struct Batch {
+        // render queue: ownership acquire, updates and copies without a dedicated transfer queue
+        VkCommandBuffer commandBuffer;
+        // VK_NULL_HANDLE if the batch does not use the transfer queue
+        VkCommandBuffer transferCommandBuffer;
+        VkSemaphore semaphore;
+        VkFence fence;
+        // staging bytes including the padding at the end of the ring, released on retire
+        VkDeviceSize stagingBytes;
+        std::chrono::high_resolution_clock::time_point submitTime;
+    };
+
+    void enqueue(VulkanBuffer const& buffer, VkDeviceSize offset, void const* data, VkDeviceSize size, bool update);
+    // returns the staging offset, flushes and waits for old batches until size fits
+    VkDeviceSize reserveStaging(VkDeviceSize size);
+    VkCommandBuffer beginCommandBuffer(VkCommandPool commandPool);
+    void retireBatch();
+
+    VkDevice m_device;
+    CVulkanHelper& m_helper;
+
+    VkQueue m_queue;
+    uint32_t m_queueFamily;
+    VkQueue m_transferQueue;
+    uint32_t m_transferQueueFamily;
+    VkCommandPool m_commandPool;
+    VkCommandPool m_transferCommandPool;
+
+    VulkanBuffer m_stagingBuffer;
+    VkDeviceSize m_stagingHead;
+    // staging bytes of the pending copies and of the batches in flight
+    VkDeviceSize m_stagingUsed;
+    VkDeviceSize m_pendingStagingBytes;
+
+    std::vector<PendingCopy> m_pendingCopies;
+    std::deque<Batch> m_batches;
+
+    UploadStats m_stats;
+    uint32_t m_batchesThisFrame;
+    bool m_frameStarted;
+};
+
+#endif // UPLOADMANAGER_HXX
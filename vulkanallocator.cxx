@@ -0,0 +1,396 @@
+#include "vulkanallocator.hxx"
+
+#include <stdio.h>
+#include <algorithm>
+
+static VkDeviceSize const kDefaultBlockSize = 64ull * 1024 * 1024;
+static VkDeviceSize const kSmallHeapSize = 1024ull * 1024 * 1024;
+
+static VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+static uint32_t countBits(uint32_t value) {
+    uint32_t count = 0;
+    for (; value != 0; value &= value - 1) {
+        ++count;
+    }
+    return count;
+}
+
+CVulkanAllocator::CVulkanAllocator(VkDevice device, VkPhysicalDevice gpu)
+    : m_device(device)
+    , m_deviceAllocationCount(0)
+{
+    vkGetPhysicalDeviceMemoryProperties(gpu, &m_memoryProperties);
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(gpu, &properties);
+    m_nonCoherentAtomSize = std::max<VkDeviceSize>(properties.limits.nonCoherentAtomSize, 1);
+    m_maxMemoryAllocationCount = properties.limits.maxMemoryAllocationCount;
+
+    m_pools.resize(m_memoryProperties.memoryTypeCount);
+}
+
+uint32_t CVulkanAllocator::findMemoryType(uint32_t typeBits, VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred) const {
+    uint32_t bestType = UINT32_MAX;
+    uint32_t bestScore = 0;
+
+    // the memory types are ordered by the driver from fastest to slowest, so ties keep the lower index
+    for (uint32_t memoryType = 0; memoryType < m_memoryProperties.memoryTypeCount; ++memoryType) {
+        VkMemoryPropertyFlags flags = m_memoryProperties.memoryTypes[memoryType].propertyFlags;
+        if (!(typeBits & (1u << memoryType)) || (flags & required) != required) {
+            continue;
+        }
+
+        uint32_t score = countBits(flags & preferred) + 1;
+        if (score > bestScore) {
+            bestScore = score;
+            bestType = memoryType;
+        }
+    }
+
+    return bestType;
+}
+
+VkDeviceSize CVulkanAllocator::getBlockSize(uint32_t memoryType) const {
+    VkDeviceSize heapSize = m_memoryProperties.memoryHeaps[m_memoryProperties.memoryTypes[memoryType].heapIndex].size;
+    // small heaps like the 256 MB host visible device local window get smaller blocks
+    return heapSize <= kSmallHeapSize ? std::min(kDefaultBlockSize, heapSize / 8) : kDefaultBlockSize;
+}
+
+CVulkanAllocator::Block* CVulkanAllocator::createBlock(uint32_t memoryType, VkDeviceSize size, bool linear, bool dedicated) {
+    if (m_deviceAllocationCount >= m_maxMemoryAllocationCount) {
+        printf("maxMemoryAllocationCount (%u) reached\n", m_maxMemoryAllocationCount);
+        return nullptr;
+    }
+
+    VkMemoryAllocateFlagsInfo memoryAllocFlagsInfo = {};
+    memoryAllocFlagsInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
+    memoryAllocFlagsInfo.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT;
+
+    VkMemoryAllocateInfo memoryAllocInfo = {};
+    memoryAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    memoryAllocInfo.pNext = &memoryAllocFlagsInfo;
+    memoryAllocInfo.allocationSize = size;
+    memoryAllocInfo.memoryTypeIndex = memoryType;
+
+    VkDeviceMemory memory;
+    if (vkAllocateMemory(m_device, &memoryAllocInfo, nullptr, &memory) != VK_SUCCESS) {
+        return nullptr;
+    }
+    ++m_deviceAllocationCount;
+
+    Block* block = new Block();
+    block->memory = memory;
+    block->size = size;
+    block->usedBytes = 0;
+    block->allocationCount = 0;
+    block->mapped = nullptr;
+    block->linear = linear;
+    block->dedicated = dedicated;
+
+    FreeRange range = { 0, size };
+    block->freeRanges.push_back(range);
+
+    if (m_memoryProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        void* data = nullptr;
+        VK_CHECK(vkMapMemory(m_device, memory, 0, VK_WHOLE_SIZE, 0, &data));
+        block->mapped = static_cast<uint8_t*>(data);
+    }
+
+    return block;
+}
+
+uint32_t CVulkanAllocator::addBlock(uint32_t memoryType, Block* block) {
+    std::vector<Block*>& blocks = m_pools[memoryType].blocks;
+    std::vector<Block*>::iterator freeSlot = std::find(blocks.begin(), blocks.end(), static_cast<Block*>(nullptr));
+    if (freeSlot != blocks.end()) {
+        *freeSlot = block;
+    }
+    else {
+        freeSlot = blocks.insert(blocks.end(), block);
+    }
+    return static_cast<uint32_t>(freeSlot - blocks.begin());
+}
+
+bool CVulkanAllocator::allocateFromBlock(Block& block, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset) {
+    size_t bestRange = block.freeRanges.size();
+    VkDeviceSize bestWaste = ~0ull;
+
+    for (size_t index = 0; index < block.freeRanges.size(); ++index) {
+        FreeRange const& range = block.freeRanges[index];
+        VkDeviceSize alignedOffset = alignUp(range.offset, alignment);
+        if (alignedOffset + size > range.offset + range.size) {
+            continue;
+        }
+
+        VkDeviceSize waste = range.size - size;
+        if (waste < bestWaste) {
+            bestWaste = waste;
+            bestRange = index;
+        }
+    }
+
+    if (bestRange == block.freeRanges.size()) {
+        return false;
+    }
+
+    FreeRange range = block.freeRanges[bestRange];
+    offset = alignUp(range.offset, alignment);
+
+    // the alignment padding in front stays free, the rest after the allocation too
+    FreeRange front = { range.offset, offset - range.offset };
+    FreeRange back = { offset + size, range.offset + range.size - (offset + size) };
+
+    block.freeRanges.erase(block.freeRanges.begin() + bestRange);
+    if (back.size > 0) {
+        block.freeRanges.insert(block.freeRanges.begin() + bestRange, back);
+    }
+    if (front.size > 0) {
+        block.freeRanges.insert(block.freeRanges.begin() + bestRange, front);
+    }
+
+    block.usedBytes += size;
+    ++block.allocationCount;
+    return true;
+}
+
+bool CVulkanAllocator::allocateFromType(uint32_t memoryType, VkDeviceSize size, VkDeviceSize alignment, bool linear, VulkanAllocation& allocation) {
+    MemoryTypePool& pool = m_pools[memoryType];
+    VkDeviceSize blockSize = getBlockSize(memoryType);
+
+    uint32_t blockIndex = UINT32_MAX;
+    VkDeviceSize offset = 0;
+
+    if (size > blockSize / 2) {
+        // large resources get their own allocation instead of leaving most of a block unused
+        Block* block = createBlock(memoryType, size, linear, true);
+        if (!block) {
+            return false;
+        }
+        allocateFromBlock(*block, size, 1, offset);
+        blockIndex = addBlock(memoryType, block);
+    }
+    else {
+        for (size_t index = 0; index < pool.blocks.size(); ++index) {
+            Block* block = pool.blocks[index];
+            if (block && !block->dedicated && block->linear == linear && allocateFromBlock(*block, size, alignment, offset)) {
+                blockIndex = static_cast<uint32_t>(index);
+                break;
+            }
+        }
+
+        if (blockIndex == UINT32_MAX) {
+            Block* block = createBlock(memoryType, blockSize, linear, false);
+            if (!block) {
+                return false;
+            }
+            allocateFromBlock(*block, size, alignment, offset);
+            blockIndex = addBlock(memoryType, block);
+        }
+    }
+
+    Block const* block = pool.blocks[blockIndex];
+    allocation.memory = block->memory;
+    allocation.offset = offset;
+    allocation.size = size;
+    allocation.mapped = block->mapped ? block->mapped + offset : nullptr;
+    allocation.memoryType = memoryType;
+    allocation.blockIndex = blockIndex;
+    return true;
+}
+
+VulkanAllocation CVulkanAllocator::allocate(VkMemoryRequirements const& memoryRequirements,
+                                            VkMemoryPropertyFlags required,
+                                            VkMemoryPropertyFlags preferred,
+                                            bool linear,
+                                            VkDeviceSize minAlignment) {
+    VulkanAllocation allocation = {};
+    allocation.memoryType = UINT32_MAX;
+
+    uint32_t typeBits = memoryRequirements.memoryTypeBits;
+    while (typeBits != 0) {
+        uint32_t memoryType = findMemoryType(typeBits, required, preferred);
+        if (memoryType == UINT32_MAX) {
+            break;
+        }
+
+        VkDeviceSize alignment = std::max(memoryRequirements.alignment, minAlignment);
+        VkDeviceSize size = memoryRequirements.size;
+
+        // flushes of non coherent memory work on whole atoms, they must not touch a neighbour
+        VkMemoryPropertyFlags flags = m_memoryProperties.memoryTypes[memoryType].propertyFlags;
+        if ((flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) && !(flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) {
+            alignment = std::max(alignment, m_nonCoherentAtomSize);
+            size = alignUp(size, m_nonCoherentAtomSize);
+        }
+
+        if (allocateFromType(memoryType, size, alignment, linear, allocation)) {
+            return allocation;
+        }
+
+        printf("allocation of %llu bytes from memory type %u failed, trying the next one\n", static_cast<unsigned long long>(size), memoryType);
+        typeBits &= ~(1u << memoryType);
+    }
+
+    printf("no memory type left for an allocation of %llu bytes\n", static_cast<unsigned long long>(memoryRequirements.size));
+    return allocation;
+}
+
+void CVulkanAllocator::free(VulkanAllocation const& allocation) {
+    if (allocation.memoryType >= m_pools.size()) {
+        return;
+    }
+
+    MemoryTypePool& pool = m_pools[allocation.memoryType];
+    Block* block = pool.blocks[allocation.blockIndex];
+
+    FreeRange range = { allocation.offset, allocation.size };
+    std::vector<FreeRange>::iterator next = block->freeRanges.begin();
+    while (next != block->freeRanges.end() && next->offset < range.offset) {
+        ++next;
+    }
+
+    next = block->freeRanges.insert(next, range);
+
+    std::vector<FreeRange>::iterator following = next + 1;
+    if (following != block->freeRanges.end() && next->offset + next->size == following->offset) {
+        next->size += following->size;
+        block->freeRanges.erase(following);
+    }
+
+    if (next != block->freeRanges.begin()) {
+        std::vector<FreeRange>::iterator previous = next - 1;
+        if (previous->offset + previous->size == next->offset) {
+            previous->size += next->size;
+            block->freeRanges.erase(next);
+        }
+    }
+
+    block->usedBytes -= allocation.size;
+    --block->allocationCount;
+
+    if (block->allocationCount > 0) {
+        return;
+    }
+
+    // keep one empty block per type around so alloc / free cycles don't hit vkAllocateMemory
+    bool keepBlock = !block->dedicated;
+    for (size_t index = 0; keepBlock && index < pool.blocks.size(); ++index) {
+        Block const* other = pool.blocks[index];
+        if (other && other != block && !other->dedicated && other->linear == block->linear && other->allocationCount == 0) {
+            keepBlock = false;
+        }
+    }
+
+    if (!keepBlock) {
+        releaseBlock(allocation.memoryType, allocation.blockIndex);
+    }
+}
+
+void CVulkanAllocator::releaseBlock(uint32_t memoryType, uint32_t blockIndex) {
+    Block* block = m_pools[memoryType].blocks[blockIndex];
+    if (block->mapped) {
+        vkUnmapMemory(m_device, block->memory);
+    }
+    vkFreeMemory(m_device, block->memory, nullptr);
+    --m_deviceAllocationCount;
+
+    delete block;
+    m_pools[memoryType].blocks[blockIndex] = nullptr;
+}
+
+void CVulkanAllocator::flush(VulkanAllocation const& allocation, VkDeviceSize offset, VkDeviceSize size) {
+    if (allocation.memoryType >= m_pools.size()) {
+        return;
+    }
+
+    VkMemoryPropertyFlags flags = m_memoryProperties.memoryTypes[allocation.memoryType].propertyFlags;
+    if (!(flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) || (flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) {
+        return;
+    }
+
+    // the allocation is atom aligned, so rounding the range out stays inside of it
+    VkDeviceSize begin = offset / m_nonCoherentAtomSize * m_nonCoherentAtomSize;
+    VkDeviceSize end = std::min(alignUp(offset + size, m_nonCoherentAtomSize), allocation.size);
+
+    VkMappedMemoryRange range = {};
+    range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+    range.memory = allocation.memory;
+    range.offset = allocation.offset + begin;
+    range.size = end - begin;
+    VK_CHECK(vkFlushMappedMemoryRanges(m_device, 1, &range));
+}
+
+VulkanAllocatorStats CVulkanAllocator::getStats(uint32_t memoryType) const {
+    VulkanAllocatorStats stats = {};
+
+    std::vector<Block*> const& blocks = m_pools[memoryType].blocks;
+    for (size_t index = 0; index < blocks.size(); ++index) {
+        Block const* block = blocks[index];
+        if (!block) {
+            continue;
+        }
+
+        ++stats.blockCount;
+        stats.allocationCount += block->allocationCount;
+        stats.freeRangeCount += static_cast<uint32_t>(block->freeRanges.size());
+        stats.reservedBytes += block->size;
+        stats.usedBytes += block->usedBytes;
+
+        VkDeviceSize largestBlockRange = 0;
+        for (size_t rangeIndex = 0; rangeIndex < block->freeRanges.size(); ++rangeIndex) {
+            largestBlockRange = std::max(largestBlockRange, block->freeRanges[rangeIndex].size);
+        }
+        stats.largestFreeRange = std::max(stats.largestFreeRange, largestBlockRange);
+        stats.fragmentedBytes += block->size - block->usedBytes - largestBlockRange;
+    }
+
+    return stats;
+}
+
+VulkanAllocatorStats CVulkanAllocator::getTotalStats() const {
+    VulkanAllocatorStats total = {};
+
+    for (uint32_t memoryType = 0; memoryType < m_pools.size(); ++memoryType) {
+        VulkanAllocatorStats stats = getStats(memoryType);
+        total.blockCount += stats.blockCount;
+        total.allocationCount += stats.allocationCount;
+        total.freeRangeCount += stats.freeRangeCount;
+        total.reservedBytes += stats.reservedBytes;
+        total.usedBytes += stats.usedBytes;
+        total.largestFreeRange = std::max(total.largestFreeRange, stats.largestFreeRange);
+        total.fragmentedBytes += stats.fragmentedBytes;
+    }
+
+    return total;
+}
+
+void CVulkanAllocator::printReport() const {
+    double const kMegabyte = 1024.0 * 1024.0;
+
+    printf("memory: %u device allocations (limit %u)\n", m_deviceAllocationCount, m_maxMemoryAllocationCount);
+
+    for (uint32_t memoryType = 0; memoryType < m_pools.size(); ++memoryType) {
+        VulkanAllocatorStats stats = getStats(memoryType);
+        if (stats.blockCount == 0) {
+            continue;
+        }
+
+        VkMemoryPropertyFlags flags = m_memoryProperties.memoryTypes[memoryType].propertyFlags;
+        printf("  type %2u [%s%s%s%s]: %u blocks, %u allocations, %.2f / %.2f MB used, %u free ranges, largest %.2f MB, fragmentation %.1f%%\n",
+               memoryType,
+               (flags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) ? "D" : "-",
+               (flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) ? "V" : "-",
+               (flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) ? "C" : "-",
+               (flags & VK_MEMORY_PROPERTY_HOST_CACHED_BIT) ? "H" : "-",
+               stats.blockCount,
+               stats.allocationCount,
+               stats.usedBytes / kMegabyte,
+               stats.reservedBytes / kMegabyte,
+               stats.freeRangeCount,
+               stats.largestFreeRange / kMegabyte,
+               stats.getFragmentation() * 100.0f);
+    }
+}
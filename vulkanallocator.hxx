@@ -0,0 +1,98 @@
+#ifndef VULKANALLOCATOR_HXX
+#define VULKANALLOCATOR_HXX
+
+#include <stdint.h>
+#include <vector>
+
+#include "vulkanhelper.hxx"
+
+struct VulkanAllocatorStats {
+    uint32_t blockCount;
+    uint32_t allocationCount;
+    uint32_t freeRangeCount;
+    VkDeviceSize reservedBytes;
+    VkDeviceSize usedBytes;
+    VkDeviceSize largestFreeRange;
+    // free bytes outside of the largest free range of their block
+    VkDeviceSize fragmentedBytes;
+
+    // 0 when every block has one free range, close to 1 when free memory is scattered over many small ones
+    float getFragmentation() const {
+        VkDeviceSize freeBytes = reservedBytes - usedBytes;
+        return freeBytes > 0 ? static_cast<float>(fragmentedBytes) / static_cast<float>(freeBytes) : 0.0f;
+    }
+};
+
+/*
+ * Block allocator on top of vkAllocateMemory. Every memory type gets a list of large
+ * blocks which are sub-allocated with a best fit free list, so the whole scene needs a
+ * handful of device memory allocations instead of one per buffer. Buffers (linear) and
+ * optimal tiling images never share a block, which keeps bufferImageGranularity out of
+ * the offset math. Host visible blocks stay mapped for their whole lifetime.
+ */
+class CVulkanAllocator
+{
+public:
+    CVulkanAllocator(VkDevice device, VkPhysicalDevice gpu);
+
+    // Picks the memory type that has all required flags and most of the preferred ones,
+    // returns UINT32_MAX if no type in typeBits has the required flags.
+    uint32_t findMemoryType(uint32_t typeBits, VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred = 0) const;
+
+    // minAlignment is raised to memoryRequirements.alignment. Falls back to the next suitable
+    // memory type if a block can not be allocated from the best one.
+    VulkanAllocation allocate(VkMemoryRequirements const& memoryRequirements,
+                              VkMemoryPropertyFlags required,
+                              VkMemoryPropertyFlags preferred,
+                              bool linear,
+                              VkDeviceSize minAlignment = 1);
+    void free(VulkanAllocation const& allocation);
+
+    // Makes host writes visible for memory types without HOST_COHERENT, no-op otherwise.
+    void flush(VulkanAllocation const& allocation, VkDeviceSize offset, VkDeviceSize size);
+
+    VulkanAllocatorStats getStats(uint32_t memoryType) const;
+    VulkanAllocatorStats getTotalStats() const;
+    void printReport() const;
+
+    VkPhysicalDeviceMemoryProperties const& getMemoryProperties() const { return m_memoryProperties; }
+
+private:
+    struct FreeRange {
+        VkDeviceSize offset;
+        VkDeviceSize size;
+    };
+
+    struct Block {
+        VkDeviceMemory memory;
+        VkDeviceSize size;
+        VkDeviceSize usedBytes;
+        uint32_t allocationCount;
+        uint8_t* mapped;
+        bool linear;
+        bool dedicated;
+        // sorted by offset, neighbours are always merged
+        std::vector<FreeRange> freeRanges;
+    };
+
+    struct MemoryTypePool {
+        // freed blocks leave a nullptr behind so the block indices in VulkanAllocation stay valid
+        std::vector<Block*> blocks;
+    };
+
+    VkDeviceSize getBlockSize(uint32_t memoryType) const;
+    Block* createBlock(uint32_t memoryType, VkDeviceSize size, bool linear, bool dedicated);
+    uint32_t addBlock(uint32_t memoryType, Block* block);
+    bool allocateFromBlock(Block& block, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset);
+    bool allocateFromType(uint32_t memoryType, VkDeviceSize size, VkDeviceSize alignment, bool linear, VulkanAllocation& allocation);
+    void releaseBlock(uint32_t memoryType, uint32_t blockIndex);
+
+    VkDevice m_device;
+    VkPhysicalDeviceMemoryProperties m_memoryProperties;
+    VkDeviceSize m_nonCoherentAtomSize;
+    uint32_t m_maxMemoryAllocationCount;
+    uint32_t m_deviceAllocationCount;
+    std::vector<MemoryTypePool> m_pools;
+};
+
+#endif // VULKANALLOCATOR_HXX
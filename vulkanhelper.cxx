@@ -1,4 +1,5 @@
 #include "vulkanhelper.hxx"
+#include "vulkanallocator.hxx"
 
 #include <string.h>
 #include <stdio.h>
@@ -89,6 +90,36 @@ DEFINE_VK_FUNCTION(vkWaitForFences);
 DEFINE_VK_FUNCTION(vkResetFences);
 DEFINE_VK_FUNCTION(vkGetBufferDeviceAddress);
 DEFINE_VK_FUNCTION(vkDestroyFence);
+DEFINE_VK_FUNCTION(vkCmdCopyImageToBuffer);
+DEFINE_VK_FUNCTION(vkCreateQueryPool);
+DEFINE_VK_FUNCTION(vkDestroyQueryPool);
+DEFINE_VK_FUNCTION(vkCmdResetQueryPool);
+DEFINE_VK_FUNCTION(vkCmdWriteTimestamp);
+DEFINE_VK_FUNCTION(vkGetQueryPoolResults);
+DEFINE_VK_FUNCTION(vkDestroyBuffer);
+DEFINE_VK_FUNCTION(vkFreeMemory);
+DEFINE_VK_FUNCTION(vkFlushMappedMemoryRanges);
+DEFINE_VK_FUNCTION(vkCmdCopyBuffer);
+DEFINE_VK_FUNCTION(vkGetFenceStatus);
+DEFINE_VK_FUNCTION(vkDestroySemaphore);
+DEFINE_VK_FUNCTION(vkWaitSemaphores);
+DEFINE_VK_FUNCTION(vkDestroyCommandPool);
+DEFINE_VK_FUNCTION(vkCreatePipelineCache);
+DEFINE_VK_FUNCTION(vkGetPipelineCacheData);
+DEFINE_VK_FUNCTION(vkDestroyPipelineCache);
+DEFINE_VK_FUNCTION(vkDestroyPipeline);
+DEFINE_VK_FUNCTION(vkDestroyShaderModule);
+DEFINE_VK_FUNCTION(vkDeviceWaitIdle);
+DEFINE_VK_FUNCTION(vkDestroyDescriptorPool);
+DEFINE_VK_FUNCTION(vkGetPhysicalDeviceFormatProperties);
+DEFINE_VK_FUNCTION(vkCreateComputePipelines);
+DEFINE_VK_FUNCTION(vkCmdDispatch);
+DEFINE_VK_FUNCTION(vkCmdPushConstants);
+DEFINE_VK_FUNCTION(vkCreateSampler);
+DEFINE_VK_FUNCTION(vkDestroySampler);
+DEFINE_VK_FUNCTION(vkDestroyPipelineLayout);
+DEFINE_VK_FUNCTION(vkDestroyDescriptorSetLayout);
+DEFINE_VK_FUNCTION(vkDestroyImageView);
 
 /*
  * Vulkan WSI functions
@@ -161,6 +192,15 @@ DEFINE_VK_FUNCTION(vkGetRayTracingCaptureReplayShaderGroupHandlesKHR);
 DEFINE_VK_FUNCTION(vkGetRayTracingShaderGroupHandlesKHR);
 DEFINE_VK_FUNCTION(vkGetRayTracingShaderGroupStackSizeKHR);
 
+/*
+ * Vulkan KHR Deferred Host Operations extension functions
+ */
+DEFINE_VK_FUNCTION(vkCreateDeferredOperationKHR);
+DEFINE_VK_FUNCTION(vkDestroyDeferredOperationKHR);
+DEFINE_VK_FUNCTION(vkGetDeferredOperationMaxConcurrencyKHR);
+DEFINE_VK_FUNCTION(vkGetDeferredOperationResultKHR);
+DEFINE_VK_FUNCTION(vkDeferredOperationJoinKHR);
+
 static void initVulkanDynamicLoadLibrary() {
 #if defined(WIN32)
     HMODULE vulkanLibrary = LoadLibrary("vulkan-1.dll");
@@ -171,12 +211,12 @@ static void initVulkanDynamicLoadLibrary() {
 #endif
 }
 
-CVulkanHelper::CVulkanHelper(VkInstance instance, VkDevice device, VkPhysicalDevice gpu)
+CVulkanHelper::CVulkanHelper(VkInstance instance, VkDevice device, VkPhysicalDevice gpu, CVulkanAllocator* allocator)
     : m_instance(instance)
     , m_device(device)
     , m_gpu(gpu)
+    , m_allocator(allocator)
 {
-    vkGetPhysicalDeviceMemoryProperties(gpu, &m_gpuMemoryProperties);
 }
 
 void CVulkanHelper::initVulkan() {
@@ -199,6 +239,7 @@ void CVulkanHelper::initVulkanInstanceFunctions(VkInstance instance) {
     INIT_VK_INSTANCE_FUNCTION(vkEnumerateDeviceLayerProperties);
     INIT_VK_INSTANCE_FUNCTION(vkEnumerateDeviceExtensionProperties);
     INIT_VK_INSTANCE_FUNCTION(vkGetPhysicalDeviceMemoryProperties);
+    INIT_VK_INSTANCE_FUNCTION(vkGetPhysicalDeviceFormatProperties);
 
 
 #ifdef VK_USE_PLATFORM_WIN32_KHR
@@ -252,6 +293,35 @@ void CVulkanHelper::initVulkanDeviceFunctions(VkDevice device) {
     INIT_VK_DEVICE_FUNCTION(vkResetFences);
     INIT_VK_DEVICE_FUNCTION(vkGetBufferDeviceAddress);
     INIT_VK_DEVICE_FUNCTION(vkDestroyFence);
+    INIT_VK_DEVICE_FUNCTION(vkCmdCopyImageToBuffer);
+    INIT_VK_DEVICE_FUNCTION(vkCreateQueryPool);
+    INIT_VK_DEVICE_FUNCTION(vkDestroyQueryPool);
+    INIT_VK_DEVICE_FUNCTION(vkCmdResetQueryPool);
+    INIT_VK_DEVICE_FUNCTION(vkCmdWriteTimestamp);
+    INIT_VK_DEVICE_FUNCTION(vkGetQueryPoolResults);
+    INIT_VK_DEVICE_FUNCTION(vkDestroyBuffer);
+    INIT_VK_DEVICE_FUNCTION(vkFreeMemory);
+    INIT_VK_DEVICE_FUNCTION(vkFlushMappedMemoryRanges);
+    INIT_VK_DEVICE_FUNCTION(vkCmdCopyBuffer);
+    INIT_VK_DEVICE_FUNCTION(vkGetFenceStatus);
+    INIT_VK_DEVICE_FUNCTION(vkDestroySemaphore);
+    INIT_VK_DEVICE_FUNCTION(vkWaitSemaphores);
+    INIT_VK_DEVICE_FUNCTION(vkDestroyCommandPool);
+    INIT_VK_DEVICE_FUNCTION(vkCreatePipelineCache);
+    INIT_VK_DEVICE_FUNCTION(vkGetPipelineCacheData);
+    INIT_VK_DEVICE_FUNCTION(vkDestroyPipelineCache);
+    INIT_VK_DEVICE_FUNCTION(vkDestroyPipeline);
+    INIT_VK_DEVICE_FUNCTION(vkDestroyShaderModule);
+    INIT_VK_DEVICE_FUNCTION(vkDeviceWaitIdle);
+    INIT_VK_DEVICE_FUNCTION(vkDestroyDescriptorPool);
+    INIT_VK_DEVICE_FUNCTION(vkCreateComputePipelines);
+    INIT_VK_DEVICE_FUNCTION(vkCmdDispatch);
+    INIT_VK_DEVICE_FUNCTION(vkCmdPushConstants);
+    INIT_VK_DEVICE_FUNCTION(vkCreateSampler);
+    INIT_VK_DEVICE_FUNCTION(vkDestroySampler);
+    INIT_VK_DEVICE_FUNCTION(vkDestroyPipelineLayout);
+    INIT_VK_DEVICE_FUNCTION(vkDestroyDescriptorSetLayout);
+    INIT_VK_DEVICE_FUNCTION(vkDestroyImageView);
 
     INIT_VK_DEVICE_FUNCTION(vkCreateSwapchainKHR);
     INIT_VK_DEVICE_FUNCTION(vkGetSwapchainImagesKHR);
@@ -296,18 +366,21 @@ void CVulkanHelper::initVulkanDeviceFunctions(VkDevice device) {
     INIT_VK_DEVICE_FUNCTION(vkGetRayTracingCaptureReplayShaderGroupHandlesKHR);
     INIT_VK_DEVICE_FUNCTION(vkGetRayTracingShaderGroupHandlesKHR);
     INIT_VK_DEVICE_FUNCTION(vkGetRayTracingShaderGroupStackSizeKHR);
+
+    INIT_VK_DEVICE_FUNCTION(vkCreateDeferredOperationKHR);
+    INIT_VK_DEVICE_FUNCTION(vkDestroyDeferredOperationKHR);
+    INIT_VK_DEVICE_FUNCTION(vkGetDeferredOperationMaxConcurrencyKHR);
+    INIT_VK_DEVICE_FUNCTION(vkGetDeferredOperationResultKHR);
+    INIT_VK_DEVICE_FUNCTION(vkDeferredOperationJoinKHR);
 }
 
 uint32_t CVulkanHelper::getMemoryType(VkMemoryRequirements& memoryRequirements,
-                                      VkMemoryPropertyFlags memoryProperties) {
-    uint32_t memoryType = 0;
-    for (uint32_t memoryTypeIndex = 0; memoryTypeIndex < VK_MAX_MEMORY_TYPES; ++memoryTypeIndex) {
-        if (memoryRequirements.memoryTypeBits & (1 << memoryTypeIndex)) {
-            if ((m_gpuMemoryProperties.memoryTypes[memoryTypeIndex].propertyFlags & memoryProperties) == memoryProperties) {
-                memoryType = memoryTypeIndex;
-                break;
-            }
-        }
+                                      VkMemoryPropertyFlags memoryProperties,
+                                      VkMemoryPropertyFlags preferredProperties) {
+    uint32_t memoryType = m_allocator->findMemoryType(memoryRequirements.memoryTypeBits, memoryProperties, preferredProperties);
+    if (memoryType == UINT32_MAX) {
+        printf("no memory type with properties 0x%x\n", memoryProperties);
+        return 0;
     }
 
     return memoryType;
@@ -315,10 +388,17 @@ uint32_t CVulkanHelper::getMemoryType(VkMemoryRequirements& memoryRequirements,
 
 VulkanBuffer CVulkanHelper::createBuffer(VkBufferUsageFlags usage,
                                      VkDeviceSize size,
-                                     VkMemoryPropertyFlags memoryProperties) {
+                                     VkMemoryPropertyFlags memoryProperties,
+                                     VkMemoryPropertyFlags preferredProperties,
+                                     bool shared) {
     VkBufferCreateInfo bufferInfo = {};
     bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
     bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    if (shared && m_sharedQueueFamilies.size() > 1) {
+        bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        bufferInfo.queueFamilyIndexCount = static_cast<uint32_t>(m_sharedQueueFamilies.size());
+        bufferInfo.pQueueFamilyIndices = m_sharedQueueFamilies.data();
+    }
     bufferInfo.usage = usage;
     bufferInfo.size = size;
 
@@ -328,36 +408,36 @@ VulkanBuffer CVulkanHelper::createBuffer(VkBufferUsageFlags usage,
     VkMemoryRequirements bufferMemoryRequirements;
     vkGetBufferMemoryRequirements(m_device, buffer, &bufferMemoryRequirements);
 
-    uint32_t memoryType = getMemoryType(bufferMemoryRequirements, memoryProperties);
+    // acceleration structures and scratch memory are placed by device address, which must be
+    // 256 byte aligned (minAccelerationStructureScratchOffsetAlignment is at most 256 as well)
+    VkDeviceSize minAlignment = (usage & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT) ? 256 : 1;
 
-    VkMemoryAllocateFlagsInfo memoryAllocFlagsInfo = {};
-    memoryAllocFlagsInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
-    memoryAllocFlagsInfo.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT;
+    VulkanAllocation allocation = m_allocator->allocate(bufferMemoryRequirements, memoryProperties, preferredProperties, true, minAlignment);
 
-    VkMemoryAllocateInfo memoryAllocInfo = {};
-    memoryAllocInfo.pNext = &memoryAllocFlagsInfo;
-    memoryAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    memoryAllocInfo.allocationSize = bufferMemoryRequirements.size;
-    memoryAllocInfo.memoryTypeIndex = memoryType;
+    vkBindBufferMemory(m_device, buffer, allocation.memory, allocation.offset);
 
-    VkDeviceMemory bufferMemory;
-    vkAllocateMemory(m_device, &memoryAllocInfo, nullptr, &bufferMemory);
+    VkDeviceAddress address = 0;
+    if (usage & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT) {
+        VkBufferDeviceAddressInfo bufferDeviceAddressInfo = {};
+        bufferDeviceAddressInfo.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO;
+        bufferDeviceAddressInfo.buffer = buffer;
 
-    vkBindBufferMemory(m_device, buffer, bufferMemory, 0);
-
-    VkBufferDeviceAddressInfo bufferDeviceAddressInfo = {};
-    bufferDeviceAddressInfo.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO;
-    bufferDeviceAddressInfo.buffer = buffer;
+        address = vkGetBufferDeviceAddress(m_device, &bufferDeviceAddressInfo);
+    }
 
-    VkDeviceAddress address = vkGetBufferDeviceAddress(m_device, &bufferDeviceAddressInfo);
+    return {buffer, allocation.memory, size, address, allocation};
+}
 
-    return {buffer, bufferMemory, size, address};
+void CVulkanHelper::destroyBuffer(VulkanBuffer const& buffer) {
+    vkDestroyBuffer(m_device, buffer.handle, nullptr);
+    m_allocator->free(buffer.allocation);
 }
 
-void CVulkanHelper::copyToBuffer(const VulkanBuffer &buffer, void* data, uint32_t size) {
+void CVulkanHelper::copyToBuffer(const VulkanBuffer &buffer, void* data, uint32_t size, VkDeviceSize offset) {
+    memcpy(static_cast<uint8_t*>(buffer.allocation.mapped) + offset, data, size);
+    m_allocator->flush(buffer.allocation, offset, size);
+}
 
-    void* localData = nullptr;
-    vkMapMemory(m_device, buffer.memory, 0, buffer.size, 0, &localData);
-    memcpy(localData, data, size);
-    vkUnmapMemory(m_device, buffer.memory);
+void CVulkanHelper::flushBuffer(VulkanBuffer const& buffer) {
+    m_allocator->flush(buffer.allocation, 0, buffer.size);
 }
@@ -5,6 +5,8 @@
 #define VK_ENABLE_BETA_EXTENSIONS
 #include <vulkan/vulkan.h>
 
+#include <vector>
+
 #define VK_CHECK(func) \
 do { \
     VkResult res = (func); \
@@ -71,6 +73,36 @@ EXTERN_VK_FUNCTION(vkWaitForFences);
 EXTERN_VK_FUNCTION(vkResetFences);
 EXTERN_VK_FUNCTION(vkGetBufferDeviceAddress);
 EXTERN_VK_FUNCTION(vkDestroyFence);
+EXTERN_VK_FUNCTION(vkCmdCopyImageToBuffer);
+EXTERN_VK_FUNCTION(vkCreateQueryPool);
+EXTERN_VK_FUNCTION(vkDestroyQueryPool);
+EXTERN_VK_FUNCTION(vkCmdResetQueryPool);
+EXTERN_VK_FUNCTION(vkCmdWriteTimestamp);
+EXTERN_VK_FUNCTION(vkGetQueryPoolResults);
+EXTERN_VK_FUNCTION(vkDestroyBuffer);
+EXTERN_VK_FUNCTION(vkFreeMemory);
+EXTERN_VK_FUNCTION(vkFlushMappedMemoryRanges);
+EXTERN_VK_FUNCTION(vkCmdCopyBuffer);
+EXTERN_VK_FUNCTION(vkGetFenceStatus);
+EXTERN_VK_FUNCTION(vkDestroySemaphore);
+EXTERN_VK_FUNCTION(vkWaitSemaphores);
+EXTERN_VK_FUNCTION(vkDestroyCommandPool);
+EXTERN_VK_FUNCTION(vkCreatePipelineCache);
+EXTERN_VK_FUNCTION(vkGetPipelineCacheData);
+EXTERN_VK_FUNCTION(vkDestroyPipelineCache);
+EXTERN_VK_FUNCTION(vkDestroyPipeline);
+EXTERN_VK_FUNCTION(vkDestroyShaderModule);
+EXTERN_VK_FUNCTION(vkDeviceWaitIdle);
+EXTERN_VK_FUNCTION(vkDestroyDescriptorPool);
+EXTERN_VK_FUNCTION(vkGetPhysicalDeviceFormatProperties);
+EXTERN_VK_FUNCTION(vkCreateComputePipelines);
+EXTERN_VK_FUNCTION(vkCmdDispatch);
+EXTERN_VK_FUNCTION(vkCmdPushConstants);
+EXTERN_VK_FUNCTION(vkCreateSampler);
+EXTERN_VK_FUNCTION(vkDestroySampler);
+EXTERN_VK_FUNCTION(vkDestroyPipelineLayout);
+EXTERN_VK_FUNCTION(vkDestroyDescriptorSetLayout);
+EXTERN_VK_FUNCTION(vkDestroyImageView);
 
 /*
  * Vulkan WSI functions
@@ -143,11 +175,32 @@ EXTERN_VK_FUNCTION(vkGetRayTracingCaptureReplayShaderGroupHandlesKHR);
 EXTERN_VK_FUNCTION(vkGetRayTracingShaderGroupHandlesKHR);
 EXTERN_VK_FUNCTION(vkGetRayTracingShaderGroupStackSizeKHR);
 
+/*
+ * Vulkan KHR Deferred Host Operations extension functions
+ */
+EXTERN_VK_FUNCTION(vkCreateDeferredOperationKHR);
+EXTERN_VK_FUNCTION(vkDestroyDeferredOperationKHR);
+EXTERN_VK_FUNCTION(vkGetDeferredOperationMaxConcurrencyKHR);
+EXTERN_VK_FUNCTION(vkGetDeferredOperationResultKHR);
+EXTERN_VK_FUNCTION(vkDeferredOperationJoinKHR);
+
+// Range of a device memory block handed out by CVulkanAllocator.
+struct VulkanAllocation {
+    VkDeviceMemory memory;
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    // persistently mapped pointer to offset, nullptr if the memory is not host visible
+    void* mapped;
+    uint32_t memoryType;
+    uint32_t blockIndex;
+};
+
 struct VulkanBuffer {
     VkBuffer handle;
     VkDeviceMemory memory;
     VkDeviceSize size;
     VkDeviceAddress address;
+    VulkanAllocation allocation;
 };
 
 struct VulkanImage {
@@ -157,28 +210,44 @@ struct VulkanImage {
     VkFormat format;
     uint32_t width;
     uint32_t height;
+    VulkanAllocation allocation;
 };
 
+class CVulkanAllocator;
+
 class CVulkanHelper
 {
 public:
-    CVulkanHelper(VkInstance instance, VkDevice device, VkPhysicalDevice gpu);
+    CVulkanHelper(VkInstance instance, VkDevice device, VkPhysicalDevice gpu, CVulkanAllocator* allocator);
     static void initVulkan();
     static void initVulkanInstanceFunctions(VkInstance instance);
     static void initVulkanDeviceFunctions(VkDevice device);
     static uint32_t alignTo(uint32_t value, uint32_t alignment);
+    // preferredProperties are used if a memory type has them, memoryProperties are required.
+    // shared buffers are accessed from every family of setSharedQueueFamilies().
     VulkanBuffer createBuffer(VkBufferUsageFlags usage,
                           VkDeviceSize size,
-                          VkMemoryPropertyFlags memoryProperties);
+                          VkMemoryPropertyFlags memoryProperties,
+                          VkMemoryPropertyFlags preferredProperties = 0,
+                          bool shared = false);
+    // Shared buffers are CONCURRENT between these families, so the compute queue and the graphics
+    // queue can both use them without ownership transfers. With less than two they are EXCLUSIVE.
+    void setSharedQueueFamilies(std::vector<uint32_t> const& queueFamilies) { m_sharedQueueFamilies = queueFamilies; }
+    void destroyBuffer(VulkanBuffer const& buffer);
     uint32_t getMemoryType(VkMemoryRequirements& memoryRequirements,
-                           VkMemoryPropertyFlags memoryProperties);
+                           VkMemoryPropertyFlags memoryProperties,
+                           VkMemoryPropertyFlags preferredProperties = 0);
 
-    void copyToBuffer(VulkanBuffer const& buffer, void* data, uint32_t size);
+    // offset is relative to the start of the buffer
+    void copyToBuffer(VulkanBuffer const& buffer, void* data, uint32_t size, VkDeviceSize offset = 0);
+    // for buffers written through allocation.mapped
+    void flushBuffer(VulkanBuffer const& buffer);
 private:
     VkInstance m_instance;
     VkDevice m_device;
     VkPhysicalDevice m_gpu;
-    VkPhysicalDeviceMemoryProperties m_gpuMemoryProperties;
+    CVulkanAllocator* m_allocator;
+    std::vector<uint32_t> m_sharedQueueFamilies;
 };
 
 inline uint32_t CVulkanHelper::alignTo(uint32_t value, uint32_t alignment)